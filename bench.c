@@ -0,0 +1,1313 @@
+/* benchmark for the digest pipeline. messages are generated from a fixed
+   seed so that every run digests exactly the same bytes, digests can be
+   compared against a golden file to check optimizations for correctness. */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "mime.h"
+#include "pool.h"
+#include "pyzor.h"
+
+#define BENCH_SEED (0x9e3779b97f4a7c15ULL)
+
+/* minimum time spent per measurement */
+#define BENCH_MIN_TIME (0.25)
+
+#define BENCH_ATTACHMENT_SIZE (50 * 1024 * 1024)
+
+/* messages of up to this size are also split in two at every offset */
+#define BENCH_SPLIT_MAX (4 * 1024)
+
+/* part cache used by the cache stage, blocks fit the lines of the largest
+   text parts generated by default */
+#define BENCH_CACHE_ENTRIES (64)
+#define BENCH_CACHE_BLOCK (2 * 1024 * 1024)
+
+static pyzor_cache_t *bench_cache = NULL;
+
+/* parts of a message are spread over these for the parallel stage */
+static pyzor_pool_t *bench_workers = NULL;
+static pyzor_digest_pool_t *bench_digests = NULL;
+
+#define BENCH_DIGEST_HWM (16 * 1024 * 1024)
+
+struct bench_buf {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+};
+
+typedef enum bench_kind bench_kind_t;
+
+enum bench_kind {
+  bench_plain = 0,
+  bench_html,
+  bench_base64,
+  bench_qp,
+  bench_multipart,
+  bench_longline,
+  bench_attachment,
+  bench_tags,
+  bench_blank,
+  bench_kind_max
+};
+
+static const char *bench_kinds[bench_kind_max] = {
+  "plain",
+  "html",
+  "base64",
+  "qp",
+  "multipart",
+  "longline",
+  "attachment",
+  "tags",
+  "blank"
+};
+
+static const size_t bench_sizes[] = {
+  4 * 1024, 64 * 1024, 1024 * 1024
+};
+
+static const size_t bench_chunks[] = {
+  64, 4096, 65536, 0 /* whole message */
+};
+
+static const char *bench_words[] = {
+  "the", "of", "and", "a", "to", "in", "is", "you", "that", "it", "free",
+  "offer", "click", "here", "now", "limited", "time", "only", "viagra",
+  "unsubscribe", "newsletter", "account", "verify", "password", "bank",
+  "http://www.example.com/track?id=12345&u=abcdef",
+  "someone@example.org", "supercalifragilisticexpialidocious",
+  "caf\xc3\xa9", "na\xc3\xafve", "0123456789", "$$$", "!!!"
+};
+
+#define bench_nwords (sizeof (bench_words) / sizeof (bench_words[0]))
+
+static uint64_t
+bench_rand (uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+
+  return (x);
+}
+
+static void
+bench_grow (struct bench_buf *buf, size_t len)
+{
+  size_t size;
+
+  if (buf->size - buf->len >= len)
+    return;
+  for (size = buf->size ? buf->size : 4096; size - buf->len < len; size *= 2)
+    ;
+  if (! (buf->data = realloc (buf->data, size))) {
+    fprintf (stderr, "error: %s\n", strerror (ENOMEM));
+    exit (1);
+  }
+  buf->size = size;
+}
+
+static void
+bench_put (struct bench_buf *buf, const void *str, size_t len)
+{
+  bench_grow (buf, len);
+  memcpy (buf->data + buf->len, str, len);
+  buf->len += len;
+}
+
+static void
+bench_puts (struct bench_buf *buf, const char *str)
+{
+  bench_put (buf, str, strlen (str));
+}
+
+static void
+bench_putc (struct bench_buf *buf, unsigned char c)
+{
+  bench_put (buf, &c, 1);
+}
+
+/* random text of roughly len bytes, lines of up to width bytes. a width of
+   zero produces a single line */
+static void
+bench_text (struct bench_buf *buf, uint64_t *state, size_t len, size_t width)
+{
+  const char *word;
+  size_t col, end;
+
+  col = 0;
+  for (end = buf->len + len; buf->len < end; ) {
+    word = bench_words[bench_rand (state) % bench_nwords];
+    if (width && col + strlen (word) >= width) {
+      bench_putc (buf, '\n');
+      col = 0;
+    } else if (col) {
+      bench_putc (buf, ' ');
+      col++;
+    }
+    bench_puts (buf, word);
+    col += strlen (word);
+  }
+  bench_putc (buf, '\n');
+}
+
+static void
+bench_markup (struct bench_buf *buf, uint64_t *state, size_t len)
+{
+  static const char *tags[] = {
+    "<p>", "</p>", "<br>", "<b>", "</b>", "<div class=\"x\">", "</div>",
+    "<a href=\"http://www.example.com/?q=1\">", "</a>",
+    "<span style=\"color: #ff0000; font-size: 12px\">", "</span>",
+    "<img src=\"cid:part1@example.com\" width=\"1\" height=\"1\">"
+  };
+  size_t col, end;
+
+  bench_puts (buf, "<html><head><title>offer</title></head><body>\n");
+  col = 0;
+  for (end = buf->len + len; buf->len < end; ) {
+    if (bench_rand (state) % 3 == 0)
+      bench_puts (buf, tags[bench_rand (state) % (sizeof (tags) / sizeof (tags[0]))]);
+    else
+      bench_puts (buf, bench_words[bench_rand (state) % bench_nwords]);
+    bench_putc (buf, ' ');
+    if (++col == 12) {
+      bench_putc (buf, '\n');
+      col = 0;
+    }
+  }
+  bench_puts (buf, "\n</body></html>\n");
+}
+
+/* markup that is hard on the tag stripper. lines carry thousands of short
+   tags, tags that are opened and closed in different tokens, tags that are
+   never closed and stray brackets */
+static void
+bench_tagsoup (struct bench_buf *buf, uint64_t *state, size_t len)
+{
+  static const char *tags[] = {
+    "<td>", "</td>", "<b>x</b>", "<i>", "<br/>", "<img", "src=x>", "<",
+    ">", "a<b", "c>d", "x>y<z", "<<>>", "<a><b>"
+  };
+  size_t end;
+
+  for (end = buf->len + len; buf->len < end; ) {
+    if (bench_rand (state) % 4 != 0)
+      bench_puts (buf, tags[bench_rand (state) % (sizeof (tags) / sizeof (tags[0]))]);
+    else
+      bench_puts (buf, bench_words[bench_rand (state) % bench_nwords]);
+    bench_putc (buf, bench_rand (state) % 8192 == 0 ? '\n' : ' ');
+  }
+  bench_putc (buf, '\n');
+}
+
+/* text lines between long runs of blank and short lines, such lines are
+   dropped and must not take up room in the line buffer */
+static void
+bench_blanks (struct bench_buf *buf, uint64_t *state, size_t len)
+{
+  static const char *lines[] = { "\n", "\n", " \n", "\t\n", "ok\n", "-- \n", ">\n" };
+  size_t cnt, end;
+
+  for (end = buf->len + len; buf->len < end; ) {
+    bench_text (buf, state, 64, 72);
+    for (cnt = 128 + bench_rand (state) % 128; cnt; cnt--)
+      bench_puts (buf, lines[bench_rand (state) % (sizeof (lines) / sizeof (lines[0]))]);
+  }
+}
+
+static void
+bench_encode_base64 (struct bench_buf *buf, const unsigned char *str, size_t len)
+{
+  static const char alpha[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t col, pos;
+  uint32_t acc;
+
+  bench_grow (buf, ((len + 2) / 3) * 4 + ((len / 57) + 1) * 2);
+  for (col = 0, pos = 0; pos < len; pos += 3) {
+    acc = (uint32_t)str[pos] << 16;
+    if (pos + 1 < len)
+      acc |= (uint32_t)str[pos + 1] << 8;
+    if (pos + 2 < len)
+      acc |= (uint32_t)str[pos + 2];
+    buf->data[buf->len++] = (unsigned char)alpha[(acc >> 18) & 0x3f];
+    buf->data[buf->len++] = (unsigned char)alpha[(acc >> 12) & 0x3f];
+    buf->data[buf->len++] = pos + 1 < len ? (unsigned char)alpha[(acc >> 6) & 0x3f] : '=';
+    buf->data[buf->len++] = pos + 2 < len ? (unsigned char)alpha[acc & 0x3f] : '=';
+    if ((col += 4) == 76) {
+      buf->data[buf->len++] = '\n';
+      col = 0;
+    }
+  }
+  if (col)
+    bench_putc (buf, '\n');
+}
+
+static void
+bench_encode_qp (struct bench_buf *buf, const unsigned char *str, size_t len)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  size_t col, pos;
+
+  for (col = 0, pos = 0; pos < len; pos++) {
+    if (str[pos] == '\n') {
+      bench_putc (buf, '\n');
+      col = 0;
+      continue;
+    }
+    if (col >= 72) {
+      bench_puts (buf, "=\n");
+      col = 0;
+    }
+    if (str[pos] == '=' || str[pos] > 126) {
+      bench_putc (buf, '=');
+      bench_putc (buf, (unsigned char)hex[str[pos] >> 4]);
+      bench_putc (buf, (unsigned char)hex[str[pos] & 0xf]);
+      col += 3;
+    } else {
+      bench_putc (buf, str[pos]);
+      col++;
+    }
+  }
+}
+
+static void
+bench_header (struct bench_buf *buf, uint64_t *state)
+{
+  char str[128];
+
+  snprintf (str, sizeof (str), "From: sender%u@example.com\n",
+    (unsigned int)(bench_rand (state) % 1000));
+  bench_puts (buf, str);
+  bench_puts (buf, "To: recipient@example.net\n");
+  snprintf (str, sizeof (str), "Subject: message %u\n",
+    (unsigned int)(bench_rand (state) % 100000));
+  bench_puts (buf, str);
+  bench_puts (buf, "MIME-Version: 1.0\n");
+}
+
+/* the bytes of buf from off on are also part of the decoded body */
+#define bench_decoded(body, buf, off) \
+  bench_put ((body), (buf)->data + (off), (buf)->len - (off))
+
+/* generate a message of kind with a body of roughly len bytes. body is set to
+   the decoded text of its leaf parts, one after the other */
+static void
+bench_generate (struct bench_buf *buf,
+                struct bench_buf *body,
+                bench_kind_t kind,
+                size_t len)
+{
+  struct bench_buf tmp;
+  uint64_t state;
+  size_t off, pos;
+
+  memset (&tmp, 0, sizeof (tmp));
+  state = BENCH_SEED ^ ((uint64_t)kind << 32) ^ (uint64_t)len;
+  buf->len = 0;
+  body->len = 0;
+
+  bench_header (buf, &state);
+
+  switch (kind) {
+    case bench_plain:
+      bench_puts (buf, "Content-Type: text/plain; charset=us-ascii\n\n");
+      off = buf->len;
+      bench_text (buf, &state, len, 72);
+      bench_decoded (body, buf, off);
+      break;
+    case bench_html:
+      bench_puts (buf, "Content-Type: text/html; charset=utf-8\n\n");
+      off = buf->len;
+      bench_markup (buf, &state, len);
+      bench_decoded (body, buf, off);
+      break;
+    case bench_base64:
+      bench_puts (buf, "Content-Type: text/plain; charset=utf-8\n");
+      bench_puts (buf, "Content-Transfer-Encoding: base64\n\n");
+      bench_text (&tmp, &state, (len / 4) * 3, 72);
+      bench_encode_base64 (buf, tmp.data, tmp.len);
+      bench_put (body, tmp.data, tmp.len);
+      break;
+    case bench_qp:
+      bench_puts (buf, "Content-Type: text/plain; charset=utf-8\n");
+      bench_puts (buf, "Content-Transfer-Encoding: quoted-printable\n\n");
+      bench_text (&tmp, &state, len, 120);
+      bench_encode_qp (buf, tmp.data, tmp.len);
+      bench_put (body, tmp.data, tmp.len);
+      break;
+    case bench_multipart:
+      bench_puts (buf, "Content-Type: multipart/mixed; boundary=\"=_outer\"\n\n");
+      bench_puts (buf, "This is a multi-part message in MIME format.\n\n");
+      bench_puts (buf, "--=_outer\n");
+      bench_puts (buf, "Content-Type: multipart/alternative; boundary=inner\n\n");
+      bench_puts (buf, "--inner\nContent-Type: text/plain\n\n");
+      off = buf->len;
+      bench_text (buf, &state, len / 4, 72);
+      bench_decoded (body, buf, off);
+      bench_puts (buf, "\n--inner\nContent-Type: text/html\n");
+      bench_puts (buf, "Content-Transfer-Encoding: quoted-printable\n\n");
+      bench_markup (&tmp, &state, len / 4);
+      bench_encode_qp (buf, tmp.data, tmp.len);
+      bench_put (body, tmp.data, tmp.len);
+      bench_puts (buf, "\n--inner--\n\n--=_outer\n");
+      bench_puts (buf, "Content-Type: application/pdf; name=\"a.pdf\"\n");
+      bench_puts (buf, "Content-Transfer-Encoding: base64\n\n");
+      tmp.len = 0;
+      bench_grow (&tmp, len / 3);
+      for (pos = 0; pos < len / 3; pos++)
+        tmp.data[pos] = (unsigned char)bench_rand (&state);
+      bench_encode_base64 (buf, tmp.data, len / 3);
+      bench_put (body, tmp.data, len / 3);
+      bench_puts (buf, "\n--=_outer--\n");
+      break;
+    case bench_longline:
+      bench_puts (buf, "Content-Type: text/plain\n\n");
+      off = buf->len;
+      for (pos = 0; pos < 4; pos++)
+        bench_text (buf, &state, len / 4, 0);
+      bench_decoded (body, buf, off);
+      break;
+    case bench_attachment:
+      bench_puts (buf, "Content-Type: multipart/mixed; boundary=\"b1\"\n\n");
+      bench_puts (buf, "--b1\nContent-Type: text/plain\n\n");
+      off = buf->len;
+      bench_text (buf, &state, 2048, 72);
+      bench_decoded (body, buf, off);
+      bench_puts (buf, "\n--b1\nContent-Type: application/octet-stream\n");
+      bench_puts (buf, "Content-Transfer-Encoding: base64\n\n");
+      bench_grow (&tmp, len);
+      for (pos = 0; pos < len; pos++)
+        tmp.data[pos] = (unsigned char)bench_rand (&state);
+      bench_encode_base64 (buf, tmp.data, len);
+      bench_put (body, tmp.data, len);
+      bench_puts (buf, "\n--b1--\n");
+      break;
+    case bench_tags:
+      bench_puts (buf, "Content-Type: text/html\n\n");
+      off = buf->len;
+      bench_tagsoup (buf, &state, len);
+      bench_decoded (body, buf, off);
+      break;
+    case bench_blank:
+      bench_puts (buf, "Content-Type: text/plain\n\n");
+      off = buf->len;
+      bench_blanks (buf, &state, len);
+      bench_decoded (body, buf, off);
+      break;
+    default:
+      assert (0);
+      break;
+  }
+
+  free (tmp.data);
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static long
+bench_rss (void)
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) == -1)
+    return (0);
+  return (ru.ru_maxrss);
+}
+
+/* stages */
+
+static int
+bench_walk_part (void *user_data, const struct pyzor_mime_part *part)
+{
+  *(size_t *)user_data += part->len;
+  return (0);
+}
+
+static int
+bench_walk (pyzor_digest_t *digest,
+            const struct bench_buf *msg,
+            size_t chunk,
+            unsigned char *str)
+{
+  size_t len = 0;
+
+  (void)digest;
+  (void)chunk;
+  (void)str;
+  return (pyzor_mime_walk (msg->data, msg->len, &bench_walk_part, &len));
+}
+
+static int
+bench_digest (pyzor_digest_t *digest,
+              const struct bench_buf *msg,
+              size_t chunk,
+              unsigned char *str)
+{
+  int err;
+
+  (void)chunk;
+  if ((err = pyzor_digest_reset (digest)) != 0 ||
+      (err = pyzor_mime_digest (digest, NULL, msg->data, msg->len)) != 0)
+    return (err);
+  return (pyzor_digest_final (str, PYZOR_DIGEST_HEX_LEN, digest));
+}
+
+/* all but the first run are served from the part cache */
+static int
+bench_cached (pyzor_digest_t *digest,
+              const struct bench_buf *msg,
+              size_t chunk,
+              unsigned char *str)
+{
+  int err;
+
+  (void)chunk;
+  if ((err = pyzor_digest_reset (digest)) != 0)
+    return (err);
+  return (pyzor_cache_digest (bench_cache, NULL, digest, msg->data, msg->len, str, PYZOR_DIGEST_HEX_LEN));
+}
+
+/* leaf parts are normalized concurrently */
+static int
+bench_parallel (pyzor_digest_t *digest,
+                const struct bench_buf *msg,
+                size_t chunk,
+                unsigned char *str)
+{
+  int err;
+
+  (void)chunk;
+  if ((err = pyzor_digest_reset (digest)) != 0 ||
+      (err = pyzor_mime_digest_parallel (digest, NULL, bench_digests, bench_workers, msg->data, msg->len)) != 0)
+    return (err);
+  return (pyzor_digest_final (str, PYZOR_DIGEST_HEX_LEN, digest));
+}
+
+/* raw message is treated as a single decoded part */
+static int
+bench_update (pyzor_digest_t *digest,
+              const struct bench_buf *msg,
+              size_t chunk,
+              unsigned char *str)
+{
+  size_t len, pos;
+  int err;
+
+  if ((err = pyzor_digest_reset (digest)) != 0)
+    return (err);
+  if (! chunk)
+    chunk = msg->len;
+  for (pos = 0; pos < msg->len; pos += len) {
+    len = msg->len - pos < chunk ? msg->len - pos : chunk;
+    if ((err = pyzor_digest_update (digest, msg->data + pos, len, 0)) != 0)
+      return (err);
+  }
+  if ((err = pyzor_digest_update (digest, msg->data, 0, 1)) != 0)
+    return (err);
+  return (pyzor_digest_final (str, PYZOR_DIGEST_HEX_LEN, digest));
+}
+
+static int
+bench_buffer (pyzor_digest_t *digest,
+              const struct bench_buf *msg,
+              size_t chunk,
+              unsigned char *str)
+{
+  (void)digest;
+  (void)chunk;
+  return (pyzor_digest_buffer (str, PYZOR_DIGEST_HEX_LEN, msg->data, msg->len));
+}
+
+typedef int (*bench_func_t) (pyzor_digest_t *, const struct bench_buf *,
+  size_t, unsigned char *);
+
+struct bench_golden {
+  FILE *check;
+  FILE *write;
+  unsigned int errs;
+};
+
+static void
+bench_golden (struct bench_golden *golden,
+              const char *kind,
+              size_t size,
+              const char *stage,
+              const unsigned char *sum)
+{
+  char line[256], want[256];
+
+  snprintf (want, sizeof (want), "%s %zu %s %s\n", kind, size, stage, sum);
+
+  if (golden->write)
+    fputs (want, golden->write);
+
+  if (golden->check) {
+    /* golden file is in the order messages are generated */
+    if (! fgets (line, sizeof (line), golden->check) || strcmp (line, want) != 0) {
+      fprintf (stderr, "Digest mismatch: %s", want);
+      golden->errs++;
+    }
+  }
+}
+
+static int
+bench_run (pyzor_digest_t *digest,
+           const struct bench_buf *msg,
+           const char *kind,
+           const char *stage,
+           size_t chunk,
+           bench_func_t func,
+           double min,
+           unsigned char *sum)
+{
+  char name[64];
+  double end, start;
+  unsigned long cnt;
+  int err;
+
+  start = bench_now ();
+  cnt = 0;
+  do {
+    if ((err = func (digest, msg, chunk, sum)) != 0)
+      return (err);
+    cnt++;
+  } while ((end = bench_now ()) - start < min);
+
+  if (chunk)
+    snprintf (name, sizeof (name), "%s/%zu", stage, chunk);
+  else
+    snprintf (name, sizeof (name), "%s", stage);
+
+  printf ("%-10s %10zu %-14s %10.2f %12.1f %8.3f %10ld\n",
+    kind, msg->len, name,
+    ((double)msg->len * (double)cnt) / (end - start) / 1e6,
+    (double)cnt / (end - start),
+    (end - start) * 1e9 / ((double)msg->len * (double)cnt),
+    bench_rss ());
+
+  return (0);
+}
+
+static int
+bench_message (pyzor_digest_t *digest,
+               struct bench_golden *golden,
+               const struct bench_buf *msg,
+               const char *kind,
+               size_t size,
+               double min)
+{
+  unsigned char ref[PYZOR_DIGEST_HEX_LEN], sum[PYZOR_DIGEST_HEX_LEN];
+  size_t cnt;
+  int err;
+
+  memset (sum, 0, sizeof (sum));
+
+  if ((err = bench_run (digest, msg, kind, "walk", 0, &bench_walk, min, sum)) != 0)
+    return (err);
+  if ((err = bench_run (digest, msg, kind, "digest", 0, &bench_digest, min, sum)) != 0)
+    return (err);
+  bench_golden (golden, kind, size, "digest", sum);
+
+  memcpy (ref, sum, sizeof (ref));
+  if ((err = bench_run (digest, msg, kind, "cache", 0, &bench_cached, min, sum)) != 0)
+    return (err);
+  if (strcmp ((char *)sum, (char *)ref) != 0) {
+    fprintf (stderr, "Digest mismatch: %s %zu cache %s != %s\n", kind, size, sum, ref);
+    golden->errs++;
+  }
+
+  if ((err = bench_run (digest, msg, kind, "parallel", 0, &bench_parallel, min, sum)) != 0)
+    return (err);
+  if (strcmp ((char *)sum, (char *)ref) != 0) {
+    fprintf (stderr, "Digest mismatch: %s %zu parallel %s != %s\n", kind, size, sum, ref);
+    golden->errs++;
+  }
+
+  if ((err = bench_run (digest, msg, kind, "buffer", 0, &bench_buffer, min, ref)) != 0)
+    return (err);
+  bench_golden (golden, kind, size, "buffer", ref);
+
+  /* digests must not depend on how input is chunked */
+  for (cnt = 0; cnt < sizeof (bench_chunks) / sizeof (bench_chunks[0]); cnt++) {
+    if ((err = bench_run (digest, msg, kind, bench_chunks[cnt] ? "update" : "update/all", bench_chunks[cnt], &bench_update, min, sum)) != 0)
+      return (err);
+    if (strcmp ((char *)sum, (char *)ref) != 0) {
+      fprintf (stderr, "Digest mismatch: %s %zu update/%zu %s != %s\n",
+        kind, size, bench_chunks[cnt], sum, ref);
+      golden->errs++;
+    }
+  }
+
+  return (0);
+}
+
+/* lines that are dropped must not take up room in the line buffer, a fresh
+   context only keeps the text lines of a message of blank lines */
+static int
+bench_bounded (struct bench_golden *golden,
+               const struct bench_buf *msg,
+               const char *kind,
+               size_t size)
+{
+  struct pyzor_digest_stats stats;
+  pyzor_digest_t *digest;
+  int err;
+
+  if ((err = pyzor_digest_create (&digest)) != 0)
+    return (err);
+  if ((err = pyzor_digest_update (digest, msg->data, msg->len, 1)) == 0) {
+    pyzor_digest_stats (digest, &stats);
+    if (stats.moved >= msg->len) {
+      fprintf (stderr, "Line buffer not bounded: %s %zu moved %llu bytes\n",
+        kind, size, (unsigned long long)stats.moved);
+      golden->errs++;
+    }
+  }
+  pyzor_digest_destroy (digest);
+
+  return (err);
+}
+
+/* chunk boundary check. a token cut off by the end of an update was once
+   flushed as is, so the digest depended on where the message was split.
+   the message is fed in two updates split at every offset and each digest
+   must be the one of the message fed whole. */
+static int
+bench_split (pyzor_digest_t *digest,
+             struct bench_golden *golden,
+             const struct bench_buf *msg,
+             const char *kind,
+             size_t size)
+{
+  unsigned char ref[PYZOR_DIGEST_HEX_LEN], sum[PYZOR_DIGEST_HEX_LEN];
+  size_t off;
+  int err;
+
+  if ((err = bench_update (digest, msg, 0, ref)) != 0)
+    return (err);
+
+  for (off = 0; off <= msg->len; off++) {
+    if ((err = pyzor_digest_reset (digest)) != 0 ||
+        (err = pyzor_digest_update (digest, msg->data, off, 0)) != 0 ||
+        (err = pyzor_digest_update (digest, msg->data + off, msg->len - off, 1)) != 0 ||
+        (err = pyzor_digest_final (sum, sizeof (sum), digest)) != 0)
+      return (err);
+    if (strcmp ((char *)sum, (char *)ref) != 0) {
+      fprintf (stderr, "Digest mismatch: %s %zu split at %zu %s != %s\n",
+        kind, size, off, sum, ref);
+      golden->errs++;
+      break;
+    }
+  }
+
+  return (0);
+}
+
+/* two-pass check. pyzor_digest_buffer counts the lines of the decoded body
+   before it selects them, its digest must be the one of update and final on
+   the same body */
+static int
+bench_body (pyzor_digest_t *digest,
+            struct bench_golden *golden,
+            const struct bench_buf *body,
+            const char *kind,
+            size_t size)
+{
+  unsigned char ref[PYZOR_DIGEST_HEX_LEN], sum[PYZOR_DIGEST_HEX_LEN];
+  int err;
+
+  if ((err = bench_update (digest, body, 0, ref)) != 0 ||
+      (err = bench_buffer (digest, body, 0, sum)) != 0)
+    return (err);
+  if (strcmp ((char *)sum, (char *)ref) != 0) {
+    fprintf (stderr, "Digest mismatch: %s %zu body buffer %s != update %s\n",
+      kind, size, sum, ref);
+    golden->errs++;
+  }
+
+  return (0);
+}
+
+/* tokenizer check. the transition table of the normalizer is compared with
+   bench_ref, a copy of the branchy tokenizer it replaced, on every string of
+   up to BENCH_TOKEN_FULL bytes over an alphabet with a byte of every class,
+   and on every longer string of up to BENCH_TOKEN_LEN bytes over a sample of
+   it so that tokens that are dropped for their length and tokens that fill
+   the carry buffer are compared too. strings are fed whole, split in two at
+   every offset and a byte at a time, lines of any length are kept so that
+   every line is compared. */
+#define BENCH_TOKEN_LEN (12) /* PYZOR_STRING_MIN + 2 */
+#define BENCH_TOKEN_FULL (8)
+#define BENCH_TOKEN_MIN (10) /* PYZOR_STRING_MIN */
+#define BENCH_TOKEN_TASKS (64)
+
+static const unsigned char bench_alphabet[] = {
+  'a', '1', ':', '@', '<', '>', ' ', '\n'
+};
+
+/* alpha, other, tag and space */
+static const unsigned char bench_sample[] = {
+  'a', '<', '>', ' '
+};
+
+typedef enum bench_phase bench_phase_t;
+
+enum bench_phase {
+  bench_phase_none = 0,
+  bench_phase_space,
+  bench_phase_non_space,
+  bench_phase_alpha,
+  bench_phase_delim,
+  bench_phase_discard
+};
+
+typedef enum bench_end bench_end_t;
+
+enum bench_end {
+  bench_end_token = 0,
+  bench_end_line,
+  bench_end_carry
+};
+
+struct bench_ref {
+  bench_phase_t phase;
+  unsigned char tok[BENCH_TOKEN_MIN];
+  size_t toklen;
+  unsigned char line[BENCH_TOKEN_LEN];
+  size_t lim;
+  ssize_t tag; /* offset of open HTML tag in line, or -1 */
+  unsigned char out[2 * BENCH_TOKEN_LEN];
+  size_t outlen;
+};
+
+#define bench_isspace(c) \
+  ((c) == '\t' || (c) == '\n' || (c) == '\f' || (c) == '\r' || (c) == ' ')
+#define bench_isalpha(c) \
+  (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+
+static void
+bench_ref_part_update (struct bench_ref *ref,
+                       bench_phase_t phase,
+                       const unsigned char *str,
+                       size_t len,
+                       ssize_t lt,
+                       ssize_t gt)
+{
+  const unsigned char *ptr;
+  size_t pos;
+
+  if (ref->tag < 0 && lt >= 0)
+    ref->tag = (ssize_t)ref->lim + lt;
+
+  if (ref->tag >= 0 && gt >= 0 && gt >= lt) {
+    if ((size_t)ref->tag > ref->lim)
+      memcpy (ref->line + ref->lim, str, (size_t)ref->tag - ref->lim);
+    ref->lim = (size_t)ref->tag;
+    pos = (size_t)gt + 1;
+    memcpy (ref->line + ref->lim, str + pos, len - pos);
+    if ((ptr = memchr (str + pos, '<', len - pos)))
+      ref->tag = (ssize_t)(ref->lim + (size_t)(ptr - (str + pos)));
+    else
+      ref->tag = -1;
+    ref->lim += len - pos;
+  } else {
+    memcpy (ref->line + ref->lim, str, len);
+    ref->lim += len;
+  }
+
+  ref->phase = phase;
+}
+
+static void
+bench_ref_part_final (struct bench_ref *ref)
+{
+  if (ref->lim > 0) {
+    memcpy (ref->out + ref->outlen, ref->line, ref->lim);
+    ref->outlen += ref->lim;
+    ref->out[ref->outlen++] = '\n';
+  }
+  ref->lim = 0;
+  ref->tag = -1;
+  ref->phase = bench_phase_none;
+}
+
+static void
+bench_ref_scan (struct bench_ref *ref,
+                const unsigned char *str,
+                size_t len,
+                size_t pos,
+                bench_end_t end)
+{
+  bench_phase_t phase, phase_ii;
+  size_t off;
+  ssize_t lt, gt;
+
+  phase = ref->phase;
+  off = 0;
+  lt = -1;
+  gt = -1;
+
+  for (;; pos++) {
+    if (phase == bench_phase_discard) {
+      for (; pos < len && ! bench_isspace (str[pos]); pos++)
+        ;
+    }
+
+    if (pos == len && end == bench_end_carry &&
+        phase != bench_phase_none && phase != bench_phase_space)
+    {
+      if (phase != bench_phase_discard) {
+        memcpy (ref->tok, str + off, pos - off);
+        ref->toklen = pos - off;
+      }
+      ref->phase = phase;
+      break;
+    }
+
+    if (pos == len || bench_isspace (str[pos])) {
+      if ((pos == len && end == bench_end_line) ||
+          (pos < len && str[pos] == '\n'))
+        phase_ii = bench_phase_none;
+      else
+        phase_ii = bench_phase_space;
+
+      if (phase == bench_phase_non_space ||
+          phase == bench_phase_alpha     ||
+          phase == bench_phase_delim)
+      {
+        bench_ref_part_update (ref, phase_ii, str + off, pos - off,
+          lt >= 0 ? lt - (ssize_t)off : lt, gt >= 0 ? gt - (ssize_t)off : gt);
+      }
+
+      if (phase_ii == bench_phase_none)
+        bench_ref_part_final (ref);
+
+      off = 0;
+      lt = -1;
+      gt = -1;
+      phase = phase_ii;
+
+      if (pos == len) {
+        ref->phase = phase;
+        break;
+      }
+
+      if (phase == bench_phase_space) {
+        for (pos++; pos < len && bench_isspace (str[pos]) && str[pos] != '\n'; pos++)
+          ;
+        pos--;
+      }
+    } else if (phase != bench_phase_discard) {
+      if (phase == bench_phase_delim) {
+        phase = bench_phase_discard;
+      } else if ((phase == bench_phase_alpha || phase == bench_phase_non_space) &&
+                 ((pos - off) + 1) >= BENCH_TOKEN_MIN)
+      {
+        phase = bench_phase_discard;
+      } else if (str[pos] == ':' && phase == bench_phase_alpha) {
+        phase = bench_phase_delim;
+      } else if (str[pos] == '@' && (phase == bench_phase_alpha || phase == bench_phase_non_space)) {
+        phase = bench_phase_delim;
+      } else {
+        if (phase == bench_phase_none || phase == bench_phase_space) {
+          off = pos;
+          if (bench_isalpha (str[pos]))
+            phase = bench_phase_alpha;
+          else
+            phase = bench_phase_non_space;
+        } else if (phase == bench_phase_alpha) {
+          if (! bench_isalpha (str[pos]))
+            phase = bench_phase_non_space;
+        }
+
+        if (str[pos] == '<' && lt == -1)
+          lt = (ssize_t)pos;
+        else if (str[pos] == '>' && gt == -1)
+          gt = (ssize_t)pos;
+      }
+    }
+  }
+}
+
+static void
+bench_ref_update (struct bench_ref *ref, const unsigned char *str, size_t len, int eom)
+{
+  bench_phase_t phase;
+  size_t pos;
+
+  pos = 0;
+  phase = ref->phase;
+
+  /* token cut off by the previous update */
+  if (phase == bench_phase_non_space ||
+      phase == bench_phase_alpha     ||
+      phase == bench_phase_delim)
+  {
+    for (; pos < len && ! bench_isspace (str[pos]) &&
+           ref->toklen < BENCH_TOKEN_MIN; pos++)
+      ref->tok[ref->toklen++] = str[pos];
+
+    if (ref->toklen == BENCH_TOKEN_MIN) {
+      phase = bench_phase_discard;
+    } else if (pos < len || eom) {
+      ref->phase = bench_phase_none;
+      bench_ref_scan (ref, ref->tok, ref->toklen, 0, bench_end_token);
+      phase = bench_phase_space;
+    }
+    ref->toklen = (phase == bench_phase_space) ? 0 : ref->toklen;
+  }
+
+  if (phase == bench_phase_discard) {
+    for (; pos < len && ! bench_isspace (str[pos]); pos++)
+      ;
+    ref->toklen = 0;
+    if (pos < len || eom)
+      phase = bench_phase_space;
+  }
+
+  ref->phase = phase;
+
+  if (pos == len && ! eom &&
+      ref->phase != bench_phase_none && ref->phase != bench_phase_space)
+    return;
+
+  bench_ref_scan (ref, str, len, pos, eom ? bench_end_line : bench_end_carry);
+}
+
+/* lines of str split at off, whole if off is len + 1 or fed a byte at a
+   time if off is past that */
+static int
+bench_tokens (pyzor_digest_t *digest,
+              const unsigned char *str,
+              size_t len,
+              size_t off)
+{
+  unsigned char out[2 * BENCH_TOKEN_LEN];
+  struct bench_ref ref;
+  const unsigned char *line;
+  size_t cnt, linelen, num, outlen, pos;
+  int err;
+
+  memset (&ref, 0, sizeof (ref));
+  ref.tag = -1;
+  if ((err = pyzor_digest_reset (digest)) != 0)
+    return (err);
+
+  if (off > len + 1) {
+    for (pos = 0; pos < len; pos++)
+      bench_ref_update (&ref, str + pos, 1, 0);
+    bench_ref_update (&ref, str + len, 0, 1);
+    for (pos = 0, err = 0; err == 0 && pos < len; pos++)
+      err = pyzor_digest_update (digest, str + pos, 1, 0);
+    if (err == 0)
+      err = pyzor_digest_update (digest, str + len, 0, 1);
+  } else if (off > len) {
+    bench_ref_update (&ref, str, len, 1);
+    err = pyzor_digest_update (digest, str, len, 1);
+  } else {
+    bench_ref_update (&ref, str, off, 0);
+    bench_ref_update (&ref, str + off, len - off, 1);
+    if ((err = pyzor_digest_update (digest, str, off, 0)) == 0)
+      err = pyzor_digest_update (digest, str + off, len - off, 1);
+  }
+  if (err != 0)
+    return (err);
+
+  outlen = 0;
+  cnt = pyzor_digest_lines (digest);
+  for (num = 1; num <= cnt; num++) {
+    if ((err = pyzor_digest_line (digest, num, &line, &linelen)) != 0)
+      return (err);
+    if (outlen + linelen + 1 > sizeof (out))
+      return (EOVERFLOW);
+    memcpy (out + outlen, line, linelen);
+    outlen += linelen;
+    out[outlen++] = '\n';
+  }
+
+  if (outlen != ref.outlen || memcmp (out, ref.out, outlen) != 0)
+    return (EILSEQ);
+
+  return (0);
+}
+
+struct bench_tokenizer {
+  pyzor_digest_t **digests; /* one per worker */
+  int *errs; /* one per task */
+  size_t ntasks;
+};
+
+/* strings of every length whose number is idx modulo the number of tasks */
+static void
+bench_tokenizer_task (void *user_data, size_t idx, unsigned int thr)
+{
+  struct bench_tokenizer *check = user_data;
+  const unsigned char *alphabet;
+  unsigned char str[BENCH_TOKEN_LEN];
+  size_t code, len, n, num, off, pos, tot;
+  int err;
+
+  err = 0;
+  for (len = 0; err == 0 && len <= BENCH_TOKEN_LEN; len++) {
+    if (len <= BENCH_TOKEN_FULL) {
+      alphabet = bench_alphabet;
+      n = sizeof (bench_alphabet);
+    } else {
+      alphabet = bench_sample;
+      n = sizeof (bench_sample);
+    }
+    for (tot = 1, pos = 0; pos < len; pos++)
+      tot *= n;
+
+    for (num = idx; err == 0 && num < tot; num += check->ntasks) {
+      for (code = num, pos = 0; pos < len; pos++, code /= n)
+        str[pos] = alphabet[code % n];
+
+      /* split at every offset, then whole, then a byte at a time */
+      for (off = 0; err == 0 && off <= len + 2; off++) {
+        if ((err = bench_tokens (check->digests[thr], str, len, off)) != EILSEQ)
+          continue;
+        fprintf (stderr, "Tokenizer mismatch: \"");
+        for (pos = 0; pos < len; pos++)
+          fprintf (stderr, str[pos] == '\n' ? "\\n" : "%c", str[pos]);
+        if (off > len + 1)
+          fprintf (stderr, "\" by byte\n");
+        else if (off > len)
+          fprintf (stderr, "\" whole\n");
+        else
+          fprintf (stderr, "\" split at %zu\n", off);
+      }
+    }
+  }
+
+  check->errs[idx] = err;
+}
+
+static int
+bench_tokenizer (struct bench_golden *golden)
+{
+  struct bench_tokenizer check;
+  pyzor_spec_t spec;
+  size_t cnt;
+  unsigned int num, nthr;
+  int err;
+
+  memcpy (&spec, &pyzor_spec_default, sizeof (spec));
+  spec.line_min = 1;
+  check.ntasks = BENCH_TOKEN_TASKS;
+
+  nthr = pyzor_pool_size (bench_workers);
+  check.digests = calloc (nthr, sizeof (*check.digests));
+  check.errs = calloc (check.ntasks, sizeof (*check.errs));
+  err = (! check.digests || ! check.errs) ? ENOMEM : 0;
+  for (num = 0; err == 0 && num < nthr; num++) {
+    if ((err = pyzor_digest_create (&check.digests[num])) == 0)
+      err = pyzor_digest_configure (check.digests[num], &spec, 1);
+  }
+
+  if (err == 0) {
+    pyzor_pool_run (bench_workers, &bench_tokenizer_task, &check, check.ntasks);
+    for (cnt = 0; err == 0 && cnt < check.ntasks; cnt++) {
+      if (check.errs[cnt] == EILSEQ)
+        golden->errs++;
+      else
+        err = check.errs[cnt];
+    }
+  }
+
+  for (num = 0; check.digests && num < nthr; num++) {
+    if (check.digests[num])
+      pyzor_digest_destroy (check.digests[num]);
+  }
+  free (check.digests);
+  free (check.errs);
+
+  return (err);
+}
+
+/* write generated messages to dir so that the command line tool can be
+   benchmarked on the same corpus */
+static int
+bench_write (const char *dir, const struct bench_buf *msg, const char *kind, size_t size)
+{
+  char path[4096];
+  FILE *fp;
+
+  snprintf (path, sizeof (path), "%s/%s-%zu.eml", dir, kind, size);
+  if (! (fp = fopen (path, "w")))
+    return (errno);
+  if (fwrite (msg->data, 1, msg->len, fp) != msg->len) {
+    fclose (fp);
+    return (EIO);
+  }
+  if (fclose (fp) != 0)
+    return (errno);
+
+  return (0);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: pyzor-bench [-k kind] [-s size] [-m seconds] [-j jobs] [-c golden|-w golden] [-o dir]\n");
+  printf ("       pyzor-bench [-j jobs] -t\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct bench_buf body, empty, msg;
+  struct bench_golden golden;
+  pyzor_digest_t *digest;
+  const char *dir, *only;
+  double min;
+  size_t cnt, size, sizes[sizeof (bench_sizes) / sizeof (bench_sizes[0])];
+  size_t nsizes;
+  unsigned int jobs;
+  int err, kind, opt, tokens;
+
+  memset (&body, 0, sizeof (body));
+  memset (&empty, 0, sizeof (empty));
+  empty.data = (unsigned char *)"";
+  memset (&msg, 0, sizeof (msg));
+  memset (&golden, 0, sizeof (golden));
+  dir = NULL;
+  only = NULL;
+  tokens = 0;
+  min = BENCH_MIN_TIME;
+  jobs = (unsigned int)sysconf (_SC_NPROCESSORS_ONLN);
+  nsizes = sizeof (bench_sizes) / sizeof (bench_sizes[0]);
+  memcpy (sizes, bench_sizes, sizeof (sizes));
+
+  while ((opt = getopt (argc, argv, "c:hj:k:m:o:s:tw:")) != -1) {
+    switch (opt) {
+      case 'c':
+        if (! (golden.check = fopen (optarg, "r"))) {
+          fprintf (stderr, "Cannot open `%s': %s\n", optarg, strerror (errno));
+          return (1);
+        }
+        break;
+      case 'j':
+        jobs = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'k':
+        only = optarg;
+        break;
+      case 'm':
+        min = strtod (optarg, NULL);
+        break;
+      case 'o':
+        dir = optarg;
+        break;
+      case 's':
+        sizes[0] = (size_t)strtoull (optarg, NULL, 10);
+        nsizes = 1;
+        break;
+      case 't':
+        tokens = 1;
+        break;
+      case 'w':
+        if (! (golden.write = fopen (optarg, "w"))) {
+          fprintf (stderr, "Cannot open `%s': %s\n", optarg, strerror (errno));
+          return (1);
+        }
+        break;
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if ((err = pyzor_digest_create (&digest)) != 0 ||
+      (err = pyzor_cache_create (&bench_cache, BENCH_CACHE_ENTRIES, BENCH_CACHE_BLOCK, 0)) != 0 ||
+      (err = pyzor_digest_pool_create (&bench_digests, BENCH_DIGEST_HWM)) != 0 ||
+      (err = pyzor_pool_create (&bench_workers, jobs)) != 0)
+  {
+    fprintf (stderr, "error: %s\n", strerror (err));
+    return (1);
+  }
+
+  /* tokenizer is checked instead of digesting the corpus */
+  if (tokens && (err = bench_tokenizer (&golden)) != 0) {
+    fprintf (stderr, "error: %s\n", strerror (err));
+    return (1);
+  }
+
+  if (! dir && ! tokens)
+    printf ("%-10s %10s %-14s %10s %12s %8s %10s\n",
+      "kind", "bytes", "stage", "MB/s", "msgs/s", "ns/byte", "rss(KB)");
+
+  if (! dir && ! tokens && (err = bench_body (digest, &golden, &empty, "empty", 0)) != 0) {
+    fprintf (stderr, "error: empty 0: %s\n", strerror (err));
+    return (1);
+  }
+
+  for (kind = 0; ! tokens && kind < bench_kind_max; kind++) {
+    if (only && strcmp (only, bench_kinds[kind]) != 0)
+      continue;
+    for (cnt = 0; cnt < nsizes; cnt++) {
+      /* attachments are always large, one size is enough */
+      if (kind == bench_attachment && cnt > 0)
+        break;
+      size = kind == bench_attachment && nsizes > 1 ? BENCH_ATTACHMENT_SIZE : sizes[cnt];
+
+      bench_generate (&msg, &body, (bench_kind_t)kind, size);
+      if (dir)
+        err = bench_write (dir, &msg, bench_kinds[kind], size);
+      else if ((err = bench_message (digest, &golden, &msg, bench_kinds[kind], size, min)) == 0 &&
+               kind == bench_blank)
+        err = bench_bounded (&golden, &msg, bench_kinds[kind], size);
+      if (err == 0 && ! dir)
+        err = bench_body (digest, &golden, &body, bench_kinds[kind], size);
+      if (err == 0 && ! dir && size <= BENCH_SPLIT_MAX)
+        err = bench_split (digest, &golden, &msg, bench_kinds[kind], size);
+      if (err != 0) {
+        fprintf (stderr, "error: %s %zu: %s\n", bench_kinds[kind], size, strerror (err));
+        return (1);
+      }
+    }
+  }
+
+  pyzor_digest_destroy (digest);
+  pyzor_cache_destroy (bench_cache);
+  pyzor_pool_destroy (bench_workers);
+  pyzor_digest_pool_destroy (bench_digests);
+  free (body.data);
+  free (msg.data);
+
+  if (golden.check)
+    fclose (golden.check);
+  if (golden.write)
+    fclose (golden.write);
+
+  if (golden.errs) {
+    fprintf (stderr, "%u digest mismatches\n", golden.errs);
+    return (1);
+  }
+
+  return (0);
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+
+# optimized build of the benchmark, debug output is compiled out
+gcc -g -O2 -pthread -o pyzor-bench bench.c pyzor.c mime.c cache.c pool.c
+
+# the tokenizer is checked against a copy of the branchy tokenizer it
+# replaced, every short string whole, split in two and a byte at a time
+./pyzor-bench -t || exit 1
+
+# digests are checked against bench.golden and small messages split in two
+# at every offset against the message fed whole, use -w to regenerate it after an
+# intentional change to the algorithm
+./pyzor-bench -c bench.golden "$@"
@@ -0,0 +1,473 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "mime.h"
+#include "pyzor.h"
+
+/* content-addressed cache of normalized lines. parts are identified by a
+   128-bit hash of their encoded body and transfer encoding, headers of the
+   message do not matter. copies of a campaign that only differ in their
+   headers therefore skip decoding and normalization. for a message that
+   consists of a single part the final digest is kept as well.
+
+   the cache is set associative. a part can only be stored in one of
+   PYZOR_CACHE_WAYS consecutive slots, which are replaced in CLOCK order. every
+   slot owns a fixed size block, so a cache never allocates after it has been
+   created and works the same in a private and in a shared mapping.
+
+   the hash is not cryptographic. it is keyed with a random seed so that
+   collisions cannot be computed up front to poison the cache. */
+
+#define PYZOR_CACHE_WAYS (8)
+
+/* messages with more parts than this are not cached */
+#define PYZOR_CACHE_PARTS (32)
+
+struct pyzor_cache_slot {
+  uint64_t key[2];
+  uint64_t len; /* length of encoded part */
+  uint32_t used; /* bytes of line records in block */
+  unsigned char encoding;
+  unsigned char valid;
+  unsigned char ref; /* referenced since the clock last passed */
+  unsigned char sole; /* sum is valid */
+  unsigned char sum[PYZOR_DIGEST_HEX_LEN];
+};
+
+/* start of the mapping */
+struct pyzor_cache_head {
+  pthread_mutex_t lock;
+  uint64_t seed[2];
+  size_t num; /* number of slots */
+  size_t blk; /* block size */
+  struct pyzor_cache_stats stats;
+};
+
+struct pyzor_cache {
+  struct pyzor_cache_head *head;
+  struct pyzor_cache_slot *slots;
+  unsigned char *blks;
+  size_t size; /* size of mapping */
+  int shared;
+};
+
+struct pyzor_cache_key {
+  uint64_t key[2];
+  uint64_t len;
+  unsigned char encoding;
+};
+
+#define PYZOR_CACHE_P1 (0x9e3779b185ebca87ULL)
+#define PYZOR_CACHE_P2 (0xc2b2ae3d27d4eb4fULL)
+#define PYZOR_CACHE_P3 (0x165667b19e3779f9ULL)
+#define PYZOR_CACHE_P4 (0x85ebca77c2b2ae63ULL)
+#define PYZOR_CACHE_P5 (0x27d4eb2f165667c5ULL)
+
+#define PYZOR_CACHE_ROL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t
+pyzor_cache_read (const unsigned char *str)
+{
+  uint64_t x;
+
+  memcpy (&x, str, sizeof (x));
+  return (x);
+}
+
+static uint64_t
+pyzor_cache_round (uint64_t acc, uint64_t x)
+{
+  acc += x * PYZOR_CACHE_P2;
+  acc = PYZOR_CACHE_ROL (acc, 31);
+  return (acc * PYZOR_CACHE_P1);
+}
+
+static uint64_t
+pyzor_cache_avalanche (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= PYZOR_CACHE_P2;
+  h ^= h >> 29;
+  h *= PYZOR_CACHE_P3;
+  h ^= h >> 32;
+  return (h);
+}
+
+/* four lanes in the style of xxh64, the two halves of the key fold the lanes
+   in a different order with a different seed */
+static void
+pyzor_cache_hash (const uint64_t seed[2],
+                  const unsigned char *str,
+                  size_t len,
+                  unsigned char encoding,
+                  uint64_t key[2])
+{
+  uint64_t h[2], v[4];
+  size_t pos;
+  unsigned int cnt;
+
+  v[0] = seed[0] + PYZOR_CACHE_P1 + PYZOR_CACHE_P2;
+  v[1] = seed[0] + PYZOR_CACHE_P2;
+  v[2] = seed[1];
+  v[3] = seed[1] - PYZOR_CACHE_P1;
+
+  for (pos = 0; len - pos >= 32; pos += 32) {
+    v[0] = pyzor_cache_round (v[0], pyzor_cache_read (str + pos));
+    v[1] = pyzor_cache_round (v[1], pyzor_cache_read (str + pos + 8));
+    v[2] = pyzor_cache_round (v[2], pyzor_cache_read (str + pos + 16));
+    v[3] = pyzor_cache_round (v[3], pyzor_cache_read (str + pos + 24));
+  }
+
+  h[0] = PYZOR_CACHE_ROL (v[0], 1) + PYZOR_CACHE_ROL (v[1], 7) +
+         PYZOR_CACHE_ROL (v[2], 12) + PYZOR_CACHE_ROL (v[3], 18);
+  h[1] = PYZOR_CACHE_ROL (v[3], 1) + PYZOR_CACHE_ROL (v[2], 7) +
+         PYZOR_CACHE_ROL (v[0], 12) + PYZOR_CACHE_ROL (v[1], 18);
+  for (cnt = 0; cnt < 4; cnt++) {
+    h[0] = (h[0] ^ pyzor_cache_round (0, v[cnt])) * PYZOR_CACHE_P1 + PYZOR_CACHE_P4;
+    h[1] = (h[1] ^ pyzor_cache_round (seed[1], v[3 - cnt])) * PYZOR_CACHE_P1 + PYZOR_CACHE_P4;
+  }
+
+  h[0] += (uint64_t)len;
+  h[1] += (uint64_t)len ^ ((uint64_t)encoding << 56);
+
+  for (; len - pos >= 8; pos += 8) {
+    h[0] ^= pyzor_cache_round (0, pyzor_cache_read (str + pos));
+    h[0] = PYZOR_CACHE_ROL (h[0], 27) * PYZOR_CACHE_P1 + PYZOR_CACHE_P4;
+    h[1] ^= pyzor_cache_round (seed[0], pyzor_cache_read (str + pos));
+    h[1] = PYZOR_CACHE_ROL (h[1], 29) * PYZOR_CACHE_P2 + PYZOR_CACHE_P3;
+  }
+  for (; pos < len; pos++) {
+    h[0] ^= str[pos] * PYZOR_CACHE_P5;
+    h[0] = PYZOR_CACHE_ROL (h[0], 11) * PYZOR_CACHE_P1;
+    h[1] ^= str[pos] * PYZOR_CACHE_P4;
+    h[1] = PYZOR_CACHE_ROL (h[1], 13) * PYZOR_CACHE_P2;
+  }
+
+  key[0] = pyzor_cache_avalanche (h[0] ^ encoding);
+  key[1] = pyzor_cache_avalanche (h[1] ^ key[0]);
+}
+
+int
+pyzor_cache_create (pyzor_cache_t **cache, size_t num, size_t blk, int shared)
+{
+  pthread_mutexattr_t attr;
+  pyzor_cache_t *ptr;
+  size_t size;
+  void *map;
+
+  assert (cache);
+
+  /* whole number of sets, blocks hold at least one line */
+  num = (num + PYZOR_CACHE_WAYS - 1) & ~((size_t)PYZOR_CACHE_WAYS - 1);
+  if (num == 0)
+    num = PYZOR_CACHE_WAYS;
+  blk = (blk + 7) & ~(size_t)7;
+  if (blk == 0)
+    blk = 4096;
+
+  if (blk > UINT32_MAX ||
+      num > (SIZE_MAX - sizeof (struct pyzor_cache_head)) /
+            (sizeof (struct pyzor_cache_slot) + blk))
+    return (EOVERFLOW);
+  size = sizeof (struct pyzor_cache_head) +
+         num * (sizeof (struct pyzor_cache_slot) + blk);
+
+  if (! (ptr = calloc (1, sizeof (pyzor_cache_t))))
+    return (ENOMEM);
+
+  /* anonymous mappings are zero filled, all slots start out invalid */
+  map = mmap (NULL, size, PROT_READ | PROT_WRITE,
+    (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    free (ptr);
+    return (ENOMEM);
+  }
+
+  ptr->head = map;
+  ptr->slots = (struct pyzor_cache_slot *)(ptr->head + 1);
+  ptr->blks = (unsigned char *)(ptr->slots + num);
+  ptr->size = size;
+  ptr->shared = shared;
+
+  ptr->head->num = num;
+  ptr->head->blk = blk;
+  if (getrandom (ptr->head->seed, sizeof (ptr->head->seed), 0) != sizeof (ptr->head->seed)) {
+    ptr->head->seed[0] = (uint64_t)time (NULL) * PYZOR_CACHE_P1;
+    ptr->head->seed[1] = (uint64_t)getpid () * PYZOR_CACHE_P2 ^ (uint64_t)(uintptr_t)ptr;
+  }
+
+  /* a robust mutex does not stay locked if a worker dies holding it */
+  pthread_mutexattr_init (&attr);
+  if (shared) {
+    pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+  }
+  pthread_mutex_init (&ptr->head->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+
+  *cache = ptr;
+
+  return (0);
+}
+
+/* a shared cache is unmapped in the calling process only */
+void
+pyzor_cache_destroy (pyzor_cache_t *cache)
+{
+  assert (cache);
+
+  if (cache) {
+    if (! cache->shared)
+      pthread_mutex_destroy (&cache->head->lock);
+    munmap (cache->head, cache->size);
+    free (cache);
+  }
+}
+
+static void
+pyzor_cache_lock (pyzor_cache_t *cache)
+{
+  size_t cnt;
+
+  if (pthread_mutex_lock (&cache->head->lock) == EOWNERDEAD) {
+    /* owner died halfway through an update, no slot can be trusted */
+    for (cnt = 0; cnt < cache->head->num; cnt++)
+      cache->slots[cnt].valid = 0;
+    pthread_mutex_consistent (&cache->head->lock);
+  }
+}
+
+static void
+pyzor_cache_unlock (pyzor_cache_t *cache)
+{
+  pthread_mutex_unlock (&cache->head->lock);
+}
+
+void
+pyzor_cache_stats (pyzor_cache_t *cache, struct pyzor_cache_stats *stats)
+{
+  assert (cache);
+  assert (stats);
+
+  pyzor_cache_lock (cache);
+  memcpy (stats, &cache->head->stats, sizeof (struct pyzor_cache_stats));
+  pyzor_cache_unlock (cache);
+}
+
+/* must be called with the lock held */
+static struct pyzor_cache_slot *
+pyzor_cache_find (pyzor_cache_t *cache, const struct pyzor_cache_key *key)
+{
+  struct pyzor_cache_slot *slot;
+  size_t cnt, set;
+
+  set = (size_t)(key->key[0] % (cache->head->num / PYZOR_CACHE_WAYS)) * PYZOR_CACHE_WAYS;
+  for (cnt = 0; cnt < PYZOR_CACHE_WAYS; cnt++) {
+    slot = &cache->slots[set + cnt];
+    if (slot->valid &&
+        slot->key[0] == key->key[0] &&
+        slot->key[1] == key->key[1] &&
+        slot->len == key->len &&
+        slot->encoding == key->encoding)
+      return (slot);
+  }
+
+  return (NULL);
+}
+
+/* must be called with the lock held */
+static struct pyzor_cache_slot *
+pyzor_cache_victim (pyzor_cache_t *cache, const struct pyzor_cache_key *key)
+{
+  struct pyzor_cache_slot *slot;
+  size_t cnt, set;
+
+  set = (size_t)(key->key[0] % (cache->head->num / PYZOR_CACHE_WAYS)) * PYZOR_CACHE_WAYS;
+  for (cnt = 0; cnt < PYZOR_CACHE_WAYS; cnt++) {
+    if (! cache->slots[set + cnt].valid)
+      return (&cache->slots[set + cnt]);
+  }
+
+  /* second chance, the hand starts at the first way of the set. at most one
+     pass clears all reference bits, so the loop always ends */
+  for (cnt = 0; ; cnt = (cnt + 1) % PYZOR_CACHE_WAYS) {
+    slot = &cache->slots[set + cnt];
+    if (! slot->ref)
+      break;
+    slot->ref = 0;
+  }
+
+  cache->head->stats.evictions++;
+  slot->valid = 0;
+
+  return (slot);
+}
+
+static unsigned char *
+pyzor_cache_block (pyzor_cache_t *cache, const struct pyzor_cache_slot *slot)
+{
+  return (cache->blks + (size_t)(slot - cache->slots) * cache->head->blk);
+}
+
+static void
+pyzor_cache_insert (pyzor_cache_t *cache,
+                    const struct pyzor_cache_key *key,
+                    const unsigned char *str,
+                    size_t len,
+                    const unsigned char *sum)
+{
+  struct pyzor_cache_slot *slot;
+
+  pyzor_cache_lock (cache);
+
+  if (len > cache->head->blk) {
+    cache->head->stats.oversize++;
+  } else if ((slot = pyzor_cache_find (cache, key))) {
+    /* inserted by somebody else in the meantime, or sum is added */
+    if (sum && ! slot->sole) {
+      memcpy (slot->sum, sum, PYZOR_DIGEST_HEX_LEN);
+      slot->sole = 1;
+    }
+  } else {
+    slot = pyzor_cache_victim (cache, key);
+    memcpy (pyzor_cache_block (cache, slot), str, len);
+    slot->key[0] = key->key[0];
+    slot->key[1] = key->key[1];
+    slot->len = key->len;
+    slot->encoding = (unsigned char)key->encoding;
+    slot->used = (uint32_t)len;
+    slot->ref = 0;
+    slot->sole = sum ? 1 : 0;
+    if (sum)
+      memcpy (slot->sum, sum, PYZOR_DIGEST_HEX_LEN);
+    slot->valid = 1;
+    cache->head->stats.inserts++;
+  }
+
+  pyzor_cache_unlock (cache);
+}
+
+struct pyzor_cache_parts {
+  struct pyzor_mime_part parts[PYZOR_CACHE_PARTS];
+  size_t cnt;
+};
+
+static int
+pyzor_cache_collect (void *user_data, const struct pyzor_mime_part *part)
+{
+  struct pyzor_cache_parts *parts = user_data;
+
+  if (parts->cnt == PYZOR_CACHE_PARTS)
+    return (E2BIG);
+
+  parts->parts[parts->cnt++] = *part;
+
+  return (0);
+}
+
+/* digest a message, parts seen before are not decoded again. the digest
+   must have been reset */
+int
+pyzor_cache_digest (pyzor_cache_t *cache,
+                    pyzor_mime_policy_t *policy, /* NULL for all parts */
+                    pyzor_digest_t *digest,
+                    const unsigned char *msg,
+                    size_t msglen,
+                    unsigned char *str,
+                    size_t len)
+{
+  struct pyzor_cache_parts parts;
+  struct pyzor_cache_key key;
+  struct pyzor_cache_slot *slot;
+  const struct pyzor_mime_part *part;
+  const unsigned char *lines;
+  size_t cnt, num, pos;
+  int err, hit;
+
+  assert (cache);
+  assert (digest);
+  assert (str);
+
+  if (len < PYZOR_DIGEST_HEX_LEN)
+    return (ENOBUFS);
+
+  parts.cnt = 0;
+  if ((err = pyzor_mime_walk (msg, msglen, &pyzor_cache_collect, &parts)) == E2BIG) {
+    if ((err = pyzor_mime_digest (digest, policy, msg, msglen)) != 0)
+      return (err);
+    return (pyzor_digest_final (str, len, digest));
+  } else if (err != 0) {
+    return (err);
+  }
+
+  /* parts the policy skips are dropped before anything is hashed, a part
+     that is left on its own is as good as a sole part */
+  for (cnt = 0, num = 0; cnt < parts.cnt; cnt++) {
+    if (pyzor_mime_policy_check (policy, &parts.parts[cnt]))
+      parts.parts[num++] = parts.parts[cnt];
+  }
+  parts.cnt = num;
+
+  for (cnt = 0; cnt < parts.cnt; cnt++) {
+    part = &parts.parts[cnt];
+    key.len = part->len;
+    key.encoding = (unsigned char)part->encoding;
+    pyzor_cache_hash (cache->head->seed, part->body, part->len, key.encoding, key.key);
+
+    pyzor_cache_lock (cache);
+    if ((slot = pyzor_cache_find (cache, &key))) {
+      slot->ref = 1;
+      cache->head->stats.hits++;
+      if (parts.cnt == 1 && slot->sole) {
+        memcpy (str, slot->sum, PYZOR_DIGEST_HEX_LEN);
+        pyzor_cache_unlock (cache);
+        return (0);
+      }
+      err = pyzor_digest_import (digest, pyzor_cache_block (cache, slot), slot->used);
+      hit = 1;
+    } else {
+      cache->head->stats.misses++;
+      hit = 0;
+    }
+    pyzor_cache_unlock (cache);
+
+    if (err != 0)
+      return (err);
+
+    if (hit) {
+      /* sum for a sole part is added below */
+      if (parts.cnt == 1)
+        break;
+      continue;
+    }
+
+    pos = pyzor_digest_tell (digest);
+    if ((err = pyzor_mime_update (digest, part)) != 0 ||
+        (err = pyzor_digest_export (digest, pos, &lines, &num)) != 0)
+      return (err);
+
+    if (parts.cnt != 1)
+      pyzor_cache_insert (cache, &key, lines, num, NULL);
+  }
+
+  if ((err = pyzor_digest_final (str, len, digest)) != 0)
+    return (err);
+
+  if (parts.cnt == 1) {
+    if ((err = pyzor_digest_export (digest, 0, &lines, &num)) != 0)
+      return (err);
+    pyzor_cache_insert (cache, &key, lines, num, str);
+  }
+
+  return (0);
+}
@@ -0,0 +1,32 @@
+#ifndef PYZOR_CACHE_H_INCLUDED
+#define PYZOR_CACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mime.h"
+#include "pyzor.h"
+
+typedef struct pyzor_cache pyzor_cache_t;
+
+struct pyzor_cache_stats {
+  uint64_t hits; /* parts that were not decoded */
+  uint64_t misses;
+  uint64_t inserts;
+  uint64_t evictions;
+  uint64_t oversize; /* parts too large to be cached */
+};
+
+/* memory is allocated up front, a cache holds at most the given number of
+   parts of which the normalized lines fit the given block size. a shared
+   cache lives in a shared mapping and can be used by processes forked after
+   it was created. */
+#define PYZOR_CACHE_SHARED (1)
+
+int pyzor_cache_create (pyzor_cache_t **, size_t, size_t, int);
+void pyzor_cache_destroy (pyzor_cache_t *);
+void pyzor_cache_stats (pyzor_cache_t *, struct pyzor_cache_stats *);
+int pyzor_cache_digest (pyzor_cache_t *, pyzor_mime_policy_t *, pyzor_digest_t *,
+  const unsigned char *, size_t, unsigned char *, size_t);
+
+#endif
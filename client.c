@@ -0,0 +1,681 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "pyzor.h"
+
+/* client side of the pyzor protocol. requests and replies are rfc 822 style
+   headers in a single datagram. a request carries a thread id that the
+   server echoes, which is what replies are matched on, and is signed with
+   the account key:
+
+     sig = sha1 (sha1 (request) ":" time ":" sha1hex (user ":" key))
+
+   any number of requests is kept in flight on a single connected socket,
+   a request that is not answered in time is sent again as is. */
+
+#define PYZOR_CLIENT_VERSION "2.1"
+
+/* thread ids below this are reserved */
+#define PYZOR_CLIENT_THREAD_MIN (1024)
+#define PYZOR_CLIENT_THREADS (65536)
+
+/* room for a request or a reply */
+#define PYZOR_CLIENT_MSG (1024)
+
+/* datagrams per sendmmsg or recvmmsg */
+#define PYZOR_CLIENT_BURST (64)
+
+/* digest spec sent along with reports, matches pyzor_digest_select */
+#define PYZOR_CLIENT_SPEC "20,3,60,3"
+
+#define PYZOR_CLIENT_FREE (SIZE_MAX)
+
+struct pyzor_client_req {
+  size_t idx; /* position in batch or PYZOR_CLIENT_FREE */
+  unsigned int thread;
+  unsigned int tries;
+  int64_t deadline;
+  size_t len;
+  char msg[PYZOR_CLIENT_MSG];
+};
+
+struct pyzor_client {
+  int fd;
+  char *user;
+  char key[PYZOR_DIGEST_HEX_LEN]; /* hashed key */
+  unsigned int timeout; /* milliseconds */
+  unsigned int retries;
+  unsigned int thread; /* next thread id */
+  int32_t *threads; /* slot by thread id, -1 if not in flight */
+  struct pyzor_client_req *reqs;
+  size_t *free;
+  size_t nfree;
+  size_t window;
+  int64_t soonest; /* no request expires before */
+  char (*in)[PYZOR_CLIENT_MSG];
+};
+
+static const char *pyzor_client_ops[] = {
+  "check", "report", "whitelist", "info", "ping"
+};
+
+static int64_t
+pyzor_client_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+pyzor_client_hex (char *str, const unsigned char *raw)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t pos;
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    str[pos * 2    ] = hex[raw[pos] >> 4];
+    str[pos * 2 + 1] = hex[raw[pos] & 0x0f];
+  }
+  str[pos * 2] = '\0';
+}
+
+static int
+pyzor_client_connect (int *fd, const char *host, const char *port)
+{
+  struct addrinfo hints, *res, *ptr;
+  int err, sock;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+
+  if ((err = getaddrinfo (host, port, &hints, &res)) != 0)
+    return (err == EAI_SYSTEM ? errno : EHOSTUNREACH);
+
+  err = EHOSTUNREACH;
+  sock = -1;
+  for (ptr = res; ptr; ptr = ptr->ai_next) {
+    sock = socket (ptr->ai_family, ptr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+      ptr->ai_protocol);
+    if (sock == -1) {
+      err = errno;
+      continue;
+    }
+    if (connect (sock, ptr->ai_addr, ptr->ai_addrlen) == 0)
+      break;
+    err = errno;
+    close (sock);
+    sock = -1;
+  }
+
+  freeaddrinfo (res);
+  if (sock == -1)
+    return (err);
+
+  *fd = sock;
+
+  return (0);
+}
+
+int
+pyzor_client_create (
+  pyzor_client_t **client,
+  const char *host,
+  const char *port,
+  const char *user,
+  const char *key)
+{
+  pyzor_client_t *ptr;
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  struct iovec iov[1];
+  char *str;
+  size_t len, pos;
+  int err;
+
+  assert (client);
+  assert (host);
+
+  if (! port)
+    port = PYZOR_CLIENT_PORT;
+  if (! user) {
+    user = "anonymous";
+    key = "";
+  } else if (! key) {
+    key = "";
+  }
+
+  if (strpbrk (user, "\r\n") || ! *user)
+    return (EINVAL);
+
+  if (! (ptr = calloc (1, sizeof (*ptr))))
+    return (errno);
+  ptr->fd = -1;
+  ptr->timeout = PYZOR_CLIENT_TIMEOUT;
+  ptr->retries = PYZOR_CLIENT_RETRIES;
+
+  /* the key is hashed along with the user name, like hash_key of pyzor
+     only the key is in lower case */
+  len = strlen (user) + 1 + strlen (key);
+  if (! (ptr->user = strdup (user)) || ! (str = malloc (len + 1))) {
+    err = errno;
+    goto error;
+  }
+  snprintf (str, len + 1, "%s:%s", user, key);
+  for (pos = strlen (user) + 1; pos < len; pos++)
+    str[pos] = (char)tolower ((unsigned char)str[pos]);
+  iov[0].iov_base = str;
+  iov[0].iov_len = len;
+  pyzor_sha1 (raw, iov, 1);
+  pyzor_client_hex (ptr->key, raw);
+  free (str);
+
+  if (! (ptr->threads = malloc (PYZOR_CLIENT_THREADS * sizeof (*ptr->threads))) ||
+      ! (ptr->in = malloc (PYZOR_CLIENT_BURST * sizeof (*ptr->in))))
+  {
+    err = errno;
+    goto error;
+  }
+  memset (ptr->threads, 0xff, PYZOR_CLIENT_THREADS * sizeof (*ptr->threads));
+
+  if (getrandom (&ptr->thread, sizeof (ptr->thread), 0) != sizeof (ptr->thread))
+    ptr->thread = (unsigned int)time (NULL) ^ (unsigned int)getpid ();
+  ptr->thread = PYZOR_CLIENT_THREAD_MIN +
+    ptr->thread % (PYZOR_CLIENT_THREADS - PYZOR_CLIENT_THREAD_MIN);
+
+  if ((err = pyzor_client_connect (&ptr->fd, host, port)) != 0 ||
+      (err = pyzor_client_window (ptr, PYZOR_CLIENT_WINDOW)) != 0)
+    goto error;
+
+  *client = ptr;
+
+  return (0);
+error:
+  pyzor_client_destroy (ptr);
+  return (err);
+}
+
+void
+pyzor_client_destroy (pyzor_client_t *client)
+{
+  if (client) {
+    if (client->fd != -1)
+      close (client->fd);
+    free (client->user);
+    free (client->threads);
+    free (client->reqs);
+    free (client->free);
+    free (client->in);
+    free (client);
+  }
+}
+
+void
+pyzor_client_timeout (pyzor_client_t *client, unsigned int timeout, unsigned int retries)
+{
+  assert (client);
+
+  /* keep the final timeout from overflowing */
+  client->timeout = timeout ? timeout : 1;
+  client->retries = retries > 16 ? 16 : retries;
+}
+
+int
+pyzor_client_window (pyzor_client_t *client, size_t window)
+{
+  struct pyzor_client_req *reqs;
+  size_t *free_;
+  size_t pos;
+  int size;
+
+  assert (client);
+
+  if (window == 0 || window > PYZOR_CLIENT_THREADS - PYZOR_CLIENT_THREAD_MIN)
+    return (EINVAL);
+
+  /* replies to a full window must fit in the receive buffer, or they are
+     dropped and only arrive after the retransmit. not fatal, the limit may
+     be lower */
+  size = (int)(window * PYZOR_CLIENT_MSG * 2);
+  (void)setsockopt (client->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+
+  if (! (reqs = malloc (window * sizeof (*reqs))))
+    return (errno);
+  if (! (free_ = malloc (window * sizeof (*free_)))) {
+    free (reqs);
+    return (ENOMEM);
+  }
+
+  free (client->reqs);
+  free (client->free);
+  client->reqs = reqs;
+  client->free = free_;
+  client->window = window;
+  client->nfree = window;
+  for (pos = 0; pos < window; pos++) {
+    reqs[pos].idx = PYZOR_CLIENT_FREE;
+    free_[pos] = window - pos - 1;
+  }
+
+  return (0);
+}
+
+static int
+pyzor_client_valid (const char *digest)
+{
+  size_t pos;
+
+  for (pos = 0; pos < PYZOR_DIGEST_HEX_LEN - 1; pos++) {
+    if (! isxdigit ((unsigned char)digest[pos]))
+      return (0);
+  }
+
+  return (digest[pos] == '\0');
+}
+
+/* formats and signs a request for the given slot */
+static int
+pyzor_client_sign (
+  pyzor_client_t *client,
+  struct pyzor_client_req *req,
+  pyzor_client_op_t op,
+  const char *digest,
+  int64_t now)
+{
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  char sig[PYZOR_DIGEST_HEX_LEN], str[PYZOR_DIGEST_HEX_LEN + 32];
+  struct iovec iov[2];
+  size_t size;
+  int len, ret;
+
+  size = sizeof (req->msg);
+  len = snprintf (req->msg, size, "Op: %s\n", pyzor_client_ops[op]);
+  if (op != pyzor_client_ping)
+    len += snprintf (req->msg + len, size - (size_t)len, "Op-Digest: %s\n", digest);
+  if (op == pyzor_client_report || op == pyzor_client_whitelist)
+    len += snprintf (req->msg + len, size - (size_t)len, "Op-Spec: %s\n", PYZOR_CLIENT_SPEC);
+  ret = snprintf (req->msg + len, size - (size_t)len,
+    "Thread: %u\nPV: %s\nUser: %s\nTime: %" PRId64,
+    req->thread, PYZOR_CLIENT_VERSION, client->user, now);
+  if (ret < 0 || (size_t)ret >= size - (size_t)len)
+    return (ENAMETOOLONG);
+  len += ret;
+
+  iov[0].iov_base = req->msg;
+  iov[0].iov_len = (size_t)len;
+  pyzor_sha1 (raw, iov, 1);
+
+  iov[0].iov_base = raw;
+  iov[0].iov_len = sizeof (raw);
+  iov[1].iov_base = str;
+  iov[1].iov_len = (size_t)snprintf (str, sizeof (str), ":%" PRId64 ":%s", now, client->key);
+  pyzor_sha1 (raw, iov, 2);
+  pyzor_client_hex (sig, raw);
+
+  ret = snprintf (req->msg + len, size - (size_t)len, "\nSig: %s\n\n", sig);
+  if (ret < 0 || (size_t)ret >= size - (size_t)len)
+    return (ENAMETOOLONG);
+  req->len = (size_t)(len + ret);
+
+  return (0);
+}
+
+static int64_t
+pyzor_client_number (const char *str, size_t len)
+{
+  int64_t num;
+  size_t pos;
+  int neg;
+
+  neg = (len && str[0] == '-');
+  num = 0;
+  for (pos = (size_t)neg; pos < len && str[pos] >= '0' && str[pos] <= '9'; pos++)
+    num = num * 10 + (str[pos] - '0');
+
+  return (neg ? -num : num);
+}
+
+/* thread id of a well formed reply or zero */
+static unsigned int
+pyzor_client_parse (const char *msg, size_t len, struct pyzor_client_result *res)
+{
+  const char *end, *name, *nl, *val;
+  size_t namelen, vallen;
+  unsigned int thread;
+  int code, version;
+
+  memset (res, 0, sizeof (*res));
+  thread = 0;
+  code = 0;
+  version = 0;
+
+  for (end = msg + len; msg < end; msg = nl + 1) {
+    if (! (nl = memchr (msg, '\n', (size_t)(end - msg))))
+      nl = end;
+    name = msg;
+    if (! (val = memchr (name, ':', (size_t)(nl - name))))
+      continue;
+    namelen = (size_t)(val - name);
+    for (val++; val < nl && (*val == ' ' || *val == '\t'); val++)
+      ;
+    vallen = (size_t)(nl - val);
+    if (vallen && val[vallen - 1] == '\r')
+      vallen--;
+
+#define PYZOR_CLIENT_HEADER(str) \
+  (namelen == sizeof (str) - 1 && strncasecmp (name, str, namelen) == 0)
+
+    if (PYZOR_CLIENT_HEADER ("Code")) {
+      res->code = (int)pyzor_client_number (val, vallen);
+      code = 1;
+    } else if (PYZOR_CLIENT_HEADER ("Diag")) {
+      if (vallen >= sizeof (res->diag))
+        vallen = sizeof (res->diag) - 1;
+      memcpy (res->diag, val, vallen);
+      res->diag[vallen] = '\0';
+    } else if (PYZOR_CLIENT_HEADER ("PV")) {
+      /* only the major version has to match */
+      version = (vallen >= 2 && val[0] == '2' && val[1] == '.');
+    } else if (PYZOR_CLIENT_HEADER ("Thread")) {
+      thread = (unsigned int)pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("Count")) {
+      res->count = pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("WL-Count")) {
+      res->wl_count = pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("Entered")) {
+      res->entered = pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("Updated")) {
+      res->updated = pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("WL-Entered")) {
+      res->wl_entered = pyzor_client_number (val, vallen);
+    } else if (PYZOR_CLIENT_HEADER ("WL-Updated")) {
+      res->wl_updated = pyzor_client_number (val, vallen);
+    }
+
+#undef PYZOR_CLIENT_HEADER
+  }
+
+  if (! code || ! version || thread < PYZOR_CLIENT_THREAD_MIN ||
+      thread >= PYZOR_CLIENT_THREADS)
+    return (0);
+
+  return (thread);
+}
+
+static void
+pyzor_client_release (pyzor_client_t *client, struct pyzor_client_req *req)
+{
+  client->threads[req->thread] = -1;
+  req->idx = PYZOR_CLIENT_FREE;
+  client->free[client->nfree++] = (size_t)(req - client->reqs);
+}
+
+/* sends the queued datagrams. datagrams that cannot be sent right now are
+   treated as lost, they are sent again once they time out */
+static int
+pyzor_client_send (pyzor_client_t *client, struct mmsghdr *out, size_t cnt)
+{
+  size_t pos;
+  int ret;
+
+  for (pos = 0; pos < cnt; ) {
+    ret = sendmmsg (client->fd, out + pos, (unsigned int)(cnt - pos), 0);
+    if (ret > 0) {
+      pos += (size_t)ret;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      break;
+    } else if (errno == ECONNREFUSED) {
+      /* error from an earlier datagram, nothing is listening (yet) */
+      continue;
+    } else if (errno != EINTR) {
+      return (errno);
+    }
+  }
+
+  return (0);
+}
+
+static void
+pyzor_client_queue (
+  pyzor_client_t *client,
+  struct pyzor_client_req *req,
+  struct mmsghdr *out,
+  struct iovec *iov,
+  size_t *cnt,
+  int64_t now)
+{
+  req->deadline = now + ((int64_t)client->timeout << req->tries);
+  req->tries++;
+  if (req->deadline < client->soonest)
+    client->soonest = req->deadline;
+
+  iov[*cnt].iov_base = req->msg;
+  iov[*cnt].iov_len = req->len;
+  memset (&out[*cnt], 0, sizeof (out[*cnt]));
+  out[*cnt].msg_hdr.msg_iov = &iov[*cnt];
+  out[*cnt].msg_hdr.msg_iovlen = 1;
+  (*cnt)++;
+}
+
+static size_t
+pyzor_client_recv (
+  pyzor_client_t *client,
+  struct pyzor_client_result *results,
+  int *err)
+{
+  struct mmsghdr in[PYZOR_CLIENT_BURST];
+  struct iovec iov[PYZOR_CLIENT_BURST];
+  struct pyzor_client_result res;
+  struct pyzor_client_req *req;
+  unsigned int thread;
+  size_t done, pos;
+  int32_t slot;
+  int ret;
+
+  done = 0;
+  memset (in, 0, sizeof (in));
+  for (pos = 0; pos < PYZOR_CLIENT_BURST; pos++) {
+    iov[pos].iov_base = client->in[pos];
+    iov[pos].iov_len = sizeof (client->in[pos]);
+    in[pos].msg_hdr.msg_iov = &iov[pos];
+    in[pos].msg_hdr.msg_iovlen = 1;
+  }
+
+  for (;;) {
+    ret = recvmmsg (client->fd, in, PYZOR_CLIENT_BURST, MSG_DONTWAIT, NULL);
+    if (ret == -1) {
+      if (errno == EINTR || errno == ECONNREFUSED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        *err = errno;
+      break;
+    }
+
+    for (pos = 0; pos < (size_t)ret; pos++) {
+      if (! (thread = pyzor_client_parse (client->in[pos], in[pos].msg_len, &res)))
+        continue;
+      /* duplicates and replies to requests that timed out are dropped */
+      if ((slot = client->threads[thread]) == -1)
+        continue;
+      req = &client->reqs[slot];
+      results[req->idx] = res;
+      pyzor_client_release (client, req);
+      done++;
+    }
+
+    if (ret < PYZOR_CLIENT_BURST)
+      break;
+  }
+
+  return (done);
+}
+
+/* one request per digest, results are stored in the same order. returns
+   non-zero only if the socket failed, the outcome of individual requests
+   is in the err member of their result */
+int
+pyzor_client_batch (
+  pyzor_client_t *client,
+  pyzor_client_op_t op,
+  const char *const *digests,
+  size_t cnt,
+  struct pyzor_client_result *results)
+{
+  struct mmsghdr out[PYZOR_CLIENT_BURST];
+  struct iovec iov[PYZOR_CLIENT_BURST];
+  struct pyzor_client_req *req;
+  struct pollfd pfd;
+  size_t busy, done, next, nout, pos;
+  int64_t now, soonest, wait;
+  int err;
+
+  assert (client);
+  assert (results || ! cnt);
+  assert ((size_t)op < sizeof (pyzor_client_ops) / sizeof (pyzor_client_ops[0]));
+
+  busy = done = next = 0;
+  err = 0;
+  client->soonest = INT64_MAX;
+
+  while (done < cnt) {
+    now = pyzor_client_now ();
+    nout = 0;
+
+    /* retransmit or give up on requests that timed out */
+    if (now >= client->soonest) {
+      client->soonest = INT64_MAX;
+      for (pos = 0; pos < client->window; pos++) {
+        req = &client->reqs[pos];
+        if (req->idx == PYZOR_CLIENT_FREE)
+          continue;
+        if (req->deadline > now) {
+          if (req->deadline < client->soonest)
+            client->soonest = req->deadline;
+        } else if (req->tries > client->retries) {
+          results[req->idx].err = ETIMEDOUT;
+          pyzor_client_release (client, req);
+          busy--;
+          done++;
+        } else {
+          if (nout == PYZOR_CLIENT_BURST) {
+            if ((err = pyzor_client_send (client, out, nout)) != 0)
+              goto error;
+            nout = 0;
+          }
+          pyzor_client_queue (client, req, out, iov, &nout, now);
+        }
+      }
+    }
+
+    /* fill the window */
+    for (; next < cnt && busy < client->window; next++) {
+      memset (&results[next], 0, sizeof (results[next]));
+      if (op != pyzor_client_ping && (! digests[next] || ! pyzor_client_valid (digests[next]))) {
+        results[next].err = EINVAL;
+        done++;
+        continue;
+      }
+
+      req = &client->reqs[client->free[--client->nfree]];
+      req->idx = next;
+      req->tries = 0;
+      while (client->threads[client->thread] != -1) {
+        if (++client->thread == PYZOR_CLIENT_THREADS)
+          client->thread = PYZOR_CLIENT_THREAD_MIN;
+      }
+      req->thread = client->thread;
+      client->threads[req->thread] = (int32_t)(req - client->reqs);
+      if (++client->thread == PYZOR_CLIENT_THREADS)
+        client->thread = PYZOR_CLIENT_THREAD_MIN;
+
+      if ((err = pyzor_client_sign (client, req, op, digests[next], (int64_t)time (NULL))) != 0) {
+        results[next].err = err;
+        pyzor_client_release (client, req);
+        err = 0;
+        done++;
+        continue;
+      }
+
+      if (nout == PYZOR_CLIENT_BURST) {
+        if ((err = pyzor_client_send (client, out, nout)) != 0)
+          goto error;
+        nout = 0;
+      }
+      pyzor_client_queue (client, req, out, iov, &nout, now);
+      busy++;
+    }
+
+    if (nout && (err = pyzor_client_send (client, out, nout)) != 0)
+      goto error;
+    if (done == cnt)
+      break;
+
+    /* wait for replies until the first request times out */
+    soonest = client->soonest;
+    wait = soonest == INT64_MAX ? -1 : soonest > now ? soonest - now : 0;
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, wait > INT32_MAX ? INT32_MAX : (int)wait) == -1 && errno != EINTR) {
+      err = errno;
+      goto error;
+    }
+
+    if (pfd.revents) {
+      pos = pyzor_client_recv (client, results, &err);
+      if (err != 0)
+        goto error;
+      busy -= pos;
+      done += pos;
+    }
+  }
+
+  return (0);
+error:
+  /* leave the client usable for the next batch */
+  for (pos = 0; pos < client->window; pos++) {
+    req = &client->reqs[pos];
+    if (req->idx != PYZOR_CLIENT_FREE) {
+      results[req->idx].err = err;
+      pyzor_client_release (client, req);
+    }
+  }
+  for (; next < cnt; next++)
+    results[next].err = err;
+  return (err);
+}
+
+int
+pyzor_client_request (
+  pyzor_client_t *client,
+  pyzor_client_op_t op,
+  const char *digest,
+  struct pyzor_client_result *result)
+{
+  int err;
+
+  if ((err = pyzor_client_batch (client, op, &digest, 1, result)) != 0)
+    return (err);
+
+  return (result->err);
+}
@@ -0,0 +1,54 @@
+#ifndef PYZOR_CLIENT_H_INCLUDED
+#define PYZOR_CLIENT_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pyzor.h"
+
+typedef struct pyzor_client pyzor_client_t;
+
+typedef enum pyzor_client_op pyzor_client_op_t;
+
+enum pyzor_client_op {
+  pyzor_client_check = 0,
+  pyzor_client_report,
+  pyzor_client_whitelist,
+  pyzor_client_info,
+  pyzor_client_ping /* digest is ignored */
+};
+
+/* err is zero if the server replied, code and diag hold the status the
+   server replied with. fields the reply did not contain are zero */
+struct pyzor_client_result {
+  int err; /* ETIMEDOUT if no reply was received */
+  int code;
+  char diag[64];
+  int64_t count;
+  int64_t wl_count;
+  int64_t entered; /* info only, seconds since the epoch */
+  int64_t updated;
+  int64_t wl_entered;
+  int64_t wl_updated;
+};
+
+#define PYZOR_CLIENT_PORT "24441"
+
+/* requests are retransmitted after the timeout, which doubles with every
+   retransmit. a request fails once the final timeout expires */
+#define PYZOR_CLIENT_TIMEOUT (1000)
+#define PYZOR_CLIENT_RETRIES (2)
+
+/* maximum number of requests in flight */
+#define PYZOR_CLIENT_WINDOW (256)
+
+int pyzor_client_create (pyzor_client_t **, const char *, const char *, const char *, const char *);
+void pyzor_client_destroy (pyzor_client_t *);
+void pyzor_client_timeout (pyzor_client_t *, unsigned int, unsigned int);
+int pyzor_client_window (pyzor_client_t *, size_t);
+int pyzor_client_batch (pyzor_client_t *, pyzor_client_op_t,
+  const char *const *, size_t, struct pyzor_client_result *);
+int pyzor_client_request (pyzor_client_t *, pyzor_client_op_t,
+  const char *, struct pyzor_client_result *);
+
+#endif
@@ -0,0 +1,236 @@
+#!/bin/sh
+
+# pyzor-client against a local pyzord, run make.sh first. requests are sent
+# to the server directly and through a proxy that drops and duplicates
+# datagrams so that retransmits and duplicate replies are exercised. the
+# exact requests and output of the client are checked against a fake server
+# that signs like Pyzor and sends fixed replies.
+
+PORT=${PORT:-24441}
+PROXY=${PROXY:-24442}
+FAKE=${FAKE:-24443}
+TMP=`mktemp -d`
+SERVER=
+RELAY=
+REFERENCE=
+FAILED=0
+
+trap 'kill $SERVER $RELAY $REFERENCE 2>/dev/null; rm -rf "$TMP"' EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+fail () {
+  echo "FAIL: $*" >&2
+  FAILED=1
+}
+
+# digests of 40 hex digits
+digests () {
+  i=$1
+  while [ $i -le $2 ]; do
+    printf '%040d\n' $i
+    i=`expr $i + 1`
+  done
+}
+
+client () {
+  port=$1
+  shift
+  ./pyzor-client -s 127.0.0.1:$port -u Alice -k SeCrEt -t 100 -r 16 "$@"
+}
+
+# every datagram the client sends is dropped once in three, every reply is
+# sent twice once in four
+cat > "$TMP/proxy.py" <<'EOF'
+import select, socket, sys
+
+port, target, log = int (sys.argv[1]), int (sys.argv[2]), sys.argv[3]
+front = socket.socket (socket.AF_INET, socket.SOCK_DGRAM)
+front.bind (("127.0.0.1", port))
+back = socket.socket (socket.AF_INET, socket.SOCK_DGRAM)
+back.connect (("127.0.0.1", target))
+peer, sent, replies = None, 0, 0
+with open (log, "a", buffering=1) as out:
+  while True:
+    ready, _, _ = select.select ([front, back], [], [])
+    if front in ready:
+      data, peer = front.recvfrom (65536)
+      sent += 1
+      if sent % 3 == 0:
+        out.write ("drop\n")
+      else:
+        back.send (data)
+    if back in ready:
+      data = back.recv (65536)
+      replies += 1
+      front.sendto (data, peer)
+      if replies % 4 == 0:
+        front.sendto (data, peer)
+        out.write ("duplicate\n")
+EOF
+
+# hash_key and sign_msg of pyzor/account.py, checked against fixed vectors
+# first. a request must be exactly what the Pyzor client sends for the op,
+# with its own thread and time, and carry the signature of Alice. a request
+# that is not is logged and refused with 400, the others get fixed replies
+cat > "$TMP/reference.py" <<'EOF'
+import hashlib, socket, sys, time
+
+def hash_key (key, user):
+  return hashlib.sha1 (("%s:%s" % (user, key.lower ())).encode ()).hexdigest ()
+
+def sign_msg (hashed_key, timestamp, msg):
+  digest = hashlib.sha1 (hashlib.sha1 (msg.encode ()).digest ())
+  digest.update ((":%d:%s" % (timestamp, hashed_key)).encode ())
+  return digest.hexdigest ()
+
+vectors = [
+  (hash_key ("SeCrEt", "Alice"), "7757835e0252d1beeb1ed1165791e61cca37bf34"),
+  (hash_key ("", "anonymous"), "993fddad78000f2246ee74c4b1b9edcb89f91937"),
+  (sign_msg ("7757835e0252d1beeb1ed1165791e61cca37bf34", 1234567890,
+     "Op: check\nOp-Digest: 0000000000000000000000000000000000000001\n"
+     "Thread: 4242\nPV: 2.1\nUser: Alice\nTime: 1234567890"),
+   "5ab0233ee5982b79ca07ba77dc74f95f90ab765b"),
+  (sign_msg ("993fddad78000f2246ee74c4b1b9edcb89f91937", 1234567890,
+     "Op: ping\nThread: 4242\nPV: 2.1\nUser: anonymous\nTime: 1234567890"),
+   "25fc80d310b5ffbd6df3f49129bda40fda6a8e2b"),
+]
+for got, want in vectors:
+  if got != want:
+    sys.exit ("reference vector %s != %s" % (got, want))
+
+# digests ending in 99 fail on the server
+replies = {
+  "check": "Count: 7\nWL-Count: 2\n",
+  "info": "Count: 7\nWL-Count: 2\nEntered: 1234567890\nUpdated: 1234567899\n"
+          "WL-Entered: 1234000000\nWL-Updated: 1234000001\n",
+}
+
+port, log = int (sys.argv[1]), sys.argv[2]
+key = hash_key ("SeCrEt", "Alice")
+sock = socket.socket (socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind (("127.0.0.1", port))
+with open (log, "a", buffering=1) as out:
+  while True:
+    data, peer = sock.recvfrom (65536)
+    req = data.decode ()
+    fields = dict (line.split (": ", 1) for line in req.split ("\n") if ": " in line)
+    op, thread, ts = fields.get ("Op", ""), fields.get ("Thread", "0"), fields.get ("Time", "0")
+    digest = fields.get ("Op-Digest", "")
+    msg = "Op: %s\n" % op
+    if op != "ping":
+      msg += "Op-Digest: %s\n" % digest
+    if op in ("report", "whitelist"):
+      msg += "Op-Spec: 20,3,60,3\n"
+    msg += "Thread: %s\nPV: 2.1\nUser: Alice\nTime: %s" % (thread, ts)
+    want = msg + "\nSig: %s\n\n" % sign_msg (key, int (ts), msg)
+    if req != want or abs (int (ts) - time.time ()) > 60:
+      out.write ("bad request %r, want %r\n" % (req, want))
+      reply = "Code: 400\nDiag: Bad request\n"
+    elif digest.endswith ("99"):
+      reply = "Code: 500\nDiag: Internal Server Error\n"
+    else:
+      reply = "Code: 200\nDiag: OK\n" + replies.get (op, "")
+    reply += "PV: 2.1\nThread: %s\n\n" % thread
+    sock.sendto (reply.encode (), peer)
+EOF
+
+# sends a request signed by Alice as is and prints the code of the reply
+cat > "$TMP/raw.py" <<'EOF'
+import hashlib, socket, sys, time
+
+port, msg = int (sys.argv[1]), sys.argv[2].replace ("\\n", "\n")
+key = hashlib.sha1 (b"Alice:secret").hexdigest ()
+ts = int (time.time ())
+msg += "Thread: 4242\nPV: 2.1\nUser: Alice\nTime: %d" % ts
+sig = hashlib.sha1 (hashlib.sha1 (msg.encode ()).digest ())
+sig.update ((":%d:%s" % (ts, key)).encode ())
+sock = socket.socket (socket.AF_INET, socket.SOCK_DGRAM)
+sock.settimeout (2)
+sock.sendto ((msg + "\nSig: %s\n\n" % sig.hexdigest ()).encode (), ("127.0.0.1", port))
+print (sock.recv (4096).decode ().split ("\n")[0])
+EOF
+
+# user names are case sensitive, keys are not
+printf 'Alice : secret\n' > "$TMP/passwd"
+./pyzord -l 127.0.0.1:$PORT -a "$TMP/passwd" &
+SERVER=$!
+python3 "$TMP/proxy.py" $PROXY $PORT "$TMP/proxy.log" &
+RELAY=$!
+python3 "$TMP/reference.py" $FAKE "$TMP/reference.log" &
+REFERENCE=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  client $PORT ping >/dev/null 2>&1 && break
+  sleep 0.2
+done
+
+# ping
+client $PORT ping > "$TMP/out" || fail "ping"
+grep -q "^-	200	OK$" "$TMP/out" || fail "ping: `cat "$TMP/out"`"
+
+# report, then check and info see the count
+digests 1 3 | client $PORT report > "$TMP/out" 2>/dev/null || fail "report"
+[ `grep -c "	200	OK" "$TMP/out"` -eq 3 ] || fail "report: `cat "$TMP/out"`"
+digests 1 1 | client $PORT report >/dev/null 2>&1 || fail "report again"
+
+client $PORT check `digests 1 1` > "$TMP/out" || fail "check"
+grep -q "	200	OK	2	0$" "$TMP/out" || fail "check: `cat "$TMP/out"`"
+client $PORT check `digests 9 9` > "$TMP/out" || fail "check unknown"
+grep -q "	200	OK	0	0$" "$TMP/out" || fail "check unknown: `cat "$TMP/out"`"
+
+client $PORT info `digests 2 2` > "$TMP/out" || fail "info"
+grep -q "	200	OK	1	0	[1-9][0-9]*	[1-9][0-9]*	0	0$" "$TMP/out" ||
+  fail "info: `cat "$TMP/out"`"
+
+# report and whitelist without a digest are refused
+for op in report whitelist; do
+  python3 "$TMP/raw.py" $PORT "Op: $op\nOp-Spec: 20,3,60,3\n" > "$TMP/out" 2>&1
+  grep -q "^Code: 400$" "$TMP/out" || fail "$op without digest: `cat "$TMP/out"`"
+done
+
+# a wrong key is refused
+./pyzor-client -s 127.0.0.1:$PORT -u Alice -k wrong ping > "$TMP/out" &&
+  fail "wrong key accepted"
+grep -q "^-	401	" "$TMP/out" || fail "wrong key: `cat "$TMP/out"`"
+
+# through the proxy every request is answered once and in order, reports
+# may be counted twice when a retransmitted request was not lost
+digests 100 299 | client $PROXY report > "$TMP/out" 2>/dev/null || fail "proxy report"
+[ `grep -c "	200	OK$" "$TMP/out"` -eq 200 ] || fail "proxy report: `grep -v "	200	OK$" "$TMP/out" | head -1`"
+digests 100 299 | client $PROXY check > "$TMP/out" 2>/dev/null || fail "proxy check"
+[ `grep -c "	200	OK	[12]	0$" "$TMP/out"` -eq 200 ] || fail "proxy check: `grep -v "	200	OK	[12]	0$" "$TMP/out" | head -1`"
+cut -f1 "$TMP/out" > "$TMP/order"
+digests 100 299 | cmp -s - "$TMP/order" || fail "proxy check: results out of order"
+grep -q drop "$TMP/proxy.log" && grep -q duplicate "$TMP/proxy.log" ||
+  fail "proxy did not drop and duplicate datagrams"
+
+# every op against the fake server, the output is compared as a whole
+D1=`digests 1 1`
+D2=`digests 99 99`
+for op in ping check report whitelist info; do
+  if [ $op = ping ]; then
+    client $FAKE ping > "$TMP/out"
+  else
+    printf '%s first\n%s second\n' $D1 $D2 | client $FAKE $op > "$TMP/out" 2>/dev/null
+  fi
+  case $op in
+    ping)
+      printf -- '-\t200\tOK\n' ;;
+    check)
+      printf '%s\t200\tOK\t7\t2\tfirst\n' $D1
+      printf '%s\t500\tInternal Server Error\t0\t0\tsecond\n' $D2 ;;
+    info)
+      printf '%s\t200\tOK\t7\t2\t1234567890\t1234567899\t1234000000\t1234000001\tfirst\n' $D1
+      printf '%s\t500\tInternal Server Error\t0\t0\t0\t0\t0\t0\tsecond\n' $D2 ;;
+    *)
+      printf '%s\t200\tOK\tfirst\n' $D1
+      printf '%s\t500\tInternal Server Error\tsecond\n' $D2 ;;
+  esac > "$TMP/want"
+  cmp -s "$TMP/want" "$TMP/out" || fail "reference $op: `cat "$TMP/out"`"
+done
+[ -s "$TMP/reference.log" ] && fail "reference: `head -1 "$TMP/reference.log"`"
+
+if [ $FAILED -ne 0 ]; then
+  exit 1
+fi
+echo "client: all tests passed"
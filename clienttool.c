@@ -0,0 +1,205 @@
+/* command line interface to the pyzor client library */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "pyzor.h"
+
+static void
+clienttool_print (
+  const char *digest,
+  const char *name,
+  pyzor_client_op_t op,
+  const struct pyzor_client_result *res)
+{
+  printf ("%s\t", digest ? digest : "-");
+  if (res->err != 0) {
+    printf ("error: %s", strerror (res->err));
+  } else {
+    printf ("%d\t%s", res->code, res->diag);
+    if (op == pyzor_client_check || op == pyzor_client_info)
+      printf ("\t%" PRId64 "\t%" PRId64, res->count, res->wl_count);
+    if (op == pyzor_client_info)
+      printf ("\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64,
+        res->entered, res->updated, res->wl_entered, res->wl_updated);
+  }
+  printf ("%s%s\n", name ? "\t" : "", name ? name : "");
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: pyzor-client [-s host[:port]] [-u user] [-k key] [-t msecs] [-r retries]\n"
+          "                    [-w window] check|report|whitelist|info|ping [digest ...]\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *ops[] = { "check", "report", "whitelist", "info", "ping" };
+  pyzor_client_t *client;
+  struct pyzor_client_result *res;
+  char *host, *port, *line, *ptr, *tok, *user, *key;
+  char **digests, **names;
+  size_t cnt, len, pos, size, window;
+  unsigned int retries, timeout;
+  int err, op, opt, ret;
+  struct timespec start, end;
+  double secs;
+
+  host = NULL;
+  port = NULL;
+  user = NULL;
+  key = NULL;
+  timeout = PYZOR_CLIENT_TIMEOUT;
+  retries = PYZOR_CLIENT_RETRIES;
+  window = PYZOR_CLIENT_WINDOW;
+
+  while ((opt = getopt (argc, argv, "hk:r:s:t:u:w:")) != -1) {
+    switch (opt) {
+      case 'k':
+        key = optarg;
+        break;
+      case 'r':
+        retries = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 's':
+        host = optarg;
+        /* host:port, an ipv6 address has more than one colon */
+        if ((ptr = strchr (host, ':')) && ! strchr (ptr + 1, ':')) {
+          *ptr = '\0';
+          port = ptr + 1;
+        }
+        break;
+      case 't':
+        timeout = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'u':
+        user = optarg;
+        break;
+      case 'w':
+        window = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (optind >= argc) {
+    usage ();
+    return (1);
+  }
+
+  for (op = 0; op < (int)(sizeof (ops) / sizeof (ops[0])); op++) {
+    if (strcmp (argv[optind], ops[op]) == 0)
+      break;
+  }
+  if (op == (int)(sizeof (ops) / sizeof (ops[0]))) {
+    usage ();
+    return (1);
+  }
+
+  argv += optind + 1;
+  argc -= optind + 1;
+
+  if ((err = pyzor_client_create (&client, host ? host : "public.pyzor.org", port, user, key)) != 0) {
+    fprintf (stderr, "Cannot create client: %s\n", strerror (err));
+    return (1);
+  }
+  pyzor_client_timeout (client, timeout, retries);
+  if ((err = pyzor_client_window (client, window)) != 0) {
+    fprintf (stderr, "Invalid window: %s\n", strerror (err));
+    pyzor_client_destroy (client);
+    return (1);
+  }
+
+  /* digests from the command line, or the first field of every line of
+     standard input, the rest of the line is printed along with the result.
+     a ping without arguments is sent once */
+  digests = names = NULL;
+  cnt = size = 0;
+  line = NULL;
+  len = 0;
+  err = 0;
+  if (argc || op == pyzor_client_ping) {
+    cnt = argc ? (size_t)argc : 1;
+    digests = calloc (cnt, sizeof (*digests));
+    names = calloc (cnt, sizeof (*names));
+    if (! digests || ! names)
+      err = errno;
+    for (pos = 0; err == 0 && pos < (size_t)argc; pos++)
+      digests[pos] = argv[pos];
+  } else {
+    while (getline (&line, &len, stdin) != -1) {
+      if (! (tok = strtok_r (line, " \t\r\n", &ptr)))
+        continue;
+      if (cnt == size) {
+        size = size ? size * 2 : 1024;
+        if (! (digests = realloc (digests, size * sizeof (*digests))) ||
+            ! (names = realloc (names, size * sizeof (*names))))
+        {
+          err = errno;
+          break;
+        }
+      }
+      if ((names[cnt] = strtok_r (NULL, "\r\n", &ptr)))
+        names[cnt] += strspn (names[cnt], " \t");
+      if (! (digests[cnt] = strdup (tok)) ||
+          (names[cnt] && ! (names[cnt] = strdup (names[cnt]))))
+      {
+        err = errno;
+        break;
+      }
+      cnt++;
+    }
+    free (line);
+  }
+
+  res = NULL;
+  if (err == 0 && cnt && ! (res = calloc (cnt, sizeof (*res))))
+    err = errno;
+
+  if (err == 0) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    err = pyzor_client_batch (client, (pyzor_client_op_t)op,
+      (const char *const *)digests, cnt, res);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    for (pos = 0; pos < cnt; pos++)
+      clienttool_print (digests[pos], names[pos], (pyzor_client_op_t)op, &res[pos]);
+
+    secs = (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (cnt > 1)
+      fprintf (stderr, "%zu requests in %.3fs, %.0f/s\n", cnt, secs, secs > 0 ? cnt / secs : 0.0);
+  }
+
+  ret = 0;
+  if (err != 0) {
+    fprintf (stderr, "%s: %s\n", ops[op], strerror (err));
+    ret = 1;
+  }
+  for (pos = 0; res && pos < cnt; pos++) {
+    if (res[pos].err != 0 || res[pos].code != 200)
+      ret = 1;
+  }
+
+  if (! argc && digests && names) {
+    for (pos = 0; pos < cnt; pos++) {
+      free (digests[pos]);
+      free (names[pos]);
+    }
+  }
+  free (digests);
+  free (names);
+  free (res);
+  pyzor_client_destroy (client);
+
+  return (ret);
+}
@@ -0,0 +1,549 @@
+/* CPython extension exposing the digest core.
+
+     import cpyzor
+     d = cpyzor.Digest ()
+     d.update (text, eom=True)
+     d.final ()                      -> hex digest of decoded text
+     cpyzor.digest (text)            -> same, in one call
+     cpyzor.digest_message (message) -> hex digest of a raw MIME message
+     cpyzor.digest_many (messages)   -> list of hex digests, digested on a
+                                        thread pool
+
+   every function takes any object that supports the buffer protocol, data
+   is never copied. the GIL is released while digesting, a Digest object
+   has a lock of its own so that it can be shared between threads. */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mime.h"
+#include "pool.h"
+#include "pyzor.h"
+
+/* inputs smaller than this are digested without releasing the GIL, the
+   same threshold hashlib uses */
+#define CPYZOR_GIL_MINSIZE (2048)
+
+/* digest contexts of digest_many are recycled, line buffers are not kept
+   above this size between messages */
+#define CPYZOR_DIGEST_HWM (64 * 1024)
+
+/* the pools are created on first use and shared by all callers, runs of
+   digest_many are serialized because a thread pool is not reentrant */
+static pthread_mutex_t cpyzor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cpyzor_once = PTHREAD_ONCE_INIT;
+static int cpyzor_forkerr = 0;
+static pyzor_pool_t *cpyzor_workers = NULL;
+static pyzor_digest_pool_t *cpyzor_digests = NULL;
+
+/* parts of a raw message that are digested, text parts only like the
+   DataDigester of Pyzor. created with the module */
+static pyzor_mime_policy_t *cpyzor_policy = NULL;
+
+/* a forked child has none of the threads of the pools and may have a copy
+   of a lock that was held by one of them. fork waits for a run to finish,
+   the child leaves the pools of the parent behind and creates its own on
+   first use */
+static void
+cpyzor_prepare (void)
+{
+  pthread_mutex_lock (&cpyzor_lock);
+}
+
+static void
+cpyzor_parent (void)
+{
+  pthread_mutex_unlock (&cpyzor_lock);
+}
+
+static void
+cpyzor_child (void)
+{
+  cpyzor_workers = NULL;
+  cpyzor_digests = NULL;
+  pthread_mutex_init (&cpyzor_lock, NULL);
+}
+
+static void
+cpyzor_atfork (void)
+{
+  cpyzor_forkerr = pthread_atfork (&cpyzor_prepare, &cpyzor_parent, &cpyzor_child);
+}
+
+static PyObject *
+cpyzor_error (int err)
+{
+  if (err == ENOMEM)
+    return (PyErr_NoMemory ());
+  errno = err;
+  return (PyErr_SetFromErrno (PyExc_OSError));
+}
+
+typedef struct {
+  PyObject_HEAD
+  pyzor_digest_t *digest;
+  PyThread_type_lock lock;
+} cpyzor_digest_t;
+
+/* the lock is taken with the GIL released so that a thread that holds it
+   while digesting does not deadlock with one that waits for it */
+#define CPYZOR_ENTER(self) \
+  do { \
+    if (! PyThread_acquire_lock ((self)->lock, 0)) { \
+      Py_BEGIN_ALLOW_THREADS \
+      PyThread_acquire_lock ((self)->lock, 1); \
+      Py_END_ALLOW_THREADS \
+    } \
+  } while (0)
+
+#define CPYZOR_LEAVE(self) PyThread_release_lock ((self)->lock)
+
+static PyObject *
+cpyzor_digest_new (PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { NULL };
+  cpyzor_digest_t *self;
+  int err;
+
+  if (! PyArg_ParseTupleAndKeywords (args, kwds, ":Digest", kwlist))
+    return (NULL);
+  if (! (self = (cpyzor_digest_t *)type->tp_alloc (type, 0)))
+    return (NULL);
+  if (! (self->lock = PyThread_allocate_lock ())) {
+    Py_DECREF (self);
+    return (PyErr_NoMemory ());
+  }
+  if ((err = pyzor_digest_create (&self->digest)) != 0) {
+    self->digest = NULL;
+    Py_DECREF (self);
+    return (cpyzor_error (err));
+  }
+
+  return ((PyObject *)self);
+}
+
+static void
+cpyzor_digest_dealloc (cpyzor_digest_t *self)
+{
+  if (self->digest)
+    pyzor_digest_destroy (self->digest);
+  if (self->lock)
+    PyThread_free_lock (self->lock);
+  Py_TYPE (self)->tp_free ((PyObject *)self);
+}
+
+PyDoc_STRVAR (cpyzor_digest_update_doc,
+"update(data, eom=False)\n\n"
+"Feed the next piece of decoded text, eom marks the end of a MIME part.");
+
+static PyObject *
+cpyzor_digest_update (cpyzor_digest_t *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "data", "eom", NULL };
+  Py_buffer view;
+  int eom = 0, err;
+
+  if (! PyArg_ParseTupleAndKeywords (args, kwds, "y*|p:update", kwlist, &view, &eom))
+    return (NULL);
+
+  CPYZOR_ENTER (self);
+  if (view.len >= CPYZOR_GIL_MINSIZE) {
+    Py_BEGIN_ALLOW_THREADS
+    err = pyzor_digest_update (self->digest, view.buf, (size_t)view.len, eom);
+    Py_END_ALLOW_THREADS
+  } else {
+    err = pyzor_digest_update (self->digest, view.buf, (size_t)view.len, eom);
+  }
+  CPYZOR_LEAVE (self);
+  PyBuffer_Release (&view);
+
+  if (err != 0)
+    return (cpyzor_error (err));
+  Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR (cpyzor_digest_final_doc,
+"final()\n\n"
+"Return the digest of the lines fed so far as a hex string. The context\n"
+"is not changed, more text can be fed afterwards.");
+
+static PyObject *
+cpyzor_digest_final (cpyzor_digest_t *self, PyObject *unused)
+{
+  unsigned char str[PYZOR_DIGEST_HEX_LEN];
+  int err;
+
+  (void)unused;
+
+  CPYZOR_ENTER (self);
+  Py_BEGIN_ALLOW_THREADS
+  err = pyzor_digest_final (str, sizeof (str), self->digest);
+  Py_END_ALLOW_THREADS
+  CPYZOR_LEAVE (self);
+
+  if (err != 0)
+    return (cpyzor_error (err));
+  return (PyUnicode_FromStringAndSize ((const char *)str, PYZOR_DIGEST_HEX_LEN - 1));
+}
+
+PyDoc_STRVAR (cpyzor_digest_reset_doc,
+"reset()\n\n"
+"Prepare the context for the next message.");
+
+static PyObject *
+cpyzor_digest_reset (cpyzor_digest_t *self, PyObject *unused)
+{
+  int err;
+
+  (void)unused;
+
+  CPYZOR_ENTER (self);
+  err = pyzor_digest_reset (self->digest);
+  CPYZOR_LEAVE (self);
+
+  if (err != 0)
+    return (cpyzor_error (err));
+  Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR (cpyzor_digest_save_doc,
+"save()\n\n"
+"Return the state of the context as bytes, see load().");
+
+static PyObject *
+cpyzor_digest_save (cpyzor_digest_t *self, PyObject *unused)
+{
+  PyObject *ret;
+  size_t len;
+  int err;
+
+  (void)unused;
+
+  CPYZOR_ENTER (self);
+  ret = NULL;
+  if ((err = pyzor_digest_save (self->digest, NULL, 0, &len)) == ENOBUFS &&
+      (ret = PyBytes_FromStringAndSize (NULL, (Py_ssize_t)len)) != NULL)
+  {
+    err = pyzor_digest_save (self->digest, (unsigned char *)PyBytes_AS_STRING (ret), len, &len);
+  }
+  CPYZOR_LEAVE (self);
+
+  if (err != 0) {
+    Py_XDECREF (ret);
+    return (PyErr_Occurred () ? NULL : cpyzor_error (err));
+  }
+  return (ret);
+}
+
+PyDoc_STRVAR (cpyzor_digest_load_doc,
+"load(state)\n\n"
+"Continue a message from the state returned by save(), possibly in\n"
+"another process.");
+
+static PyObject *
+cpyzor_digest_load (cpyzor_digest_t *self, PyObject *args)
+{
+  Py_buffer view;
+  int err;
+
+  if (! PyArg_ParseTuple (args, "y*:load", &view))
+    return (NULL);
+
+  CPYZOR_ENTER (self);
+  err = pyzor_digest_load (self->digest, view.buf, (size_t)view.len);
+  CPYZOR_LEAVE (self);
+  PyBuffer_Release (&view);
+
+  if (err == EINVAL || err == ENOTSUP) {
+    PyErr_SetString (PyExc_ValueError, "invalid digest state");
+    return (NULL);
+  }
+  if (err != 0)
+    return (cpyzor_error (err));
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef cpyzor_digest_methods[] = {
+  { "update", (PyCFunction)(void (*) (void))cpyzor_digest_update,
+    METH_VARARGS | METH_KEYWORDS, cpyzor_digest_update_doc },
+  { "final", (PyCFunction)cpyzor_digest_final, METH_NOARGS, cpyzor_digest_final_doc },
+  { "reset", (PyCFunction)cpyzor_digest_reset, METH_NOARGS, cpyzor_digest_reset_doc },
+  { "save", (PyCFunction)cpyzor_digest_save, METH_NOARGS, cpyzor_digest_save_doc },
+  { "load", (PyCFunction)cpyzor_digest_load, METH_VARARGS, cpyzor_digest_load_doc },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject cpyzor_digest_type = {
+  PyVarObject_HEAD_INIT (NULL, 0)
+  .tp_name = "cpyzor.Digest",
+  .tp_doc = PyDoc_STR ("Digest()\n\nIncremental digest of decoded text."),
+  .tp_basicsize = sizeof (cpyzor_digest_t),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = cpyzor_digest_new,
+  .tp_dealloc = (destructor)cpyzor_digest_dealloc,
+  .tp_methods = cpyzor_digest_methods
+};
+
+/* digest a single buffer, as text or as a MIME message */
+static int
+cpyzor_digest_one (pyzor_digest_pool_t *pool,
+                   const unsigned char *str,
+                   size_t len,
+                   int mime,
+                   unsigned char *sum)
+{
+  pyzor_digest_t *digest;
+  int err;
+
+  if (! mime)
+    return (pyzor_digest_buffer (sum, PYZOR_DIGEST_HEX_LEN, str, len));
+
+  if ((err = pyzor_digest_pool_get (pool, &digest)) != 0)
+    return (err);
+  if ((err = pyzor_mime_digest (digest, cpyzor_policy, str, len)) == 0)
+    err = pyzor_digest_final (sum, PYZOR_DIGEST_HEX_LEN, digest);
+  pyzor_digest_pool_put (pool, digest);
+
+  return (err);
+}
+
+static int
+cpyzor_init (void)
+{
+  long num;
+  int err;
+
+  if (cpyzor_workers)
+    return (0);
+
+  if ((err = pyzor_digest_pool_create (&cpyzor_digests, CPYZOR_DIGEST_HWM)) != 0)
+    return (err);
+  if ((num = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    num = 1;
+  if ((err = pyzor_pool_create (&cpyzor_workers, (unsigned int)num)) != 0) {
+    pyzor_digest_pool_destroy (cpyzor_digests);
+    cpyzor_digests = NULL;
+    return (err);
+  }
+
+  return (0);
+}
+
+PyDoc_STRVAR (cpyzor_digest_doc,
+"digest(text)\n\n"
+"Return the digest of decoded text as a hex string.");
+
+static PyObject *
+cpyzor_digest (PyObject *module, PyObject *args)
+{
+  unsigned char sum[PYZOR_DIGEST_HEX_LEN];
+  Py_buffer view;
+  int err;
+
+  (void)module;
+
+  if (! PyArg_ParseTuple (args, "y*:digest", &view))
+    return (NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  err = pyzor_digest_buffer (sum, sizeof (sum), view.buf, (size_t)view.len);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release (&view);
+
+  if (err != 0)
+    return (cpyzor_error (err));
+  return (PyUnicode_FromStringAndSize ((const char *)sum, PYZOR_DIGEST_HEX_LEN - 1));
+}
+
+PyDoc_STRVAR (cpyzor_digest_message_doc,
+"digest_message(message)\n\n"
+"Return the digest of a raw MIME message as a hex string. Like the\n"
+"DataDigester of Pyzor only text parts are decoded and digested.");
+
+static PyObject *
+cpyzor_digest_message (PyObject *module, PyObject *args)
+{
+  unsigned char sum[PYZOR_DIGEST_HEX_LEN];
+  Py_buffer view;
+  int err;
+
+  (void)module;
+
+  if (! PyArg_ParseTuple (args, "y*:digest_message", &view))
+    return (NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&cpyzor_lock);
+  err = cpyzor_init ();
+  pthread_mutex_unlock (&cpyzor_lock);
+  if (err == 0)
+    err = cpyzor_digest_one (cpyzor_digests, view.buf, (size_t)view.len, 1, sum);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release (&view);
+
+  if (err != 0)
+    return (cpyzor_error (err));
+  return (PyUnicode_FromStringAndSize ((const char *)sum, PYZOR_DIGEST_HEX_LEN - 1));
+}
+
+struct cpyzor_batch {
+  Py_buffer *views;
+  unsigned char (*sums)[PYZOR_DIGEST_HEX_LEN];
+  int *errs;
+  int mime;
+};
+
+static void
+cpyzor_batch_task (void *user_data, size_t idx, unsigned int thr)
+{
+  struct cpyzor_batch *batch = user_data;
+
+  (void)thr;
+
+  batch->errs[idx] = cpyzor_digest_one (cpyzor_digests, batch->views[idx].buf,
+    (size_t)batch->views[idx].len, batch->mime, batch->sums[idx]);
+}
+
+PyDoc_STRVAR (cpyzor_digest_many_doc,
+"digest_many(messages, mime=True)\n\n"
+"Return the digests of a sequence of raw MIME messages, or of decoded\n"
+"texts if mime is False, as a list of hex strings. Only the text parts of\n"
+"a message are digested, see digest_message. Messages are digested\n"
+"on a thread pool with one thread per processor.");
+
+static PyObject *
+cpyzor_digest_many (PyObject *module, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = { "messages", "mime", NULL };
+  struct cpyzor_batch batch;
+  PyObject *items, *seq, *ret, *str;
+  Py_ssize_t cnt, num, held;
+  int err, mime = 1;
+
+  (void)module;
+
+  if (! PyArg_ParseTupleAndKeywords (args, kwds, "O|p:digest_many", kwlist, &items, &mime))
+    return (NULL);
+  if (! (seq = PySequence_Fast (items, "messages must be a sequence")))
+    return (NULL);
+
+  ret = NULL;
+  cnt = PySequence_Fast_GET_SIZE (seq);
+  memset (&batch, 0, sizeof (batch));
+  batch.mime = mime;
+  batch.views = PyMem_Calloc ((size_t)cnt + 1, sizeof (Py_buffer));
+  batch.sums = PyMem_Calloc ((size_t)cnt + 1, sizeof (*batch.sums));
+  batch.errs = PyMem_Calloc ((size_t)cnt + 1, sizeof (int));
+  if (! batch.views || ! batch.sums || ! batch.errs) {
+    PyErr_NoMemory ();
+    goto out;
+  }
+
+  /* buffers are held until every message is digested */
+  for (held = 0; held < cnt; held++) {
+    if (PyObject_GetBuffer (PySequence_Fast_GET_ITEM (seq, held), &batch.views[held], PyBUF_SIMPLE) != 0)
+      goto release;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&cpyzor_lock);
+  if ((err = cpyzor_init ()) == 0)
+    pyzor_pool_run (cpyzor_workers, &cpyzor_batch_task, &batch, (size_t)cnt);
+  pthread_mutex_unlock (&cpyzor_lock);
+  Py_END_ALLOW_THREADS
+
+  for (num = 0; err == 0 && num < cnt; num++)
+    err = batch.errs[num];
+  if (err != 0) {
+    cpyzor_error (err);
+    goto release;
+  }
+
+  if (! (ret = PyList_New (cnt)))
+    goto release;
+  for (num = 0; num < cnt; num++) {
+    str = PyUnicode_FromStringAndSize ((const char *)batch.sums[num], PYZOR_DIGEST_HEX_LEN - 1);
+    if (! str) {
+      Py_CLEAR (ret);
+      break;
+    }
+    PyList_SET_ITEM (ret, num, str);
+  }
+
+release:
+  for (num = 0; num < held; num++)
+    PyBuffer_Release (&batch.views[num]);
+out:
+  PyMem_Free (batch.views);
+  PyMem_Free (batch.sums);
+  PyMem_Free (batch.errs);
+  Py_DECREF (seq);
+
+  return (ret);
+}
+
+static PyMethodDef cpyzor_methods[] = {
+  { "digest", cpyzor_digest, METH_VARARGS, cpyzor_digest_doc },
+  { "digest_message", cpyzor_digest_message, METH_VARARGS, cpyzor_digest_message_doc },
+  { "digest_many", (PyCFunction)(void (*) (void))cpyzor_digest_many,
+    METH_VARARGS | METH_KEYWORDS, cpyzor_digest_many_doc },
+  { NULL, NULL, 0, NULL }
+};
+
+static void
+cpyzor_free (void *module)
+{
+  (void)module;
+
+  if (cpyzor_workers) {
+    pyzor_pool_destroy (cpyzor_workers);
+    pyzor_digest_pool_destroy (cpyzor_digests);
+    cpyzor_workers = NULL;
+    cpyzor_digests = NULL;
+  }
+  if (cpyzor_policy) {
+    pyzor_mime_policy_destroy (cpyzor_policy);
+    cpyzor_policy = NULL;
+  }
+}
+
+static struct PyModuleDef cpyzor_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "cpyzor",
+  .m_doc = PyDoc_STR ("C implementation of the Pyzor digest."),
+  .m_size = -1,
+  .m_methods = cpyzor_methods,
+  .m_free = cpyzor_free
+};
+
+PyMODINIT_FUNC
+PyInit_cpyzor (void)
+{
+  PyObject *module;
+  int err;
+
+  if (PyType_Ready (&cpyzor_digest_type) < 0)
+    return (NULL);
+  pthread_once (&cpyzor_once, &cpyzor_atfork);
+  if (cpyzor_forkerr != 0)
+    return (cpyzor_error (cpyzor_forkerr));
+  if (! cpyzor_policy &&
+      (err = pyzor_mime_policy_create (&cpyzor_policy, PYZOR_MIME_TEXT, NULL, 0)) != 0)
+    return (cpyzor_error (err));
+  if (! (module = PyModule_Create (&cpyzor_module)))
+    return (NULL);
+
+  Py_INCREF (&cpyzor_digest_type);
+  if (PyModule_AddObject (module, "Digest", (PyObject *)&cpyzor_digest_type) < 0) {
+    Py_DECREF (&cpyzor_digest_type);
+    Py_DECREF (module);
+    return (NULL);
+  }
+  PyModule_AddIntConstant (module, "DIGEST_HEX_LEN", PYZOR_DIGEST_HEX_LEN - 1);
+
+  return (module);
+}
@@ -0,0 +1,112 @@
+#!/bin/sh
+
+# cpyzor against canned digests, run make.sh first. the digests were taken
+# from the DataDigester of Pyzor, every entry point must reproduce them.
+
+TMP=`mktemp -d`
+
+trap 'rm -rf "$TMP"' EXIT
+trap 'exit 1' HUP INT PIPE TERM
+
+cat > "$TMP/test.py" <<'PY'
+import base64, sys
+
+sys.path.insert (0, sys.argv[1])
+import cpyzor
+
+failed = 0
+
+def fail (what, got, want):
+  global failed
+  print ("FAIL: %s: got %s, want %s" % (what, got, want), file=sys.stderr)
+  failed = 1
+
+def lines (fmt, n):
+  return b"".join ((fmt % i).encode () for i in range (n))
+
+# decoded text and its digest. empty has no lines, short and atomic have
+# no more than four lines and are digested whole, pieces and urls take
+# three lines at 20% and 60%
+texts = [
+  ("empty", b"",
+   "da39a3ee5e6b4b0d3255bfef95601890afd80709"),
+  ("short", b"Hello world, this is a test\n",
+   "1b8a9a0319f634878f4665836a710c2dc407f78a"),
+  ("atomic", b"line one is here\nline two is here\n"
+             b"see <b>bold</b> text now\nmail bob@example.com today please\n",
+   "b2d680968dbfcac012bbbf9f6cfcaf5818e874ba"),
+  ("pieces", lines ("This is line number %d of the message\n", 30),
+   "88d9acd9f3181c1b309b7655646266a7031ae1b6"),
+  ("urls", b"visit http://example.com/path now or later\n" +
+           lines ("filler text %d with words\n", 12),
+   "c2ea67086cc3bda8b9adcefadddbf97ec23bbdf0"),
+  ("long", b"averyveryverylongtoken short words here\n" * 3 +
+           b"tiny\n\nabc def ghi jkl\n",
+   "c37d01698ceb6e525e4c44f92567fd8592ff7b90"),
+]
+
+# the text of pieces in a quoted-printable part and a base64 part, the
+# attachment is not digested
+message = (
+  b"From: alice@example.com\n"
+  b"Subject: test\n"
+  b"MIME-Version: 1.0\n"
+  b"Content-Type: multipart/mixed; boundary=\"b\"\n\n"
+  b"--b\n"
+  b"Content-Type: text/plain\n"
+  b"Content-Transfer-Encoding: quoted-printable\n\n" +
+  lines ("This is line number %d of the =\nmessage\n", 15) +
+  b"--b\n"
+  b"Content-Type: application/octet-stream\n"
+  b"Content-Transfer-Encoding: base64\n\n" +
+  base64.encodebytes (lines ("attached line %d is not digested\n", 20)) +
+  b"--b\n"
+  b"Content-Type: text/plain; charset=us-ascii\n"
+  b"Content-Transfer-Encoding: base64\n\n" +
+  base64.encodebytes (lines ("This is line number %d of the message\n", 30)[15 * 38:]) +
+  b"--b--\n")
+
+for name, text, want in texts:
+  got = cpyzor.digest (text)
+  if got != want:
+    fail ("digest %s" % name, got, want)
+
+  # fed in pieces of every size up to 16 and across a save and load
+  for size in range (1, 17):
+    d = cpyzor.Digest ()
+    for i in range (0, len (text), size):
+      d.update (text[i:i + size])
+      if i // size == 2:
+        e = cpyzor.Digest ()
+        e.load (d.save ())
+        d = e
+    d.update (b"", eom=True)
+    got = d.final ()
+    if got != want:
+      fail ("update %s by %d" % (name, size), got, want)
+
+  # reset prepares the context for the next message
+  d.reset ()
+  d.update (text, eom=True)
+  got = d.final ()
+  if got != want:
+    fail ("reset %s" % name, got, want)
+
+got = cpyzor.digest_many ([text for name, text, want in texts], mime=False)
+want = [want for name, text, want in texts]
+if got != want:
+  fail ("digest_many", got, want)
+
+want = "88d9acd9f3181c1b309b7655646266a7031ae1b6"
+got = cpyzor.digest_message (message)
+if got != want:
+  fail ("digest_message", got, want)
+got = cpyzor.digest_many ([message] * 3)
+if got != [want] * 3:
+  fail ("digest_many messages", got, [want] * 3)
+
+sys.exit (failed)
+PY
+
+python3 "$TMP/test.py" "${1:-.}" || exit 1
+echo "cpyzor: all tests passed"
@@ -0,0 +1,786 @@
+#define _GNU_SOURCE /* accept4 */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "daemon.h"
+#include "mime.h"
+#include "pyzor.h"
+
+/* the event loop runs in the main thread and only does i/o. complete
+   requests are queued for a fixed number of workers, each of which digests
+   with a context taken from a shared pool. finished requests are handed back
+   through an eventfd and replies are written in the order requests arrived
+   on a connection, regardless of the order in which they finished. */
+
+#define PYZOR_DAEMON_EVENTS (64)
+#define PYZOR_DAEMON_BACKLOG (128)
+#define PYZOR_DAEMON_READ (64 * 1024)
+
+/* descriptors received but not yet claimed by a request */
+#define PYZOR_DAEMON_FDS (16)
+
+/* line buffers are not kept above this size between messages */
+#define PYZOR_DAEMON_HWM (64 * 1024)
+
+/* a connection is not read from while it has this many requests outstanding
+   or holds this many bytes of requests and replies, so that a client that
+   does not read its replies cannot make the daemon buffer without bound.
+   one request is always accepted, whatever its size */
+#define PYZOR_DAEMON_PENDING (256)
+#define PYZOR_DAEMON_QUEUED (8 * 1024 * 1024)
+
+/* room for a reply, "error: " plus strerror is cut off if necessary */
+#define PYZOR_DAEMON_REPLY (128)
+
+struct pyzor_conn;
+
+struct pyzor_job {
+  struct pyzor_job *next; /* work or done queue */
+  struct pyzor_job *order; /* next request on connection */
+  struct pyzor_conn *conn;
+  unsigned char *data;
+  size_t len;
+  int fd;
+  int err;
+  int done;
+  unsigned char sum[PYZOR_DIGEST_HEX_LEN];
+};
+
+struct pyzor_conn {
+  int fd;
+  int eof; /* no more requests, close once replies are written */
+  int dead; /* socket closed, waiting for outstanding requests */
+  uint32_t events;
+  unsigned char *in;
+  size_t inpos, inlen, insize;
+  unsigned char *out;
+  size_t outpos, outlen, outsize;
+  int fds[PYZOR_DAEMON_FDS];
+  size_t nfds;
+  struct pyzor_job *head, *tail; /* requests in arrival order */
+  size_t pending;
+  size_t queued; /* bytes of outstanding requests */
+  struct pyzor_conn *next; /* finished requests, see pyzor_daemon_done */
+  int dirty;
+};
+
+struct pyzor_daemon {
+  int lfd; /* listening socket */
+  int epfd;
+  int evfd; /* signals finished requests */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct pyzor_job *work, *last;
+  struct pyzor_job *done;
+  struct pyzor_conn *dead; /* freed after the current batch of events */
+  pthread_t *thrs;
+  unsigned int num;
+  int stop;
+  pyzor_digest_pool_t *digests;
+  pyzor_cache_t *cache; /* optional */
+  pyzor_mime_policy_t *policy; /* optional */
+};
+
+static volatile sig_atomic_t pyzor_daemon_quit = 0;
+
+static int pyzor_conn_parse (struct pyzor_daemon *, struct pyzor_conn *);
+
+static void
+pyzor_daemon_signal (int sig)
+{
+  (void)sig;
+  pyzor_daemon_quit = 1;
+}
+
+static int
+pyzor_daemon_digest (struct pyzor_daemon *daemon,
+                     const unsigned char *msg,
+                     size_t len,
+                     unsigned char *str)
+{
+  pyzor_digest_t *digest;
+  int err;
+
+  if ((err = pyzor_digest_pool_get (daemon->digests, &digest)) != 0)
+    return (err);
+  if (daemon->cache)
+    err = pyzor_cache_digest (daemon->cache, daemon->policy, digest, msg, len, str, PYZOR_DIGEST_HEX_LEN);
+  else if ((err = pyzor_mime_digest (digest, daemon->policy, msg, len)) == 0)
+    err = pyzor_digest_final (str, PYZOR_DIGEST_HEX_LEN, digest);
+  pyzor_digest_pool_put (daemon->digests, digest);
+
+  return (err);
+}
+
+static int
+pyzor_daemon_digest_fd (struct pyzor_daemon *daemon, int fd, unsigned char *str)
+{
+  struct stat st;
+  void *map;
+  int err;
+
+  if (fstat (fd, &st) == -1)
+    return (errno);
+  if (! S_ISREG (st.st_mode))
+    return (EINVAL);
+
+  map = NULL;
+  if (st.st_size > 0) {
+    map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      return (errno);
+    (void)madvise (map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  }
+
+  err = pyzor_daemon_digest (daemon, map, (size_t)st.st_size, str);
+
+  if (map)
+    munmap (map, (size_t)st.st_size);
+
+  return (err);
+}
+
+static void *
+pyzor_daemon_worker (void *arg)
+{
+  struct pyzor_daemon *daemon = arg;
+  struct pyzor_job *job;
+  uint64_t one = 1;
+  int signal;
+
+  for (;;) {
+    pthread_mutex_lock (&daemon->lock);
+    while (! daemon->work && ! daemon->stop)
+      pthread_cond_wait (&daemon->cond, &daemon->lock);
+    if (! (job = daemon->work)) {
+      pthread_mutex_unlock (&daemon->lock);
+      break;
+    }
+    if (! (daemon->work = job->next))
+      daemon->last = NULL;
+    pthread_mutex_unlock (&daemon->lock);
+
+    if (job->fd != -1) {
+      job->err = pyzor_daemon_digest_fd (daemon, job->fd, job->sum);
+      close (job->fd);
+      job->fd = -1;
+    } else {
+      job->err = pyzor_daemon_digest (daemon, job->data, job->len, job->sum);
+    }
+    free (job->data);
+    job->data = NULL;
+
+    pthread_mutex_lock (&daemon->lock);
+    signal = (daemon->done == NULL);
+    job->next = daemon->done;
+    daemon->done = job;
+    pthread_mutex_unlock (&daemon->lock);
+
+    /* the event loop drains the whole list, wake it once */
+    if (signal)
+      (void)write (daemon->evfd, &one, sizeof (one));
+  }
+
+  return (NULL);
+}
+
+static int
+pyzor_conn_full (const struct pyzor_conn *conn)
+{
+  return (conn->pending >= PYZOR_DAEMON_PENDING ||
+          conn->queued + (conn->outlen - conn->outpos) >= PYZOR_DAEMON_QUEUED);
+}
+
+static void
+pyzor_conn_events (struct pyzor_daemon *daemon, struct pyzor_conn *conn)
+{
+  struct epoll_event ev;
+  uint32_t events;
+
+  events = 0;
+  if (! conn->eof && ! pyzor_conn_full (conn))
+    events |= EPOLLIN;
+  if (conn->outlen > conn->outpos)
+    events |= EPOLLOUT;
+
+  if (events == conn->events)
+    return;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.ptr = conn;
+  (void)epoll_ctl (daemon->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+  conn->events = events;
+}
+
+/* close the socket, the connection itself is freed once no requests are
+   outstanding. events for it may still be pending in the current batch,
+   it is therefore not freed right away */
+static void
+pyzor_conn_close (struct pyzor_daemon *daemon, struct pyzor_conn *conn)
+{
+  size_t cnt;
+
+  if (conn->fd != -1) {
+    (void)epoll_ctl (daemon->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close (conn->fd);
+    conn->fd = -1;
+  }
+  for (cnt = 0; cnt < conn->nfds; cnt++)
+    close (conn->fds[cnt]);
+  conn->nfds = 0;
+  conn->dead = 1;
+
+  if (conn->pending == 0) {
+    conn->next = daemon->dead;
+    daemon->dead = conn;
+  }
+}
+
+static void
+pyzor_daemon_reap (struct pyzor_daemon *daemon)
+{
+  struct pyzor_conn *conn;
+
+  for (; (conn = daemon->dead); ) {
+    daemon->dead = conn->next;
+    free (conn->in);
+    free (conn->out);
+    free (conn);
+  }
+}
+
+static int
+pyzor_conn_reply (struct pyzor_conn *conn, const char *str, size_t len)
+{
+  unsigned char *buf;
+  size_t size;
+
+  if (conn->outpos == conn->outlen)
+    conn->outpos = conn->outlen = 0;
+
+  if (conn->outsize - conn->outlen < len) {
+    size = conn->outsize ? conn->outsize : 4096;
+    for (; size - conn->outlen < len; size *= 2)
+      ;
+    if (! (buf = realloc (conn->out, size)))
+      return (ENOMEM);
+    conn->out = buf;
+    conn->outsize = size;
+  }
+
+  memcpy (conn->out + conn->outlen, str, len);
+  conn->outlen += len;
+
+  return (0);
+}
+
+static int
+pyzor_conn_flush (struct pyzor_daemon *daemon, struct pyzor_conn *conn)
+{
+  struct pyzor_job *job;
+  char str[PYZOR_DAEMON_REPLY];
+  ssize_t cnt;
+  int err, len;
+
+  /* move finished requests at the head to the output buffer */
+  for (; (job = conn->head) && job->done; ) {
+    if (job->err == 0)
+      len = snprintf (str, sizeof (str), "%s\n", job->sum);
+    else
+      len = snprintf (str, sizeof (str), "error: %s\n", strerror (job->err));
+    if (len >= (int)sizeof (str)) {
+      len = (int)sizeof (str);
+      str[len - 1] = '\n';
+    }
+    if (pyzor_conn_reply (conn, str, (size_t)len) != 0)
+      return (-1);
+
+    if (! (conn->head = job->order))
+      conn->tail = NULL;
+    conn->pending--;
+    conn->queued -= job->len;
+    free (job);
+  }
+
+  for (; conn->outpos < conn->outlen; conn->outpos += (size_t)cnt) {
+    cnt = send (conn->fd, conn->out + conn->outpos,
+      conn->outlen - conn->outpos, MSG_NOSIGNAL);
+    if (cnt == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno == EINTR) {
+        cnt = 0;
+        continue;
+      }
+      return (-1);
+    }
+  }
+
+  /* requests held back while the connection was full */
+  if (! conn->eof && conn->inlen > conn->inpos && ! pyzor_conn_full (conn) &&
+      (err = pyzor_conn_parse (daemon, conn)) != 0)
+  {
+    fprintf (stderr, "Dropping connection: %s\n", strerror (err));
+    conn->eof = 1;
+  }
+
+  if (conn->eof && conn->pending == 0 && conn->outpos == conn->outlen)
+    return (-1);
+
+  pyzor_conn_events (daemon, conn);
+
+  return (0);
+}
+
+static int
+pyzor_conn_submit (struct pyzor_daemon *daemon,
+                   struct pyzor_conn *conn,
+                   unsigned char *data,
+                   size_t len,
+                   int fd)
+{
+  struct pyzor_job *job;
+
+  if (! (job = calloc (1, sizeof (struct pyzor_job))))
+    return (ENOMEM);
+
+  job->conn = conn;
+  job->data = data;
+  job->len = len;
+  job->fd = fd;
+
+  if (conn->tail)
+    conn->tail->order = job;
+  else
+    conn->head = job;
+  conn->tail = job;
+  conn->pending++;
+  conn->queued += len;
+
+  pthread_mutex_lock (&daemon->lock);
+  if (daemon->last)
+    daemon->last->next = job;
+  else
+    daemon->work = job;
+  daemon->last = job;
+  pthread_cond_signal (&daemon->cond);
+  pthread_mutex_unlock (&daemon->lock);
+
+  return (0);
+}
+
+/* split buffered input into requests, the rest is left in the buffer once
+   the connection is full */
+static int
+pyzor_conn_parse (struct pyzor_daemon *daemon, struct pyzor_conn *conn)
+{
+  unsigned char *buf;
+  uint32_t len;
+  int err, fd;
+
+  for (; conn->inlen - conn->inpos >= sizeof (len) && ! pyzor_conn_full (conn); ) {
+    memcpy (&len, conn->in + conn->inpos, sizeof (len));
+    len = ntohl (len);
+
+    if (len == PYZOR_DAEMON_FD) {
+      if (conn->nfds == 0)
+        return (EPROTO);
+      fd = conn->fds[0];
+      memmove (conn->fds, conn->fds + 1, --conn->nfds * sizeof (int));
+      if ((err = pyzor_conn_submit (daemon, conn, NULL, 0, fd)) != 0) {
+        close (fd);
+        return (err);
+      }
+      conn->inpos += sizeof (len);
+      continue;
+    }
+
+    if (len > PYZOR_DAEMON_MSG_MAX)
+      return (EMSGSIZE);
+    if (conn->inlen - conn->inpos - sizeof (len) < len)
+      break;
+
+    if (! (buf = malloc (len ? len : 1)))
+      return (ENOMEM);
+    memcpy (buf, conn->in + conn->inpos + sizeof (len), len);
+    if ((err = pyzor_conn_submit (daemon, conn, buf, len, -1)) != 0) {
+      free (buf);
+      return (err);
+    }
+    conn->inpos += sizeof (len) + len;
+  }
+
+  /* keep the remainder at the start of the buffer */
+  if (conn->inpos == conn->inlen) {
+    conn->inpos = conn->inlen = 0;
+  } else if (conn->inpos) {
+    memmove (conn->in, conn->in + conn->inpos, conn->inlen - conn->inpos);
+    conn->inlen -= conn->inpos;
+    conn->inpos = 0;
+  }
+
+  /* a large message grew the buffer, do not hold on to it */
+  if (conn->insize > 2 * PYZOR_DAEMON_READ && conn->inlen <= PYZOR_DAEMON_READ &&
+      (buf = realloc (conn->in, 2 * PYZOR_DAEMON_READ)) != NULL)
+  {
+    conn->in = buf;
+    conn->insize = 2 * PYZOR_DAEMON_READ;
+  }
+
+  return (0);
+}
+
+static int
+pyzor_conn_read (struct pyzor_daemon *daemon, struct pyzor_conn *conn)
+{
+  union {
+    struct cmsghdr hdr;
+    unsigned char buf[CMSG_SPACE (PYZOR_DAEMON_FDS * sizeof (int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  unsigned char *buf;
+  size_t cnt, num, size;
+  ssize_t len;
+  int *fds;
+
+  if (conn->insize - conn->inlen < PYZOR_DAEMON_READ) {
+    size = conn->insize ? conn->insize : PYZOR_DAEMON_READ;
+    for (; size - conn->inlen < PYZOR_DAEMON_READ; size *= 2)
+      ;
+    if (! (buf = realloc (conn->in, size)))
+      return (ENOMEM);
+    conn->in = buf;
+    conn->insize = size;
+  }
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = conn->in + conn->inlen;
+  iov.iov_len = conn->insize - conn->inlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof (ctl.buf);
+
+  if ((len = recvmsg (conn->fd, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return (0);
+    return (errno);
+  }
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    fds = (int *)CMSG_DATA (cmsg);
+    num = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+    for (cnt = 0; cnt < num; cnt++) {
+      if (conn->nfds < PYZOR_DAEMON_FDS)
+        conn->fds[conn->nfds++] = fds[cnt];
+      else
+        close (fds[cnt]);
+    }
+  }
+
+  if (len == 0) {
+    conn->eof = 1;
+    return (conn->inlen - conn->inpos ? EPROTO : 0);
+  }
+
+  conn->inlen += (size_t)len;
+  /* a request was cut off, the descriptors it referred to are lost */
+  if (msg.msg_flags & MSG_CTRUNC)
+    return (EPROTO);
+
+  return (pyzor_conn_parse (daemon, conn));
+}
+
+static void
+pyzor_daemon_accept (struct pyzor_daemon *daemon)
+{
+  struct epoll_event ev;
+  struct pyzor_conn *conn;
+  int fd;
+
+  for (;;) {
+    if ((fd = accept4 (daemon->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf (stderr, "Cannot accept connection: %s\n", strerror (errno));
+      return;
+    }
+
+    if (! (conn = calloc (1, sizeof (struct pyzor_conn)))) {
+      close (fd);
+      continue;
+    }
+
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl (daemon->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close (fd);
+      free (conn);
+    }
+  }
+}
+
+/* hand finished requests back to their connections */
+static void
+pyzor_daemon_done (struct pyzor_daemon *daemon)
+{
+  struct pyzor_job *job;
+  struct pyzor_conn *conn, *dirty;
+  uint64_t cnt;
+
+  (void)read (daemon->evfd, &cnt, sizeof (cnt));
+
+  pthread_mutex_lock (&daemon->lock);
+  job = daemon->done;
+  daemon->done = NULL;
+  pthread_mutex_unlock (&daemon->lock);
+
+  /* jobs are freed by the flush, collect connections first */
+  for (dirty = NULL; job; job = job->next) {
+    job->done = 1;
+    conn = job->conn;
+    if (! conn->dirty) {
+      conn->dirty = 1;
+      conn->next = dirty;
+      dirty = conn;
+    }
+  }
+
+  for (; (conn = dirty); ) {
+    dirty = conn->next;
+    conn->dirty = 0;
+    conn->next = NULL;
+
+    if (conn->dead) {
+      /* nobody to reply to */
+      for (; (job = conn->head) && job->done; conn->pending--) {
+        if (! (conn->head = job->order))
+          conn->tail = NULL;
+        free (job);
+      }
+      if (conn->pending == 0)
+        pyzor_conn_close (daemon, conn);
+    } else if (pyzor_conn_flush (daemon, conn) != 0) {
+      pyzor_conn_close (daemon, conn);
+    }
+  }
+}
+
+static int
+pyzor_daemon_listen (struct pyzor_daemon *daemon, const char *path)
+{
+  struct sockaddr_un sun;
+  int err;
+
+  if (strlen (path) >= sizeof (sun.sun_path))
+    return (ENAMETOOLONG);
+
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+
+  if ((daemon->lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return (errno);
+
+  /* remove a socket left behind by a previous instance */
+  (void)unlink (path);
+  if (bind (daemon->lfd, (struct sockaddr *)&sun, sizeof (sun)) == -1 ||
+      listen (daemon->lfd, PYZOR_DAEMON_BACKLOG) == -1)
+  {
+    err = errno;
+    close (daemon->lfd);
+    daemon->lfd = -1;
+    return (err);
+  }
+
+  return (0);
+}
+
+static void
+pyzor_daemon_event (struct pyzor_daemon *daemon,
+                    struct pyzor_conn *conn,
+                    uint32_t events)
+{
+  int err;
+
+  if (conn->dead)
+    return;
+
+  if (events & (EPOLLERR | EPOLLHUP) && ! (events & EPOLLIN)) {
+    pyzor_conn_close (daemon, conn);
+    return;
+  }
+
+  if (events & EPOLLIN) {
+    if ((err = pyzor_conn_read (daemon, conn)) != 0) {
+      /* requests parsed so far are still answered, nothing more is read as
+         the position in the stream is lost */
+      fprintf (stderr, "Dropping connection: %s\n", strerror (err));
+      conn->eof = 1;
+    }
+  }
+
+  if (pyzor_conn_flush (daemon, conn) != 0)
+    pyzor_conn_close (daemon, conn);
+}
+
+static void
+pyzor_daemon_cleanup (struct pyzor_daemon *daemon)
+{
+  struct pyzor_job *job;
+  unsigned int cnt;
+
+  pthread_mutex_lock (&daemon->lock);
+  daemon->stop = 1;
+  pthread_cond_broadcast (&daemon->cond);
+  pthread_mutex_unlock (&daemon->lock);
+
+  for (cnt = 0; cnt < daemon->num; cnt++)
+    pthread_join (daemon->thrs[cnt], NULL);
+  free (daemon->thrs);
+
+  /* the process is about to exit, connections are not torn down one by
+     one. requests still queued are released for the benefit of leak
+     checkers */
+  for (; (job = daemon->work); ) {
+    daemon->work = job->next;
+    if (job->fd != -1)
+      close (job->fd);
+    free (job->data);
+    free (job);
+  }
+
+  if (daemon->digests)
+    pyzor_digest_pool_destroy (daemon->digests);
+  if (daemon->evfd != -1)
+    close (daemon->evfd);
+  if (daemon->epfd != -1)
+    close (daemon->epfd);
+  if (daemon->lfd != -1)
+    close (daemon->lfd);
+  pthread_cond_destroy (&daemon->cond);
+  pthread_mutex_destroy (&daemon->lock);
+}
+
+int
+pyzor_daemon (const char *path,
+              unsigned int num,
+              pyzor_cache_t *cache,
+              pyzor_mime_policy_t *policy)
+{
+  struct epoll_event ev, evs[PYZOR_DAEMON_EVENTS];
+  struct pyzor_daemon daemon;
+  struct sigaction sa;
+  int cnt, err;
+
+  assert (path);
+
+  if (num == 0)
+    num = 1;
+
+  memset (&daemon, 0, sizeof (daemon));
+  daemon.lfd = daemon.epfd = daemon.evfd = -1;
+  daemon.cache = cache;
+  daemon.policy = policy;
+  pthread_mutex_init (&daemon.lock, NULL);
+  pthread_cond_init (&daemon.cond, NULL);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = &pyzor_daemon_signal;
+  sigemptyset (&sa.sa_mask);
+  (void)sigaction (SIGINT, &sa, NULL);
+  (void)sigaction (SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  (void)sigaction (SIGPIPE, &sa, NULL);
+
+  if ((err = pyzor_digest_pool_create (&daemon.digests, PYZOR_DAEMON_HWM)) != 0 ||
+      (err = pyzor_daemon_listen (&daemon, path)) != 0)
+    goto error;
+
+  if ((daemon.epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1 ||
+      (daemon.evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+  {
+    err = errno;
+    goto error;
+  }
+
+  /* listening socket and eventfd are told apart from connections by their
+     event data */
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &daemon.lfd;
+  if (epoll_ctl (daemon.epfd, EPOLL_CTL_ADD, daemon.lfd, &ev) == -1) {
+    err = errno;
+    goto error;
+  }
+  ev.data.ptr = &daemon.evfd;
+  if (epoll_ctl (daemon.epfd, EPOLL_CTL_ADD, daemon.evfd, &ev) == -1) {
+    err = errno;
+    goto error;
+  }
+
+  if (! (daemon.thrs = calloc (num, sizeof (pthread_t)))) {
+    err = ENOMEM;
+    goto error;
+  }
+  for (; daemon.num < num; daemon.num++) {
+    if ((err = pthread_create (&daemon.thrs[daemon.num], NULL, &pyzor_daemon_worker, &daemon)) != 0)
+      goto error;
+  }
+
+  while (! pyzor_daemon_quit) {
+    if ((cnt = epoll_wait (daemon.epfd, evs, PYZOR_DAEMON_EVENTS, -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+      err = errno;
+      goto error;
+    }
+
+    for (; cnt > 0; cnt--) {
+      if (evs[cnt - 1].data.ptr == &daemon.lfd)
+        pyzor_daemon_accept (&daemon);
+      else if (evs[cnt - 1].data.ptr == &daemon.evfd)
+        pyzor_daemon_done (&daemon);
+      else
+        pyzor_daemon_event (&daemon, evs[cnt - 1].data.ptr, evs[cnt - 1].events);
+    }
+
+    pyzor_daemon_reap (&daemon);
+  }
+
+  (void)unlink (path);
+  pyzor_daemon_cleanup (&daemon);
+
+  return (0);
+
+error:
+  if (daemon.lfd != -1)
+    (void)unlink (path);
+  pyzor_daemon_cleanup (&daemon);
+
+  return (err);
+}
@@ -0,0 +1,27 @@
+#ifndef PYZOR_DAEMON_H_INCLUDED
+#define PYZOR_DAEMON_H_INCLUDED
+
+#include <sys/types.h>
+
+#include "cache.h"
+#include "mime.h"
+
+/* daemon protocol. a client sends any number of requests over a stream
+   socket without waiting for replies, every request is answered with a
+   single line and replies are sent in request order.
+
+   request: 4 byte length in network byte order followed by the message. a
+            length of PYZOR_DAEMON_FD means no message follows, instead the
+            message is read from a descriptor passed with SCM_RIGHTS along
+            with the length.
+   reply:   "<40 hex digits>\n" or "error: <reason>\n" */
+
+#define PYZOR_DAEMON_FD (0xffffffffu)
+
+/* messages passed inline cannot exceed this size */
+#define PYZOR_DAEMON_MSG_MAX (64 * 1024 * 1024)
+
+int pyzor_daemon (const char *, unsigned int, pyzor_cache_t *,
+  pyzor_mime_policy_t *);
+
+#endif
@@ -0,0 +1,642 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "pyzor.h"
+
+/* local digest database. the file is a header followed by a power of two
+   number of 64 byte slots, digests are placed by linear probing starting at
+   the slot given by their first bytes. digests are SHA-1 sums and therefore
+   evenly distributed, they need not be hashed again.
+
+   readers map the file and never lock. the single writer updates a slot
+   under a per slot sequence counter, a reader retries if the counter was
+   odd or changed while it copied the slot. slots are never emptied in
+   place, so a probe sequence cannot be cut short under a reader.
+
+   the table is grown and expired entries are dropped by writing a new file
+   next to the old one and renaming it over the old one. the old file is
+   then marked as moved, handles that still map it reopen the path on their
+   next access. lookups in progress are counted per handle, a mapping that
+   was replaced is released once no lookup is in progress, so that a reader
+   in the middle of a lookup is never left with an unmapped table. */
+
+#define PYZOR_DB_MAGIC "PYZORDB"
+#define PYZOR_DB_VERSION (1)
+
+#define PYZOR_DB_HEAD_LEN (4096)
+#define PYZOR_DB_SLOTS_MIN (1024)
+
+/* number of times a reader retries a slot that is being written */
+#define PYZOR_DB_SPIN (1 << 20)
+
+/* table is grown once more than 3/4 of the slots are used */
+#define PYZOR_DB_LOAD(slots) (((slots) / 4) * 3)
+
+struct pyzor_db_head {
+  char magic[8];
+  uint32_t version;
+  uint32_t slotlen;
+  uint64_t slots;
+  uint64_t count; /* slots in use */
+  uint32_t moved; /* file was replaced */
+  uint32_t pad;
+  int64_t created;
+};
+
+struct pyzor_db_slot {
+  uint32_t seq; /* odd while slot is written */
+  uint32_t used;
+  uint32_t digest[PYZOR_DIGEST_RAW_LEN / sizeof (uint32_t)];
+  uint32_t spam;
+  uint32_t ham;
+  uint32_t pad;
+  int64_t first;
+  int64_t last;
+  uint64_t reserved;
+};
+
+typedef char pyzor_db_slot_len[sizeof (struct pyzor_db_slot) == 64 ? 1 : -1];
+
+struct pyzor_db_map {
+  struct pyzor_db_map *prev; /* retired mappings */
+  struct pyzor_db_head *head;
+  struct pyzor_db_slot *slots;
+  size_t size;
+  uint64_t mask;
+  int fd;
+};
+
+struct pyzor_db {
+  struct pyzor_db_map *map;
+  unsigned int readers; /* lookups in progress */
+  unsigned int retired; /* mappings replaced but not released */
+  pthread_mutex_t lock; /* serializes reopening */
+  char *path;
+  int flags;
+};
+
+#define pyzor_db_load(ptr) (__atomic_load_n ((ptr), __ATOMIC_RELAXED))
+#define pyzor_db_store(ptr, val) (__atomic_store_n ((ptr), (val), __ATOMIC_RELAXED))
+
+static int
+pyzor_db_map_open (struct pyzor_db_map **map,
+                   const char *path,
+                   int flags,
+                   uint64_t slots)
+{
+  struct pyzor_db_head head;
+  struct pyzor_db_map *ptr;
+  struct stat st;
+  void *addr;
+  int err, fd, prot;
+
+  if ((fd = open (path, ((flags & PYZOR_DB_RDWR) ? O_RDWR : O_RDONLY) |
+                        ((flags & PYZOR_DB_CREATE) ? O_CREAT : 0) | O_CLOEXEC, 0644)) == -1)
+    return (errno);
+
+  /* a writer holds the lock until it closes, a writer waiting for it finds
+     that the file was replaced in the meantime */
+  if ((flags & PYZOR_DB_RDWR) && flock (fd, LOCK_EX) == -1)
+    goto error;
+  if (fstat (fd, &st) == -1)
+    goto error;
+
+  if (st.st_size == 0 && (flags & PYZOR_DB_CREATE)) {
+    memset (&head, 0, sizeof (head));
+    memcpy (head.magic, PYZOR_DB_MAGIC, sizeof (PYZOR_DB_MAGIC));
+    head.version = PYZOR_DB_VERSION;
+    head.slotlen = sizeof (struct pyzor_db_slot);
+    head.slots = slots;
+    head.created = (int64_t)time (NULL);
+    if (ftruncate (fd, (off_t)(PYZOR_DB_HEAD_LEN + slots * sizeof (struct pyzor_db_slot))) == -1 ||
+        pwrite (fd, &head, sizeof (head), 0) != (ssize_t)sizeof (head) ||
+        fstat (fd, &st) == -1)
+      goto error;
+  }
+
+  if ((size_t)st.st_size < PYZOR_DB_HEAD_LEN ||
+      pread (fd, &head, sizeof (head), 0) != (ssize_t)sizeof (head) ||
+      memcmp (head.magic, PYZOR_DB_MAGIC, sizeof (PYZOR_DB_MAGIC)) != 0 ||
+      head.version != PYZOR_DB_VERSION ||
+      head.slotlen != sizeof (struct pyzor_db_slot) ||
+      head.slots == 0 || (head.slots & (head.slots - 1)) != 0 ||
+      head.slots > ((uint64_t)st.st_size - PYZOR_DB_HEAD_LEN) / sizeof (struct pyzor_db_slot))
+  {
+    close (fd);
+    return (EINVAL);
+  }
+
+  prot = PROT_READ | ((flags & PYZOR_DB_RDWR) ? PROT_WRITE : 0);
+  if ((addr = mmap (NULL, (size_t)st.st_size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    goto error;
+
+  if (! (ptr = calloc (1, sizeof (struct pyzor_db_map)))) {
+    munmap (addr, (size_t)st.st_size);
+    close (fd);
+    return (ENOMEM);
+  }
+
+  ptr->head = addr;
+  ptr->slots = (struct pyzor_db_slot *)((unsigned char *)addr + PYZOR_DB_HEAD_LEN);
+  ptr->size = (size_t)st.st_size;
+  ptr->mask = head.slots - 1;
+  ptr->fd = fd;
+  *map = ptr;
+
+  return (0);
+
+error:
+  err = errno;
+  close (fd);
+  return (err);
+}
+
+static void
+pyzor_db_map_close (struct pyzor_db_map *map)
+{
+  munmap (map->head, map->size);
+  close (map->fd);
+  free (map);
+}
+
+/* complete updates of a writer that died. counts of a slot that was being
+   written may be off by one report, it was either written or not */
+static void
+pyzor_db_repair (struct pyzor_db_map *map)
+{
+  struct pyzor_db_slot *slot;
+  uint64_t pos;
+
+  for (pos = 0; pos <= map->mask; pos++) {
+    slot = &map->slots[pos];
+    if (slot->seq & 1)
+      __atomic_store_n (&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+int
+pyzor_db_open (pyzor_db_t **db, const char *path, int flags)
+{
+  pyzor_db_t *ptr;
+  int err;
+
+  assert (db);
+  assert (path);
+
+  if (flags & PYZOR_DB_CREATE)
+    flags |= PYZOR_DB_RDWR;
+
+  if (! (ptr = calloc (1, sizeof (pyzor_db_t))))
+    return (ENOMEM);
+  if (! (ptr->path = strdup (path))) {
+    free (ptr);
+    return (ENOMEM);
+  }
+  pthread_mutex_init (&ptr->lock, NULL);
+  ptr->flags = flags;
+
+  for (;;) {
+    if ((err = pyzor_db_map_open (&ptr->map, path, flags, PYZOR_DB_SLOTS_MIN)) != 0) {
+      pthread_mutex_destroy (&ptr->lock);
+      free (ptr->path);
+      free (ptr);
+      return (err);
+    }
+    /* replaced while waiting for the writer lock */
+    if (! __atomic_load_n (&ptr->map->head->moved, __ATOMIC_ACQUIRE))
+      break;
+    pyzor_db_map_close (ptr->map);
+  }
+
+  if (flags & PYZOR_DB_RDWR)
+    pyzor_db_repair (ptr->map);
+
+  *db = ptr;
+
+  return (0);
+}
+
+void
+pyzor_db_close (pyzor_db_t *db)
+{
+  struct pyzor_db_map *map;
+
+  assert (db);
+
+  if (db) {
+    for (; (map = db->map); ) {
+      db->map = map->prev;
+      pyzor_db_map_close (map);
+    }
+    pthread_mutex_destroy (&db->lock);
+    free (db->path);
+    free (db);
+  }
+}
+
+/* release replaced mappings if no lookup is in progress, called with the
+   lock held. a lookup that starts after the check loads the current
+   mapping, which is never released here */
+static void
+pyzor_db_release (pyzor_db_t *db)
+{
+  struct pyzor_db_map *map, *ptr;
+
+  if (__atomic_load_n (&db->readers, __ATOMIC_SEQ_CST) != 0)
+    return;
+
+  map = db->map;
+  for (; (ptr = map->prev); ) {
+    map->prev = ptr->prev;
+    pyzor_db_map_close (ptr);
+  }
+  __atomic_store_n (&db->retired, 0, __ATOMIC_RELAXED);
+}
+
+/* make map the current mapping, called with the lock held */
+static void
+pyzor_db_replace (pyzor_db_t *db, struct pyzor_db_map *map)
+{
+  map->prev = db->map;
+  __atomic_store_n (&db->map, map, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&db->retired, 1, __ATOMIC_RELAXED);
+  pyzor_db_release (db);
+}
+
+/* current mapping, the path is reopened if the file was replaced. the
+   mapping stays valid until pyzor_db_leave */
+static struct pyzor_db_map *
+pyzor_db_enter (pyzor_db_t *db)
+{
+  struct pyzor_db_map *map, *ptr;
+
+  __atomic_add_fetch (&db->readers, 1, __ATOMIC_SEQ_CST);
+  map = __atomic_load_n (&db->map, __ATOMIC_SEQ_CST);
+  if (! __atomic_load_n (&map->head->moved, __ATOMIC_ACQUIRE))
+    return (map);
+
+  pthread_mutex_lock (&db->lock);
+  map = db->map;
+  if (__atomic_load_n (&map->head->moved, __ATOMIC_ACQUIRE) &&
+      pyzor_db_map_open (&ptr, db->path, db->flags & ~PYZOR_DB_CREATE, 0) == 0)
+  {
+    pyzor_db_replace (db, ptr);
+    map = ptr;
+  }
+  pthread_mutex_unlock (&db->lock);
+
+  return (map);
+}
+
+static void
+pyzor_db_leave (pyzor_db_t *db)
+{
+  if (__atomic_sub_fetch (&db->readers, 1, __ATOMIC_SEQ_CST) != 0 ||
+      __atomic_load_n (&db->retired, __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock (&db->lock);
+  pyzor_db_release (db);
+  pthread_mutex_unlock (&db->lock);
+}
+
+static uint64_t
+pyzor_db_hash (const unsigned char *digest)
+{
+  uint64_t x;
+
+  memcpy (&x, digest, sizeof (x));
+  return (x);
+}
+
+/* consistent copy of a slot, returns 0 if the slot is empty. a slot that
+   stays odd belongs to a writer that died, it is treated as empty until the
+   next writer repairs it */
+static int
+pyzor_db_read (const struct pyzor_db_slot *slot, struct pyzor_db_slot *copy)
+{
+  uint32_t seq;
+  unsigned int cnt, spin;
+
+  for (spin = 0; ; spin++) {
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      if (spin < PYZOR_DB_SPIN)
+        continue;
+      copy->used = 0;
+      return (0);
+    }
+
+    copy->used = pyzor_db_load (&slot->used);
+    for (cnt = 0; cnt < sizeof (copy->digest) / sizeof (copy->digest[0]); cnt++)
+      copy->digest[cnt] = pyzor_db_load (&slot->digest[cnt]);
+    copy->spam = pyzor_db_load (&slot->spam);
+    copy->ham = pyzor_db_load (&slot->ham);
+    copy->first = pyzor_db_load (&slot->first);
+    copy->last = pyzor_db_load (&slot->last);
+
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (pyzor_db_load (&slot->seq) == seq)
+      break;
+  }
+
+  return (copy->used != 0);
+}
+
+static void
+pyzor_db_write (struct pyzor_db_slot *slot, const struct pyzor_db_slot *copy)
+{
+  uint32_t seq;
+  unsigned int cnt;
+
+  seq = pyzor_db_load (&slot->seq);
+  pyzor_db_store (&slot->seq, seq + 1);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  for (cnt = 0; cnt < sizeof (copy->digest) / sizeof (copy->digest[0]); cnt++)
+    pyzor_db_store (&slot->digest[cnt], copy->digest[cnt]);
+  pyzor_db_store (&slot->spam, copy->spam);
+  pyzor_db_store (&slot->ham, copy->ham);
+  pyzor_db_store (&slot->first, copy->first);
+  pyzor_db_store (&slot->last, copy->last);
+  pyzor_db_store (&slot->used, copy->used);
+
+  __atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* slot holding digest, or the empty slot it would go in */
+static struct pyzor_db_slot *
+pyzor_db_probe (const struct pyzor_db_map *map,
+                const unsigned char *digest,
+                struct pyzor_db_slot *copy)
+{
+  uint64_t cnt, pos;
+
+  pos = pyzor_db_hash (digest) & map->mask;
+  for (cnt = 0; cnt <= map->mask; cnt++, pos = (pos + 1) & map->mask) {
+    if (! pyzor_db_read (&map->slots[pos], copy) ||
+        memcmp (copy->digest, digest, PYZOR_DIGEST_RAW_LEN) == 0)
+      return (&map->slots[pos]);
+  }
+
+  return (NULL);
+}
+
+int
+pyzor_db_lookup (pyzor_db_t *db,
+                 const unsigned char *digest,
+                 struct pyzor_db_record *rec)
+{
+  struct pyzor_db_map *map;
+  struct pyzor_db_slot copy;
+  int found;
+
+  assert (db);
+  assert (digest);
+  assert (rec);
+
+  map = pyzor_db_enter (db);
+  found = pyzor_db_probe (map, digest, &copy) && copy.used;
+  pyzor_db_leave (db);
+  if (! found)
+    return (ENOENT);
+
+  memcpy (rec->digest, copy.digest, PYZOR_DIGEST_RAW_LEN);
+  rec->spam = copy.spam;
+  rec->ham = copy.ham;
+  rec->first = copy.first;
+  rec->last = copy.last;
+
+  return (0);
+}
+
+static uint32_t
+pyzor_db_add (uint32_t cnt, uint32_t num)
+{
+  return (num > UINT32_MAX - cnt ? UINT32_MAX : cnt + num);
+}
+
+/* must be called by the writer only */
+static int
+pyzor_db_put (struct pyzor_db_map *map, const struct pyzor_db_record *rec)
+{
+  struct pyzor_db_slot copy, *slot;
+
+  if (! (slot = pyzor_db_probe (map, rec->digest, &copy)))
+    return (ENOSPC);
+
+  if (! copy.used) {
+    memset (&copy, 0, sizeof (copy));
+    memcpy (copy.digest, rec->digest, PYZOR_DIGEST_RAW_LEN);
+    copy.used = 1;
+    copy.spam = rec->spam;
+    copy.ham = rec->ham;
+    copy.first = rec->first;
+    copy.last = rec->last;
+    pyzor_db_store (&map->head->count, map->head->count + 1);
+  } else {
+    copy.spam = pyzor_db_add (copy.spam, rec->spam);
+    copy.ham = pyzor_db_add (copy.ham, rec->ham);
+    if (rec->first < copy.first)
+      copy.first = rec->first;
+    if (rec->last > copy.last)
+      copy.last = rec->last;
+  }
+
+  pyzor_db_write (slot, &copy);
+
+  return (0);
+}
+
+/* write live records to a new file of the given size and rename it over the
+   current one. records last seen before expire are dropped */
+static int
+pyzor_db_rebuild (pyzor_db_t *db, uint64_t slots, int64_t expire)
+{
+  struct pyzor_db_map *map, *ptr;
+  struct pyzor_db_record rec;
+  struct pyzor_db_slot copy;
+  char *tmp;
+  size_t len;
+  uint64_t pos;
+  int err, fd;
+
+  map = db->map;
+  len = strlen (db->path) + sizeof (".XXXXXX");
+  if (! (tmp = malloc (len)))
+    return (ENOMEM);
+  snprintf (tmp, len, "%s.XXXXXX", db->path);
+  if ((fd = mkstemp (tmp)) == -1) {
+    err = errno;
+    free (tmp);
+    return (err);
+  }
+  (void)fchmod (fd, 0644);
+  close (fd);
+
+  /* the new file is locked before it becomes visible */
+  if ((err = pyzor_db_map_open (&ptr, tmp, PYZOR_DB_RDWR | PYZOR_DB_CREATE, slots)) != 0) {
+    (void)unlink (tmp);
+    free (tmp);
+    return (err);
+  }
+
+  for (pos = 0; pos <= map->mask; pos++) {
+    if (! pyzor_db_read (&map->slots[pos], &copy) || copy.last < expire)
+      continue;
+    memcpy (rec.digest, copy.digest, PYZOR_DIGEST_RAW_LEN);
+    rec.spam = copy.spam;
+    rec.ham = copy.ham;
+    rec.first = copy.first;
+    rec.last = copy.last;
+    if ((err = pyzor_db_put (ptr, &rec)) != 0)
+      goto error;
+  }
+  ptr->head->created = map->head->created;
+
+  if (msync (ptr->head, ptr->size, MS_SYNC) == -1 ||
+      rename (tmp, db->path) == -1)
+  {
+    err = errno;
+    goto error;
+  }
+  free (tmp);
+
+  /* lookups on this handle find the new mapping before the old one is
+     marked, they do not reopen the path while the new file is locked. the
+     old mapping may be released by pyzor_db_replace */
+  pthread_mutex_lock (&db->lock);
+  __atomic_store_n (&map->head->moved, 1, __ATOMIC_RELEASE);
+  pyzor_db_replace (db, ptr);
+  pthread_mutex_unlock (&db->lock);
+
+  return (0);
+
+error:
+  (void)unlink (tmp);
+  free (tmp);
+  pyzor_db_map_close (ptr);
+  return (err);
+}
+
+int
+pyzor_db_merge (pyzor_db_t *db, const struct pyzor_db_record *rec)
+{
+  struct pyzor_db_map *map;
+  int err;
+
+  assert (db);
+  assert (rec);
+
+  if (! (db->flags & PYZOR_DB_RDWR))
+    return (EBADF);
+
+  map = db->map;
+  if (map->head->count >= PYZOR_DB_LOAD (map->mask + 1)) {
+    if ((err = pyzor_db_rebuild (db, (map->mask + 1) * 2, INT64_MIN)) != 0)
+      return (err);
+    map = db->map;
+  }
+
+  return (pyzor_db_put (map, rec));
+}
+
+int
+pyzor_db_report (pyzor_db_t *db,
+                 const unsigned char *digest,
+                 uint32_t spam,
+                 uint32_t ham,
+                 int64_t when)
+{
+  struct pyzor_db_record rec;
+
+  assert (digest);
+
+  memcpy (rec.digest, digest, PYZOR_DIGEST_RAW_LEN);
+  rec.spam = spam;
+  rec.ham = ham;
+  rec.first = when;
+  rec.last = when;
+
+  return (pyzor_db_merge (db, &rec));
+}
+
+/* drop records last seen before expire and size the table for the records
+   that remain */
+int
+pyzor_db_compact (pyzor_db_t *db, int64_t expire)
+{
+  struct pyzor_db_map *map;
+  struct pyzor_db_slot copy;
+  uint64_t cnt, pos, slots;
+
+  assert (db);
+
+  if (! (db->flags & PYZOR_DB_RDWR))
+    return (EBADF);
+
+  map = db->map;
+  for (cnt = 0, pos = 0; pos <= map->mask; pos++) {
+    if (pyzor_db_read (&map->slots[pos], &copy) && copy.last >= expire)
+      cnt++;
+  }
+
+  for (slots = PYZOR_DB_SLOTS_MIN; PYZOR_DB_LOAD (slots) <= cnt * 2; slots *= 2)
+    ;
+
+  return (pyzor_db_rebuild (db, slots, expire));
+}
+
+int
+pyzor_db_sync (pyzor_db_t *db)
+{
+  struct pyzor_db_map *map;
+
+  assert (db);
+
+  map = db->map;
+  if ((db->flags & PYZOR_DB_RDWR) && msync (map->head, map->size, MS_SYNC) == -1)
+    return (errno);
+
+  return (0);
+}
+
+size_t
+pyzor_db_count (pyzor_db_t *db)
+{
+  size_t cnt;
+
+  assert (db);
+
+  cnt = (size_t)pyzor_db_load (&pyzor_db_enter (db)->head->count);
+  pyzor_db_leave (db);
+
+  return (cnt);
+}
+
+size_t
+pyzor_db_size (pyzor_db_t *db)
+{
+  size_t size;
+
+  assert (db);
+
+  size = (size_t)(pyzor_db_enter (db)->mask + 1);
+  pyzor_db_leave (db);
+
+  return (size);
+}
@@ -0,0 +1,35 @@
+#ifndef PYZOR_DB_H_INCLUDED
+#define PYZOR_DB_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pyzor.h"
+
+typedef struct pyzor_db pyzor_db_t;
+
+struct pyzor_db_record {
+  unsigned char digest[PYZOR_DIGEST_RAW_LEN];
+  uint32_t spam; /* number of times reported */
+  uint32_t ham; /* number of times whitelisted */
+  int64_t first; /* first seen, seconds since the epoch */
+  int64_t last; /* last seen */
+};
+
+/* open flags. any number of readers can use a database, there is only ever
+   one writer. a writer waits for a previous writer to close */
+#define PYZOR_DB_RDONLY (0)
+#define PYZOR_DB_RDWR (1)
+#define PYZOR_DB_CREATE (2)
+
+int pyzor_db_open (pyzor_db_t **, const char *, int);
+void pyzor_db_close (pyzor_db_t *);
+int pyzor_db_lookup (pyzor_db_t *, const unsigned char *, struct pyzor_db_record *);
+int pyzor_db_report (pyzor_db_t *, const unsigned char *, uint32_t, uint32_t, int64_t);
+int pyzor_db_merge (pyzor_db_t *, const struct pyzor_db_record *);
+int pyzor_db_compact (pyzor_db_t *, int64_t);
+int pyzor_db_sync (pyzor_db_t *);
+size_t pyzor_db_count (pyzor_db_t *);
+size_t pyzor_db_size (pyzor_db_t *);
+
+#endif
@@ -0,0 +1,259 @@
+/* command line interface to the local digest database */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "pyzor.h"
+
+static int
+dbtool_hex (unsigned char *raw, const char *str, size_t len)
+{
+  size_t pos;
+  int hi, lo;
+
+  if (len != PYZOR_DIGEST_RAW_LEN * 2)
+    return (EINVAL);
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    hi = str[pos * 2];
+    lo = str[pos * 2 + 1];
+    hi = (hi >= '0' && hi <= '9') ? hi - '0' :
+         (hi >= 'a' && hi <= 'f') ? hi - 'a' + 10 :
+         (hi >= 'A' && hi <= 'F') ? hi - 'A' + 10 : -1;
+    lo = (lo >= '0' && lo <= '9') ? lo - '0' :
+         (lo >= 'a' && lo <= 'f') ? lo - 'a' + 10 :
+         (lo >= 'A' && lo <= 'F') ? lo - 'A' + 10 : -1;
+    if (hi < 0 || lo < 0)
+      return (EINVAL);
+    raw[pos] = (unsigned char)((hi << 4) | lo);
+  }
+
+  return (0);
+}
+
+static void
+dbtool_print (const struct pyzor_db_record *rec, const char *name)
+{
+  static const char hex[] = "0123456789abcdef";
+  char str[PYZOR_DIGEST_HEX_LEN];
+  size_t pos;
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    str[pos * 2    ] = hex[rec->digest[pos] >> 4];
+    str[pos * 2 + 1] = hex[rec->digest[pos] & 0x0f];
+  }
+  str[pos * 2] = '\0';
+
+  printf ("%s %" PRIu32 " %" PRIu32 " %" PRId64 " %" PRId64 "%s%s\n",
+    str, rec->spam, rec->ham, rec->first, rec->last,
+    name ? " " : "", name ? name : "");
+}
+
+/* lines are "<digest> [spam [whitelist [first [last]]]]". counts that are
+   missing count as one report. anything that is not a number ends the
+   fields, so that output of pyzor can be imported as is */
+static int
+dbtool_import (pyzor_db_t *db, FILE *fp, int64_t now)
+{
+  struct pyzor_db_record rec;
+  char *end, *line, *ptr, *tok;
+  size_t len, num;
+  unsigned long long val[4];
+  int cnt, err;
+
+  line = NULL;
+  len = 0;
+  num = 0;
+  err = 0;
+
+  for (; getline (&line, &len, fp) != -1; ) {
+    if (! (tok = strtok_r (line, " \t\r\n", &ptr)))
+      continue;
+    if (dbtool_hex (rec.digest, tok, strlen (tok)) != 0) {
+      fprintf (stderr, "Skipping invalid digest `%s'\n", tok);
+      continue;
+    }
+
+    for (cnt = 0; cnt < 4 && (tok = strtok_r (NULL, " \t\r\n", &ptr)); cnt++) {
+      errno = 0;
+      val[cnt] = strtoull (tok, &end, 10);
+      if (errno != 0 || *end != '\0')
+        break;
+    }
+
+    rec.spam = cnt > 0 ? (uint32_t)(val[0] > UINT32_MAX ? UINT32_MAX : val[0]) : 1;
+    rec.ham = cnt > 1 ? (uint32_t)(val[1] > UINT32_MAX ? UINT32_MAX : val[1]) : 0;
+    rec.first = cnt > 2 ? (int64_t)val[2] : now;
+    rec.last = cnt > 3 ? (int64_t)val[3] : rec.first;
+
+    if ((err = pyzor_db_merge (db, &rec)) != 0)
+      break;
+    num++;
+  }
+
+  free (line);
+  if (err == 0)
+    err = pyzor_db_sync (db);
+  if (err == 0)
+    fprintf (stderr, "Imported %zu records\n", num);
+
+  return (err);
+}
+
+/* digests from the command line, or the first field of every line of
+   standard input. the rest of the line is printed along with the result */
+static int
+dbtool_query (pyzor_db_t *db, char **argv, int argc)
+{
+  struct pyzor_db_record rec;
+  char *line, *name, *ptr, *tok;
+  size_t len;
+  int cnt, err;
+
+  line = NULL;
+  len = 0;
+
+  for (cnt = 0; argc ? cnt < argc : getline (&line, &len, stdin) != -1; cnt++) {
+    if (argc) {
+      tok = argv[cnt];
+      name = NULL;
+    } else {
+      if (! (tok = strtok_r (line, " \t\r\n", &ptr)))
+        continue;
+      if ((name = strtok_r (NULL, "\r\n", &ptr)))
+        name += strspn (name, " \t");
+    }
+
+    if (dbtool_hex (rec.digest, tok, strlen (tok)) != 0) {
+      fprintf (stderr, "Skipping invalid digest `%s'\n", tok);
+      continue;
+    }
+
+    if ((err = pyzor_db_lookup (db, rec.digest, &rec)) == ENOENT) {
+      rec.spam = rec.ham = 0;
+      rec.first = rec.last = 0;
+    } else if (err != 0) {
+      free (line);
+      return (err);
+    }
+    dbtool_print (&rec, name);
+  }
+
+  free (line);
+
+  return (0);
+}
+
+static int
+dbtool_report (pyzor_db_t *db, char **argv, int argc, int ham, int64_t now)
+{
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  int cnt, err;
+
+  for (cnt = 0; cnt < argc; cnt++) {
+    if (dbtool_hex (raw, argv[cnt], strlen (argv[cnt])) != 0) {
+      fprintf (stderr, "Skipping invalid digest `%s'\n", argv[cnt]);
+      continue;
+    }
+    if ((err = pyzor_db_report (db, raw, ham ? 0 : 1, ham ? 1 : 0, now)) != 0)
+      return (err);
+  }
+
+  return (pyzor_db_sync (db));
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: pyzor-db [-e seconds] <database> import [file|-]\n"
+          "       pyzor-db <database> query [digest ...]\n"
+          "       pyzor-db <database> report|whitelist <digest> ...\n"
+          "       pyzor-db [-e seconds] <database> compact\n"
+          "       pyzor-db <database> stats\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  pyzor_db_t *db;
+  const char *cmd, *path;
+  FILE *fp;
+  int64_t expire, now;
+  int err, flags, opt;
+
+  expire = INT64_MIN;
+  now = (int64_t)time (NULL);
+
+  while ((opt = getopt (argc, argv, "e:h")) != -1) {
+    switch (opt) {
+      case 'e':
+        /* records not seen for this many seconds are dropped */
+        expire = now - strtoll (optarg, NULL, 10);
+        break;
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (argc - optind < 2) {
+    usage ();
+    return (1);
+  }
+
+  path = argv[optind];
+  cmd = argv[optind + 1];
+  argv += optind + 2;
+  argc -= optind + 2;
+
+  if (strcmp (cmd, "query") == 0 || strcmp (cmd, "stats") == 0)
+    flags = PYZOR_DB_RDONLY;
+  else
+    flags = PYZOR_DB_CREATE;
+
+  if ((err = pyzor_db_open (&db, path, flags)) != 0) {
+    fprintf (stderr, "Cannot open database `%s': %s\n", path, strerror (err));
+    return (1);
+  }
+
+  if (strcmp (cmd, "import") == 0) {
+    fp = stdin;
+    if (argc > 0 && strcmp (argv[0], "-") != 0 && ! (fp = fopen (argv[0], "r"))) {
+      err = errno;
+    } else {
+      err = dbtool_import (db, fp, now);
+      if (fp != stdin)
+        fclose (fp);
+    }
+    if (err == 0 && expire != INT64_MIN)
+      err = pyzor_db_compact (db, expire);
+  } else if (strcmp (cmd, "query") == 0) {
+    err = dbtool_query (db, argv, argc);
+  } else if (strcmp (cmd, "report") == 0 || strcmp (cmd, "whitelist") == 0) {
+    err = dbtool_report (db, argv, argc, strcmp (cmd, "whitelist") == 0, now);
+  } else if (strcmp (cmd, "compact") == 0) {
+    err = pyzor_db_compact (db, expire);
+  } else if (strcmp (cmd, "stats") == 0) {
+    printf ("records: %zu\nslots: %zu\n", pyzor_db_count (db), pyzor_db_size (db));
+    err = 0;
+  } else {
+    pyzor_db_close (db);
+    usage ();
+    return (1);
+  }
+
+  pyzor_db_close (db);
+
+  if (err != 0) {
+    fprintf (stderr, "%s: %s\n", cmd, strerror (err));
+    return (1);
+  }
+
+  return (0);
+}
@@ -0,0 +1,514 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "fuzzy.h"
+#include "pyzor.h"
+
+/* a shingle is read as a little endian word and mixed into its feature
+   hash. the top bits of the hash select the MinHash bin and the low 32 bits
+   are the value kept for it, one permutation for all bins. every bit of the
+   hash votes for the matching bit of the SimHash. */
+
+#define PYZOR_FUZZY_BIN_SHIFT (58) /* 64 - log2 (PYZOR_FUZZY_BINS) */
+
+/* votes are counted by bit-sliced counters, slice n holds bit n of the count
+   of every bit of the SimHash. votes are added four at a time, summed by a
+   carry-save adder first, and moved to the totals before a count can
+   overflow the slices. */
+#define PYZOR_FUZZY_SLICES (8)
+#define PYZOR_FUZZY_GROUP (4)
+
+/* fixed, fingerprints are compared across hosts */
+#define PYZOR_FUZZY_SEED (0x9e3779b97f4a7c15ULL)
+#define PYZOR_FUZZY_SHORT (0xc2b2ae3d27d4eb4fULL) /* lines below a shingle */
+#define PYZOR_FUZZY_ROTATE (0x27d4eb2fU) /* offset of densified bins */
+
+struct pyzor_fuzzy_ctx {
+  uint64_t slices[PYZOR_FUZZY_SLICES];
+  uint64_t ones[64];
+  unsigned int pending; /* votes counted in slices */
+  uint32_t minhash[PYZOR_FUZZY_BINS]; /* UINT32_MAX until filled */
+  uint64_t filled; /* bins that hold a value */
+  uint64_t features;
+};
+
+static uint64_t
+pyzor_fuzzy_mix (uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (x);
+}
+
+static uint64_t
+pyzor_fuzzy_read (const unsigned char *str)
+{
+  uint64_t x;
+
+  memcpy (&x, str, sizeof (x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64 (x);
+#endif
+  return (x);
+}
+
+static void
+pyzor_fuzzy_flush (struct pyzor_fuzzy_ctx *ctx)
+{
+  unsigned int bit, slice;
+
+  for (bit = 0; bit < 64; bit++) {
+    for (slice = 0; slice < PYZOR_FUZZY_SLICES; slice++)
+      ctx->ones[bit] += ((ctx->slices[slice] >> bit) & 1) << slice;
+  }
+  memset (ctx->slices, 0, sizeof (ctx->slices));
+  ctx->pending = 0;
+}
+
+/* add a count of up to seven per bit, given as its three bits */
+static void
+pyzor_fuzzy_count (uint64_t *slices, uint64_t b0, uint64_t b1, uint64_t b2)
+{
+  uint64_t carry, sum;
+  unsigned int slice;
+
+  carry = slices[0] & b0;
+  slices[0] ^= b0;
+  sum = slices[1] ^ b1 ^ carry;
+  carry = (slices[1] & b1) | (carry & (slices[1] ^ b1));
+  slices[1] = sum;
+  sum = slices[2] ^ b2 ^ carry;
+  carry = (slices[2] & b2) | (carry & (slices[2] ^ b2));
+  slices[2] = sum;
+  for (slice = 3; slice < PYZOR_FUZZY_SLICES; slice++) {
+    sum = slices[slice] & carry;
+    slices[slice] ^= carry;
+    carry = sum;
+  }
+}
+
+static void
+pyzor_fuzzy_add (struct pyzor_fuzzy_ctx *ctx, uint64_t hash)
+{
+  unsigned int bin;
+  uint32_t val;
+
+  if (ctx->pending == (1u << PYZOR_FUZZY_SLICES) - 1)
+    pyzor_fuzzy_flush (ctx);
+  pyzor_fuzzy_count (ctx->slices, hash, 0, 0);
+  ctx->pending++;
+
+  bin = (unsigned int)(hash >> PYZOR_FUZZY_BIN_SHIFT);
+  val = (uint32_t)hash;
+  if (val < ctx->minhash[bin])
+    ctx->minhash[bin] = val;
+  ctx->filled |= (uint64_t)1 << bin;
+  ctx->features++;
+}
+
+#define PYZOR_FUZZY_MIN(ctx, filled, hash) \
+  do { \
+    unsigned int bin_ = (unsigned int)((hash) >> PYZOR_FUZZY_BIN_SHIFT); \
+    if ((uint32_t)(hash) < (ctx)->minhash[bin_]) \
+      (ctx)->minhash[bin_] = (uint32_t)(hash); \
+    (filled) |= (uint64_t)1 << bin_; \
+  } while (0)
+
+/* shingles are hashed a group at a time with the slices in registers, the
+   shingles that do not make up a group are added one by one */
+static void
+pyzor_fuzzy_line (struct pyzor_fuzzy_ctx *ctx, const unsigned char *str, size_t len)
+{
+  unsigned char pad[PYZOR_FUZZY_SHINGLE];
+  uint64_t c1, c2, filled, h0, h1, h2, h3, k, s1, s2;
+  uint64_t slices[PYZOR_FUZZY_SLICES];
+  unsigned int pending;
+  size_t cnt, pos;
+
+  if (len < PYZOR_FUZZY_SHINGLE) {
+    memset (pad, 0, sizeof (pad));
+    memcpy (pad, str, len);
+    pyzor_fuzzy_add (ctx, pyzor_fuzzy_mix (pyzor_fuzzy_read (pad) ^ PYZOR_FUZZY_SHORT));
+    return;
+  }
+
+  cnt = len - PYZOR_FUZZY_SHINGLE + 1;
+  memcpy (slices, ctx->slices, sizeof (slices));
+  filled = ctx->filled;
+  pending = ctx->pending;
+
+  for (pos = 0; cnt - pos >= PYZOR_FUZZY_GROUP; pos += PYZOR_FUZZY_GROUP) {
+    h0 = pyzor_fuzzy_mix (pyzor_fuzzy_read (str + pos) ^ PYZOR_FUZZY_SEED);
+    h1 = pyzor_fuzzy_mix (pyzor_fuzzy_read (str + pos + 1) ^ PYZOR_FUZZY_SEED);
+    h2 = pyzor_fuzzy_mix (pyzor_fuzzy_read (str + pos + 2) ^ PYZOR_FUZZY_SEED);
+    h3 = pyzor_fuzzy_mix (pyzor_fuzzy_read (str + pos + 3) ^ PYZOR_FUZZY_SEED);
+    PYZOR_FUZZY_MIN (ctx, filled, h0);
+    PYZOR_FUZZY_MIN (ctx, filled, h1);
+    PYZOR_FUZZY_MIN (ctx, filled, h2);
+    PYZOR_FUZZY_MIN (ctx, filled, h3);
+
+    if (pending > (1u << PYZOR_FUZZY_SLICES) - 1 - PYZOR_FUZZY_GROUP) {
+      memcpy (ctx->slices, slices, sizeof (slices));
+      pyzor_fuzzy_flush (ctx);
+      memset (slices, 0, sizeof (slices));
+      pending = 0;
+    }
+    s1 = h0 ^ h1;
+    c1 = h0 & h1;
+    s2 = h2 ^ h3;
+    c2 = h2 & h3;
+    k = s1 & s2;
+    pyzor_fuzzy_count (slices, s1 ^ s2, c1 ^ c2 ^ k, (c1 & c2) | (k & (c1 ^ c2)));
+    pending += PYZOR_FUZZY_GROUP;
+  }
+
+  memcpy (ctx->slices, slices, sizeof (slices));
+  ctx->filled = filled;
+  ctx->pending = pending;
+  ctx->features += pos;
+
+  for (; pos < cnt; pos++)
+    pyzor_fuzzy_add (ctx, pyzor_fuzzy_mix (pyzor_fuzzy_read (str + pos) ^ PYZOR_FUZZY_SEED));
+}
+
+/* bins that no feature fell in take the value of the next bin that holds
+   one, offset by the distance, so that empty bins of unrelated messages do
+   not match by accident */
+static void
+pyzor_fuzzy_densify (struct pyzor_fuzzy_ctx *ctx)
+{
+  unsigned int bin, dist, next;
+
+  if (ctx->filled == 0)
+    return;
+
+  for (bin = 0; bin < PYZOR_FUZZY_BINS; bin++) {
+    if (ctx->filled & ((uint64_t)1 << bin))
+      continue;
+    for (dist = 1; ; dist++) {
+      next = (bin + dist) % PYZOR_FUZZY_BINS;
+      if (ctx->filled & ((uint64_t)1 << next))
+        break;
+    }
+    ctx->minhash[bin] = ctx->minhash[next] + dist * PYZOR_FUZZY_ROTATE;
+  }
+}
+
+/* fingerprint of the lines a context keeps, the lines are read from the line
+   buffer and are not normalized again */
+int
+pyzor_fuzzy_digest (pyzor_fuzzy_t *fuzzy, pyzor_digest_t *digest)
+{
+  struct pyzor_fuzzy_ctx ctx;
+  const unsigned char *str;
+  size_t cnt, len, num;
+  unsigned int bit;
+  int err;
+
+  assert (fuzzy);
+  assert (digest);
+
+  memset (fuzzy, 0, sizeof (*fuzzy));
+  memset (&ctx, 0, sizeof (ctx));
+  memset (ctx.minhash, 0xff, sizeof (ctx.minhash));
+
+  cnt = pyzor_digest_lines (digest);
+  for (num = 1; num <= cnt; num++) {
+    if ((err = pyzor_digest_line (digest, num, &str, &len)) != 0)
+      return (err);
+    pyzor_fuzzy_line (&ctx, str, len);
+  }
+
+  pyzor_fuzzy_flush (&ctx);
+  for (bit = 0; bit < 64; bit++) {
+    if (ctx.ones[bit] * 2 > ctx.features)
+      fuzzy->simhash |= (uint64_t)1 << bit;
+  }
+  pyzor_fuzzy_densify (&ctx);
+  memcpy (fuzzy->minhash, ctx.minhash, sizeof (fuzzy->minhash));
+  fuzzy->features = ctx.features;
+
+  return (0);
+}
+
+/* digest and fingerprint from the same lines */
+int
+pyzor_digest_final_fuzzy (unsigned char *str,
+                          size_t len,
+                          pyzor_digest_t *digest,
+                          pyzor_fuzzy_t *fuzzy)
+{
+  int err;
+
+  assert (str);
+  assert (digest);
+  assert (fuzzy);
+
+  if ((err = pyzor_digest_final (str, len, digest)) != 0)
+    return (err);
+
+  return (pyzor_fuzzy_digest (fuzzy, digest));
+}
+
+unsigned int
+pyzor_fuzzy_hamming (const pyzor_fuzzy_t *a, const pyzor_fuzzy_t *b)
+{
+  assert (a);
+  assert (b);
+
+  return ((unsigned int)__builtin_popcountll (a->simhash ^ b->simhash));
+}
+
+/* fraction of bins that are equal */
+double
+pyzor_fuzzy_jaccard (const pyzor_fuzzy_t *a, const pyzor_fuzzy_t *b)
+{
+  unsigned int bin, cnt;
+
+  assert (a);
+  assert (b);
+
+  if (a->features == 0 || b->features == 0)
+    return (a->features == b->features ? 1.0 : 0.0);
+
+  for (cnt = 0, bin = 0; bin < PYZOR_FUZZY_BINS; bin++)
+    cnt += (a->minhash[bin] == b->minhash[bin]);
+
+  return ((double)cnt / PYZOR_FUZZY_BINS);
+}
+
+/* every band of every fingerprint is a node in a chained hash table keyed
+   by the hash of the bins of the band. fingerprints are stored once, a node
+   refers to its fingerprint by position. */
+
+#define PYZOR_FUZZY_NONE (SIZE_MAX)
+
+/* number of heads the table starts out with */
+#define PYZOR_FUZZY_HEADS (1024)
+
+struct pyzor_fuzzy_entry {
+  pyzor_fuzzy_t fuzzy;
+  uint64_t id;
+  uint32_t seen; /* query that last visited the entry */
+};
+
+struct pyzor_fuzzy_node {
+  uint64_t key;
+  size_t entry;
+  size_t next;
+};
+
+struct pyzor_fuzzy_index {
+  unsigned int bands;
+  unsigned int rows; /* bins per band */
+  uint32_t query;
+  struct pyzor_fuzzy_entry *entries;
+  size_t nentries;
+  size_t size; /* entries allocated */
+  struct pyzor_fuzzy_node *nodes;
+  size_t nnodes;
+  size_t *heads;
+  size_t nheads; /* power of two, at least the number of nodes */
+};
+
+int
+pyzor_fuzzy_index_create (pyzor_fuzzy_index_t **index, unsigned int bands)
+{
+  pyzor_fuzzy_index_t *ptr;
+  size_t cnt;
+
+  assert (index);
+
+  if (bands == 0)
+    bands = PYZOR_FUZZY_BANDS;
+  if (bands > PYZOR_FUZZY_BINS || PYZOR_FUZZY_BINS % bands != 0)
+    return (EINVAL);
+
+  if (! (ptr = calloc (1, sizeof (*ptr))))
+    return (ENOMEM);
+  if (! (ptr->heads = malloc (PYZOR_FUZZY_HEADS * sizeof (size_t)))) {
+    free (ptr);
+    return (ENOMEM);
+  }
+  for (cnt = 0; cnt < PYZOR_FUZZY_HEADS; cnt++)
+    ptr->heads[cnt] = PYZOR_FUZZY_NONE;
+
+  ptr->bands = bands;
+  ptr->rows = PYZOR_FUZZY_BINS / bands;
+  ptr->nheads = PYZOR_FUZZY_HEADS;
+
+  *index = ptr;
+
+  return (0);
+}
+
+void
+pyzor_fuzzy_index_destroy (pyzor_fuzzy_index_t *index)
+{
+  if (index) {
+    free (index->entries);
+    free (index->nodes);
+    free (index->heads);
+    free (index);
+  }
+}
+
+size_t
+pyzor_fuzzy_index_size (pyzor_fuzzy_index_t *index)
+{
+  assert (index);
+
+  return (index->nentries);
+}
+
+static uint64_t
+pyzor_fuzzy_band (pyzor_fuzzy_index_t *index, const pyzor_fuzzy_t *fuzzy, unsigned int band)
+{
+  uint64_t key;
+  unsigned int row;
+
+  key = pyzor_fuzzy_mix (PYZOR_FUZZY_SEED + band);
+  for (row = 0; row < index->rows; row++)
+    key = pyzor_fuzzy_mix (key ^ fuzzy->minhash[band * index->rows + row]);
+
+  return (key);
+}
+
+static int
+pyzor_fuzzy_index_grow (pyzor_fuzzy_index_t *index)
+{
+  struct pyzor_fuzzy_entry *a_entries;
+  struct pyzor_fuzzy_node *a_nodes;
+  size_t *a_heads;
+  size_t a_len, cnt, pos;
+
+  if (index->nentries == index->size) {
+    a_len = index->size ? index->size * 2 : 64;
+    if (a_len > SIZE_MAX / (sizeof (*a_nodes) * index->bands))
+      return (EOVERFLOW);
+    if (! (a_entries = realloc (index->entries, a_len * sizeof (*a_entries))))
+      return (ENOMEM);
+    index->entries = a_entries;
+    if (! (a_nodes = realloc (index->nodes, a_len * index->bands * sizeof (*a_nodes))))
+      return (ENOMEM);
+    index->nodes = a_nodes;
+    index->size = a_len;
+  }
+
+  /* chains are kept short, every node of a new entry has a head of its own
+     on average */
+  if (index->nnodes + index->bands <= index->nheads)
+    return (0);
+
+  a_len = index->nheads * 2;
+  if (! (a_heads = malloc (a_len * sizeof (size_t))))
+    return (ENOMEM);
+  for (cnt = 0; cnt < a_len; cnt++)
+    a_heads[cnt] = PYZOR_FUZZY_NONE;
+  for (cnt = 0; cnt < index->nnodes; cnt++) {
+    pos = index->nodes[cnt].key & (a_len - 1);
+    index->nodes[cnt].next = a_heads[pos];
+    a_heads[pos] = cnt;
+  }
+
+  free (index->heads);
+  index->heads = a_heads;
+  index->nheads = a_len;
+
+  return (0);
+}
+
+int
+pyzor_fuzzy_index_insert (pyzor_fuzzy_index_t *index,
+                          const pyzor_fuzzy_t *fuzzy,
+                          uint64_t id)
+{
+  struct pyzor_fuzzy_entry *entry;
+  struct pyzor_fuzzy_node *node;
+  unsigned int band;
+  size_t pos;
+  int err;
+
+  assert (index);
+  assert (fuzzy);
+
+  if ((err = pyzor_fuzzy_index_grow (index)) != 0)
+    return (err);
+
+  entry = &index->entries[index->nentries];
+  entry->fuzzy = *fuzzy;
+  entry->id = id;
+  entry->seen = 0;
+
+  for (band = 0; band < index->bands; band++) {
+    node = &index->nodes[index->nnodes];
+    node->key = pyzor_fuzzy_band (index, fuzzy, band);
+    node->entry = index->nentries;
+    pos = node->key & (index->nheads - 1);
+    node->next = index->heads[pos];
+    index->heads[pos] = index->nnodes++;
+  }
+  index->nentries++;
+
+  return (0);
+}
+
+/* identifiers of the fingerprints that share a band with the given one and
+   of which the estimated Jaccard similarity is at least min. at most cnt
+   are stored, num is set to the number that matched */
+int
+pyzor_fuzzy_index_query (pyzor_fuzzy_index_t *index,
+                         const pyzor_fuzzy_t *fuzzy,
+                         double min,
+                         uint64_t *ids,
+                         size_t cnt,
+                         size_t *num)
+{
+  struct pyzor_fuzzy_entry *entry;
+  struct pyzor_fuzzy_node *node;
+  unsigned int band;
+  uint64_t key;
+  size_t found, pos;
+
+  assert (index);
+  assert (fuzzy);
+  assert (ids || ! cnt);
+  assert (num);
+
+  /* entries are visited once per query, the marks are cleared when the
+     query counter wraps */
+  if (++index->query == 0) {
+    for (pos = 0; pos < index->nentries; pos++)
+      index->entries[pos].seen = 0;
+    index->query = 1;
+  }
+
+  found = 0;
+  for (band = 0; band < index->bands; band++) {
+    key = pyzor_fuzzy_band (index, fuzzy, band);
+    pos = index->heads[key & (index->nheads - 1)];
+    for (; pos != PYZOR_FUZZY_NONE; pos = node->next) {
+      node = &index->nodes[pos];
+      entry = &index->entries[node->entry];
+      if (node->key != key || entry->seen == index->query)
+        continue;
+      entry->seen = index->query;
+      if (pyzor_fuzzy_jaccard (&entry->fuzzy, fuzzy) < min)
+        continue;
+      if (found < cnt)
+        ids[found] = entry->id;
+      found++;
+    }
+  }
+
+  *num = found;
+
+  return (0);
+}
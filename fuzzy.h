@@ -0,0 +1,47 @@
+#ifndef PYZOR_FUZZY_H_INCLUDED
+#define PYZOR_FUZZY_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pyzor.h"
+
+/* similarity fingerprint of the normalized lines of a message. features are
+   the overlapping shingles of PYZOR_FUZZY_SHINGLE bytes of every line, so a
+   word that differs between copies of a campaign only changes the features
+   that overlap it. the SimHash of the features is compared by Hamming
+   distance, the MinHash estimates the Jaccard similarity of the sets of
+   features. fingerprints do not depend on the host. */
+#define PYZOR_FUZZY_SHINGLE (8)
+#define PYZOR_FUZZY_BINS (64)
+
+typedef struct pyzor_fuzzy pyzor_fuzzy_t;
+
+struct pyzor_fuzzy {
+  uint64_t simhash;
+  uint32_t minhash[PYZOR_FUZZY_BINS];
+  uint64_t features; /* number of shingles, zero if there are no lines */
+};
+
+int pyzor_fuzzy_digest (pyzor_fuzzy_t *, pyzor_digest_t *);
+int pyzor_digest_final_fuzzy (unsigned char *, size_t, pyzor_digest_t *, pyzor_fuzzy_t *);
+unsigned int pyzor_fuzzy_hamming (const pyzor_fuzzy_t *, const pyzor_fuzzy_t *);
+double pyzor_fuzzy_jaccard (const pyzor_fuzzy_t *, const pyzor_fuzzy_t *);
+
+/* near neighbours by MinHash banding. the bins are split into bands, two
+   fingerprints are candidates if every bin of a band is equal, which for
+   bands of r bins happens with a probability of 1 - (1 - J^r)^bands. the
+   similarity of candidates is checked against the threshold of the query.
+   an index is not thread safe. */
+#define PYZOR_FUZZY_BANDS (16)
+
+typedef struct pyzor_fuzzy_index pyzor_fuzzy_index_t;
+
+int pyzor_fuzzy_index_create (pyzor_fuzzy_index_t **, unsigned int);
+void pyzor_fuzzy_index_destroy (pyzor_fuzzy_index_t *);
+size_t pyzor_fuzzy_index_size (pyzor_fuzzy_index_t *);
+int pyzor_fuzzy_index_insert (pyzor_fuzzy_index_t *, const pyzor_fuzzy_t *, uint64_t);
+int pyzor_fuzzy_index_query (pyzor_fuzzy_index_t *, const pyzor_fuzzy_t *, double,
+  uint64_t *, size_t, size_t *);
+
+#endif
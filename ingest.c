@@ -0,0 +1,720 @@
+#define _GNU_SOURCE /* struct statx */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* io_uring is driven with raw system calls, the kernel header is all that
+   is needed. define PYZOR_NO_URING to always read with threads */
+#if ! defined (PYZOR_NO_URING) && defined (__linux__) && defined (__has_include)
+# if __has_include (<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  if defined (__NR_io_uring_setup) && defined (IO_URING_OP_SUPPORTED)
+#   define PYZOR_INGEST_URING (1)
+#  endif
+# endif
+#endif
+
+#include "ingest.h"
+
+/* the thread pool does blocking reads, more threads than this do not make
+   for a deeper queue in practice */
+#define PYZOR_INGEST_THREADS (32)
+
+struct pyzor_ingest_slot {
+  unsigned char *buf;
+  size_t idx; /* position of the name in the batch */
+  size_t size; /* file size */
+  size_t len; /* bytes read */
+  int fd;
+  int err;
+  int large;
+#if PYZOR_INGEST_URING
+  unsigned int wait; /* open and statx outstanding */
+  struct statx stx;
+#endif
+};
+
+#if PYZOR_INGEST_URING
+/* operation a completion belongs to, kept in the low bits of user_data */
+#define PYZOR_INGEST_OPEN (0)
+#define PYZOR_INGEST_STATX (1)
+#define PYZOR_INGEST_READ (2)
+#define PYZOR_INGEST_OPS (4)
+
+struct pyzor_ingest_ring {
+  int fd;
+  int fixed; /* buffers are registered */
+  /* submission queue */
+  void *sqmap;
+  size_t sqlen;
+  struct io_uring_sqe *sqes;
+  size_t sqeslen;
+  unsigned int *sqhead;
+  unsigned int *sqtail;
+  unsigned int *sqarray;
+  unsigned int sqmask;
+  unsigned int sqentries;
+  unsigned int tail; /* local tail, published on submit */
+  /* completion queue */
+  void *cqmap;
+  size_t cqlen;
+  struct io_uring_cqe *cqes;
+  unsigned int *cqhead;
+  unsigned int *cqtail;
+  unsigned int cqmask;
+  unsigned int pending; /* queued, not submitted */
+  unsigned int inflight; /* submitted, not completed */
+};
+#endif
+
+struct pyzor_ingest {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* new batch, free buffer or shutdown */
+  pthread_cond_t ready; /* file completed or batch exhausted */
+  unsigned char *arena;
+  struct pyzor_ingest_slot *slots;
+  unsigned int depth;
+  size_t slotlen;
+  unsigned int *free; /* stack of free buffers */
+  unsigned int nfree;
+  unsigned int *queue; /* ring of completed buffers */
+  unsigned int head;
+  unsigned int nready;
+  /* current batch */
+  char *const *names;
+  size_t cnt;
+  size_t next; /* next name to read */
+  size_t done; /* files handed out */
+  uint64_t start;
+  int stop;
+  pthread_t *thrs;
+  unsigned int nthrs;
+#if PYZOR_INGEST_URING
+  struct pyzor_ingest_ring *ring;
+#endif
+  struct pyzor_ingest_stats stats;
+};
+
+static uint64_t
+pyzor_ingest_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+}
+
+/* take a free buffer for the next name, called with the lock held */
+static struct pyzor_ingest_slot *
+pyzor_ingest_take (pyzor_ingest_t *ingest)
+{
+  struct pyzor_ingest_slot *slot;
+
+  assert (ingest->nfree && ingest->next < ingest->cnt);
+
+  slot = &ingest->slots[ingest->free[--ingest->nfree]];
+  slot->idx = ingest->next++;
+  slot->size = 0;
+  slot->len = 0;
+  slot->fd = -1;
+  slot->err = 0;
+  slot->large = 0;
+
+  return (slot);
+}
+
+/* hand a file to the consumers, called with the lock held */
+static void
+pyzor_ingest_finish (pyzor_ingest_t *ingest, struct pyzor_ingest_slot *slot)
+{
+  unsigned int num;
+
+  if (slot->fd != -1) {
+    close (slot->fd);
+    slot->fd = -1;
+  }
+
+  num = (unsigned int)(slot - ingest->slots);
+  ingest->queue[(ingest->head + ingest->nready) % ingest->depth] = num;
+  ingest->nready++;
+
+  ingest->stats.bytes += slot->len;
+  ingest->stats.large += (slot->large != 0);
+  ingest->stats.failed += (slot->err != 0);
+
+  pthread_cond_signal (&ingest->ready);
+}
+
+/* read a file with blocking calls, reads are retried until the size found
+   when the file was opened is read or the file turns out shorter */
+static void
+pyzor_ingest_read (pyzor_ingest_t *ingest, struct pyzor_ingest_slot *slot, const char *path)
+{
+  struct stat st;
+  ssize_t cnt;
+
+  if ((slot->fd = open (path, O_RDONLY | O_CLOEXEC, 0)) == -1 ||
+      fstat (slot->fd, &st) == -1)
+  {
+    slot->err = errno;
+    return;
+  }
+
+  slot->size = (size_t)st.st_size;
+  if (slot->size > ingest->slotlen) {
+    slot->large = 1;
+    return;
+  }
+
+  while (slot->len < slot->size) {
+    cnt = pread (slot->fd, slot->buf + slot->len, slot->size - slot->len, (off_t)slot->len);
+    if (cnt == -1 && errno == EINTR)
+      continue;
+    if (cnt == -1) {
+      slot->err = errno;
+      return;
+    }
+    if (cnt == 0)
+      break;
+    slot->len += (size_t)cnt;
+  }
+}
+
+static void *
+pyzor_ingest_reader (void *arg)
+{
+  pyzor_ingest_t *ingest = arg;
+  struct pyzor_ingest_slot *slot;
+  const char *path;
+
+  pthread_mutex_lock (&ingest->lock);
+  for (;;) {
+    while (! ingest->stop && ! (ingest->nfree && ingest->next < ingest->cnt))
+      pthread_cond_wait (&ingest->cond, &ingest->lock);
+    if (ingest->stop)
+      break;
+
+    slot = pyzor_ingest_take (ingest);
+    path = ingest->names[slot->idx];
+    pthread_mutex_unlock (&ingest->lock);
+
+    pyzor_ingest_read (ingest, slot, path);
+
+    pthread_mutex_lock (&ingest->lock);
+    pyzor_ingest_finish (ingest, slot);
+  }
+  pthread_mutex_unlock (&ingest->lock);
+
+  return (NULL);
+}
+
+#if PYZOR_INGEST_URING
+/* a single thread owns the ring. for every file an open and a statx are
+   queued together, the read into the buffer of the file is queued once
+   both have completed. buffers are registered with the kernel if the
+   locked memory limit allows it so that reads do not have to map them */
+
+static struct io_uring_sqe *
+pyzor_ingest_sqe (struct pyzor_ingest_ring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  if (ring->tail - __atomic_load_n (ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+    return (NULL);
+
+  idx = ring->tail & ring->sqmask;
+  sqe = &ring->sqes[idx];
+  memset (sqe, 0, sizeof (*sqe));
+  ring->sqarray[idx] = idx;
+  ring->tail++;
+  ring->pending++;
+
+  return (sqe);
+}
+
+static void
+pyzor_ingest_queue_read (pyzor_ingest_t *ingest, struct pyzor_ingest_slot *slot)
+{
+  struct pyzor_ingest_ring *ring = ingest->ring;
+  struct io_uring_sqe *sqe;
+
+  /* a read is only queued for a slot that has no other operation in
+     flight, there is always room for it */
+  sqe = pyzor_ingest_sqe (ring);
+  assert (sqe);
+  sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(slot->buf + slot->len);
+  sqe->len = (uint32_t)(slot->size - slot->len);
+  sqe->off = slot->len;
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)(slot - ingest->slots) * PYZOR_INGEST_OPS + PYZOR_INGEST_READ;
+}
+
+static int
+pyzor_ingest_queue_open (pyzor_ingest_t *ingest)
+{
+  struct pyzor_ingest_ring *ring = ingest->ring;
+  struct pyzor_ingest_slot *slot;
+  struct io_uring_sqe *sqe;
+  uint64_t num;
+  const char *path;
+
+  if (ring->sqentries - (ring->tail - __atomic_load_n (ring->sqhead, __ATOMIC_ACQUIRE)) < 2)
+    return (ENOBUFS);
+
+  slot = pyzor_ingest_take (ingest);
+  slot->wait = 2;
+  path = ingest->names[slot->idx];
+  num = (uint64_t)(slot - ingest->slots) * PYZOR_INGEST_OPS;
+
+  sqe = pyzor_ingest_sqe (ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  sqe->user_data = num + PYZOR_INGEST_OPEN;
+
+  sqe = pyzor_ingest_sqe (ring);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)path;
+  sqe->len = STATX_SIZE;
+  sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+  sqe->user_data = num + PYZOR_INGEST_STATX;
+
+  return (0);
+}
+
+static void
+pyzor_ingest_complete (pyzor_ingest_t *ingest, uint64_t data, int res)
+{
+  struct pyzor_ingest_slot *slot;
+
+  slot = &ingest->slots[data / PYZOR_INGEST_OPS];
+
+  switch (data % PYZOR_INGEST_OPS) {
+    case PYZOR_INGEST_OPEN:
+    case PYZOR_INGEST_STATX:
+      if (res < 0 && slot->err == 0)
+        slot->err = -res;
+      else if (res >= 0 && data % PYZOR_INGEST_OPS == PYZOR_INGEST_OPEN)
+        slot->fd = res;
+      else if (res >= 0)
+        slot->size = (size_t)slot->stx.stx_size;
+      if (--slot->wait != 0)
+        break;
+      if (slot->err == 0 && slot->size > ingest->slotlen)
+        slot->large = 1;
+      else if (slot->err == 0 && slot->size != 0) {
+        pyzor_ingest_queue_read (ingest, slot);
+        break;
+      }
+      pyzor_ingest_finish (ingest, slot);
+      break;
+    case PYZOR_INGEST_READ:
+      if (res == -EINTR || res == -EAGAIN) {
+        pyzor_ingest_queue_read (ingest, slot);
+        break;
+      }
+      if (res < 0)
+        slot->err = -res;
+      else
+        slot->len += (size_t)res;
+      /* short reads are continued, end of file ends the file early */
+      if (res > 0 && slot->len < slot->size)
+        pyzor_ingest_queue_read (ingest, slot);
+      else
+        pyzor_ingest_finish (ingest, slot);
+      break;
+  }
+}
+
+static void
+pyzor_ingest_cancel (pyzor_ingest_t *ingest, int err)
+{
+  struct pyzor_ingest_ring *ring = ingest->ring;
+  unsigned int cnt, tail;
+
+  tail = ring->tail;
+  cnt = ring->pending;
+  ring->tail -= cnt;
+  ring->pending = 0;
+  for (; cnt > 0; cnt--)
+    pyzor_ingest_complete (ingest, ring->sqes[(tail - cnt) & ring->sqmask].user_data, -err);
+}
+
+static void *
+pyzor_ingest_uring (void *arg)
+{
+  pyzor_ingest_t *ingest = arg;
+  struct pyzor_ingest_ring *ring = ingest->ring;
+  struct io_uring_cqe *cqe;
+  unsigned int head, min;
+  long ret;
+
+  pthread_mutex_lock (&ingest->lock);
+  for (;;) {
+    while (! ingest->stop && ingest->nfree && ingest->next < ingest->cnt) {
+      if (pyzor_ingest_queue_open (ingest) != 0)
+        break;
+    }
+    if (ingest->stop && ring->inflight == 0)
+      break;
+    if (ring->pending == 0 && ring->inflight == 0) {
+      pthread_cond_wait (&ingest->cond, &ingest->lock);
+      continue;
+    }
+
+    /* the lock is not held while waiting, consumers return buffers in the
+       meantime and these are picked up after the next completion */
+    __atomic_store_n (ring->sqtail, ring->tail, __ATOMIC_RELEASE);
+    min = 1;
+    pthread_mutex_unlock (&ingest->lock);
+    ret = syscall (__NR_io_uring_enter, ring->fd, ring->pending, min,
+                   IORING_ENTER_GETEVENTS, NULL, 0);
+    pthread_mutex_lock (&ingest->lock);
+
+    if (ret >= 0) {
+      ring->pending -= (unsigned int)ret;
+      ring->inflight += (unsigned int)ret;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+               errno != ENOMEM)
+    {
+      /* operations that were not submitted fail, so that every file is
+         still handed out */
+      pyzor_ingest_cancel (ingest, errno);
+    }
+
+    head = *ring->cqhead;
+    for (; head != __atomic_load_n (ring->cqtail, __ATOMIC_ACQUIRE); head++) {
+      cqe = &ring->cqes[head & ring->cqmask];
+      ring->inflight--;
+      pyzor_ingest_complete (ingest, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n (ring->cqhead, head, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock (&ingest->lock);
+
+  return (NULL);
+}
+
+static void
+pyzor_ingest_ring_destroy (struct pyzor_ingest_ring *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqeslen);
+  if (ring->cqmap)
+    munmap (ring->cqmap, ring->cqlen);
+  if (ring->sqmap)
+    munmap (ring->sqmap, ring->sqlen);
+  if (ring->fd != -1)
+    close (ring->fd);
+  free (ring);
+}
+
+static int
+pyzor_ingest_ring_create (pyzor_ingest_t *ingest)
+{
+  static const unsigned char ops[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ };
+  struct pyzor_ingest_ring *ring;
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  struct iovec iov;
+  unsigned char *map;
+  unsigned int num;
+  int err;
+
+  if (! (ring = calloc (1, sizeof (*ring))))
+    return (ENOMEM);
+
+  /* open and statx of a file are queued together */
+  memset (&params, 0, sizeof (params));
+  if ((ring->fd = (int)syscall (__NR_io_uring_setup, ingest->depth * 2, &params)) == -1) {
+    err = errno;
+    free (ring);
+    return (err);
+  }
+
+  /* operations needed were added in 5.6, as was the probe */
+  num = 256;
+  if (! (probe = calloc (1, sizeof (*probe) + num * sizeof (struct io_uring_probe_op)))) {
+    err = ENOMEM;
+    goto error;
+  }
+  if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, num) == -1) {
+    err = errno;
+    free (probe);
+    goto error;
+  }
+  for (num = 0, err = 0; num < sizeof (ops); num++) {
+    if (ops[num] > probe->last_op || ! (probe->ops[ops[num]].flags & IO_URING_OP_SUPPORTED))
+      err = ENOTSUP;
+  }
+  free (probe);
+  if (err != 0)
+    goto error;
+
+  ring->sqlen = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+  map = mmap (NULL, ring->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (map == MAP_FAILED) {
+    err = errno;
+    goto error;
+  }
+  ring->sqmap = map;
+  ring->sqhead = (unsigned int *)(map + params.sq_off.head);
+  ring->sqtail = (unsigned int *)(map + params.sq_off.tail);
+  ring->sqarray = (unsigned int *)(map + params.sq_off.array);
+  ring->sqmask = *(unsigned int *)(map + params.sq_off.ring_mask);
+  ring->sqentries = *(unsigned int *)(map + params.sq_off.ring_entries);
+  ring->tail = *ring->sqtail;
+
+  ring->sqeslen = params.sq_entries * sizeof (struct io_uring_sqe);
+  map = mmap (NULL, ring->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (map == MAP_FAILED) {
+    err = errno;
+    goto error;
+  }
+  ring->sqes = (struct io_uring_sqe *)map;
+
+  ring->cqlen = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  map = mmap (NULL, ring->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (map == MAP_FAILED) {
+    err = errno;
+    goto error;
+  }
+  ring->cqmap = map;
+  ring->cqhead = (unsigned int *)(map + params.cq_off.head);
+  ring->cqtail = (unsigned int *)(map + params.cq_off.tail);
+  ring->cqmask = *(unsigned int *)(map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+  /* buffers count towards the locked memory limit, reads go through
+     regular buffers if registering them fails */
+  iov.iov_base = ingest->arena;
+  iov.iov_len = ingest->depth * ingest->slotlen;
+  ring->fixed = syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+  ingest->ring = ring;
+
+  return (0);
+error:
+  pyzor_ingest_ring_destroy (ring);
+  return (err);
+}
+#endif
+
+int
+pyzor_ingest_create (pyzor_ingest_t **ingest,
+                     unsigned int depth, /* number of files in flight */
+                     size_t slotlen) /* largest file that is read */
+{
+  pyzor_ingest_t *ptr;
+  unsigned int cnt, num;
+  void *(*func) (void *);
+  int err;
+
+  assert (ingest);
+
+  if (depth == 0)
+    depth = PYZOR_INGEST_DEPTH;
+  if (slotlen == 0)
+    slotlen = PYZOR_INGEST_SLOT;
+  /* buffers are page aligned */
+  slotlen = (slotlen + 4095) & ~(size_t)4095;
+  if (slotlen > UINT32_MAX || depth > SIZE_MAX / slotlen)
+    return (EINVAL);
+
+  if (! (ptr = calloc (1, sizeof (pyzor_ingest_t))))
+    return (ENOMEM);
+  pthread_mutex_init (&ptr->lock, NULL);
+  pthread_cond_init (&ptr->cond, NULL);
+  pthread_cond_init (&ptr->ready, NULL);
+  ptr->depth = depth;
+  ptr->slotlen = slotlen;
+
+  if ((err = posix_memalign ((void **)&ptr->arena, 4096, depth * slotlen)) != 0) {
+    ptr->arena = NULL;
+    goto error;
+  }
+  if (! (ptr->slots = calloc (depth, sizeof (struct pyzor_ingest_slot))) ||
+      ! (ptr->free = calloc (depth, sizeof (unsigned int))) ||
+      ! (ptr->queue = calloc (depth, sizeof (unsigned int))))
+  {
+    err = ENOMEM;
+    goto error;
+  }
+  for (cnt = 0; cnt < depth; cnt++) {
+    ptr->slots[cnt].buf = ptr->arena + (size_t)cnt * slotlen;
+    ptr->slots[cnt].fd = -1;
+    ptr->free[cnt] = depth - cnt - 1;
+  }
+  ptr->nfree = depth;
+
+  func = &pyzor_ingest_reader;
+  num = depth < PYZOR_INGEST_THREADS ? depth : PYZOR_INGEST_THREADS;
+#if PYZOR_INGEST_URING
+  if (pyzor_ingest_ring_create (ptr) == 0) {
+    func = &pyzor_ingest_uring;
+    num = 1;
+  }
+#endif
+
+  if (! (ptr->thrs = calloc (num, sizeof (pthread_t)))) {
+    err = ENOMEM;
+    goto error;
+  }
+  for (cnt = 0; cnt < num; cnt++) {
+    if ((err = pthread_create (&ptr->thrs[cnt], NULL, func, ptr)) != 0)
+      goto error;
+    ptr->nthrs++;
+  }
+
+  *ingest = ptr;
+
+  return (0);
+error:
+  pyzor_ingest_destroy (ptr);
+  return (err);
+}
+
+void
+pyzor_ingest_destroy (pyzor_ingest_t *ingest)
+{
+  unsigned int cnt;
+
+  assert (ingest);
+
+  if (ingest) {
+    pthread_mutex_lock (&ingest->lock);
+    ingest->stop = 1;
+    pthread_cond_broadcast (&ingest->cond);
+    pthread_mutex_unlock (&ingest->lock);
+
+    for (cnt = 0; cnt < ingest->nthrs; cnt++)
+      pthread_join (ingest->thrs[cnt], NULL);
+#if PYZOR_INGEST_URING
+    if (ingest->ring)
+      pyzor_ingest_ring_destroy (ingest->ring);
+#endif
+
+    pthread_cond_destroy (&ingest->ready);
+    pthread_cond_destroy (&ingest->cond);
+    pthread_mutex_destroy (&ingest->lock);
+    free (ingest->thrs);
+    free (ingest->queue);
+    free (ingest->free);
+    free (ingest->slots);
+    free (ingest->arena);
+    memset (ingest, 0, sizeof (pyzor_ingest_t));
+    free (ingest);
+  }
+}
+
+const char *
+pyzor_ingest_method (pyzor_ingest_t *ingest)
+{
+  assert (ingest);
+
+#if PYZOR_INGEST_URING
+  if (ingest->ring)
+    return (ingest->ring->fixed ? "io_uring" : "io_uring (buffers not registered)");
+#endif
+  return ("pread");
+}
+
+/* read the files of a batch, the names must stay valid until every file
+   of the batch is handed out. a batch must be consumed entirely, and its
+   buffers given back, before the next is started */
+void
+pyzor_ingest_start (pyzor_ingest_t *ingest, char *const *names, size_t cnt)
+{
+  assert (ingest);
+  assert (names || ! cnt);
+
+  pthread_mutex_lock (&ingest->lock);
+  assert (ingest->done == ingest->cnt && ingest->nfree == ingest->depth);
+  ingest->names = names;
+  ingest->cnt = cnt;
+  ingest->next = 0;
+  ingest->done = 0;
+  ingest->start = pyzor_ingest_now ();
+  pthread_cond_broadcast (&ingest->cond);
+  pthread_mutex_unlock (&ingest->lock);
+}
+
+/* next file that was read, ENOENT once every file of the batch is handed
+   out. safe to call from any number of threads */
+int
+pyzor_ingest_next (pyzor_ingest_t *ingest, struct pyzor_ingest_file *file)
+{
+  struct pyzor_ingest_slot *slot;
+  unsigned int num;
+
+  assert (ingest);
+  assert (file);
+
+  pthread_mutex_lock (&ingest->lock);
+  while (ingest->nready == 0 && ingest->done < ingest->cnt)
+    pthread_cond_wait (&ingest->ready, &ingest->lock);
+  if (ingest->nready == 0) {
+    pthread_mutex_unlock (&ingest->lock);
+    return (ENOENT);
+  }
+
+  num = ingest->queue[ingest->head];
+  ingest->head = (ingest->head + 1) % ingest->depth;
+  ingest->nready--;
+  ingest->stats.files++;
+  if (++ingest->done == ingest->cnt) {
+    ingest->stats.ns += pyzor_ingest_now () - ingest->start;
+    pthread_cond_broadcast (&ingest->ready);
+  }
+
+  slot = &ingest->slots[num];
+  file->idx = slot->idx;
+  file->data = slot->large || slot->err ? NULL : slot->buf;
+  file->len = slot->len;
+  file->err = slot->err;
+  file->slot = num;
+  pthread_mutex_unlock (&ingest->lock);
+
+  return (0);
+}
+
+void
+pyzor_ingest_done (pyzor_ingest_t *ingest, const struct pyzor_ingest_file *file)
+{
+  assert (ingest);
+  assert (file && file->slot < ingest->depth);
+
+  pthread_mutex_lock (&ingest->lock);
+  ingest->free[ingest->nfree++] = file->slot;
+  pthread_cond_signal (&ingest->cond);
+  pthread_mutex_unlock (&ingest->lock);
+}
+
+void
+pyzor_ingest_stats (pyzor_ingest_t *ingest, struct pyzor_ingest_stats *stats)
+{
+  assert (ingest);
+  assert (stats);
+
+  pthread_mutex_lock (&ingest->lock);
+  *stats = ingest->stats;
+  pthread_mutex_unlock (&ingest->lock);
+}
@@ -0,0 +1,42 @@
+#ifndef PYZOR_INGEST_H_INCLUDED
+#define PYZOR_INGEST_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* files are read ahead of the digest workers into a fixed set of buffers,
+   so that reading and digesting overlap. reads are queued with io_uring if
+   the kernel supports it and by a pool of threads using pread otherwise.
+   files are handed out in the order they complete, a consumer gives the
+   buffer back once it is done with the file. */
+typedef struct pyzor_ingest pyzor_ingest_t;
+
+/* default number of files in flight and size of a buffer */
+#define PYZOR_INGEST_DEPTH (64)
+#define PYZOR_INGEST_SLOT (128 * 1024)
+
+struct pyzor_ingest_file {
+  size_t idx; /* position of the name in the batch */
+  const unsigned char *data; /* NULL if the file is larger than a buffer */
+  size_t len;
+  int err;
+  unsigned int slot;
+};
+
+struct pyzor_ingest_stats {
+  uint64_t files; /* files handed out, failed included */
+  uint64_t bytes; /* bytes read */
+  uint64_t large; /* files larger than a buffer, not read */
+  uint64_t failed;
+  uint64_t ns; /* time batches were in progress */
+};
+
+int pyzor_ingest_create (pyzor_ingest_t **, unsigned int, size_t);
+void pyzor_ingest_destroy (pyzor_ingest_t *);
+const char *pyzor_ingest_method (pyzor_ingest_t *);
+void pyzor_ingest_start (pyzor_ingest_t *, char *const *, size_t);
+int pyzor_ingest_next (pyzor_ingest_t *, struct pyzor_ingest_file *);
+void pyzor_ingest_done (pyzor_ingest_t *, const struct pyzor_ingest_file *);
+void pyzor_ingest_stats (pyzor_ingest_t *, struct pyzor_ingest_stats *);
+
+#endif
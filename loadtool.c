@@ -0,0 +1,245 @@
+/* load generator for pyzord. every thread runs its own client, and thus its
+   own socket, so that requests are spread over the workers of a server
+   that listens with SO_REUSEPORT */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "pyzor.h"
+
+/* requests per batch */
+#define LOADTOOL_BATCH (4096)
+
+struct loadtool {
+  const char *host;
+  const char *port;
+  const char *user;
+  const char *key;
+  pyzor_client_op_t op;
+  unsigned int timeout;
+  unsigned int retries;
+  size_t window;
+  double secs;
+  char (*digests)[PYZOR_DIGEST_HEX_LEN];
+  size_t ndigests;
+};
+
+struct loadtool_thread {
+  struct loadtool *load;
+  pthread_t thr;
+  uint64_t seed;
+  uint64_t ok;
+  uint64_t failed; /* no reply or not 200 */
+  int err;
+};
+
+static uint64_t
+loadtool_rand (uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+
+  return (x);
+}
+
+static double
+loadtool_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static void *
+loadtool_run (void *arg)
+{
+  struct loadtool_thread *thr = arg;
+  struct loadtool *load = thr->load;
+  struct pyzor_client_result *res;
+  pyzor_client_t *client;
+  const char **batch;
+  double end;
+  size_t pos;
+
+  batch = calloc (LOADTOOL_BATCH, sizeof (*batch));
+  res = calloc (LOADTOOL_BATCH, sizeof (*res));
+  if (! batch || ! res) {
+    thr->err = ENOMEM;
+    goto out;
+  }
+
+  if ((thr->err = pyzor_client_create (&client, load->host, load->port, load->user, load->key)) != 0)
+    goto out;
+  pyzor_client_timeout (client, load->timeout, load->retries);
+  if ((thr->err = pyzor_client_window (client, load->window)) != 0)
+    goto close;
+
+  end = loadtool_now () + load->secs;
+  while (loadtool_now () < end) {
+    for (pos = 0; pos < LOADTOOL_BATCH; pos++)
+      batch[pos] = load->digests[loadtool_rand (&thr->seed) % load->ndigests];
+    if ((thr->err = pyzor_client_batch (client, load->op, batch, LOADTOOL_BATCH, res)) != 0)
+      break;
+    for (pos = 0; pos < LOADTOOL_BATCH; pos++) {
+      if (res[pos].err == 0 && res[pos].code == 200)
+        thr->ok++;
+      else
+        thr->failed++;
+    }
+  }
+
+close:
+  pyzor_client_destroy (client);
+out:
+  free (batch);
+  free (res);
+  return (NULL);
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: pyzor-load [-s host[:port]] [-u user] [-k key] [-j threads] [-d digests]\n"
+          "                  [-n seconds] [-t msecs] [-r retries] [-w window]\n"
+          "                  [check|report|whitelist|info|ping]\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *ops[] = { "check", "report", "whitelist", "info", "ping" };
+  static const char hex[] = "0123456789abcdef";
+  struct loadtool load;
+  struct loadtool_thread *thrs;
+  unsigned int num, pos;
+  uint64_t failed, ok, seed;
+  size_t cnt, off;
+  double secs, start;
+  char *ptr;
+  int err, op, opt;
+
+  memset (&load, 0, sizeof (load));
+  load.host = "127.0.0.1";
+  load.timeout = PYZOR_CLIENT_TIMEOUT;
+  load.retries = PYZOR_CLIENT_RETRIES;
+  load.window = PYZOR_CLIENT_WINDOW;
+  load.secs = 10;
+  load.ndigests = 1024 * 1024;
+  num = 1;
+
+  while ((opt = getopt (argc, argv, "d:hj:k:n:r:s:t:u:w:")) != -1) {
+    switch (opt) {
+      case 'd':
+        load.ndigests = strtoul (optarg, NULL, 10);
+        break;
+      case 'j':
+        num = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'k':
+        load.key = optarg;
+        break;
+      case 'n':
+        load.secs = strtod (optarg, NULL);
+        break;
+      case 'r':
+        load.retries = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 's':
+        /* host:port, an ipv6 address has more than one colon */
+        load.host = optarg;
+        if ((ptr = strchr (optarg, ':')) && ! strchr (ptr + 1, ':')) {
+          *ptr = '\0';
+          load.port = ptr + 1;
+        }
+        break;
+      case 't':
+        load.timeout = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'u':
+        load.user = optarg;
+        break;
+      case 'w':
+        load.window = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  op = pyzor_client_check;
+  if (optind < argc) {
+    for (op = 0; op < (int)(sizeof (ops) / sizeof (ops[0])); op++) {
+      if (strcmp (argv[optind], ops[op]) == 0)
+        break;
+    }
+    if (op == (int)(sizeof (ops) / sizeof (ops[0])) || optind + 1 != argc) {
+      usage ();
+      return (1);
+    }
+  }
+  load.op = (pyzor_client_op_t)op;
+
+  if (num == 0 || load.ndigests == 0) {
+    usage ();
+    return (1);
+  }
+
+  /* random digests, drawn from uniformly by every thread */
+  if (! (load.digests = malloc (load.ndigests * sizeof (*load.digests))) ||
+      ! (thrs = calloc (num, sizeof (*thrs))))
+  {
+    fprintf (stderr, "pyzor-load: %s\n", strerror (ENOMEM));
+    return (1);
+  }
+  seed = 0x9e3779b97f4a7c15ull;
+  for (cnt = 0; cnt < load.ndigests; cnt++) {
+    for (off = 0; off < PYZOR_DIGEST_HEX_LEN - 1; off++)
+      load.digests[cnt][off] = hex[loadtool_rand (&seed) & 0x0f];
+    load.digests[cnt][off] = '\0';
+  }
+
+  start = loadtool_now ();
+  for (pos = 0; pos < num; pos++) {
+    thrs[pos].load = &load;
+    thrs[pos].seed = seed + pos * 0x2545f4914f6cdd1dull;
+    if ((err = pthread_create (&thrs[pos].thr, NULL, &loadtool_run, &thrs[pos])) != 0) {
+      fprintf (stderr, "pyzor-load: %s\n", strerror (err));
+      return (1);
+    }
+  }
+
+  ok = failed = 0;
+  err = 0;
+  for (pos = 0; pos < num; pos++) {
+    pthread_join (thrs[pos].thr, NULL);
+    ok += thrs[pos].ok;
+    failed += thrs[pos].failed;
+    if (thrs[pos].err != 0)
+      err = thrs[pos].err;
+  }
+  secs = loadtool_now () - start;
+
+  printf ("%s: %" PRIu64 " ok, %" PRIu64 " failed in %.2fs, %.0f requests/s\n",
+    ops[op], ok, failed, secs, secs > 0 ? (double)(ok + failed) / secs : 0.0);
+  if (err != 0)
+    fprintf (stderr, "pyzor-load: %s\n", strerror (err));
+
+  free (load.digests);
+  free (thrs);
+
+  return (err != 0 || failed != 0);
+}
@@ -1,28 +1,103 @@
 /* */
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#ifdef PYZOR_GMIME
 #include <glib.h>
 #include <gmime/gmime.h>
+#endif
 
+#include "cache.h"
+#include "daemon.h"
+#include "fuzzy.h"
+#include "ingest.h"
+#include "mbox.h"
+#include "mime.h"
+#include "pool.h"
 #include "pyzor.h"
 
+/* contexts are reused across messages, line buffers are not kept above this
+   size between messages */
+#define PYZOR_DIGEST_HWM (64 * 1024)
+
+static int
+pyzor_map (const char *path, void **map, size_t *len)
+{
+  struct stat st;
+  int err, fd;
+
+  if ((fd = open (path, O_RDONLY, 0)) == -1)
+    return (errno);
+  if (fstat (fd, &st) == -1) {
+    err = errno;
+    close (fd);
+    return (err);
+  }
+
+  *map = NULL;
+  *len = (size_t)st.st_size;
+  if (st.st_size > 0) {
+    *map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) {
+      err = errno;
+      close (fd);
+      return (err);
+    }
+    (void)madvise (*map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  }
+
+  close (fd);
+
+  return (0);
+}
+
+static void
+pyzor_unmap (void *map, size_t len)
+{
+  if (map)
+    munmap (map, len);
+}
+
+/* leaf parts that are digested, all of them if NULL */
+static pyzor_mime_policy_t *pyzor_policy = NULL;
+
+/* workers the parts of a single message are spread over, if any */
+static pyzor_pool_t *pyzor_workers = NULL;
+
+/* state files of text that is digested in pieces, see pyzor_digest_piece */
+static const char *pyzor_state_in = NULL;
+static const char *pyzor_state_out = NULL;
+
+/* digest specs given with -S, computed together from one pass */
+#define PYZOR_SPECS (8)
+
+static pyzor_spec_t pyzor_specs[PYZOR_SPECS];
+static const char *pyzor_spec_names[PYZOR_SPECS];
+static size_t pyzor_nspecs = 0;
+
+/* print the similarity fingerprint next to the digest */
+static int pyzor_fingerprint = 0;
+
+#ifdef PYZOR_GMIME
+/* parse with gmime instead of the built-in walker */
+static int pyzor_gmime = 0;
 
 static GMimeMessage *
-parse_message (int fd)
+parse_message (GMimeStream *stream)
 {
 	GMimeMessage *message;
 	GMimeParser *parser;
-	GMimeStream *stream;
-	
-	/* create a stream to read from the file descriptor */
-	stream = g_mime_stream_fs_new (fd);
 	
 	/* create a new parser object to parse the stream */
 	parser = g_mime_parser_new_with_stream (stream);
@@ -39,123 +114,1041 @@ parse_message (int fd)
 	return message;
 }
 
-// look at rfc822BodyCleaner in client.py line 698
-// it does some decoding... check if we should do so as well or if thats done
-// by gmime automatically
-
 #define BUFLEN 4096
 
 static void
 pyzor_foreach_callback (GMimeObject *parent, GMimeObject *part, gpointer user_data)
 {
   pyzor_digest_t *digest = user_data;
-
+  struct pyzor_mime_decoder dec;
+  struct pyzor_mime_part desc;
+  pyzor_mime_encoding_t encoding;
+  GMimeContentType *ctype;
   GMimeFilter *filter;
-  GMimeStream *stream, *filtered_stream;
-  //GMimeDataWrapper *wrapper;
-
+  GMimeStream *stream;
+  gint64 size;
   ssize_t cnt;
   char buf[BUFLEN];
-  memset (buf, '\0', BUFLEN);
-
-// it can automatically decode stuff... there's an example for that look it
-// up.
-// the easiest thing to do is look at write_part in imap-example.c which comes
-// with the gmime distribution
-// the content member of GMimePart is a GMimeDataWrapper
-// does g_mime_data_wrapper_get_stream do automatic decoding?!?! thats what i
-// want to know!
-
-  if (GMIME_IS_MULTIPART (part)) {
-    //multipart = (GMimeMultipart *) part;
-    // invoke foreach stuff
-    //} else if (GMIME_IS_MESSAGE_PARTIAL
-
-  } else if (GMIME_IS_PART (part)) {
-    // right this is what we want...
-    // now just call pyzor_digest_update (...)
-    //g_mime_data_wrapper_get_stream (GMIME_PART(part)->content);
+  int err;
+
+  if (GMIME_IS_PART (part)) {
+    /* the content stream is not decoded. base64 and quoted-printable are
+       decoded by the same decoders the built-in walker uses, straight into
+       the digest. anything else gmime knows about is left to its filter */
     stream = g_mime_data_wrapper_get_stream (GMIME_PART (part)->content);
-    // returns stream member of wrapper...
-    // we can then invoke g_mime_data_wrapper_get_encoding
-    // GMimeContentEncoding  g_mime_data_wrapper_get_encoding  (GMimeDataWrapper *wrapper);
-    // to get the content encoding...
-    // then we need to create a filter... because the stream doesn't do decoding
-    // by default... see write_to_stream() inn gmime/gmime-data-wrapper.c
-    filter = g_mime_filter_basic_new (g_mime_data_wrapper_get_encoding (GMIME_PART (part)->content), FALSE);
-		filtered_stream = g_mime_stream_filter_new (stream);
-		g_mime_stream_filter_add (GMIME_STREAM_FILTER (filtered_stream), filter);
-		g_object_unref (filter);
-		//g_mime_stream_write_to_stream (istream, ostream); // forget this
-		// we now have a filtered stream... which can be used to read data if i'm
-		// not mistaken
-		// yep... just use use g_mime_stream_read
-		//g_object_unref (ostream);
-		// as far as i can see no attempt is made by pyzor to do character set
-		// conversion
-		/* now read... */
-		for (;;) {
-		  cnt = g_mime_stream_read (filtered_stream, buf, BUFLEN);
-		  if (cnt == -1) {
-		    fprintf (stderr, "error\n");
-		    return;
-		  } else if (cnt == 0) {
-		    printf ("stream empty\n");
-		    break;
-		  } else {
-//fprintf (stderr, "MIME: %.*s\n", cnt, buf);
-		    int err = pyzor_digest_update (digest, buf, (size_t)cnt, (cnt < BUFLEN ? 1 : 0));
-		    if (err != 0) {
-		      fprintf (stderr, "error: %s\n", strerror (err));
-		      return;
-		    }
-		    //printf ("%.*s", cnt, buf);
-		    //if (cnt < BUFLEN)
-		    //  break;
-		  }
-		}
+
+    /* parts the policy skips are not read at all */
+    memset (&desc, 0, sizeof (desc));
+    ctype = g_mime_object_get_content_type (part);
+    desc.type = (const unsigned char *)g_mime_content_type_get_media_type (ctype);
+    desc.typelen = strlen ((const char *)desc.type);
+    desc.subtype = (const unsigned char *)g_mime_content_type_get_media_subtype (ctype);
+    desc.subtypelen = strlen ((const char *)desc.subtype);
+    if ((size = g_mime_stream_length (stream)) > 0)
+      desc.len = (size_t)size;
+    if (! pyzor_mime_policy_check (pyzor_policy, &desc))
+      return;
+
+    switch (g_mime_data_wrapper_get_encoding (GMIME_PART (part)->content)) {
+      case GMIME_CONTENT_ENCODING_BASE64:
+        encoding = pyzor_mime_base64;
+        g_object_ref (stream);
+        break;
+      case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+        encoding = pyzor_mime_quoted_printable;
+        g_object_ref (stream);
+        break;
+      default:
+        encoding = pyzor_mime_identity;
+        filter = g_mime_filter_basic_new (g_mime_data_wrapper_get_encoding (GMIME_PART (part)->content), FALSE);
+        stream = g_mime_stream_filter_new (stream);
+        g_mime_stream_filter_add (GMIME_STREAM_FILTER (stream), filter);
+        g_object_unref (filter);
+        break;
+    }
+
+    pyzor_mime_decoder_init (&dec, encoding);
+
+    /* a short read does not signal the end of the part, only the end of
+       the stream does */
+    for (;;) {
+      cnt = g_mime_stream_read (stream, buf, BUFLEN);
+      if (cnt == -1) {
+        fprintf (stderr, "error\n");
+        break;
+      }
+      err = pyzor_mime_decoder_update (&dec, digest, (unsigned char *)buf, (size_t)cnt, (cnt == 0 ? 1 : 0));
+      if (err != 0) {
+        fprintf (stderr, "error: %s\n", strerror (err));
+        break;
+      }
+      if (cnt == 0)
+        break;
+    }
+
+    g_object_unref (stream);
   }
 
   return;
 }
 
-int
-main (int argc, char *argv[])
+static int
+pyzor_digest_stream (pyzor_digest_pool_t *pool,
+                     GMimeStream *stream,
+                     unsigned char *str,
+                     size_t len)
 {
-	GMimeMessage *message;
-	int fd;
-	
-	if (argc < 2) {
-		printf ("Usage: a.out <message file>\n");
-		return 0;
-	} else {
-		if ((fd = open (argv[1], O_RDONLY, 0)) == -1) {
-			fprintf (stderr, "Cannot open message `%s': %s\n", argv[1], g_strerror (errno));
-			return 0;
-		}
-	}
-	
-	/* init the gmime library */
-	g_mime_init (0);
-	
-	/* parse the message */
-	message = parse_message (fd);
+  GMimeMessage *message;
+  pyzor_digest_t *digest;
+  int err;
+
+  if (! (message = parse_message (stream)))
+    return (EINVAL);
+
+  if ((err = pyzor_digest_pool_get (pool, &digest)) == 0) {
+    g_mime_message_foreach (message, pyzor_foreach_callback, (void *)digest);
+    err = pyzor_digest_final (str, len, digest);
+    pyzor_digest_pool_put (pool, digest);
+  }
+
+  g_object_unref (message);
 
+  return (err);
+}
+#endif /* PYZOR_GMIME */
+
+/* message is in memory, parts are fed to the digest straight from it */
+static int
+pyzor_digest_message (pyzor_digest_pool_t *pool,
+                      pyzor_cache_t *cache,
+                      const unsigned char *msg,
+                      size_t msglen,
+                      unsigned char *str,
+                      size_t len)
+{
   pyzor_digest_t *digest;
   int err;
-//  pyzor_digest_init (&digest);
-  if ((err = pyzor_digest_create (&digest)) != 0) {
+
+  if ((err = pyzor_digest_pool_get (pool, &digest)) != 0)
+    return (err);
+  if (cache)
+    err = pyzor_cache_digest (cache, pyzor_policy, digest, msg, msglen, str, len);
+  else if (pyzor_workers)
+    err = pyzor_mime_digest_parallel (digest, pyzor_policy, pool, pyzor_workers, msg, msglen);
+  else
+    err = pyzor_mime_digest (digest, pyzor_policy, msg, msglen);
+  if (! cache && err == 0)
+    err = pyzor_digest_final (str, len, digest);
+  pyzor_digest_pool_put (pool, digest);
+
+  return (err);
+}
+
+static int
+pyzor_digest_file (pyzor_digest_pool_t *pool,
+                   pyzor_cache_t *cache,
+                   const char *path,
+                   unsigned char *str,
+                   size_t len)
+{
+  void *map;
+  size_t maplen;
+  int err;
+
+#ifdef PYZOR_GMIME
+  int fd;
+
+  if (pyzor_gmime) {
+    if ((fd = open (path, O_RDONLY, 0)) == -1)
+      return (errno);
+
+    /* the fs stream owns the descriptor, it is closed with the message */
+    return (pyzor_digest_stream (pool, g_mime_stream_fs_new (fd), str, len));
+  }
+#endif
+
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    return (err);
+  err = pyzor_digest_message (pool, cache, map, maplen, str, len);
+  pyzor_unmap (map, maplen);
+
+  return (err);
+}
+
+/* input is already decoded text, digest the mapping directly */
+static int
+pyzor_digest_text (const char *path, unsigned char *str, size_t len)
+{
+  void *map;
+  size_t maplen;
+  int err;
+
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    return (err);
+  err = pyzor_digest_buffer (str, len, map, maplen);
+  pyzor_unmap (map, maplen);
+
+  return (err);
+}
+
+static int
+pyzor_state_read (pyzor_digest_t *digest, const char *path)
+{
+  void *map;
+  size_t maplen;
+  int err;
+
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    return (err);
+  err = pyzor_digest_load (digest, map, maplen);
+  pyzor_unmap (map, maplen);
+
+  return (err);
+}
+
+static int
+pyzor_state_write (pyzor_digest_t *digest, const char *path)
+{
+  unsigned char *buf;
+  size_t len, pos;
+  ssize_t cnt;
+  int err, fd;
+
+  if ((err = pyzor_digest_save (digest, NULL, 0, &len)) != ENOBUFS)
+    return (err ? err : EINVAL);
+  if (! (buf = malloc (len)))
+    return (ENOMEM);
+  if ((err = pyzor_digest_save (digest, buf, len, &len)) != 0) {
+    free (buf);
+    return (err);
+  }
+
+  if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+    err = errno;
+    free (buf);
+    return (err);
+  }
+  err = 0;
+  for (pos = 0; pos < len; pos += (size_t)cnt) {
+    if ((cnt = write (fd, buf + pos, len - pos)) == -1) {
+      if (errno == EINTR) {
+        cnt = 0;
+        continue;
+      }
+      err = errno;
+      break;
+    }
+  }
+  if (close (fd) == -1 && err == 0)
+    err = errno;
+  free (buf);
+
+  return (err);
+}
+
+/* decoded text that arrives in pieces, e.g. from different processes. the
+   state is loaded from pyzor_state_in before the piece is digested and, if
+   more pieces follow, saved to pyzor_state_out instead of finishing the
+   digest. earlier pieces are never read again */
+static int
+pyzor_digest_piece (const char *path, unsigned char *str, size_t len)
+{
+  pyzor_digest_t *digest;
+  void *map;
+  size_t maplen;
+  int err;
+
+  if ((err = pyzor_digest_create (&digest)) != 0)
+    return (err);
+  if (pyzor_state_in && (err = pyzor_state_read (digest, pyzor_state_in)) != 0)
+    goto out;
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    goto out;
+  err = pyzor_digest_update (digest, map ? map : (void *)"", maplen, ! pyzor_state_out);
+  pyzor_unmap (map, maplen);
+  if (err != 0)
+    goto out;
+
+  if (pyzor_state_out)
+    err = pyzor_state_write (digest, pyzor_state_out);
+  else
+    err = pyzor_digest_final (str, len, digest);
+
+out:
+  pyzor_digest_destroy (digest);
+
+  return (err);
+}
+
+/* a single message, or text, digested for every spec in pyzor_specs */
+static int
+pyzor_digest_specs (pyzor_digest_pool_t *pool, const char *path, int text)
+{
+  unsigned char sums[PYZOR_SPECS][PYZOR_DIGEST_RAW_LEN];
+  pyzor_digest_t *digest;
+  void *map;
+  size_t maplen, num, pos;
+  int err;
+
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    return (err);
+  if (text) {
+    err = pyzor_digest_buffer_specs (sums, pyzor_specs, pyzor_nspecs, map, maplen);
+  } else if ((err = pyzor_digest_pool_get (pool, &digest)) == 0) {
+    err = pyzor_digest_configure (digest, pyzor_specs, pyzor_nspecs);
+    if (err == 0 && pyzor_workers)
+      err = pyzor_mime_digest_parallel (digest, pyzor_policy, pool, pyzor_workers, map, maplen);
+    else if (err == 0)
+      err = pyzor_mime_digest (digest, pyzor_policy, map, maplen);
+    for (num = 0; err == 0 && num < pyzor_nspecs; num++)
+      err = pyzor_digest_final_spec_raw (sums[num], sizeof (sums[num]), digest, &pyzor_specs[num]);
+    pyzor_digest_pool_put (pool, digest);
+  }
+  pyzor_unmap (map, maplen);
+  if (err != 0)
+    return (err);
+
+  for (num = 0; num < pyzor_nspecs; num++) {
+    printf ("digest %s: ", pyzor_spec_names[num]);
+    for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++)
+      printf ("%02x", sums[num][pos]);
+    printf ("\n");
+  }
+
+  return (0);
+}
+
+/* a single message, or text, digested with its fingerprint */
+static int
+pyzor_digest_fuzzy (pyzor_digest_pool_t *pool,
+                    const char *path,
+                    int text,
+                    unsigned char *str,
+                    size_t len,
+                    pyzor_fuzzy_t *fuzzy)
+{
+  pyzor_digest_t *digest;
+  void *map;
+  size_t maplen;
+  int err;
+
+  if ((err = pyzor_map (path, &map, &maplen)) != 0)
+    return (err);
+  if ((err = pyzor_digest_pool_get (pool, &digest)) == 0) {
+    if (text)
+      err = pyzor_digest_update (digest, map ? map : (void *)"", maplen, 1);
+    else if (pyzor_workers)
+      err = pyzor_mime_digest_parallel (digest, pyzor_policy, pool, pyzor_workers, map, maplen);
+    else
+      err = pyzor_mime_digest (digest, pyzor_policy, map, maplen);
+    if (err == 0)
+      err = pyzor_digest_final_fuzzy (str, len, digest, fuzzy);
+    pyzor_digest_pool_put (pool, digest);
+  }
+  pyzor_unmap (map, maplen);
+
+  return (err);
+}
+
+static int
+pyzor_digest_range (pyzor_digest_pool_t *pool,
+                    pyzor_cache_t *cache,
+                    pyzor_mbox_t *mbox,
+                    const struct pyzor_mbox_msg *msg,
+                    unsigned char *str,
+                    size_t len)
+{
+  unsigned char *buf;
+  size_t cnt;
+  int err;
+
+#ifdef PYZOR_GMIME
+  GMimeStream *stream;
+  int fd;
+
+  if (pyzor_gmime) {
+    if (! msg->quoted) {
+      /* map the message range directly, the stream closes its own copy of
+         the descriptor */
+      if ((fd = dup (pyzor_mbox_fd (mbox))) == -1)
+        return (errno);
+      stream = g_mime_stream_mmap_new_with_bounds (
+        fd, PROT_READ, MAP_PRIVATE, msg->pos, msg->pos + (off_t)msg->len);
+      if (! stream) {
+        close (fd);
+        return (ENOMEM);
+      }
+    } else {
+      if (! (buf = malloc (msg->len ? msg->len : 1)))
+        return (ENOMEM);
+      cnt = pyzor_mbox_unquote (buf, pyzor_mbox_data (mbox) + msg->pos, msg->len);
+      stream = g_mime_stream_mem_new_with_buffer ((const char *)buf, cnt);
+      free (buf);
+    }
+
+    return (pyzor_digest_stream (pool, stream, str, len));
+  }
+#endif
+
+  if (! msg->quoted)
+    return (pyzor_digest_message (pool, cache, pyzor_mbox_data (mbox) + msg->pos, msg->len, str, len));
+
+  if (! (buf = malloc (msg->len ? msg->len : 1)))
+    return (ENOMEM);
+  cnt = pyzor_mbox_unquote (buf, pyzor_mbox_data (mbox) + msg->pos, msg->len);
+  err = pyzor_digest_message (pool, cache, buf, cnt, str, len);
+  free (buf);
+
+  return (err);
+}
+
+/* batch mode. names are collected in batches of PYZOR_BATCH_MAX, each batch
+   is spread over the worker pool and results are written in input order once
+   the whole batch is done. in mbox mode a batch holds messages from a single
+   mbox instead. */
+
+#define PYZOR_BATCH_MAX (8192)
+
+struct pyzor_walk {
+  struct pyzor_walk *up;
+  char *path;
+  struct dirent **ents;
+  int cnt;
+  int pos;
+};
+
+struct pyzor_source {
+  char **argv;
+  int argc;
+  int recurse; /* descend into directories */
+  int list; /* read names from stdin */
+  int mbox; /* files are mboxes */
+  int text; /* files are decoded text */
+  struct pyzor_walk *walk;
+};
+
+struct pyzor_batch {
+  pyzor_digest_pool_t *pool;
+  pyzor_cache_t *cache;
+  pyzor_ingest_t *ingest; /* files are read ahead, if set */
+  int text;
+  pyzor_mbox_t *mbox;
+  char *names[PYZOR_BATCH_MAX];
+  struct pyzor_mbox_msg msgs[PYZOR_BATCH_MAX];
+  unsigned char sums[PYZOR_BATCH_MAX][PYZOR_DIGEST_HEX_LEN];
+  int errs[PYZOR_BATCH_MAX];
+  size_t cnt;
+};
+
+static int
+pyzor_walk_push (struct pyzor_source *src, const char *path)
+{
+  struct pyzor_walk *walk;
+
+  if (! (walk = calloc (1, sizeof (struct pyzor_walk))))
+    return (ENOMEM);
+  if (! (walk->path = strdup (path))) {
+    free (walk);
+    return (ENOMEM);
+  }
+  /* sorted so that output order does not depend on the file system */
+  if ((walk->cnt = scandir (path, &walk->ents, NULL, alphasort)) == -1) {
+    free (walk->path);
+    free (walk);
+    return (errno);
+  }
+
+  walk->up = src->walk;
+  src->walk = walk;
+
+  return (0);
+}
+
+static void
+pyzor_walk_pop (struct pyzor_source *src)
+{
+  struct pyzor_walk *walk;
+
+  walk = src->walk;
+  src->walk = walk->up;
+
+  for (; walk->pos < walk->cnt; walk->pos++)
+    free (walk->ents[walk->pos]);
+  free (walk->ents);
+  free (walk->path);
+  free (walk);
+}
+
+/* classify path, directories are pushed on the walk stack if recursion is
+   enabled, returns 0 for regular files. symbolic links to directories are
+   only followed if path was given, not if it was found in a directory, so
+   that a link to a parent does not send the walk around in circles */
+static int
+pyzor_source_add (struct pyzor_source *src, const char *path, int walked)
+{
+  int err;
+  struct stat st;
+
+  if (stat (path, &st) == -1) {
+    fprintf (stderr, "Cannot open message `%s': %s\n", path, strerror (errno));
+    return (-1);
+  }
+
+  if (S_ISDIR (st.st_mode) && walked) {
+    if (lstat (path, &st) == -1) {
+      fprintf (stderr, "Cannot open directory `%s': %s\n", path, strerror (errno));
+      return (-1);
+    }
+    if (S_ISLNK (st.st_mode)) {
+      fprintf (stderr, "Skipping symbolic link `%s'\n", path);
+      return (-1);
+    }
+  }
+
+  if (S_ISDIR (st.st_mode)) {
+    if (! src->recurse) {
+      fprintf (stderr, "Skipping directory `%s'\n", path);
+    } else if ((err = pyzor_walk_push (src, path)) != 0) {
+      fprintf (stderr, "Cannot open directory `%s': %s\n", path, strerror (err));
+    }
+    return (-1);
+  }
+
+  return (0);
+}
+
+static char *
+pyzor_source_next (struct pyzor_source *src)
+{
+  char *path;
+  struct dirent *ent;
+  ssize_t cnt;
+  size_t len;
+
+  for (;;) {
+    if (src->walk) {
+      if (src->walk->pos == src->walk->cnt) {
+        pyzor_walk_pop (src);
+        continue;
+      }
+
+      ent = src->walk->ents[src->walk->pos++];
+      if (strcmp (ent->d_name, ".") == 0 || strcmp (ent->d_name, "..") == 0) {
+        free (ent);
+        continue;
+      }
+
+      len = strlen (src->walk->path) + strlen (ent->d_name) + 2;
+      if ((path = malloc (len)) != NULL)
+        snprintf (path, len, "%s/%s", src->walk->path, ent->d_name);
+      free (ent);
+
+      if (! path)
+        return (NULL);
+      if (pyzor_source_add (src, path, 1) == 0)
+        return (path);
+      free (path);
+
+    } else if (src->list) {
+      path = NULL;
+      len = 0;
+      if ((cnt = getline (&path, &len, stdin)) == -1) {
+        free (path);
+        src->list = 0;
+        continue;
+      }
+      for (; cnt > 0 && (path[cnt - 1] == '\n' || path[cnt - 1] == '\r'); )
+        path[--cnt] = '\0';
+      if (cnt > 0 && pyzor_source_add (src, path, 0) == 0)
+        return (path);
+      free (path);
+
+    } else if (src->argc > 0) {
+      src->argc--;
+      path = *src->argv++;
+      if (strcmp (path, "-") == 0) {
+        src->list = 1;
+      } else if (pyzor_source_add (src, path, 0) == 0) {
+        return (strdup (path));
+      }
+
+    } else {
+      return (NULL);
+    }
+  }
+}
+
+static void
+pyzor_batch_task (void *user_data, size_t idx, unsigned int thr)
+{
+  struct pyzor_batch *batch = user_data;
+
+  (void)thr;
+
+  if (batch->mbox)
+    batch->errs[idx] = pyzor_digest_range (batch->pool, batch->cache, batch->mbox, &batch->msgs[idx], batch->sums[idx], PYZOR_DIGEST_HEX_LEN);
+  else if (batch->text)
+    batch->errs[idx] = pyzor_digest_text (batch->names[idx], batch->sums[idx], PYZOR_DIGEST_HEX_LEN);
+  else
+    batch->errs[idx] = pyzor_digest_file (batch->pool, batch->cache, batch->names[idx], batch->sums[idx], PYZOR_DIGEST_HEX_LEN);
+}
+
+/* files read ahead by the ingest layer are digested in the order they
+   complete, every worker takes files until the batch is exhausted. files
+   that do not fit in a buffer are mapped as usual */
+static int
+pyzor_batch_read (struct pyzor_batch *batch, const struct pyzor_ingest_file *file)
+{
+  const char *path = batch->names[file->idx];
+  unsigned char *str = batch->sums[file->idx];
+
+  if (file->err != 0)
+    return (file->err);
+
+  if (! file->data) {
+    if (batch->text)
+      return (pyzor_digest_text (path, str, PYZOR_DIGEST_HEX_LEN));
+    return (pyzor_digest_file (batch->pool, batch->cache, path, str, PYZOR_DIGEST_HEX_LEN));
+  }
+
+  if (batch->text)
+    return (pyzor_digest_buffer (str, PYZOR_DIGEST_HEX_LEN, file->data, file->len));
+#ifdef PYZOR_GMIME
+  if (pyzor_gmime)
+    return (pyzor_digest_stream (batch->pool,
+      g_mime_stream_mem_new_with_buffer ((const char *)file->data, file->len),
+      str, PYZOR_DIGEST_HEX_LEN));
+#endif
+  return (pyzor_digest_message (batch->pool, batch->cache, file->data, file->len, str, PYZOR_DIGEST_HEX_LEN));
+}
+
+static void
+pyzor_batch_consume (void *user_data, size_t idx, unsigned int thr)
+{
+  struct pyzor_batch *batch = user_data;
+  struct pyzor_ingest_file file;
+
+  (void)idx;
+  (void)thr;
+
+  while (pyzor_ingest_next (batch->ingest, &file) == 0) {
+    batch->errs[file.idx] = pyzor_batch_read (batch, &file);
+    pyzor_ingest_done (batch->ingest, &file);
+  }
+}
+
+static void
+pyzor_batch_fill (struct pyzor_batch *batch, struct pyzor_source *src)
+{
+  char *path;
+  int err;
+
+  for (batch->cnt = 0; batch->cnt < PYZOR_BATCH_MAX; ) {
+    if (batch->mbox) {
+      if (pyzor_mbox_next (batch->mbox, &batch->msgs[batch->cnt]) == 0) {
+        batch->cnt++;
+        continue;
+      }
+      /* never mix messages from different mboxes in a single batch */
+      if (batch->cnt)
+        break;
+      pyzor_mbox_close (batch->mbox);
+      batch->mbox = NULL;
+    }
+
+    if (! (path = pyzor_source_next (src)))
+      break;
+
+    if (src->mbox) {
+      if ((err = pyzor_mbox_open (&batch->mbox, path)) != 0) {
+        fprintf (stderr, "Cannot open mbox `%s': %s\n", path, strerror (err));
+        batch->mbox = NULL;
+      }
+      free (path);
+    } else {
+      batch->names[batch->cnt++] = path;
+    }
+  }
+}
+
+static void
+pyzor_ingest_report (pyzor_ingest_t *ingest, unsigned int depth)
+{
+  struct pyzor_ingest_stats stats;
+  double secs;
+
+  pyzor_ingest_stats (ingest, &stats);
+  secs = (double)stats.ns / 1e9;
+  fprintf (stderr, "ingest: %s, depth %u, %ju files (%ju bytes, %ju larger than a buffer, %ju failed) in %.3fs, %.0f files/s\n",
+    pyzor_ingest_method (ingest), depth, (uintmax_t)stats.files,
+    (uintmax_t)stats.bytes, (uintmax_t)stats.large, (uintmax_t)stats.failed,
+    secs, secs > 0 ? (double)stats.files / secs : 0.0);
+}
+
+static int
+pyzor_batch (pyzor_digest_pool_t *digests,
+             pyzor_cache_t *cache,
+             struct pyzor_source *src,
+             unsigned int jobs,
+             unsigned int depth, /* files read ahead, zero to disable */
+             int stats)
+{
+  int err;
+  size_t cnt;
+  pyzor_pool_t *pool;
+  struct pyzor_batch *batch;
+
+  if (! (batch = calloc (1, sizeof (struct pyzor_batch))))
+    return (ENOMEM);
+  if ((err = pyzor_pool_create (&pool, jobs)) != 0) {
+    free (batch);
+    return (err);
+  }
+
+  /* mboxes are mapped as a whole */
+  if (depth > 0 && ! src->mbox &&
+      (err = pyzor_ingest_create (&batch->ingest, depth, PYZOR_INGEST_SLOT)) != 0)
+  {
+    pyzor_pool_destroy (pool);
+    free (batch);
+    return (err);
+  }
+
+  batch->pool = digests;
+  batch->cache = cache;
+  batch->text = src->text;
+
+  for (;;) {
+    pyzor_batch_fill (batch, src);
+
+    if (batch->cnt == 0)
+      break;
+
+    if (batch->ingest) {
+      pyzor_ingest_start (batch->ingest, batch->names, batch->cnt);
+      pyzor_pool_run (pool, &pyzor_batch_consume, batch, pyzor_pool_size (pool));
+    } else {
+      pyzor_pool_run (pool, &pyzor_batch_task, batch, batch->cnt);
+    }
+
+    for (cnt = 0; cnt < batch->cnt; cnt++) {
+      if (batch->mbox) {
+        if (batch->errs[cnt] == 0)
+          printf ("%s %s:%jd\n", batch->sums[cnt], pyzor_mbox_path (batch->mbox), (intmax_t)batch->msgs[cnt].off);
+        else
+          fprintf (stderr, "Cannot digest message `%s:%jd': %s\n", pyzor_mbox_path (batch->mbox), (intmax_t)batch->msgs[cnt].off, strerror (batch->errs[cnt]));
+      } else {
+        if (batch->errs[cnt] == 0)
+          printf ("%s %s\n", batch->sums[cnt], batch->names[cnt]);
+        else
+          fprintf (stderr, "Cannot digest message `%s': %s\n", batch->names[cnt], strerror (batch->errs[cnt]));
+        free (batch->names[cnt]);
+      }
+    }
+  }
+
+  for (; src->walk; )
+    pyzor_walk_pop (src);
+
+  if (batch->ingest) {
+    if (stats)
+      pyzor_ingest_report (batch->ingest, depth);
+    pyzor_ingest_destroy (batch->ingest);
+  }
+  pyzor_pool_destroy (pool);
+  free (batch);
+
+  return (0);
+}
+
+#ifdef PYZOR_GMIME
+#define PYZOR_OPTS "a:c:d:fghj:l:mPpq:rS:s:tvw:x:"
+#define PYZOR_USAGE "Usage: pyzor [-g] [-j jobs] [-q depth] [-c entries] [-d socket] [-P|-a types] [-x types]\n" \
+                    "             [-s bytes] [-p] [-v] [-r] [-m|-t] <message file|directory|-> ...\n" \
+                    "       pyzor -t [-l state] [-w state] <text file>\n" \
+                    "       pyzor [-j jobs] [-a types] [-x types] [-s bytes] [-t] -S spec [-S spec] ... <file>\n" \
+                    "       pyzor [-j jobs] [-a types] [-x types] [-s bytes] [-t] -f <file>\n"
+#else
+#define PYZOR_OPTS "a:c:d:fhj:l:mPpq:rS:s:tvw:x:"
+#define PYZOR_USAGE "Usage: pyzor [-j jobs] [-q depth] [-c entries] [-d socket] [-P|-a types] [-x types]\n" \
+                    "             [-s bytes] [-p] [-v] [-r] [-m|-t] <message file|directory|-> ...\n" \
+                    "       pyzor -t [-l state] [-w state] <text file>\n" \
+                    "       pyzor [-j jobs] [-a types] [-x types] [-s bytes] [-t] -S spec [-S spec] ... <file>\n" \
+                    "       pyzor [-j jobs] [-a types] [-x types] [-s bytes] [-t] -f <file>\n"
+#endif
+
+/* normalized lines of a part are cached if they fit in this many bytes */
+#define PYZOR_CACHE_BLOCK (16 * 1024)
+
+static void
+pyzor_cache_report (pyzor_cache_t *cache)
+{
+  struct pyzor_cache_stats stats;
+
+  pyzor_cache_stats (cache, &stats);
+  fprintf (stderr, "cache: %ju hits, %ju misses, %ju inserts, %ju evictions, %ju oversize\n",
+    (uintmax_t)stats.hits, (uintmax_t)stats.misses, (uintmax_t)stats.inserts,
+    (uintmax_t)stats.evictions, (uintmax_t)stats.oversize);
+}
+
+static void
+pyzor_policy_report (pyzor_mime_policy_t *policy)
+{
+  struct pyzor_mime_stats stats;
+
+  pyzor_mime_policy_stats (policy, &stats);
+  fprintf (stderr, "parts: %ju digested (%ju bytes), %ju skipped (%ju bytes)\n",
+    (uintmax_t)stats.parts, (uintmax_t)stats.bytes,
+    (uintmax_t)stats.skipped, (uintmax_t)stats.skipped_bytes);
+}
+
+static void
+pyzor_stats_report (pyzor_digest_pool_t *pool)
+{
+  struct pyzor_digest_stats stats;
+
+  pyzor_digest_pool_stats (pool, &stats);
+  fprintf (stderr, "input: %ju bytes in %ju updates\n",
+    (uintmax_t)stats.bytes, (uintmax_t)stats.updates);
+  fprintf (stderr, "tokens: %ju kept, %ju too long, %ju with '@' or ':', %ju tags stripped\n",
+    (uintmax_t)stats.tokens, (uintmax_t)stats.long_tokens,
+    (uintmax_t)stats.delim_tokens, (uintmax_t)stats.tags);
+  fprintf (stderr, "lines: %ju kept, %ju too short\n",
+    (uintmax_t)stats.lines, (uintmax_t)stats.short_lines);
+  fprintf (stderr, "buffer: %ju bytes copied, %ju grows moving %ju bytes, %ju index grows\n",
+    (uintmax_t)stats.copied, (uintmax_t)stats.grows, (uintmax_t)stats.moved,
+    (uintmax_t)stats.index_grows);
+  fprintf (stderr, "time: %.3fs update, %.3fs final\n",
+    (double)stats.update_ns / 1e9, (double)stats.final_ns / 1e9);
+}
+
+static void
+usage (void)
+{
+  printf (PYZOR_USAGE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct pyzor_source src;
+  pyzor_digest_pool_t *digests;
+  pyzor_cache_t *cache;
+  const char *allow, *deny, *sock;
+  long depth, entries, max;
+  int debug, stats;
+  unsigned char buf[PYZOR_DIGEST_HEX_LEN];
+  pyzor_fuzzy_t fuzzy;
+  unsigned int cnt;
+  long jobs;
+  int err, opt;
+
+  memset (&src, 0, sizeof (src));
+  allow = NULL;
+  deny = NULL;
+  sock = NULL;
+  cache = NULL;
+  entries = 0;
+  depth = PYZOR_INGEST_DEPTH;
+  max = 0;
+  debug = 0;
+  stats = 0;
+  jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt (argc, argv, PYZOR_OPTS)) != -1) {
+    switch (opt) {
+      case 'a':
+        allow = optarg;
+        break;
+      case 'c':
+        entries = strtol (optarg, NULL, 10);
+        break;
+      case 'd':
+        sock = optarg;
+        break;
+      case 'f':
+        pyzor_fingerprint = 1;
+        break;
+      case 'j':
+        jobs = strtol (optarg, NULL, 10);
+        break;
+      case 'l':
+        pyzor_state_in = optarg;
+        break;
+      case 'm':
+        src.mbox = 1;
+        break;
+      case 'P':
+        /* text parts only, like Pyzor */
+        allow = PYZOR_MIME_TEXT;
+        break;
+      case 'p':
+        stats = 1;
+        break;
+      case 'q':
+        depth = strtol (optarg, NULL, 10);
+        break;
+      case 'r':
+        src.recurse = 1;
+        break;
+      case 'S':
+        if (pyzor_nspecs == PYZOR_SPECS || pyzor_spec_parse (&pyzor_specs[pyzor_nspecs], optarg) != 0) {
+          fprintf (stderr, "Invalid digest spec `%s'\n", optarg);
+          return (1);
+        }
+        pyzor_spec_names[pyzor_nspecs++] = optarg;
+        break;
+      case 's':
+        max = strtol (optarg, NULL, 10);
+        break;
+      case 't':
+        src.text = 1;
+        break;
+      case 'v':
+        debug++;
+        break;
+      case 'w':
+        pyzor_state_out = optarg;
+        break;
+      case 'x':
+        deny = optarg;
+        break;
+#ifdef PYZOR_GMIME
+      case 'g':
+        pyzor_gmime = 1;
+        break;
+#endif
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (jobs < 1)
+    jobs = 1;
+
+  pyzor_debug_level (debug);
+  pyzor_stats_timing (stats);
+
+  if (entries > 0 && (err = pyzor_cache_create (&cache, (size_t)entries, PYZOR_CACHE_BLOCK, 0)) != 0) {
+    fprintf (stderr, "Cannot create cache: %s\n", strerror (err));
+    return (1);
+  }
+
+  if ((allow || deny || max > 0) &&
+      (err = pyzor_mime_policy_create (&pyzor_policy, allow, deny, max > 0 ? (size_t)max : 0)) != 0)
+  {
+    fprintf (stderr, "Invalid content type policy: %s\n", strerror (err));
+    return (1);
+  }
+
+  if (sock) {
+    if ((err = pyzor_daemon (sock, (unsigned int)jobs, cache, pyzor_policy)) != 0) {
+      fprintf (stderr, "Cannot serve on `%s': %s\n", sock, strerror (err));
+      return (1);
+    }
+    if (cache) {
+      pyzor_cache_report (cache);
+      pyzor_cache_destroy (cache);
+    }
+    if (pyzor_policy) {
+      pyzor_policy_report (pyzor_policy);
+      pyzor_mime_policy_destroy (pyzor_policy);
+    }
+    return (0);
+  }
+
+  if (optind == argc) {
+    usage ();
+    return (0);
+  }
+
+  src.argv = argv + optind;
+  src.argc = argc - optind;
+
+  /* pieces are single files of decoded text */
+  if ((pyzor_state_in || pyzor_state_out) &&
+      (! src.text || src.argc != 1 || src.recurse || strcmp (src.argv[0], "-") == 0))
+  {
+    usage ();
+    return (1);
+  }
+
+  /* specs and fingerprints are computed for a single file, cached lines
+     are those of the default spec */
+  if ((pyzor_nspecs && pyzor_fingerprint) ||
+      ((pyzor_nspecs || pyzor_fingerprint) &&
+       (src.argc != 1 || src.recurse || src.mbox || cache ||
+        pyzor_state_in || pyzor_state_out || strcmp (src.argv[0], "-") == 0)))
+  {
+    usage ();
+    return (1);
+  }
+
+#ifdef PYZOR_GMIME
+  /* init the gmime library */
+  if (pyzor_gmime)
+    g_mime_init (0);
+#endif
+
+  if ((err = pyzor_digest_pool_create (&digests, PYZOR_DIGEST_HWM)) != 0) {
     fprintf (stderr, "error: %s\n", strerror (err));
     return (1);
   }
 
-  g_mime_message_foreach (message, pyzor_foreach_callback, (void *)digest);
+  /* a single message is digested in place with its parts spread over the
+     workers, anything else goes through the worker pool a message at a
+     time */
+  if (src.argc == 1 && ! src.recurse && ! src.mbox && strcmp (src.argv[0], "-") != 0) {
+    if (jobs > 1 && ! src.text && (err = pyzor_pool_create (&pyzor_workers, (unsigned int)jobs)) != 0) {
+      fprintf (stderr, "error: %s\n", strerror (err));
+      return (1);
+    }
+    if (pyzor_nspecs)
+      err = pyzor_digest_specs (digests, src.argv[0], src.text);
+    else if (pyzor_fingerprint)
+      err = pyzor_digest_fuzzy (digests, src.argv[0], src.text, buf, sizeof (buf), &fuzzy);
+    else if (pyzor_state_in || pyzor_state_out)
+      err = pyzor_digest_piece (src.argv[0], buf, sizeof (buf));
+    else if (src.text)
+      err = pyzor_digest_text (src.argv[0], buf, sizeof (buf));
+    else
+      err = pyzor_digest_file (digests, cache, src.argv[0], buf, sizeof (buf));
+    if (pyzor_workers) {
+      pyzor_pool_destroy (pyzor_workers);
+      pyzor_workers = NULL;
+    }
+    if (err != 0) {
+      fprintf (stderr, "Cannot digest message `%s': %s\n", src.argv[0], strerror (err));
+      return (1);
+    }
 
-  char buf[1024];
-  pyzor_digest_final (buf, 1024, digest);
+    if (! pyzor_state_out && ! pyzor_nspecs)
+      printf ("digest: %s\n", buf);
+    if (pyzor_fingerprint) {
+      printf ("simhash: %016jx\nminhash:", (uintmax_t)fuzzy.simhash);
+      for (cnt = 0; cnt < PYZOR_FUZZY_BINS; cnt++)
+        printf (" %08jx", (uintmax_t)fuzzy.minhash[cnt]);
+      printf ("\n");
+    }
+  } else if ((err = pyzor_batch (digests, cache, &src, (unsigned int)jobs,
+                                  depth > 0 ? (unsigned int)depth : 0, stats)) != 0)
+  {
+    fprintf (stderr, "error: %s\n", strerror (err));
+    return (1);
+  }
 
-  printf ("digest: %s\n", buf);
+  if (stats)
+    pyzor_stats_report (digests);
+  pyzor_digest_pool_destroy (digests);
+  if (cache) {
+    pyzor_cache_report (cache);
+    pyzor_cache_destroy (cache);
+  }
+  if (pyzor_policy) {
+    pyzor_policy_report (pyzor_policy);
+    pyzor_mime_policy_destroy (pyzor_policy);
+  }
 
   return (0);
 }
-
@@ -1,3 +1,18 @@
 #!/bin/sh
 
-gcc -g -O0 -DPYZOR_DEBUG -o pyzor pyzor.c main.c `pkg-config --cflags --libs gmime-2.6`
+# gmime is optional, messages are parsed by the built-in walker by default
+GMIME=""
+if pkg-config --exists gmime-2.6 2>/dev/null; then
+  GMIME="-DPYZOR_GMIME `pkg-config --cflags --libs gmime-2.6`"
+fi
+
+gcc -g -O0 -DPYZOR_DEBUG -pthread -o pyzor pyzor.c pool.c mbox.c mime.c cache.c daemon.c ingest.c fuzzy.c main.c $GMIME
+gcc -g -O0 -DPYZOR_DEBUG -pthread -o pyzor-db db.c dbtool.c
+gcc -g -O0 -DPYZOR_DEBUG -pthread -o pyzor-client pyzor.c client.c clienttool.c
+gcc -g -O0 -DPYZOR_DEBUG -pthread -o pyzord pyzor.c server.c pyzord.c
+gcc -g -O0 -DPYZOR_DEBUG -pthread -o pyzor-load pyzor.c client.c loadtool.c
+
+# python extension, see setup.py
+if command -v python3-config >/dev/null 2>&1; then
+  gcc -g -O0 -DPYZOR_DEBUG -pthread -shared -fPIC `python3-config --includes` -o cpyzor`python3-config --extension-suffix` pyzor.c pool.c mime.c cpyzor.c
+fi
@@ -0,0 +1,217 @@
+#define _GNU_SOURCE /* memmem */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mbox.h"
+
+/* messages are separated by lines starting with "From ". lines in the body
+   that start with "From " are quoted with one or more '>' characters
+   (mboxrd), one level of quoting is removed again before digesting. */
+
+#define PYZOR_MBOX_FROM "From "
+#define PYZOR_MBOX_FROM_LEN (sizeof (PYZOR_MBOX_FROM) - 1)
+
+struct pyzor_mbox {
+  char *path;
+  unsigned char *map;
+  size_t len; /* size of mapping */
+  size_t pos; /* offset of next From_ line */
+  int fd;
+};
+
+static const unsigned char *pyzor_mbox_find (const unsigned char *, size_t);
+static int pyzor_mbox_is_quoted (const unsigned char *, size_t);
+
+int
+pyzor_mbox_open (pyzor_mbox_t **mbox, const char *path)
+{
+  int err;
+  pyzor_mbox_t *ptr;
+  struct stat st;
+
+  assert (mbox);
+  assert (path);
+
+  if (! (ptr = calloc (1, sizeof (pyzor_mbox_t))))
+    return (ENOMEM);
+
+  ptr->fd = -1;
+  if (! (ptr->path = strdup (path))) {
+    err = ENOMEM;
+    goto error;
+  }
+  if ((ptr->fd = open (path, O_RDONLY, 0)) == -1 || fstat (ptr->fd, &st) == -1) {
+    err = errno;
+    goto error;
+  }
+  if (! S_ISREG (st.st_mode)) {
+    err = EINVAL;
+    goto error;
+  }
+
+  ptr->len = (size_t)st.st_size;
+  if (ptr->len) {
+    ptr->map = mmap (NULL, ptr->len, PROT_READ, MAP_PRIVATE, ptr->fd, 0);
+    if (ptr->map == MAP_FAILED) {
+      ptr->map = NULL;
+      err = errno;
+      goto error;
+    }
+    (void)madvise (ptr->map, ptr->len, MADV_SEQUENTIAL);
+  }
+
+  /* anything before the first From_ line is not a message */
+  if (ptr->len < PYZOR_MBOX_FROM_LEN ||
+      memcmp (ptr->map, PYZOR_MBOX_FROM, PYZOR_MBOX_FROM_LEN) != 0)
+  {
+    const unsigned char *sep = pyzor_mbox_find (ptr->map, ptr->len);
+    ptr->pos = sep ? (size_t)(sep - ptr->map) : ptr->len;
+  }
+
+  *mbox = ptr;
+
+  return (0);
+error:
+  pyzor_mbox_close (ptr);
+  return (err);
+}
+
+void
+pyzor_mbox_close (pyzor_mbox_t *mbox)
+{
+  assert (mbox);
+
+  if (mbox) {
+    if (mbox->map)
+      munmap (mbox->map, mbox->len);
+    if (mbox->fd != -1)
+      close (mbox->fd);
+    if (mbox->path)
+      free (mbox->path);
+    memset (mbox, 0, sizeof (pyzor_mbox_t));
+    free (mbox);
+  }
+}
+
+int
+pyzor_mbox_fd (pyzor_mbox_t *mbox)
+{
+  assert (mbox);
+
+  return (mbox->fd);
+}
+
+const char *
+pyzor_mbox_path (pyzor_mbox_t *mbox)
+{
+  assert (mbox);
+
+  return (mbox->path);
+}
+
+const unsigned char *
+pyzor_mbox_data (pyzor_mbox_t *mbox)
+{
+  assert (mbox);
+
+  return (mbox->map);
+}
+
+/* find next From_ line, must be preceded by a newline */
+static const unsigned char *
+pyzor_mbox_find (const unsigned char *str, size_t len)
+{
+  const unsigned char *ptr;
+
+  ptr = memmem (str, len, "\n" PYZOR_MBOX_FROM, PYZOR_MBOX_FROM_LEN + 1);
+  return (ptr ? ptr + 1 : NULL);
+}
+
+/* str points to a newline */
+static int
+pyzor_mbox_is_quoted (const unsigned char *str, size_t len)
+{
+  size_t pos;
+
+  for (pos = 1; pos < len && str[pos] == '>'; pos++)
+    ;
+
+  return (pos > 1 && len - pos >= PYZOR_MBOX_FROM_LEN &&
+          memcmp (str + pos, PYZOR_MBOX_FROM, PYZOR_MBOX_FROM_LEN) == 0);
+}
+
+int
+pyzor_mbox_next (pyzor_mbox_t *mbox, struct pyzor_mbox_msg *msg)
+{
+  const unsigned char *ptr, *sep, *lim;
+  size_t pos;
+
+  assert (mbox);
+  assert (msg);
+
+  if (mbox->pos >= mbox->len)
+    return (ENOENT);
+
+  /* skip From_ line */
+  pos = mbox->pos;
+  ptr = memchr (mbox->map + pos, '\n', mbox->len - pos);
+  ptr = ptr ? ptr + 1 : mbox->map + mbox->len;
+  lim = mbox->map + mbox->len;
+
+  if (! (sep = pyzor_mbox_find (ptr - 1, (size_t)(lim - (ptr - 1)))))
+    sep = lim;
+
+  msg->off = (off_t)pos;
+  msg->pos = (off_t)(ptr - mbox->map);
+  msg->len = (size_t)(sep - ptr);
+  msg->quoted = 0;
+
+  /* quoted lines are rare, the message is only copied if it has any */
+  for (ptr = ptr - 1; ptr < sep; ptr++) {
+    if (! (ptr = memmem (ptr, (size_t)(sep - ptr), "\n>", 2)))
+      break;
+    if (pyzor_mbox_is_quoted (ptr, (size_t)(sep - ptr))) {
+      msg->quoted = 1;
+      break;
+    }
+  }
+
+  mbox->pos = (size_t)(sep - mbox->map);
+
+  return (0);
+}
+
+/* remove one level of quoting from >From_ lines, dst must be at least len
+   bytes. returns number of bytes written */
+size_t
+pyzor_mbox_unquote (unsigned char *dst, const unsigned char *src, size_t len)
+{
+  size_t cnt, pos;
+  int bol;
+
+  assert (dst);
+  assert (src);
+
+  /* message always starts at the beginning of a line */
+  for (bol = 1, cnt = 0, pos = 0; pos < len; pos++) {
+    if (bol && src[pos] == '>') {
+      size_t end;
+      for (end = pos; end < len && src[end] == '>'; end++)
+        ;
+      if (len - end >= PYZOR_MBOX_FROM_LEN &&
+          memcmp (src + end, PYZOR_MBOX_FROM, PYZOR_MBOX_FROM_LEN) == 0)
+        pos++;
+    }
+    dst[cnt++] = src[pos];
+    bol = (src[pos] == '\n');
+  }
+
+  return (cnt);
+}
@@ -0,0 +1,24 @@
+#ifndef PYZOR_MBOX_H_INCLUDED
+#define PYZOR_MBOX_H_INCLUDED
+
+#include <sys/types.h>
+
+typedef struct pyzor_mbox pyzor_mbox_t;
+
+struct pyzor_mbox_msg {
+  off_t off; /* offset of From_ line */
+  off_t pos; /* offset of message, first byte after From_ line */
+  size_t len; /* length of message */
+  int quoted; /* message contains >From_ lines */
+};
+
+int pyzor_mbox_open (pyzor_mbox_t **, const char *);
+void pyzor_mbox_close (pyzor_mbox_t *);
+int pyzor_mbox_next (pyzor_mbox_t *, struct pyzor_mbox_msg *);
+int pyzor_mbox_fd (pyzor_mbox_t *);
+const char *pyzor_mbox_path (pyzor_mbox_t *);
+const unsigned char *pyzor_mbox_data (pyzor_mbox_t *);
+size_t pyzor_mbox_unquote (unsigned char *, const unsigned char *, size_t);
+
+#endif
+
@@ -0,0 +1,1141 @@
+#define _GNU_SOURCE /* memmem */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#if ! defined (PYZOR_NO_SIMD) && defined (__GNUC__) && \
+    (defined (__x86_64__) || defined (__i386__))
+# define PYZOR_MIME_X86 (1)
+# include <immintrin.h>
+#endif
+
+#include "mime.h"
+#include "pool.h"
+#include "pyzor.h"
+
+/* minimal MIME walker. only Content-Type (and its boundary parameter) and
+   Content-Transfer-Encoding are looked at, leaf parts are reported as byte
+   ranges of the message. like g_mime_message_foreach, embedded messages
+   (message/rfc822) are not descended into. */
+
+/* multiparts nested deeper than this are not descended into */
+#define PYZOR_MIME_DEPTH_MAX (32)
+
+/* size of the buffer decoded bodies are passed to the digest in */
+#define PYZOR_MIME_BUFLEN (4096)
+
+#define pyzor_mime_isblank(c) ((c) == ' ' || (c) == '\t')
+#define pyzor_mime_isspace(c) \
+  ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+struct pyzor_mime_head {
+  const unsigned char *ctype; /* Content-Type value */
+  size_t ctypelen;
+  const unsigned char *cte; /* Content-Transfer-Encoding value */
+  size_t ctelen;
+};
+
+#define PYZOR_MIME_CTYPE "content-type"
+#define PYZOR_MIME_CTE "content-transfer-encoding"
+
+static int pyzor_mime_walk_part (const unsigned char *, size_t, int,
+  unsigned int, pyzor_mime_func_t, void *);
+
+static int
+pyzor_mime_eq (const unsigned char *str, size_t len, const char *name)
+{
+  return (len == strlen (name) && strncasecmp ((const char *)str, name, len) == 0);
+}
+
+/* collect headers of interest, returns offset of body */
+static size_t
+pyzor_mime_headers (const unsigned char *str,
+                    size_t len,
+                    struct pyzor_mime_head *head)
+{
+  const unsigned char *eol, *sep, **val;
+  size_t end, name, pos, *vallen;
+
+  memset (head, 0, sizeof (struct pyzor_mime_head));
+  val = NULL;
+  vallen = NULL;
+
+  for (pos = 0; pos < len; pos = eol ? end + 1 : len) {
+    eol = memchr (str + pos, '\n', len - pos);
+    end = eol ? (size_t)(eol - str) : len;
+
+    /* empty line separates headers from body */
+    if (end == pos || (end == pos + 1 && str[pos] == '\r'))
+      return (eol ? end + 1 : len);
+
+    if (pyzor_mime_isblank (str[pos])) {
+      /* folded header */
+      if (val)
+        *vallen = end - (size_t)(*val - str);
+      continue;
+    }
+
+    val = NULL;
+    vallen = NULL;
+    if (! (sep = memchr (str + pos, ':', end - pos)))
+      continue;
+
+    for (name = (size_t)(sep - str); name > pos && pyzor_mime_isblank (str[name - 1]); name--)
+      ;
+    if (pyzor_mime_eq (str + pos, name - pos, PYZOR_MIME_CTYPE)) {
+      val = &head->ctype;
+      vallen = &head->ctypelen;
+    } else if (pyzor_mime_eq (str + pos, name - pos, PYZOR_MIME_CTE)) {
+      val = &head->cte;
+      vallen = &head->ctelen;
+    }
+
+    if (val) {
+      *val = sep + 1;
+      *vallen = end - (size_t)(*val - str);
+    }
+  }
+
+  return (len);
+}
+
+static size_t
+pyzor_mime_skip_space (const unsigned char *str, size_t len, size_t pos)
+{
+  for (; pos < len && pyzor_mime_isspace (str[pos]); pos++)
+    ;
+  return (pos);
+}
+
+static size_t
+pyzor_mime_token (const unsigned char *str, size_t len, size_t pos)
+{
+  for (; pos < len && ! pyzor_mime_isspace (str[pos]) &&
+         str[pos] != '/' && str[pos] != ';' && str[pos] != '=' &&
+         str[pos] != '"'; pos++)
+    ;
+  return (pos);
+}
+
+/* parse type/subtype and boundary parameter from Content-Type value */
+static void
+pyzor_mime_ctype (const unsigned char *str,
+                  size_t len,
+                  struct pyzor_mime_part *part,
+                  const unsigned char **bnd,
+                  size_t *bndlen)
+{
+  size_t end, name, namelen, pos;
+
+  *bnd = NULL;
+  *bndlen = 0;
+
+  pos = pyzor_mime_skip_space (str, len, 0);
+  end = pyzor_mime_token (str, len, pos);
+  if (end == pos || end == len || str[end] != '/')
+    return;
+
+  part->type = str + pos;
+  part->typelen = end - pos;
+  pos = end + 1;
+  end = pyzor_mime_token (str, len, pos);
+  part->subtype = str + pos;
+  part->subtypelen = end - pos;
+
+  /* parameters */
+  for (pos = end; pos < len; ) {
+    const unsigned char *ptr = memchr (str + pos, ';', len - pos);
+    if (! ptr)
+      break;
+    pos = pyzor_mime_skip_space (str, len, (size_t)(ptr - str) + 1);
+    name = pos;
+    pos = pyzor_mime_token (str, len, pos);
+    namelen = pos - name;
+    pos = pyzor_mime_skip_space (str, len, pos);
+    if (pos == len || str[pos] != '=')
+      continue;
+    pos = pyzor_mime_skip_space (str, len, pos + 1);
+
+    if (pos < len && str[pos] == '"') {
+      for (end = ++pos; end < len && str[end] != '"'; end++) {
+        if (str[end] == '\\' && end + 1 < len)
+          end++;
+      }
+    } else {
+      end = pyzor_mime_token (str, len, pos);
+    }
+
+    if (pyzor_mime_eq (str + name, namelen, "boundary") && end > pos) {
+      *bnd = str + pos;
+      *bndlen = end - pos;
+    }
+    pos = end;
+  }
+}
+
+static pyzor_mime_encoding_t
+pyzor_mime_cte (const unsigned char *str, size_t len)
+{
+  size_t end, pos;
+
+  pos = pyzor_mime_skip_space (str, len, 0);
+  for (end = len; end > pos && pyzor_mime_isspace (str[end - 1]); end--)
+    ;
+
+  if (pyzor_mime_eq (str + pos, end - pos, "base64"))
+    return (pyzor_mime_base64);
+  if (pyzor_mime_eq (str + pos, end - pos, "quoted-printable"))
+    return (pyzor_mime_quoted_printable);
+  return (pyzor_mime_identity);
+}
+
+/* offset of the "--" that starts the next delimiter line, or len */
+static size_t
+pyzor_mime_delim (const unsigned char *str,
+                  size_t len,
+                  size_t pos,
+                  const unsigned char *bnd,
+                  size_t bndlen)
+{
+  const unsigned char *ptr;
+  size_t off;
+
+  for (; pos < len; pos = off + 1) {
+    if (! (ptr = memmem (str + pos, len - pos, bnd, bndlen)))
+      break;
+    off = (size_t)(ptr - str);
+    if (off >= 2 && str[off - 1] == '-' && str[off - 2] == '-' &&
+        (off == 2 || str[off - 3] == '\n'))
+      return (off - 2);
+  }
+
+  return (len);
+}
+
+static int
+pyzor_mime_walk_multipart (const unsigned char *str,
+                           size_t len,
+                           const unsigned char *bnd,
+                           size_t bndlen,
+                           int digest,
+                           unsigned int depth,
+                           pyzor_mime_func_t func,
+                           void *user_data)
+{
+  const unsigned char *eol;
+  size_t end, pos, next, start;
+  int err;
+
+  /* preamble is ignored */
+  for (pos = pyzor_mime_delim (str, len, 0, bnd, bndlen); pos < len; pos = next) {
+    start = pos + 2 + bndlen;
+    /* close delimiter, epilogue is ignored */
+    if (len - start >= 2 && str[start] == '-' && str[start + 1] == '-')
+      break;
+
+    eol = memchr (str + start, '\n', len - start);
+    start = eol ? (size_t)(eol - str) + 1 : len;
+    next = pyzor_mime_delim (str, len, start, bnd, bndlen);
+
+    /* line break preceding the delimiter belongs to the delimiter */
+    end = next;
+    if (next < len) {
+      if (end > start && str[end - 1] == '\n')
+        end--;
+      if (end > start && str[end - 1] == '\r')
+        end--;
+    }
+
+    err = pyzor_mime_walk_part (str + start, end - start, digest, depth + 1,
+                                func, user_data);
+    if (err != 0)
+      return (err);
+  }
+
+  return (0);
+}
+
+static int
+pyzor_mime_walk_part (const unsigned char *str,
+                      size_t len,
+                      int digest, /* part of multipart/digest */
+                      unsigned int depth,
+                      pyzor_mime_func_t func,
+                      void *user_data)
+{
+  const unsigned char *bnd;
+  size_t bndlen, pos;
+  struct pyzor_mime_head head;
+  struct pyzor_mime_part part;
+
+  pos = pyzor_mime_headers (str, len, &head);
+
+  memset (&part, 0, sizeof (struct pyzor_mime_part));
+  bnd = NULL;
+  bndlen = 0;
+  if (head.ctype)
+    pyzor_mime_ctype (head.ctype, head.ctypelen, &part, &bnd, &bndlen);
+  if (! part.type) {
+    part.type = (const unsigned char *)(digest ? "message" : "text");
+    part.typelen = strlen ((const char *)part.type);
+    part.subtype = (const unsigned char *)(digest ? "rfc822" : "plain");
+    part.subtypelen = strlen ((const char *)part.subtype);
+  }
+
+  if (pyzor_mime_eq (part.type, part.typelen, "multipart") && bnd) {
+    if (depth >= PYZOR_MIME_DEPTH_MAX)
+      return (0);
+    return (pyzor_mime_walk_multipart (
+      str + pos, len - pos, bnd, bndlen,
+      pyzor_mime_eq (part.subtype, part.subtypelen, "digest"),
+      depth, func, user_data));
+  }
+
+  if (pyzor_mime_eq (part.type, part.typelen, "message") &&
+      (pyzor_mime_eq (part.subtype, part.subtypelen, "rfc822") ||
+       pyzor_mime_eq (part.subtype, part.subtypelen, "news") ||
+       pyzor_mime_eq (part.subtype, part.subtypelen, "global")))
+    return (0);
+
+  if (head.cte)
+    part.encoding = pyzor_mime_cte (head.cte, head.ctelen);
+  part.body = str + pos;
+  part.len = len - pos;
+
+  return (func (user_data, &part));
+}
+
+int
+pyzor_mime_walk (const unsigned char *str,
+                 size_t len,
+                 pyzor_mime_func_t func,
+                 void *user_data)
+{
+  assert (str || ! len);
+  assert (func);
+
+  if (! str)
+    str = (const unsigned char *)"";
+
+  return (pyzor_mime_walk_part (str, len, 0, 0, func, user_data));
+}
+
+/* content type policy. both lists are kept in a single copy, entries point
+   into it. deny entries follow allow entries. counters are shared by all
+   threads that use the policy and are updated atomically. */
+
+struct pyzor_mime_type {
+  const char *type; /* "*" matches any type */
+  const char *subtype; /* "*" matches any subtype */
+};
+
+struct pyzor_mime_policy {
+  char *str;
+  struct pyzor_mime_type *types;
+  size_t nallow;
+  size_t ndeny;
+  size_t max; /* zero for no limit */
+  struct pyzor_mime_stats stats;
+};
+
+#define PYZOR_MIME_SEP ", \t\r\n"
+
+static size_t
+pyzor_mime_policy_count (const char *str)
+{
+  size_t cnt, pos;
+
+  for (cnt = 0, pos = 0; str && str[pos]; cnt++) {
+    pos += strspn (str + pos, PYZOR_MIME_SEP);
+    if (! str[pos])
+      break;
+    pos += strcspn (str + pos, PYZOR_MIME_SEP);
+  }
+
+  return (cnt);
+}
+
+/* split a list into entries, str is modified in place */
+static int
+pyzor_mime_policy_parse (struct pyzor_mime_type *types, char *str)
+{
+  char *ptr, *sub, *tok;
+  size_t cnt;
+
+  for (cnt = 0, tok = strtok_r (str, PYZOR_MIME_SEP, &ptr); tok;
+       cnt++, tok = strtok_r (NULL, PYZOR_MIME_SEP, &ptr))
+  {
+    if ((sub = strchr (tok, '/'))) {
+      *sub++ = '\0';
+      if (! *sub || strchr (sub, '/') || strcmp (tok, "*") == 0)
+        return (EINVAL);
+    } else {
+      sub = "*";
+    }
+    if (! *tok)
+      return (EINVAL);
+    types[cnt].type = tok;
+    types[cnt].subtype = sub;
+  }
+
+  return (0);
+}
+
+int
+pyzor_mime_policy_create (pyzor_mime_policy_t **policy,
+                          const char *allow, /* NULL to allow all */
+                          const char *deny, /* NULL to deny none */
+                          size_t max) /* zero for no limit */
+{
+  pyzor_mime_policy_t *ptr;
+  size_t len;
+  int err;
+
+  assert (policy);
+
+  if (! (ptr = calloc (1, sizeof (pyzor_mime_policy_t))))
+    return (ENOMEM);
+
+  ptr->nallow = pyzor_mime_policy_count (allow);
+  ptr->ndeny = pyzor_mime_policy_count (deny);
+  ptr->max = max;
+
+  len = (allow ? strlen (allow) : 0) + 1 + (deny ? strlen (deny) : 0) + 1;
+  if (! (ptr->str = malloc (len)) ||
+      ! (ptr->types = calloc (ptr->nallow + ptr->ndeny + 1, sizeof (struct pyzor_mime_type))))
+  {
+    pyzor_mime_policy_destroy (ptr);
+    return (ENOMEM);
+  }
+
+  len = strlen (strcpy (ptr->str, allow ? allow : "")) + 1;
+  strcpy (ptr->str + len, deny ? deny : "");
+  if ((err = pyzor_mime_policy_parse (ptr->types, ptr->str)) != 0 ||
+      (err = pyzor_mime_policy_parse (ptr->types + ptr->nallow, ptr->str + len)) != 0)
+  {
+    pyzor_mime_policy_destroy (ptr);
+    return (err);
+  }
+
+  *policy = ptr;
+
+  return (0);
+}
+
+void
+pyzor_mime_policy_destroy (pyzor_mime_policy_t *policy)
+{
+  assert (policy);
+
+  if (policy) {
+    if (policy->str)
+      free (policy->str);
+    if (policy->types)
+      free (policy->types);
+    memset (policy, 0, sizeof (pyzor_mime_policy_t));
+    free (policy);
+  }
+}
+
+static int
+pyzor_mime_policy_match (const struct pyzor_mime_type *types,
+                         size_t cnt,
+                         const struct pyzor_mime_part *part)
+{
+  for (; cnt > 0; cnt--, types++) {
+    if ((strcmp (types->type, "*") == 0 ||
+         pyzor_mime_eq (part->type, part->typelen, types->type)) &&
+        (strcmp (types->subtype, "*") == 0 ||
+         pyzor_mime_eq (part->subtype, part->subtypelen, types->subtype)))
+      return (1);
+  }
+
+  return (0);
+}
+
+/* returns non-zero if the part is to be digested */
+int
+pyzor_mime_policy_check (pyzor_mime_policy_t *policy,
+                         const struct pyzor_mime_part *part)
+{
+  int ok;
+
+  assert (part);
+
+  if (! policy)
+    return (1);
+
+  ok = (policy->max == 0 || part->len <= policy->max) &&
+       ! pyzor_mime_policy_match (policy->types + policy->nallow, policy->ndeny, part) &&
+       (policy->nallow == 0 || pyzor_mime_policy_match (policy->types, policy->nallow, part));
+
+  if (ok) {
+    __atomic_fetch_add (&policy->stats.parts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&policy->stats.bytes, part->len, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add (&policy->stats.skipped, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&policy->stats.skipped_bytes, part->len, __ATOMIC_RELAXED);
+  }
+
+  return (ok);
+}
+
+void
+pyzor_mime_policy_stats (pyzor_mime_policy_t *policy, struct pyzor_mime_stats *stats)
+{
+  assert (policy);
+  assert (stats);
+
+  stats->parts = __atomic_load_n (&policy->stats.parts, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n (&policy->stats.bytes, __ATOMIC_RELAXED);
+  stats->skipped = __atomic_load_n (&policy->stats.skipped, __ATOMIC_RELAXED);
+  stats->skipped_bytes = __atomic_load_n (&policy->stats.skipped_bytes, __ATOMIC_RELAXED);
+}
+
+static const unsigned char pyzor_mime_base64_rank[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+    52,   53,   54,   55,   56,   57,   58,   59,
+    60,   61, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
+  0xff,    0,    1,    2,    3,    4,    5,    6,
+     7,    8,    9,   10,   11,   12,   13,   14,
+    15,   16,   17,   18,   19,   20,   21,   22,
+    23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff,   26,   27,   28,   29,   30,   31,   32,
+    33,   34,   35,   36,   37,   38,   39,   40,
+    41,   42,   43,   44,   45,   46,   47,   48,
+    49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff
+  /* the upper 128 are all 0xff */
+  , 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+#define PYZOR_MIME_BASE64_PAD (0xfe)
+
+/* bodies are decoded in blocks that stay in the first level cache, every
+   block is passed to the normalizer before the next one is decoded. the
+   decoded body never exists as a whole and the decoder state is kept in
+   struct pyzor_mime_decoder, so that a body can also be fed in pieces. */
+
+/* vector decoders take whole blocks of alphabet characters only, padding,
+   line breaks and anything else is left to the scalar loop. they return the
+   number of input bytes decoded and may write up to eight bytes past the
+   decoded output. without one, everything is decoded by the scalar loop. */
+typedef size_t (*pyzor_mime_base64_func_t) (const unsigned char *, size_t, unsigned char *);
+
+#define PYZOR_MIME_BASE64_SLACK (8)
+
+#if PYZOR_MIME_X86
+/* classification and translation as described by Wojciech Muła and Daniel
+   Lemire in "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+   the low and high nibble of every byte index two tables, a byte is in the
+   alphabet if the entries have no bits in common */
+#define PYZOR_MIME_BASE64_LUT_LO \
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+  0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define PYZOR_MIME_BASE64_LUT_HI \
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define PYZOR_MIME_BASE64_LUT_ROLL \
+  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+
+/* one block of sixteen characters, inlined into both decoders so that the
+   avx2 decoder does not mix in legacy sse encoded instructions */
+__attribute__ ((target ("ssse3"), always_inline))
+static inline int
+pyzor_mime_base64_block (const unsigned char *str, unsigned char *out)
+{
+  const __m128i lut_lo = _mm_setr_epi8 (PYZOR_MIME_BASE64_LUT_LO);
+  const __m128i lut_hi = _mm_setr_epi8 (PYZOR_MIME_BASE64_LUT_HI);
+  const __m128i lut_roll = _mm_setr_epi8 (PYZOR_MIME_BASE64_LUT_ROLL);
+  const __m128i nibble = _mm_set1_epi8 (0x0f);
+  const __m128i pack = _mm_setr_epi8 (
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m128i vec, hi, lo, roll;
+
+  vec = _mm_loadu_si128 ((const __m128i *)str);
+  hi = _mm_and_si128 (_mm_srli_epi32 (vec, 4), nibble);
+  lo = _mm_and_si128 (vec, nibble);
+  lo = _mm_and_si128 (_mm_shuffle_epi8 (lut_lo, lo), _mm_shuffle_epi8 (lut_hi, hi));
+  if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (lo, _mm_setzero_si128 ())) != 0xffff)
+    return (0);
+  roll = _mm_shuffle_epi8 (lut_roll,
+    _mm_add_epi8 (_mm_cmpeq_epi8 (vec, _mm_set1_epi8 ('/')), hi));
+  vec = _mm_add_epi8 (vec, roll);
+  /* four sextets to three bytes */
+  vec = _mm_maddubs_epi16 (vec, _mm_set1_epi32 (0x01400140));
+  vec = _mm_madd_epi16 (vec, _mm_set1_epi32 (0x00011000));
+  vec = _mm_shuffle_epi8 (vec, pack);
+  _mm_storeu_si128 ((__m128i *)out, vec);
+
+  return (1);
+}
+
+__attribute__ ((target ("ssse3")))
+static size_t
+pyzor_mime_base64_ssse3 (const unsigned char *str, size_t len, unsigned char *out)
+{
+  size_t pos;
+
+  for (pos = 0; len - pos >= 16; pos += 16) {
+    if (! pyzor_mime_base64_block (str + pos, out + (pos / 4) * 3))
+      break;
+  }
+
+  return (pos);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t
+pyzor_mime_base64_avx2 (const unsigned char *str, size_t len, unsigned char *out)
+{
+  const __m256i lut_lo = _mm256_setr_epi8 (
+    PYZOR_MIME_BASE64_LUT_LO, PYZOR_MIME_BASE64_LUT_LO);
+  const __m256i lut_hi = _mm256_setr_epi8 (
+    PYZOR_MIME_BASE64_LUT_HI, PYZOR_MIME_BASE64_LUT_HI);
+  const __m256i lut_roll = _mm256_setr_epi8 (
+    PYZOR_MIME_BASE64_LUT_ROLL, PYZOR_MIME_BASE64_LUT_ROLL);
+  const __m256i nibble = _mm256_set1_epi8 (0x0f);
+  const __m256i pack = _mm256_setr_epi8 (
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m256i vec, hi, lo, roll;
+  size_t pos;
+
+  for (pos = 0; len - pos >= 32; pos += 32) {
+    vec = _mm256_loadu_si256 ((const __m256i *)(str + pos));
+    hi = _mm256_and_si256 (_mm256_srli_epi32 (vec, 4), nibble);
+    lo = _mm256_and_si256 (vec, nibble);
+    if (! _mm256_testz_si256 (_mm256_shuffle_epi8 (lut_lo, lo), _mm256_shuffle_epi8 (lut_hi, hi)))
+      break;
+    roll = _mm256_shuffle_epi8 (lut_roll,
+      _mm256_add_epi8 (_mm256_cmpeq_epi8 (vec, _mm256_set1_epi8 ('/')), hi));
+    vec = _mm256_add_epi8 (vec, roll);
+    vec = _mm256_maddubs_epi16 (vec, _mm256_set1_epi32 (0x01400140));
+    vec = _mm256_madd_epi16 (vec, _mm256_set1_epi32 (0x00011000));
+    vec = _mm256_shuffle_epi8 (vec, pack);
+    /* twelve bytes per lane, moved together */
+    vec = _mm256_permutevar8x32_epi32 (vec, _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 7, 7));
+    _mm256_storeu_si256 ((__m256i *)(out + (pos / 4) * 3), vec);
+  }
+
+  /* finish with a smaller block if one fits */
+  if (len - pos >= 16 && pyzor_mime_base64_block (str + pos, out + (pos / 4) * 3))
+    pos += 16;
+
+  return (pos);
+}
+#endif
+
+static int pyzor_mime_base64_init = 0;
+static pyzor_mime_base64_func_t pyzor_mime_base64_func = NULL;
+
+static pyzor_mime_base64_func_t
+pyzor_mime_base64_get (void)
+{
+  pyzor_mime_base64_func_t func;
+
+  /* selection is idempotent, racing threads store the same value */
+  if (__atomic_load_n (&pyzor_mime_base64_init, __ATOMIC_ACQUIRE))
+    return (__atomic_load_n (&pyzor_mime_base64_func, __ATOMIC_RELAXED));
+
+  func = NULL;
+#if PYZOR_MIME_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    func = &pyzor_mime_base64_avx2;
+  else if (__builtin_cpu_supports ("ssse3"))
+    func = &pyzor_mime_base64_ssse3;
+#endif
+
+  __atomic_store_n (&pyzor_mime_base64_func, func, __ATOMIC_RELAXED);
+  __atomic_store_n (&pyzor_mime_base64_init, 1, __ATOMIC_RELEASE);
+  return (func);
+}
+
+void
+pyzor_mime_decoder_init (struct pyzor_mime_decoder *dec, pyzor_mime_encoding_t encoding)
+{
+  assert (dec);
+
+  memset (dec, 0, sizeof (*dec));
+  dec->encoding = encoding;
+}
+
+/* characters outside of the alphabet are skipped, padding ends a quantum */
+static int
+pyzor_mime_decode_base64 (struct pyzor_mime_decoder *dec,
+                          pyzor_digest_t *digest,
+                          const unsigned char *str,
+                          size_t len,
+                          int eom)
+{
+  unsigned char buf[PYZOR_MIME_BUFLEN];
+  pyzor_mime_base64_func_t func;
+  unsigned char rank;
+  uint32_t acc;
+  size_t cnt, num, pos;
+  int err, vec;
+
+  func = pyzor_mime_base64_get ();
+  vec = func != NULL;
+  acc = dec->acc;
+  num = dec->num;
+  cnt = 0;
+
+  for (pos = 0; pos < len; pos++) {
+    /* a block is passed on once fewer than a vector store worth of bytes
+       is left, checked whenever a quantum is complete */
+    if (num == 0 && PYZOR_MIME_BUFLEN - cnt < 64) {
+      if ((err = pyzor_digest_update (digest, buf, cnt, 0)) != 0)
+        return (err);
+      cnt = 0;
+    }
+
+    /* whole quanta are handed to the vector decoder. it stops at the block
+       with the next line break or padding, the rest of that line is left
+       to the scalar loop */
+    if (vec && num == 0 && pyzor_mime_base64_rank[str[pos]] < 64) {
+      num = ((PYZOR_MIME_BUFLEN - cnt - PYZOR_MIME_BASE64_SLACK) / 3) * 4;
+      num = func (str + pos, len - pos < num ? len - pos : num, buf + cnt);
+      cnt += (num / 4) * 3;
+      pos += num;
+      num = 0;
+      vec = 0;
+      if (pos == len)
+        break;
+    }
+
+    rank = pyzor_mime_base64_rank[str[pos]];
+    if (rank == 0xff) {
+      vec = func != NULL;
+      continue;
+    }
+
+    if (rank == PYZOR_MIME_BASE64_PAD) {
+      vec = func != NULL;
+      if (num == 2) {
+        buf[cnt++] = (unsigned char)(acc >> 4);
+      } else if (num == 3) {
+        buf[cnt++] = (unsigned char)(acc >> 10);
+        buf[cnt++] = (unsigned char)(acc >> 2);
+      }
+      acc = 0;
+      num = 0;
+    } else {
+      acc = (acc << 6) | rank;
+      if (++num == 4) {
+        buf[cnt++] = (unsigned char)(acc >> 16);
+        buf[cnt++] = (unsigned char)(acc >> 8);
+        buf[cnt++] = (unsigned char)(acc);
+        acc = 0;
+        num = 0;
+      }
+    }
+  }
+
+  /* bits of an incomplete quantum at the end of the part are dropped */
+  dec->acc = eom ? 0 : acc;
+  dec->num = eom ? 0 : (unsigned int)num;
+
+  return (pyzor_digest_update (digest, buf, cnt, eom));
+}
+
+static int
+pyzor_mime_hex (unsigned char c)
+{
+  if (c >= '0' && c <= '9')
+    return (c - '0');
+  if (c >= 'a' && c <= 'f')
+    return (c - 'a' + 10);
+  if (c >= 'A' && c <= 'F')
+    return (c - 'A' + 10);
+  return (-1);
+}
+
+/* decodes the escape or soft line break at the start of str. returns the
+   number of bytes it takes up, or zero if that depends on input that has
+   not been seen yet */
+static size_t
+pyzor_mime_escape (const unsigned char *str,
+                   size_t len,
+                   int eom,
+                   unsigned char *buf,
+                   size_t *cnt)
+{
+  int hi, lo;
+
+  assert (len && str[0] == '=');
+
+  if (len > 2 && (hi = pyzor_mime_hex (str[1])) >= 0 &&
+                 (lo = pyzor_mime_hex (str[2])) >= 0) {
+    buf[(*cnt)++] = (unsigned char)((hi << 4) | lo);
+    return (3);
+  }
+  if (len > 1 && str[1] == '\n')
+    return (2);
+  if (len > 2 && str[1] == '\r' && str[2] == '\n')
+    return (3);
+  if (! eom && (len == 1 ||
+                (len == 2 && (pyzor_mime_hex (str[1]) >= 0 || str[1] == '\r'))))
+    return (0);
+
+  /* not an escape, passed on as is */
+  buf[(*cnt)++] = '=';
+  return (1);
+}
+
+static int
+pyzor_mime_decode_quoted_printable (struct pyzor_mime_decoder *dec,
+                                    pyzor_digest_t *digest,
+                                    const unsigned char *str,
+                                    size_t len,
+                                    int eom)
+{
+  unsigned char buf[PYZOR_MIME_BUFLEN], tmp[3];
+  const unsigned char *end;
+  size_t add, cnt, num, pos;
+  int err;
+
+  cnt = 0;
+  pos = 0;
+
+  /* complete an escape cut off by the end of the previous update */
+  if (dec->pendlen) {
+    memcpy (tmp, dec->pend, dec->pendlen);
+    add = sizeof (tmp) - dec->pendlen;
+    add = len < add ? len : add;
+    memcpy (tmp + dec->pendlen, str, add);
+    if (! (num = pyzor_mime_escape (tmp, dec->pendlen + add, eom, buf, &cnt))) {
+      memcpy (dec->pend, tmp, dec->pendlen + add);
+      dec->pendlen += add;
+      return (0);
+    }
+    if (num < dec->pendlen) {
+      /* escape turned out to be a plain '=', the rest is plain text */
+      for (; num < dec->pendlen; num++)
+        buf[cnt++] = dec->pend[num];
+    } else {
+      pos = num - dec->pendlen;
+    }
+    dec->pendlen = 0;
+  }
+
+  while (pos < len) {
+    if (PYZOR_MIME_BUFLEN - cnt < 4) {
+      if ((err = pyzor_digest_update (digest, buf, cnt, 0)) != 0)
+        return (err);
+      cnt = 0;
+    }
+
+    if (str[pos] != '=') {
+      /* runs of plain text are copied in one go */
+      num = PYZOR_MIME_BUFLEN - cnt;
+      num = len - pos < num ? len - pos : num;
+      if ((end = memchr (str + pos, '=', num)))
+        num = (size_t)(end - (str + pos));
+      memcpy (buf + cnt, str + pos, num);
+      cnt += num;
+      pos += num;
+    } else if ((num = pyzor_mime_escape (str + pos, len - pos, eom, buf, &cnt))) {
+      pos += num;
+    } else {
+      memcpy (dec->pend, str + pos, len - pos);
+      dec->pendlen = len - pos;
+      break;
+    }
+  }
+
+  return (pyzor_digest_update (digest, buf, cnt, eom));
+}
+
+/* decode the next piece of a body and feed it to the digest, eom is set for
+   the last piece. the decoder can be used for the next part after that */
+int
+pyzor_mime_decoder_update (struct pyzor_mime_decoder *dec,
+                           pyzor_digest_t *digest,
+                           const unsigned char *str,
+                           size_t len,
+                           int eom)
+{
+  assert (dec);
+  assert (digest);
+  assert (str || ! len);
+
+  if (! str)
+    str = (const unsigned char *)"";
+
+  switch (dec->encoding) {
+    case pyzor_mime_base64:
+      return (pyzor_mime_decode_base64 (dec, digest, str, len, eom));
+    case pyzor_mime_quoted_printable:
+      return (pyzor_mime_decode_quoted_printable (dec, digest, str, len, eom));
+    default:
+      /* passed as is, no copy */
+      return (pyzor_digest_update (digest, str, len, eom));
+  }
+}
+
+/* decoder state of a part that is continued in another process, saved
+   along with the digest. the blob does not depend on byte order */
+#define PYZOR_MIME_DECODER_VERSION (1)
+
+void
+pyzor_mime_decoder_save (const struct pyzor_mime_decoder *dec, unsigned char *str)
+{
+  assert (dec);
+  assert (str);
+
+  memset (str, 0, PYZOR_MIME_DECODER_SAVE_LEN);
+  str[0] = PYZOR_MIME_DECODER_VERSION;
+  str[1] = (unsigned char)dec->encoding;
+  str[2] = (unsigned char)dec->num;
+  str[3] = (unsigned char)dec->pendlen;
+  str[4] = (unsigned char)(dec->acc >> 24);
+  str[5] = (unsigned char)(dec->acc >> 16);
+  str[6] = (unsigned char)(dec->acc >> 8);
+  str[7] = (unsigned char)(dec->acc);
+  memcpy (str + 8, dec->pend, dec->pendlen);
+}
+
+int
+pyzor_mime_decoder_load (struct pyzor_mime_decoder *dec, const unsigned char *str, size_t len)
+{
+  assert (dec);
+  assert (str || ! len);
+
+  if (len != PYZOR_MIME_DECODER_SAVE_LEN)
+    return (EINVAL);
+  if (str[0] != PYZOR_MIME_DECODER_VERSION)
+    return (ENOTSUP);
+  /* at most three sextets are pending, an escape is cut off after at most
+     two bytes */
+  if (str[1] > pyzor_mime_quoted_printable || str[2] > 3 ||
+      str[3] >= sizeof (dec->pend))
+    return (EINVAL);
+
+  pyzor_mime_decoder_init (dec, (pyzor_mime_encoding_t)str[1]);
+  dec->num = str[2];
+  dec->pendlen = str[3];
+  dec->acc = ((uint32_t)str[4] << 24) | ((uint32_t)str[5] << 16) |
+             ((uint32_t)str[6] <<  8) |  (uint32_t)str[7];
+  memcpy (dec->pend, str + 8, dec->pendlen);
+
+  return (0);
+}
+
+/* decode a leaf part and feed it to the digest as a whole */
+int
+pyzor_mime_update (pyzor_digest_t *digest, const struct pyzor_mime_part *part)
+{
+  struct pyzor_mime_decoder dec;
+
+  assert (digest);
+  assert (part);
+
+  pyzor_mime_decoder_init (&dec, part->encoding);
+
+  return (pyzor_mime_decoder_update (&dec, digest, part->body, part->len, 1));
+}
+
+struct pyzor_mime_digest {
+  pyzor_digest_t *digest;
+  pyzor_mime_policy_t *policy;
+};
+
+static int
+pyzor_mime_digest_part (void *user_data, const struct pyzor_mime_part *part)
+{
+  struct pyzor_mime_digest *ctx = user_data;
+
+  if (! pyzor_mime_policy_check (ctx->policy, part))
+    return (0);
+
+  return (pyzor_mime_update (ctx->digest, part));
+}
+
+/* feed the leaf parts of a message that the policy allows to the digest */
+int
+pyzor_mime_digest (pyzor_digest_t *digest,
+                   pyzor_mime_policy_t *policy, /* NULL for all parts */
+                   const unsigned char *str,
+                   size_t len)
+{
+  struct pyzor_mime_digest ctx;
+
+  assert (digest);
+
+  ctx.digest = digest;
+  ctx.policy = policy;
+
+  return (pyzor_mime_walk (str, len, &pyzor_mime_digest_part, &ctx));
+}
+
+/* leaf parts are independent, a part always starts and ends at a line
+   boundary. parts are therefore normalized concurrently, each in a context
+   of its own, and their lines are imported into the digest in document
+   order, which yields the same lines as feeding the parts one after the
+   other. larger parts are started first, a message cannot be digested
+   faster than its largest part. */
+
+/* messages smaller than this are not worth handing out */
+#define PYZOR_MIME_PARALLEL_MIN (256 * 1024)
+
+struct pyzor_mime_order {
+  size_t len;
+  size_t pos;
+};
+
+struct pyzor_mime_parallel {
+  pyzor_mime_policy_t *policy;
+  pyzor_digest_t *digest; /* contexts keep the lines it keeps */
+  pyzor_digest_pool_t *digests;
+  struct pyzor_mime_part *parts;
+  struct pyzor_mime_order *order; /* larger parts first */
+  pyzor_digest_t **ctxs;
+  int *errs;
+  size_t cnt;
+  size_t size;
+  size_t len; /* encoded bytes in all parts */
+};
+
+static int
+pyzor_mime_parallel_collect (void *user_data, const struct pyzor_mime_part *part)
+{
+  struct pyzor_mime_parallel *par = user_data;
+  struct pyzor_mime_part *a_parts;
+  size_t a_size;
+
+  if (! pyzor_mime_policy_check (par->policy, part))
+    return (0);
+
+  if (par->cnt == par->size) {
+    a_size = par->size ? par->size * 2 : 16;
+    if (! (a_parts = realloc (par->parts, a_size * sizeof (*a_parts))))
+      return (ENOMEM);
+    par->parts = a_parts;
+    par->size = a_size;
+  }
+
+  par->parts[par->cnt++] = *part;
+  par->len += part->len;
+
+  return (0);
+}
+
+static void
+pyzor_mime_parallel_task (void *user_data, size_t idx, unsigned int thr)
+{
+  struct pyzor_mime_parallel *par = user_data;
+  size_t pos = par->order[idx].pos;
+
+  (void)thr;
+
+  if ((par->errs[pos] = pyzor_digest_pool_get (par->digests, &par->ctxs[pos])) != 0) {
+    par->ctxs[pos] = NULL;
+    return;
+  }
+
+  if ((par->errs[pos] = pyzor_digest_inherit (par->ctxs[pos], par->digest)) == 0)
+    par->errs[pos] = pyzor_mime_update (par->ctxs[pos], &par->parts[pos]);
+}
+
+static int
+pyzor_mime_parallel_cmp (const void *a, const void *b)
+{
+  const struct pyzor_mime_order *lhs = a, *rhs = b;
+
+  if (lhs->len != rhs->len)
+    return (lhs->len < rhs->len ? 1 : -1);
+  return (lhs->pos < rhs->pos ? -1 : (lhs->pos > rhs->pos ? 1 : 0));
+}
+
+/* like pyzor_mime_digest, with the parts of a message spread over the
+   workers of a pool. the digest must have been reset and the pool must not
+   be running anything else */
+int
+pyzor_mime_digest_parallel (pyzor_digest_t *digest,
+                            pyzor_mime_policy_t *policy, /* NULL for all parts */
+                            pyzor_digest_pool_t *digests,
+                            pyzor_pool_t *pool,
+                            const unsigned char *str,
+                            size_t len)
+{
+  struct pyzor_mime_parallel par;
+  const unsigned char *lines;
+  size_t cnt, num;
+  int err;
+
+  assert (digest);
+  assert (digests);
+  assert (pool);
+
+  memset (&par, 0, sizeof (par));
+  par.policy = policy;
+  par.digest = digest;
+  par.digests = digests;
+
+  if ((err = pyzor_mime_walk (str, len, &pyzor_mime_parallel_collect, &par)) != 0)
+    goto exit;
+
+  if (par.cnt < 2 || par.len < PYZOR_MIME_PARALLEL_MIN || pyzor_pool_size (pool) < 2) {
+    for (cnt = 0; err == 0 && cnt < par.cnt; cnt++)
+      err = pyzor_mime_update (digest, &par.parts[cnt]);
+    goto exit;
+  }
+
+  if (! (par.order = calloc (par.cnt, sizeof (*par.order))) ||
+      ! (par.ctxs = calloc (par.cnt, sizeof (*par.ctxs))) ||
+      ! (par.errs = calloc (par.cnt, sizeof (*par.errs))))
+  {
+    err = ENOMEM;
+    goto exit;
+  }
+
+  for (cnt = 0; cnt < par.cnt; cnt++) {
+    par.order[cnt].len = par.parts[cnt].len;
+    par.order[cnt].pos = cnt;
+  }
+  qsort (par.order, par.cnt, sizeof (*par.order), &pyzor_mime_parallel_cmp);
+
+  pyzor_pool_run (pool, &pyzor_mime_parallel_task, &par, par.cnt);
+
+  /* merge in document order, contexts are released either way */
+  for (cnt = 0; cnt < par.cnt; cnt++) {
+    if (err == 0 && (err = par.errs[cnt]) == 0 &&
+        (err = pyzor_digest_export (par.ctxs[cnt], 0, &lines, &num)) == 0)
+      err = pyzor_digest_import (digest, lines, num);
+    if (par.ctxs[cnt])
+      pyzor_digest_pool_put (digests, par.ctxs[cnt]);
+  }
+
+exit:
+  free (par.parts);
+  free (par.order);
+  free (par.ctxs);
+  free (par.errs);
+
+  return (err);
+}
@@ -0,0 +1,79 @@
+#ifndef PYZOR_MIME_H_INCLUDED
+#define PYZOR_MIME_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pool.h"
+#include "pyzor.h"
+
+typedef enum pyzor_mime_encoding pyzor_mime_encoding_t;
+
+enum pyzor_mime_encoding {
+  pyzor_mime_identity = 0, /* 7bit, 8bit, binary or unknown */
+  pyzor_mime_base64,
+  pyzor_mime_quoted_printable
+};
+
+/* leaf part, all pointers point into the message */
+struct pyzor_mime_part {
+  const unsigned char *type;
+  size_t typelen;
+  const unsigned char *subtype;
+  size_t subtypelen;
+  pyzor_mime_encoding_t encoding;
+  const unsigned char *body; /* encoded body */
+  size_t len;
+};
+
+/* transfer decoding state of a part that is fed in pieces */
+struct pyzor_mime_decoder {
+  pyzor_mime_encoding_t encoding;
+  uint32_t acc; /* base64 sextets not yet decoded */
+  unsigned int num;
+  unsigned char pend[3]; /* quoted-printable escape cut off */
+  size_t pendlen;
+};
+
+/* size of a saved decoder state */
+#define PYZOR_MIME_DECODER_SAVE_LEN (11)
+
+typedef int (*pyzor_mime_func_t) (void *, const struct pyzor_mime_part *);
+
+/* which leaf parts are digested. lists hold "type/subtype" or "type" entries
+   separated by commas or white space, "*" matches any type or subtype and
+   entries are matched case-insensitively. a part is skipped if it matches the deny
+   list, if the allow list is not empty and it does not match it or if its
+   encoded body is larger than the byte cap. skipped parts are never
+   decoded. a NULL policy digests every part. */
+typedef struct pyzor_mime_policy pyzor_mime_policy_t;
+
+/* allow list equivalent to the body extraction of Pyzor, text parts only.
+   selected by pyzor -P and used by the python extension */
+#define PYZOR_MIME_TEXT "text"
+
+struct pyzor_mime_stats {
+  uint64_t parts; /* parts that were digested */
+  uint64_t bytes; /* encoded bytes of parts that were digested */
+  uint64_t skipped;
+  uint64_t skipped_bytes;
+};
+
+int pyzor_mime_walk (const unsigned char *, size_t, pyzor_mime_func_t, void *);
+int pyzor_mime_policy_create (pyzor_mime_policy_t **, const char *, const char *, size_t);
+void pyzor_mime_policy_destroy (pyzor_mime_policy_t *);
+int pyzor_mime_policy_check (pyzor_mime_policy_t *, const struct pyzor_mime_part *);
+void pyzor_mime_policy_stats (pyzor_mime_policy_t *, struct pyzor_mime_stats *);
+void pyzor_mime_decoder_init (struct pyzor_mime_decoder *, pyzor_mime_encoding_t);
+int pyzor_mime_decoder_update (struct pyzor_mime_decoder *, pyzor_digest_t *,
+  const unsigned char *, size_t, int);
+void pyzor_mime_decoder_save (const struct pyzor_mime_decoder *, unsigned char *);
+int pyzor_mime_decoder_load (struct pyzor_mime_decoder *, const unsigned char *, size_t);
+int pyzor_mime_update (pyzor_digest_t *, const struct pyzor_mime_part *);
+int pyzor_mime_digest (pyzor_digest_t *, pyzor_mime_policy_t *,
+  const unsigned char *, size_t);
+int pyzor_mime_digest_parallel (pyzor_digest_t *, pyzor_mime_policy_t *,
+  pyzor_digest_pool_t *, pyzor_pool_t *, const unsigned char *, size_t);
+
+#endif
+
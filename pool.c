@@ -0,0 +1,240 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "pool.h"
+
+/* every worker owns a range of indexes. the owner takes indexes from the
+   bottom, idle workers steal the upper half of somebody else's range. a
+   single expensive index therefore only ever delays the worker processing
+   it, the remainder of its range is picked up by others. */
+struct pyzor_pool_queue {
+  pyzor_pool_t *pool;
+  pthread_t thr;
+  pthread_mutex_t lock;
+  size_t lo; /* next index */
+  size_t hi; /* one past last index */
+  unsigned int id;
+};
+
+struct pyzor_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* new run or shutdown */
+  pthread_cond_t done; /* run completed */
+  struct pyzor_pool_queue *queues;
+  unsigned int num; /* number of workers */
+  unsigned int act; /* number of workers started */
+  unsigned int busy; /* number of workers in current run */
+  unsigned long gen; /* run generation */
+  int stop;
+  pyzor_pool_func_t func;
+  void *user_data;
+};
+
+static void *pyzor_pool_worker (void *);
+static int pyzor_pool_take (pyzor_pool_t *, unsigned int, size_t *);
+
+int
+pyzor_pool_create (pyzor_pool_t **pool, unsigned int num)
+{
+  int err;
+  unsigned int cnt;
+  pyzor_pool_t *ptr;
+
+  assert (pool);
+
+  if (num == 0)
+    num = 1;
+
+  if (! (ptr = calloc (1, sizeof (pyzor_pool_t))))
+    return (ENOMEM);
+  if (! (ptr->queues = calloc (num, sizeof (struct pyzor_pool_queue)))) {
+    free (ptr);
+    return (ENOMEM);
+  }
+
+  pthread_mutex_init (&ptr->lock, NULL);
+  pthread_cond_init (&ptr->cond, NULL);
+  pthread_cond_init (&ptr->done, NULL);
+  ptr->num = num;
+
+  for (cnt = 0; cnt < num; cnt++) {
+    ptr->queues[cnt].pool = ptr;
+    ptr->queues[cnt].id = cnt;
+    pthread_mutex_init (&ptr->queues[cnt].lock, NULL);
+  }
+
+  for (cnt = 0; cnt < num; cnt++) {
+    err = pthread_create (&ptr->queues[cnt].thr, NULL, &pyzor_pool_worker,
+                          &ptr->queues[cnt]);
+    if (err != 0) {
+      pyzor_pool_destroy (ptr);
+      return (err);
+    }
+    ptr->act++;
+  }
+
+  *pool = ptr;
+
+  return (0);
+}
+
+void
+pyzor_pool_destroy (pyzor_pool_t *pool)
+{
+  unsigned int cnt;
+
+  assert (pool);
+
+  if (pool) {
+    pthread_mutex_lock (&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast (&pool->cond);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (cnt = 0; cnt < pool->act; cnt++)
+      pthread_join (pool->queues[cnt].thr, NULL);
+    for (cnt = 0; cnt < pool->num; cnt++)
+      pthread_mutex_destroy (&pool->queues[cnt].lock);
+
+    pthread_cond_destroy (&pool->done);
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->queues);
+    memset (pool, 0, sizeof (pyzor_pool_t));
+    free (pool);
+  }
+}
+
+unsigned int
+pyzor_pool_size (pyzor_pool_t *pool)
+{
+  assert (pool);
+
+  return (pool->num);
+}
+
+int
+pyzor_pool_run (pyzor_pool_t *pool,
+                pyzor_pool_func_t func,
+                void *user_data,
+                size_t cnt) /* number of indexes */
+{
+  unsigned int num;
+
+  assert (pool);
+  assert (func);
+
+  if (cnt == 0)
+    return (0);
+
+  pthread_mutex_lock (&pool->lock);
+
+  /* hand out contiguous ranges so that neighbouring indexes, which are
+     usually neighbouring files, end up with the same worker */
+  for (num = 0; num < pool->num; num++) {
+    pthread_mutex_lock (&pool->queues[num].lock);
+    pool->queues[num].lo = (cnt * num) / pool->num;
+    pool->queues[num].hi = (cnt * (num + 1)) / pool->num;
+    pthread_mutex_unlock (&pool->queues[num].lock);
+  }
+
+  pool->func = func;
+  pool->user_data = user_data;
+  pool->busy = pool->num;
+  pool->gen++;
+  pthread_cond_broadcast (&pool->cond);
+
+  while (pool->busy)
+    pthread_cond_wait (&pool->done, &pool->lock);
+
+  pool->func = NULL;
+  pool->user_data = NULL;
+  pthread_mutex_unlock (&pool->lock);
+
+  return (0);
+}
+
+static int
+pyzor_pool_take (pyzor_pool_t *pool, unsigned int id, size_t *idx)
+{
+  size_t lo, hi;
+  unsigned int cnt, num;
+  struct pyzor_pool_queue *queue;
+
+  assert (pool);
+  assert (idx);
+
+  queue = &pool->queues[id];
+  pthread_mutex_lock (&queue->lock);
+  if (queue->lo < queue->hi) {
+    *idx = queue->lo++;
+    pthread_mutex_unlock (&queue->lock);
+    return (0);
+  }
+  pthread_mutex_unlock (&queue->lock);
+
+  /* own range exhausted, steal upper half of first non-empty range */
+  for (cnt = 1; cnt < pool->num; cnt++) {
+    num = (id + cnt) % pool->num;
+    queue = &pool->queues[num];
+    pthread_mutex_lock (&queue->lock);
+    if (queue->lo < queue->hi) {
+      hi = queue->hi;
+      lo = queue->hi - ((queue->hi - queue->lo) + 1) / 2;
+      queue->hi = lo;
+      pthread_mutex_unlock (&queue->lock);
+
+      queue = &pool->queues[id];
+      pthread_mutex_lock (&queue->lock);
+      queue->lo = lo + 1;
+      queue->hi = hi;
+      pthread_mutex_unlock (&queue->lock);
+      *idx = lo;
+      return (0);
+    }
+    pthread_mutex_unlock (&queue->lock);
+  }
+
+  return (ENOENT);
+}
+
+static void *
+pyzor_pool_worker (void *arg)
+{
+  pyzor_pool_t *pool;
+  struct pyzor_pool_queue *queue;
+  unsigned long gen;
+  size_t idx;
+
+  assert (arg);
+
+  queue = arg;
+  pool = queue->pool;
+  gen = 0;
+
+  for (;;) {
+    pthread_mutex_lock (&pool->lock);
+    while (! pool->stop && pool->gen == gen)
+      pthread_cond_wait (&pool->cond, &pool->lock);
+    if (pool->stop) {
+      pthread_mutex_unlock (&pool->lock);
+      break;
+    }
+    gen = pool->gen;
+    pthread_mutex_unlock (&pool->lock);
+
+    while (pyzor_pool_take (pool, queue->id, &idx) == 0)
+      pool->func (pool->user_data, idx, queue->id);
+
+    pthread_mutex_lock (&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal (&pool->done);
+    pthread_mutex_unlock (&pool->lock);
+  }
+
+  return (NULL);
+}
@@ -0,0 +1,18 @@
+#ifndef PYZOR_POOL_H_INCLUDED
+#define PYZOR_POOL_H_INCLUDED
+
+#include <sys/types.h>
+
+typedef struct pyzor_pool pyzor_pool_t;
+
+/* invoked once for every index in a run. the worker number is stable for the
+   lifetime of the pool and can be used to address per-thread state */
+typedef void (*pyzor_pool_func_t) (void *, size_t, unsigned int);
+
+int pyzor_pool_create (pyzor_pool_t **, unsigned int);
+void pyzor_pool_destroy (pyzor_pool_t *);
+unsigned int pyzor_pool_size (pyzor_pool_t *);
+int pyzor_pool_run (pyzor_pool_t *, pyzor_pool_func_t, void *, size_t);
+
+#endif
+
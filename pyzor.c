@@ -1,30 +1,78 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
-//#include <openssl/sha.h>
-#include <glib.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#if ! defined (PYZOR_NO_SIMD) && defined (__GNUC__) && \
+    (defined (__x86_64__) || defined (__i386__))
+# define PYZOR_SCAN_X86 (1)
+# include <immintrin.h>
+#endif
 
 #include "pyzor.h"
 
-/* minimum line length for it to be included in the message digest */
+/* static probes for tracers that read SystemTap SDT notes (perf, bpftrace,
+   stap). they are compiled in if <sys/sdt.h> is available unless
+   PYZOR_NO_PROBES is defined, and are a single nop each when not traced. */
+#if ! defined (PYZOR_NO_PROBES) && defined (__has_include)
+# if __has_include (<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define PYZOR_PROBES (1)
+# endif
+#endif
+
+#ifdef PYZOR_PROBES
+# define PYZOR_PROBE1(name, a) DTRACE_PROBE1 (pyzor, name, a)
+# define PYZOR_PROBE2(name, a, b) DTRACE_PROBE2 (pyzor, name, a, b)
+#else
+# define PYZOR_PROBE1(name, a) do { } while (0)
+# define PYZOR_PROBE2(name, a, b) do { } while (0)
+#endif
+
+/* reasons passed to the drop probe */
+#define PYZOR_DROP_LONG (1)
+#define PYZOR_DROP_DELIM (2)
+
+/* diagnostics do not exist unless PYZOR_DEBUG is defined, otherwise they
+   cost a load and a compare when the runtime level is below theirs */
+static int pyzor_debug = 0;
+static int pyzor_timing = 0;
+
+#ifdef PYZOR_DEBUG
+# define pyzor_trace(lvl, ...) \
+  do { \
+    if ((lvl) <= __atomic_load_n (&pyzor_debug, __ATOMIC_RELAXED)) \
+      fprintf (stderr, __VA_ARGS__); \
+  } while (0)
+#else
+# define pyzor_trace(lvl, ...) do { } while (0)
+#endif
+
+/* minimum line length for it to be included in the message digest, unless
+   a context is configured otherwise */
 #define PYZOR_LINE_MIN (8)
 
 /* minimum number of non white space characters to remove portion */
 #define PYZOR_STRING_MIN (10)
 
 /* message digested as a whole if number of lines is less than or equal to
-   this amount of lines */
+   this amount of lines, unless a spec says otherwise */
 #define PYZOR_LINES_ATOMIC (4)
 
 #define PYZOR_DELIM_LEN (sizeof (unsigned char) + sizeof (size_t))
 
 #define PYZOR_SIZE_MAX (SIZE_MAX - PYZOR_DELIM_LEN)
 
+/* number of entries the line index starts out with */
+#define PYZOR_INDEX_MIN (64)
+
 /* functions like the ones in <ctype.h> that are not affected by locale.
    copied directly from GLib. */
 static const unsigned int pyzor_ascii_table[256] = {
@@ -94,45 +142,681 @@ typedef enum {
 #define pyzor_isxdigit(c) \
   ((pyzor_ascii_table[(unsigned char) (c)] & PYZOR_ASCII_XDIGIT) != 0)
 
+/* byte classification. white space and newline are located as bitmasks
+   over blocks of PYZOR_SCAN_LEN bytes, which allows for the rest of a
+   discarded token and for runs of blanks to be skipped in one go. the
+   other characters that drive the tokenizer are left to the transition
+   table. the vector implementations are selected at runtime, the scalar
+   implementation is used if none is supported. */
+
+#define PYZOR_SCAN_LEN (64)
+
+typedef struct pyzor_scan_mask pyzor_scan_mask_t;
+
+struct pyzor_scan_mask {
+  uint64_t space; /* white space, newline included */
+  uint64_t nl;
+};
+
+typedef void (*pyzor_scan_func_t) (const unsigned char *, pyzor_scan_mask_t *);
+
+static void
+pyzor_scan_scalar (const unsigned char *str, pyzor_scan_mask_t *mask)
+{
+  uint64_t bit;
+  unsigned int pos;
+
+  memset (mask, 0, sizeof (pyzor_scan_mask_t));
+
+  for (pos = 0; pos < PYZOR_SCAN_LEN; pos++) {
+    bit = (uint64_t)1 << pos;
+    if (pyzor_isspace (str[pos]))
+      mask->space |= bit;
+    if (str[pos] == '\n')
+      mask->nl |= bit;
+  }
+}
+
+#if PYZOR_SCAN_X86
+/* white space is \t, \n, \f, \r and ' ', i.e. 0x09 - 0x0d except 0x0b */
+__attribute__ ((target ("sse2")))
+static void
+pyzor_scan_sse2 (const unsigned char *str, pyzor_scan_mask_t *mask)
+{
+  __m128i vec, tmp;
+  unsigned int pos;
+
+  memset (mask, 0, sizeof (pyzor_scan_mask_t));
+
+  for (pos = 0; pos < PYZOR_SCAN_LEN; pos += 16) {
+    vec = _mm_loadu_si128 ((const __m128i *)(str + pos));
+    tmp = _mm_sub_epi8 (vec, _mm_set1_epi8 (0x09));
+    tmp = _mm_cmpeq_epi8 (_mm_min_epu8 (tmp, _mm_set1_epi8 (0x04)), tmp);
+    tmp = _mm_andnot_si128 (_mm_cmpeq_epi8 (vec, _mm_set1_epi8 (0x0b)), tmp);
+    tmp = _mm_or_si128 (tmp, _mm_cmpeq_epi8 (vec, _mm_set1_epi8 (' ')));
+#define PYZOR_SCAN_SSE2(v) \
+  ((uint64_t)(unsigned int)_mm_movemask_epi8 (v) << pos)
+    mask->space |= PYZOR_SCAN_SSE2 (tmp);
+    mask->nl    |= PYZOR_SCAN_SSE2 (_mm_cmpeq_epi8 (vec, _mm_set1_epi8 ('\n')));
+#undef PYZOR_SCAN_SSE2
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static void
+pyzor_scan_avx2 (const unsigned char *str, pyzor_scan_mask_t *mask)
+{
+  __m256i vec, tmp;
+  unsigned int pos;
+
+  memset (mask, 0, sizeof (pyzor_scan_mask_t));
+
+  for (pos = 0; pos < PYZOR_SCAN_LEN; pos += 32) {
+    vec = _mm256_loadu_si256 ((const __m256i *)(str + pos));
+    tmp = _mm256_sub_epi8 (vec, _mm256_set1_epi8 (0x09));
+    tmp = _mm256_cmpeq_epi8 (_mm256_min_epu8 (tmp, _mm256_set1_epi8 (0x04)), tmp);
+    tmp = _mm256_andnot_si256 (_mm256_cmpeq_epi8 (vec, _mm256_set1_epi8 (0x0b)), tmp);
+    tmp = _mm256_or_si256 (tmp, _mm256_cmpeq_epi8 (vec, _mm256_set1_epi8 (' ')));
+#define PYZOR_SCAN_AVX2(v) \
+  ((uint64_t)(unsigned int)_mm256_movemask_epi8 (v) << pos)
+    mask->space |= PYZOR_SCAN_AVX2 (tmp);
+    mask->nl    |= PYZOR_SCAN_AVX2 (_mm256_cmpeq_epi8 (vec, _mm256_set1_epi8 ('\n')));
+#undef PYZOR_SCAN_AVX2
+  }
+}
+
+__attribute__ ((target ("avx512f,avx512bw")))
+static void
+pyzor_scan_avx512 (const unsigned char *str, pyzor_scan_mask_t *mask)
+{
+  __m512i vec, tmp;
+  __mmask64 ws;
+
+  vec = _mm512_loadu_si512 ((const void *)str);
+  tmp = _mm512_sub_epi8 (vec, _mm512_set1_epi8 (0x09));
+  ws  = _mm512_cmple_epu8_mask (tmp, _mm512_set1_epi8 (0x04));
+  ws &= ~_mm512_cmpeq_epi8_mask (vec, _mm512_set1_epi8 (0x0b));
+  ws |= _mm512_cmpeq_epi8_mask (vec, _mm512_set1_epi8 (' '));
+  mask->space = ws;
+  mask->nl    = _mm512_cmpeq_epi8_mask (vec, _mm512_set1_epi8 ('\n'));
+}
+#endif
+
+static pyzor_scan_func_t pyzor_scan_func = NULL;
+
+static pyzor_scan_func_t
+pyzor_scan_get (void)
+{
+  pyzor_scan_func_t func;
+
+  /* selection is idempotent, racing threads store the same value */
+  if ((func = __atomic_load_n (&pyzor_scan_func, __ATOMIC_RELAXED)))
+    return (func);
+
+  func = &pyzor_scan_scalar;
+#if PYZOR_SCAN_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512bw"))
+    func = &pyzor_scan_avx512;
+  else if (__builtin_cpu_supports ("avx2"))
+    func = &pyzor_scan_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    func = &pyzor_scan_sse2;
+#endif
+
+  __atomic_store_n (&pyzor_scan_func, func, __ATOMIC_RELAXED);
+  return (func);
+}
+
+/* offset of first white space at or after pos, or len */
+static size_t
+pyzor_scan_space (const unsigned char *str, size_t pos, size_t len)
+{
+  pyzor_scan_func_t func;
+  pyzor_scan_mask_t mask;
+
+  func = pyzor_scan_get ();
+  for (; len - pos >= PYZOR_SCAN_LEN; pos += PYZOR_SCAN_LEN) {
+    func (str + pos, &mask);
+    if (mask.space)
+      return (pos + (size_t)__builtin_ctzll (mask.space));
+  }
+
+  for (; pos < len && ! pyzor_isspace (str[pos]); pos++)
+    ;
+
+  return (pos);
+}
+
+/* offset of first byte at or after pos that is not white space or that is a
+   newline, or len */
+static size_t
+pyzor_scan_blank (const unsigned char *str, size_t pos, size_t len)
+{
+  pyzor_scan_func_t func;
+  pyzor_scan_mask_t mask;
+  uint64_t rest;
+
+  func = pyzor_scan_get ();
+  for (; len - pos >= PYZOR_SCAN_LEN; pos += PYZOR_SCAN_LEN) {
+    func (str + pos, &mask);
+    if ((rest = ~(mask.space & ~mask.nl)))
+      return (pos + (size_t)__builtin_ctzll (rest));
+  }
+
+  for (; pos < len && pyzor_isspace (str[pos]) && str[pos] != '\n'; pos++)
+    ;
+
+  return (pos);
+}
+
+/* SHA-1. the digest core does not depend on a crypto library, the block
+   function is selected at runtime and uses the SHA extensions if the
+   processor supports them. */
+
+#define PYZOR_SHA1_BLOCK_LEN (64)
+
+typedef struct pyzor_sha1 pyzor_sha1_t;
+
+struct pyzor_sha1 {
+  uint32_t state[5];
+  uint64_t cnt; /* number of bytes hashed */
+  unsigned char buf[PYZOR_SHA1_BLOCK_LEN];
+};
+
+/* hashes a number of complete blocks */
+typedef void (*pyzor_sha1_func_t) (uint32_t *, const unsigned char *, size_t);
+
+#define PYZOR_SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+pyzor_sha1_portable (uint32_t *state, const unsigned char *str, size_t cnt)
+{
+  uint32_t a, b, c, d, e, f, k, t, w[80];
+  unsigned int pos;
+
+  for (; cnt; cnt--, str += PYZOR_SHA1_BLOCK_LEN) {
+    for (pos = 0; pos < 16; pos++) {
+      w[pos] = ((uint32_t)str[pos * 4    ] << 24) |
+               ((uint32_t)str[pos * 4 + 1] << 16) |
+               ((uint32_t)str[pos * 4 + 2] <<  8) |
+               ((uint32_t)str[pos * 4 + 3]);
+    }
+    for (; pos < 80; pos++) {
+      t = w[pos - 3] ^ w[pos - 8] ^ w[pos - 14] ^ w[pos - 16];
+      w[pos] = PYZOR_SHA1_ROL (t, 1);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (pos = 0; pos < 80; pos++) {
+      if (pos < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (pos < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (pos < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      t = PYZOR_SHA1_ROL (a, 5) + f + e + k + w[pos];
+      e = d;
+      d = c;
+      c = PYZOR_SHA1_ROL (b, 30);
+      b = a;
+      a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#if PYZOR_SCAN_X86
+/* four rounds, m0 holds the current message words */
+#define PYZOR_SHA1_NI_ROUNDS(e, f, m0, m1, m2, m3, k) \
+  do { \
+    e = _mm_sha1nexte_epu32 (e, m0); \
+    f = abcd; \
+    m1 = _mm_sha1msg2_epu32 (m1, m0); \
+    abcd = _mm_sha1rnds4_epu32 (abcd, e, k); \
+    m3 = _mm_sha1msg1_epu32 (m3, m0); \
+    m2 = _mm_xor_si128 (m2, m0); \
+  } while (0)
+
+__attribute__ ((target ("sha,sse4.1,ssse3")))
+static void
+pyzor_sha1_ni (uint32_t *state, const unsigned char *str, size_t cnt)
+{
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_loadu_si128 ((const __m128i *)state);
+  abcd = _mm_shuffle_epi32 (abcd, 0x1b);
+  e0 = _mm_set_epi32 ((int)state[4], 0, 0, 0);
+
+  for (; cnt; cnt--, str += PYZOR_SHA1_BLOCK_LEN) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* rounds 0-15 load the message */
+    msg0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(str +  0)), mask);
+    e0 = _mm_add_epi32 (e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+    msg1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(str + 16)), mask);
+    e1 = _mm_sha1nexte_epu32 (e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+
+    msg2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(str + 32)), mask);
+    e0 = _mm_sha1nexte_epu32 (e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+    msg0 = _mm_xor_si128 (msg0, msg2);
+
+    msg3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(str + 48)), mask);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 0);
+
+    /* rounds 16-79 */
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 0);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 1);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 1);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 1);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 1);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 1);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 2);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 2);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 2);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 2);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 2);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 3);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg0, msg1, msg2, msg3, 3);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg1, msg2, msg3, msg0, 3);
+    PYZOR_SHA1_NI_ROUNDS (e0, e1, msg2, msg3, msg0, msg1, 3);
+    PYZOR_SHA1_NI_ROUNDS (e1, e0, msg3, msg0, msg1, msg2, 3);
+
+    e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+    abcd = _mm_add_epi32 (abcd, abcd_save);
+  }
+
+  abcd = _mm_shuffle_epi32 (abcd, 0x1b);
+  _mm_storeu_si128 ((__m128i *)state, abcd);
+  state[4] = (uint32_t)_mm_extract_epi32 (e0, 3);
+}
+
+#undef PYZOR_SHA1_NI_ROUNDS
+#endif
+
+static pyzor_sha1_func_t pyzor_sha1_func = NULL;
+
+static pyzor_sha1_func_t
+pyzor_sha1_get (void)
+{
+  pyzor_sha1_func_t func;
+
+  if ((func = __atomic_load_n (&pyzor_sha1_func, __ATOMIC_RELAXED)))
+    return (func);
+
+  func = &pyzor_sha1_portable;
+#if PYZOR_SCAN_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sha") &&
+      __builtin_cpu_supports ("sse4.1") &&
+      __builtin_cpu_supports ("ssse3"))
+    func = &pyzor_sha1_ni;
+#endif
+
+  __atomic_store_n (&pyzor_sha1_func, func, __ATOMIC_RELAXED);
+  return (func);
+}
+
+static void
+pyzor_sha1_init (pyzor_sha1_t *sha1)
+{
+  assert (sha1);
+
+  sha1->state[0] = 0x67452301;
+  sha1->state[1] = 0xefcdab89;
+  sha1->state[2] = 0x98badcfe;
+  sha1->state[3] = 0x10325476;
+  sha1->state[4] = 0xc3d2e1f0;
+  sha1->cnt = 0;
+}
+
+static void
+pyzor_sha1_update (pyzor_sha1_t *sha1, const unsigned char *str, size_t len)
+{
+  pyzor_sha1_func_t func;
+  size_t cnt, pos;
+
+  assert (sha1);
+  assert (str || ! len);
+
+  func = pyzor_sha1_get ();
+  pos = (size_t)(sha1->cnt % PYZOR_SHA1_BLOCK_LEN);
+  sha1->cnt += len;
+
+  if (pos) {
+    cnt = PYZOR_SHA1_BLOCK_LEN - pos;
+    if (cnt > len)
+      cnt = len;
+    memcpy (sha1->buf + pos, str, cnt);
+    str += cnt;
+    len -= cnt;
+    if (pos + cnt < PYZOR_SHA1_BLOCK_LEN)
+      return;
+    func (sha1->state, sha1->buf, 1);
+  }
+
+  if ((cnt = len / PYZOR_SHA1_BLOCK_LEN)) {
+    func (sha1->state, str, cnt);
+    str += cnt * PYZOR_SHA1_BLOCK_LEN;
+    len -= cnt * PYZOR_SHA1_BLOCK_LEN;
+  }
+
+  if (len)
+    memcpy (sha1->buf, str, len);
+}
+
+static void
+pyzor_sha1_final (pyzor_sha1_t *sha1, unsigned char *str)
+{
+  unsigned char pad[PYZOR_SHA1_BLOCK_LEN + 8];
+  uint64_t bits;
+  size_t len, pos;
+
+  assert (sha1);
+  assert (str);
+
+  bits = sha1->cnt * 8;
+  pos = (size_t)(sha1->cnt % PYZOR_SHA1_BLOCK_LEN);
+  len = (pos < 56) ? (56 - pos) : (120 - pos);
+
+  memset (pad, 0, sizeof (pad));
+  pad[0] = 0x80;
+  for (pos = 0; pos < 8; pos++)
+    pad[len + pos] = (unsigned char)(bits >> (56 - (pos * 8)));
+
+  pyzor_sha1_update (sha1, pad, len + 8);
+
+  for (pos = 0; pos < 5; pos++) {
+    str[pos * 4    ] = (unsigned char)(sha1->state[pos] >> 24);
+    str[pos * 4 + 1] = (unsigned char)(sha1->state[pos] >> 16);
+    str[pos * 4 + 2] = (unsigned char)(sha1->state[pos] >>  8);
+    str[pos * 4 + 3] = (unsigned char)(sha1->state[pos]);
+  }
+}
+
+static void
+pyzor_sha1_hex (unsigned char *str, const unsigned char *raw)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned int pos;
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    str[pos * 2    ] = (unsigned char)hex[raw[pos] >> 4];
+    str[pos * 2 + 1] = (unsigned char)hex[raw[pos] & 0x0f];
+  }
+  str[pos * 2] = '\0';
+}
+
+/* SHA-1 of the concatenation of a number of buffers, for users of the
+   library that need a hash other than the digest, e.g. to sign requests */
+void
+pyzor_sha1 (unsigned char *raw, const struct iovec *iov, size_t cnt)
+{
+  pyzor_sha1_t sum;
+  size_t pos;
+
+  assert (raw);
+  assert (iov || ! cnt);
+
+  pyzor_sha1_init (&sum);
+  for (pos = 0; pos < cnt; pos++)
+    pyzor_sha1_update (&sum, iov[pos].iov_base, iov[pos].iov_len);
+  pyzor_sha1_final (&sum, raw);
+}
+
+
+/* tokenizer. the normalization rules are a transition table over byte
+   classes and states. the length of a token is part of its state, so that
+   a token that grows too long is dropped by the table like a token that
+   contains an email or URL like delimiter. every entry holds the next state
+   and the actions to perform on the transition, the table is constant and
+   evaluated by the compiler from PYZOR_DFA_NEXT and PYZOR_DFA_ACT. */
+
+/* byte classes */
+#define PYZOR_CLASS_OTHER (0)
+#define PYZOR_CLASS_ALPHA (1)
+#define PYZOR_CLASS_COLON (2)
+#define PYZOR_CLASS_AT (3)
+#define PYZOR_CLASS_LT (4)
+#define PYZOR_CLASS_GT (5)
+#define PYZOR_CLASS_SPACE (6) /* white space other than newline */
+#define PYZOR_CLASS_NL (7)
+#define PYZOR_CLASSES (8)
+
+/* states, a token of n bytes is in ALPHA(n) if it consists of letters only
+   and in OTHER(n) otherwise. DELIM is a token that is dropped if another
+   byte is added to it. */
+#define PYZOR_STATE_NONE (0) /* start of line */
+#define PYZOR_STATE_SPACE (1)
+#define PYZOR_STATE_ALPHA(n) (1 + (n))
+#define PYZOR_STATE_OTHER(n) (PYZOR_STRING_MIN + (n))
+#define PYZOR_STATE_DELIM (2 * PYZOR_STRING_MIN)
+#define PYZOR_STATE_DISCARD (2 * PYZOR_STRING_MIN + 1)
+#define PYZOR_STATES (2 * PYZOR_STRING_MIN + 2)
+
+#define PYZOR_STATE_IS_ALPHA(s) \
+  ((s) >= PYZOR_STATE_ALPHA (1) && (s) < PYZOR_STATE_ALPHA (PYZOR_STRING_MIN))
+#define PYZOR_STATE_IS_OTHER(s) \
+  ((s) >= PYZOR_STATE_OTHER (1) && (s) < PYZOR_STATE_OTHER (PYZOR_STRING_MIN))
+#define PYZOR_STATE_IS_TOKEN(s) \
+  ((s) >= PYZOR_STATE_ALPHA (1) && (s) <= PYZOR_STATE_DELIM)
+/* adding a byte to a token in this state makes it too long */
+#define PYZOR_STATE_IS_FULL(s) \
+  ((s) == PYZOR_STATE_ALPHA (PYZOR_STRING_MIN - 1) || \
+   (s) == PYZOR_STATE_OTHER (PYZOR_STRING_MIN - 1))
+
+/* actions */
+#define PYZOR_ACT_START (1 << 0) /* token starts at this byte */
+#define PYZOR_ACT_LT (1 << 1) /* possible HTML tag open */
+#define PYZOR_ACT_GT (1 << 2) /* possible HTML tag close */
+#define PYZOR_ACT_EMIT (1 << 3) /* token ends before this byte */
+#define PYZOR_ACT_LINE (1 << 4) /* line ends at this byte */
+#define PYZOR_ACT_BLANK (1 << 5) /* white space follows, skip it */
+#define PYZOR_ACT_LONG (1 << 6) /* token dropped for its length */
+#define PYZOR_ACT_DELIM (1 << 7) /* token dropped for a delimiter */
+
+#define PYZOR_DFA_SHIFT (8)
+
+#define PYZOR_DFA_NEXT(s, c) \
+  ((c) == PYZOR_CLASS_NL ? PYZOR_STATE_NONE : \
+   (c) == PYZOR_CLASS_SPACE ? PYZOR_STATE_SPACE : \
+   (s) == PYZOR_STATE_DISCARD || (s) == PYZOR_STATE_DELIM || \
+   PYZOR_STATE_IS_FULL (s) ? PYZOR_STATE_DISCARD : \
+   (s) == PYZOR_STATE_NONE || (s) == PYZOR_STATE_SPACE ? \
+     ((c) == PYZOR_CLASS_ALPHA ? PYZOR_STATE_ALPHA (1) : PYZOR_STATE_OTHER (1)) : \
+   ((c) == PYZOR_CLASS_AT || \
+    ((c) == PYZOR_CLASS_COLON && PYZOR_STATE_IS_ALPHA (s))) ? PYZOR_STATE_DELIM : \
+   (c) == PYZOR_CLASS_ALPHA && PYZOR_STATE_IS_ALPHA (s) ? (s) + 1 : \
+   PYZOR_STATE_IS_ALPHA (s) ? \
+     PYZOR_STATE_OTHER ((s) - PYZOR_STATE_ALPHA (0) + 1) : (s) + 1)
+
+#define PYZOR_DFA_ACT(s, c) \
+  ((c) == PYZOR_CLASS_NL || (c) == PYZOR_CLASS_SPACE ? \
+     ((PYZOR_STATE_IS_TOKEN (s) ? PYZOR_ACT_EMIT : 0) | \
+      ((c) == PYZOR_CLASS_NL ? PYZOR_ACT_LINE : PYZOR_ACT_BLANK)) : \
+   (s) == PYZOR_STATE_DISCARD ? 0 : \
+   (s) == PYZOR_STATE_DELIM ? PYZOR_ACT_DELIM : \
+   PYZOR_STATE_IS_FULL (s) ? PYZOR_ACT_LONG : \
+   (((s) == PYZOR_STATE_NONE || (s) == PYZOR_STATE_SPACE ? PYZOR_ACT_START : 0) | \
+    ((c) == PYZOR_CLASS_LT ? PYZOR_ACT_LT : 0) | \
+    ((c) == PYZOR_CLASS_GT ? PYZOR_ACT_GT : 0)))
+
+#define PYZOR_DFA(s, c) \
+  (uint16_t)(PYZOR_DFA_NEXT (s, c) | (PYZOR_DFA_ACT (s, c) << PYZOR_DFA_SHIFT))
+
+#define PYZOR_DFA_ROW(s) { \
+  PYZOR_DFA (s, 0), PYZOR_DFA (s, 1), PYZOR_DFA (s, 2), PYZOR_DFA (s, 3), \
+  PYZOR_DFA (s, 4), PYZOR_DFA (s, 5), PYZOR_DFA (s, 6), PYZOR_DFA (s, 7) }
+
+#if PYZOR_STATES != 22 || PYZOR_CLASSES != 8
+# error "transition table does not match number of states or classes"
+#endif
+
+static const uint16_t pyzor_dfa[PYZOR_STATES][PYZOR_CLASSES] = {
+  PYZOR_DFA_ROW (0),  PYZOR_DFA_ROW (1),  PYZOR_DFA_ROW (2),
+  PYZOR_DFA_ROW (3),  PYZOR_DFA_ROW (4),  PYZOR_DFA_ROW (5),
+  PYZOR_DFA_ROW (6),  PYZOR_DFA_ROW (7),  PYZOR_DFA_ROW (8),
+  PYZOR_DFA_ROW (9),  PYZOR_DFA_ROW (10), PYZOR_DFA_ROW (11),
+  PYZOR_DFA_ROW (12), PYZOR_DFA_ROW (13), PYZOR_DFA_ROW (14),
+  PYZOR_DFA_ROW (15), PYZOR_DFA_ROW (16), PYZOR_DFA_ROW (17),
+  PYZOR_DFA_ROW (18), PYZOR_DFA_ROW (19), PYZOR_DFA_ROW (20),
+  PYZOR_DFA_ROW (21)
+};
 
-typedef enum pyzor_phase pyzor_phase_t;
+#undef PYZOR_DFA_ROW
+#undef PYZOR_DFA
+
+/* class of every byte, white space as in pyzor_isspace and letters as in
+   pyzor_isalpha, i.e. ASCII only */
+#define PYZOR_CLASS(c) \
+  ((c) == '\n' ? PYZOR_CLASS_NL : \
+   (c) == '\t' || (c) == '\f' || (c) == '\r' || (c) == ' ' ? PYZOR_CLASS_SPACE : \
+   (c) == ':' ? PYZOR_CLASS_COLON : \
+   (c) == '@' ? PYZOR_CLASS_AT : \
+   (c) == '<' ? PYZOR_CLASS_LT : \
+   (c) == '>' ? PYZOR_CLASS_GT : \
+   ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') ? PYZOR_CLASS_ALPHA : \
+   PYZOR_CLASS_OTHER)
+
+#define PYZOR_CLASS4(c) \
+  PYZOR_CLASS (c), PYZOR_CLASS (c + 1), PYZOR_CLASS (c + 2), PYZOR_CLASS (c + 3)
+#define PYZOR_CLASS16(c) \
+  PYZOR_CLASS4 (c), PYZOR_CLASS4 (c + 4), PYZOR_CLASS4 (c + 8), PYZOR_CLASS4 (c + 12)
+#define PYZOR_CLASS64(c) \
+  PYZOR_CLASS16 (c), PYZOR_CLASS16 (c + 16), PYZOR_CLASS16 (c + 32), PYZOR_CLASS16 (c + 48)
+
+static const unsigned char pyzor_class[256] = {
+  PYZOR_CLASS64 (0), PYZOR_CLASS64 (64), PYZOR_CLASS64 (128), PYZOR_CLASS64 (192)
+};
+
+#undef PYZOR_CLASS64
+#undef PYZOR_CLASS16
+#undef PYZOR_CLASS4
+#undef PYZOR_CLASS
+
+/* what to do with a token that runs up to the end of the input */
+typedef enum pyzor_end pyzor_end_t;
+
+enum pyzor_end {
+  pyzor_end_carry = 0, /* token continues in the next update */
+  pyzor_end_token, /* token ends, line continues */
+  pyzor_end_line /* token and line end, i.e. end of mime part */
+};
+
+/* lines are either kept in the line buffer until pyzor_digest_final, or
+   passed on as soon as they are complete. the latter is used to digest a
+   buffer in two passes, the first pass counts the lines and the second pass
+   hashes the selected lines. */
+typedef enum pyzor_mode pyzor_mode_t;
+
+enum pyzor_mode {
+  pyzor_mode_keep = 0,
+  pyzor_mode_count,
+  pyzor_mode_select
+};
 
-enum pyzor_phase {
-  pyzor_phase_none = 0,
-  pyzor_phase_space,
-  pyzor_phase_non_space,
-  pyzor_phase_alpha,
-  pyzor_phase_delim,
-  pyzor_phase_discard
+/* lines are kept in the line buffer as records, a delimiter that holds the
+   length followed by the line itself, which is the format in which lines are
+   exported. the index holds where every line is so that the selected lines
+   are located without walking the records in front of them. */
+typedef struct pyzor_line pyzor_line_t;
+
+struct pyzor_line {
+  size_t off; /* offset of line in line buffer */
+  size_t len;
+};
+
+/* lines of a spec, only used in count and select mode. line numbers start
+   at one and count the lines that are long enough for the spec */
+typedef struct pyzor_select pyzor_select_t;
+
+struct pyzor_select {
+  const pyzor_spec_t *spec;
+  size_t tot; /* number of lines for the spec */
+  size_t offs[PYZOR_SPEC_WINDOWS][2];
+  unsigned int noffs;
+  pyzor_sha1_t sum;
 };
 
 struct pyzor_digest {
-  pyzor_phase_t phase;
+  struct pyzor_digest_stats stats;
+  unsigned int state; /* tokenizer state */
+  pyzor_mode_t mode;
   /* line buffer */
   unsigned char *buf;
   size_t len;
   size_t cnt;
-  /* line counters */
+  /* line index, entry n is line n + 1 */
+  pyzor_line_t *lines;
+  size_t nlines; /* number of entries allocated */
   size_t tot; /* number of lines in buffer */
-  size_t nth; /* number of first line in buffer */
   /* offset counters */
   size_t delim; /* offset of current line delimiter in bytes */
-  size_t off; /* part lower bound */
   size_t lim; /* part upper bound */
-  size_t lt; /* first HTML tag open */
-  size_t gt; /* first HTML tag close */
+  size_t tag; /* open HTML tag, zero if none */
+  size_t line_min; /* shorter lines are dropped, kept across resets */
+  /* token cut off by the end of the previous update */
+  unsigned char tok[PYZOR_STRING_MIN];
+  size_t toklen;
+  /* specs counted or selected for, only used in count and select mode */
+  pyzor_select_t *sel;
+  size_t nsel;
+  /* context pool */
+  pyzor_digest_t *next;
+};
+
+struct pyzor_digest_pool {
+  pthread_mutex_t lock;
+  pyzor_digest_t *free; /* contexts ready for use */
+  size_t hwm; /* line buffers are shrunk to this size on release */
+  struct pyzor_digest_stats stats; /* of contexts that were released */
 };
 
+static int pyzor_digest_init (pyzor_digest_t *);
 static int pyzor_digest_grow (pyzor_digest_t *, size_t);
-static void pyzor_digest_scrub (pyzor_digest_t *);
-static int pyzor_digest_part_update (pyzor_digest_t *, pyzor_phase_t,
+static int pyzor_digest_shrink (pyzor_digest_t *, size_t);
+static int pyzor_digest_index (pyzor_digest_t *, size_t);
+static int pyzor_spec_check (const pyzor_spec_t *);
+static unsigned int pyzor_digest_select (const pyzor_spec_t *, size_t,
+  size_t [PYZOR_SPEC_WINDOWS][2]);
+static int pyzor_digest_part_update (pyzor_digest_t *,
   const unsigned char *, size_t, ssize_t, ssize_t);
 static int pyzor_digest_part_final (pyzor_digest_t *);
 static int pyzor_digest_part_term (pyzor_digest_t *);
-static void pyzor_digest_part_strip (pyzor_digest_t *); /* strip HTML tags */
-static int pyzor_digest_part_forget (pyzor_digest_t *, pyzor_phase_t);
 static int pyzor_digest_pre_update (pyzor_digest_t *, const unsigned char *,
   size_t, int, size_t *);
+static int pyzor_digest_scan (pyzor_digest_t *, const unsigned char *,
+  size_t, size_t, pyzor_end_t);
 
 int
 pyzor_digest_create (pyzor_digest_t **digest)
@@ -142,20 +826,53 @@ pyzor_digest_create (pyzor_digest_t **digest)
 
   assert (digest);
 
-  if (! (ptr = calloc (1, sizeof (pyzor_digest_t))) ||
-        (err = pyzor_digest_grow (ptr, 0)))
-  {
-    pyzor_digest_destroy (ptr);
+  if (! (ptr = calloc (1, sizeof (pyzor_digest_t))))
     return (ENOMEM);
+  ptr->line_min = PYZOR_LINE_MIN;
+  if ((err = pyzor_digest_init (ptr)) != 0) {
+    pyzor_digest_destroy (ptr);
+    return (err);
   }
 
-  ptr->cnt = PYZOR_DELIM_LEN;
-  ptr->lim = PYZOR_DELIM_LEN;
   *digest = ptr;
 
   return (0);
 }
 
+static int
+pyzor_digest_init (pyzor_digest_t *digest)
+{
+  int err;
+
+  assert (digest);
+
+  if (! digest->buf && (err = pyzor_digest_grow (digest, 0)))
+    return (err);
+
+  /* only the first delimiter is read before it is written */
+  memset (digest->buf, 0, PYZOR_DELIM_LEN);
+  memset (&digest->stats, 0, sizeof (digest->stats));
+  digest->state = PYZOR_STATE_NONE;
+  digest->mode = pyzor_mode_keep;
+  digest->cnt = PYZOR_DELIM_LEN;
+  digest->tot = 0;
+  digest->delim = 0;
+  digest->lim = PYZOR_DELIM_LEN;
+  digest->tag = 0;
+  digest->toklen = 0;
+
+  return (0);
+}
+
+/* prepare context for the next message, the line buffer is kept */
+int
+pyzor_digest_reset (pyzor_digest_t *digest)
+{
+  assert (digest);
+
+  return (pyzor_digest_init (digest));
+}
+
 void
 pyzor_digest_destroy (pyzor_digest_t *digest)
 {
@@ -164,6 +881,8 @@ pyzor_digest_destroy (pyzor_digest_t *digest)
   if (digest) {
     if (digest->buf)
       free (digest->buf);
+    if (digest->lines)
+      free (digest->lines);
     memset (digest, 0, sizeof (pyzor_digest_t));
     free (digest);
   }
@@ -177,9 +896,6 @@ pyzor_digest_grow (pyzor_digest_t *digest, size_t len)
 
   assert (digest);
 
-  if (len + PYZOR_DELIM_LEN < digest->len - digest->cnt)
-    return (0);
-  pyzor_digest_scrub (digest);
   if (len + PYZOR_DELIM_LEN < digest->len - digest->cnt)
     return (0);
 
@@ -197,278 +913,417 @@ pyzor_digest_grow (pyzor_digest_t *digest, size_t len)
     return (errno);
   memset (a_buf + digest->len, 0, a_len - digest->len);
 
+  PYZOR_PROBE2 (grow, digest->len, a_len);
+  digest->stats.grows++;
+  digest->stats.moved += digest->cnt;
+
   digest->buf = a_buf;
   digest->len = a_len;
 
   return (0);
 }
 
-static void
-pyzor_digest_scrub (pyzor_digest_t *digest)
+static int
+pyzor_digest_shrink (pyzor_digest_t *digest, size_t len)
 {
-  size_t cnt, len, nth, off;
+  unsigned char *a_buf;
 
   assert (digest);
-
-  /* do not remove lines unless we have at least this many lines */
-  if (digest->tot < PYZOR_LINE_MIN) {
-    /* spec is hard coded, three lines at twenty percent and three at
-       sixty percent */
-    nth = ((size_t)((float) digest->tot / 100.0) * 20);
-
-    if (nth > digest->nth) {
-      off = 0;
-
-      for (cnt = nth - digest->nth; cnt > 0; cnt--) {
-        off += sizeof (unsigned char);
-        memcpy (&len, digest->buf + off, sizeof (size_t));
-        /* bail if len is zero */
-        assert (len);
-        off += sizeof (size_t) + len;
-      }
-
-      memmove (digest->buf, digest->buf + off, digest->len - off);
-      digest->cnt   -= off;
-      digest->delim -= off;
-      if (digest->off)
-        digest->off -= off;
-      if (digest->lim)
-        digest->lim -= off;
-      if (digest->lt)
-        digest->lt  -= off;
-      if (digest->gt)
-        digest->gt  -= off;
-
-      digest->nth = nth;
-    }
+  /* must not be called with lines in the buffer */
+  assert (digest->cnt == PYZOR_DELIM_LEN);
+
+  /* index is allocated again for the next message that needs it */
+  if (digest->nlines * sizeof (pyzor_line_t) > len) {
+    free (digest->lines);
+    digest->lines = NULL;
+    digest->nlines = 0;
   }
-}
 
-static int
-pyzor_digest_part_update (pyzor_digest_t *digest,
-                          pyzor_phase_t phase,
-                          const unsigned char *str,
-                          size_t len,
-                          ssize_t lt, /* HTML tag open */
-                          ssize_t gt) /* HTML tag close */
-{
-  int err;
+  if (len < PYZOR_DELIM_LEN)
+    len = PYZOR_DELIM_LEN;
+  if (digest->len <= len)
+    return (0);
 
-  assert (digest);
-  assert (str);
-  assert (lt == -1 || (lt >= 0 && lt < len));
-  assert (gt == -1 || (gt >= 0 && gt < len));
+  if (! (a_buf = realloc (digest->buf, len)))
+    return (errno);
 
-  if ((err = pyzor_digest_grow (digest, len)) != 0)
-    return (err);
+  digest->buf = a_buf;
+  digest->len = len;
 
-  memcpy (digest->buf + digest->lim, str, len);
+  return (0);
+}
 
-  digest->cnt += len;
-  /* do not update offset if previous update was incomplete */
-  if (digest->phase == pyzor_phase_none ||
-      digest->phase == pyzor_phase_space)
-    digest->off = digest->lim;
-  if (! digest->lt && lt >= 0)
-    digest->lt = digest->off + lt;
-  if (! digest->gt && gt >= 0 && digest->lt && gt >= lt)
-    digest->gt = digest->off + gt;
-  digest->lim += len;
-  digest->phase = phase;
-
-  pyzor_digest_part_strip (digest);
-  pyzor_digest_part_term (digest);
+void
+pyzor_debug_level (int level)
+{
+  __atomic_store_n (&pyzor_debug, level, __ATOMIC_RELAXED);
+}
 
-  return (0);
+void
+pyzor_stats_timing (int on)
+{
+  __atomic_store_n (&pyzor_timing, on, __ATOMIC_RELAXED);
 }
 
-static int
-pyzor_digest_part_final (pyzor_digest_t *digest)
+static uint64_t
+pyzor_now (void)
 {
-  int err;
-  size_t len, off;
+  struct timespec ts;
 
-  assert (digest);
+  clock_gettime (CLOCK_MONOTONIC, &ts);
 
-  if ((digest->delim + PYZOR_DELIM_LEN) >= digest->lim) {
-    len = 0;
-  } else {
-    len = digest->lim - (digest->delim + PYZOR_DELIM_LEN);
-  }
+  return ((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+}
 
-  if (len >= PYZOR_LINE_MIN) {
-    off = digest->delim + sizeof (unsigned char);
-    memcpy (digest->buf + off, &len, sizeof (size_t));
-    /* update line counter only on first invocation */
-    if (! digest->tot)
-      digest->nth = 1;
-    digest->tot++;
-    /* no rewind */
-    digest->delim = digest->lim;
-  } else {
-    /* rewind */
-    digest->lim = digest->delim;
-  }
+void
+pyzor_digest_stats (pyzor_digest_t *digest, struct pyzor_digest_stats *stats)
+{
+  assert (digest);
+  assert (stats);
 
-  if ((err = pyzor_digest_grow (digest, 0)) != 0)
-    return (err);
-  if ((err = pyzor_digest_part_term (digest)) != 0)
-    return (err);
+  *stats = digest->stats;
+}
 
-  digest->cnt += PYZOR_DELIM_LEN;
-  digest->lim = digest->delim + PYZOR_DELIM_LEN;
-  digest->off = digest->lim;
-  digest->lt  = 0;
-  digest->gt  = 0;
-  digest->phase = pyzor_phase_none;
+/* counters are all of the same type */
+static void
+pyzor_digest_stats_add (struct pyzor_digest_stats *dst,
+                        const struct pyzor_digest_stats *src)
+{
+  uint64_t *a = (uint64_t *)dst;
+  const uint64_t *b = (const uint64_t *)src;
+  size_t pos;
 
-  return (err);
+  for (pos = 0; pos < sizeof (*dst) / sizeof (uint64_t); pos++)
+    a[pos] += b[pos];
 }
 
-static int
-pyzor_digest_part_term (pyzor_digest_t *digest)
+/* contexts are recycled through a pool so that a long running process does
+   not allocate once it has reached a steady state. a message that needed an
+   unusually large line buffer does not pin that memory, buffers larger than
+   the high-water mark are shrunk when the context is released. */
+int
+pyzor_digest_pool_create (pyzor_digest_pool_t **pool, size_t hwm)
 {
-  int err;
+  pyzor_digest_pool_t *ptr;
 
-  assert (digest);
+  assert (pool);
 
-  if (digest->len - digest->cnt < PYZOR_DELIM_LEN)
-    return (ENOBUFS);
+  if (! (ptr = calloc (1, sizeof (pyzor_digest_pool_t))))
+    return (ENOMEM);
+
+  pthread_mutex_init (&ptr->lock, NULL);
+  ptr->hwm = hwm;
+  *pool = ptr;
 
-  /* used space counter not updated here on purpose */
-  memset (digest->buf + digest->lim, '\0', PYZOR_DELIM_LEN);
   return (0);
 }
 
-static void
-pyzor_digest_part_strip (pyzor_digest_t *digest)
+void
+pyzor_digest_pool_destroy (pyzor_digest_pool_t *pool)
 {
-  size_t lim, len, off, pos;
+  pyzor_digest_t *digest;
 
-  assert (digest);
+  assert (pool);
 
-  for (; digest->lt && digest->gt > digest->lt; ) {
-    if (digest->gt < digest->lim) {
-      /* remove portion */
-      off = digest->lt;
-      lim = digest->gt + 1;
-      len = digest->lim - lim;
-
-      memmove (digest->buf + off, digest->buf + lim, len);
-
-      /* update counters */
-      digest->lim -= (lim - off);
-      if (digest->off >= digest->lt)
-        digest->off = digest->lim;
-      /* find open or close tags located in tail */
-      pos = off;
-      digest->lt = 0;
-      digest->gt = 0;
-
-      for (; pos < digest->lim && ! digest->lt && ! digest->gt; pos++) {
-        if (! digest->lt && digest->buf[pos] == '<')
-          digest->lt = pos;
-        else if (! digest->gt && digest->buf[pos] == '>' && digest->lt)
-          digest->gt = pos;
-      }
-    } else {
-      digest->lim = digest->lt;
-      /* no need to look any further */
-      digest->lt = 0;
-      digest->gt = 0;
+  if (pool) {
+    for (; (digest = pool->free); ) {
+      pool->free = digest->next;
+      pyzor_digest_destroy (digest);
     }
+    pthread_mutex_destroy (&pool->lock);
+    memset (pool, 0, sizeof (pyzor_digest_pool_t));
+    free (pool);
   }
 }
 
-static int
-pyzor_digest_part_forget (pyzor_digest_t *digest, pyzor_phase_t phase)
+int
+pyzor_digest_pool_get (pyzor_digest_pool_t *pool, pyzor_digest_t **digest)
 {
-  int err;
+  pyzor_digest_t *ptr;
 
+  assert (pool);
   assert (digest);
 
-  if (digest->off <= digest->delim ||
-      digest->off >= digest->lim   ||
-      digest->lim <= digest->delim)
-    return (0);
+  pthread_mutex_lock (&pool->lock);
+  if ((ptr = pool->free))
+    pool->free = ptr->next;
+  pthread_mutex_unlock (&pool->lock);
 
-  digest->cnt -= digest->lim - digest->off;
-  digest->lim  = digest->off;
-  if (digest->lt >= digest->off)
-    digest->lt = 0;
-  if (digest->gt >= digest->off)
-    digest->gt = 0;
-  digest->phase = phase;
+  if (! ptr)
+    return (pyzor_digest_create (digest));
 
-  err = pyzor_digest_part_term (digest);
-  return (err);
+  ptr->next = NULL;
+  *digest = ptr;
+
+  return (0);
 }
 
-static int
-pyzor_digest_pre_update (pyzor_digest_t *digest,
-                         const unsigned char *str,
-                         size_t len,
-                         int eom,
-                         size_t *num)
+void
+pyzor_digest_pool_put (pyzor_digest_pool_t *pool, pyzor_digest_t *digest)
 {
-  int err;
-  size_t cnt, off, pos;
-  ssize_t lt, gt;
-  pyzor_phase_t phase;
+  struct pyzor_digest_stats stats;
 
+  assert (pool);
   assert (digest);
-  assert (str);
-
-  lt = -1;
-  gt = -1;
-  pos = 0;
-  phase = digest->phase;
 
-  if (phase == pyzor_phase_non_space ||
-      phase == pyzor_phase_alpha     ||
-      phase == pyzor_phase_delim)
+  /* contexts are handed out with the default configuration */
+  stats = digest->stats;
+  digest->line_min = PYZOR_LINE_MIN;
+  if (pyzor_digest_reset (digest) != 0 ||
+      pyzor_digest_shrink (digest, pool->hwm) != 0)
   {
-    /* unlikely, but you can never be to sure */
-    if (digest->off <= digest->delim || digest->off >= digest->lim)
-      return (EINVAL);
+    pyzor_digest_destroy (digest);
+    digest = NULL;
+  }
 
-    cnt = digest->lim - digest->off;
+  pthread_mutex_lock (&pool->lock);
+  pyzor_digest_stats_add (&pool->stats, &stats);
+  if (digest) {
+    digest->next = pool->free;
+    pool->free = digest;
+  }
+  pthread_mutex_unlock (&pool->lock);
+}
 
-    for (; cnt; pos++) {
-      if (pos == len || pyzor_isspace (str[pos])) {
-        if ((pos == len && eom) || str[pos] == '\n')
-          phase = pyzor_phase_none;
-        else if (! eom)
-          phase = pyzor_phase_space;
+void
+pyzor_digest_pool_stats (pyzor_digest_pool_t *pool, struct pyzor_digest_stats *stats)
+{
+  assert (pool);
+  assert (stats);
 
-        if ((err = pyzor_digest_part_update (digest, phase, str, pos, lt, gt)))
-          return (err);
+  pthread_mutex_lock (&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock (&pool->lock);
+}
 
-        if (phase == pyzor_phase_none) {
-          if ((err = pyzor_digest_part_final (digest)))
-            return (err);
-        }
+/* make room in the index for cnt more lines */
+static int
+pyzor_digest_index (pyzor_digest_t *digest, size_t cnt)
+{
+  pyzor_line_t *a_lines;
+  size_t a_len;
 
-        break;
+  assert (digest);
 
-      } else {
-        ++cnt;
-
-        if (cnt >= PYZOR_STRING_MIN || phase == pyzor_phase_delim) {
-          if ((err = pyzor_digest_part_forget (digest, pyzor_phase_discard)))
-            return (err);
-          break;
-        } else if (str[pos] == '<') {
-          lt = pos;
-        } else if (str[pos] == '>') {
-          gt = pos;
-        } else if (str[pos] == '@') {
-          phase = pyzor_phase_delim;
-        } else if (str[pos] == ':' && phase == pyzor_phase_alpha) {
-          phase = pyzor_phase_delim;
-        }
+  if (cnt <= digest->nlines - digest->tot)
+    return (0);
+  if (cnt > (SIZE_MAX / sizeof (pyzor_line_t)) - digest->tot)
+    return (EOVERFLOW);
+
+  a_len = digest->nlines ? digest->nlines : PYZOR_INDEX_MIN;
+  for (; a_len < digest->tot + cnt; ) {
+    if (a_len > (SIZE_MAX / sizeof (pyzor_line_t)) / 2)
+      a_len = digest->tot + cnt;
+    else
+      a_len *= 2;
+  }
+
+  if (! (a_lines = realloc (digest->lines, a_len * sizeof (pyzor_line_t))))
+    return (errno);
+
+  digest->lines = a_lines;
+  digest->nlines = a_len;
+  digest->stats.index_grows++;
+
+  return (0);
+}
+
+static int
+pyzor_digest_part_update (pyzor_digest_t *digest,
+                          const unsigned char *str,
+                          size_t len,
+                          ssize_t lt, /* first HTML tag open in str */
+                          ssize_t gt) /* first HTML tag close in str */
+{
+  int err;
+  const unsigned char *ptr;
+  size_t pos;
+
+  assert (digest);
+  assert (str);
+  assert (lt == -1 || (lt >= 0 && lt < len));
+  assert (gt == -1 || (gt >= 0 && gt < len));
+
+  if ((err = pyzor_digest_grow (digest, len)) != 0)
+    return (err);
+
+  digest->cnt += len;
+  digest->stats.tokens++;
+
+  /* HTML tags are elided while the token is copied, bytes that are already
+     written are never moved. a tag is opened by the first '<' of a token if
+     none is open and closed by the first '>' of a token that does not come
+     before its first '<', so at most one tag is closed per token. the tag is
+     dropped by rewinding to where it was opened, which may be in a token
+     written earlier on the same line. the open tag is part of the context,
+     a tag may therefore span any number of tokens and updates. */
+  if (! digest->tag && lt >= 0)
+    digest->tag = digest->lim + lt;
+
+  if (digest->tag && gt >= 0 && gt >= lt) {
+    PYZOR_PROBE1 (tag, (digest->lim + (size_t)gt + 1) - digest->tag);
+    digest->stats.tags++;
+    /* bytes in front of a tag opened by this token */
+    if (digest->tag > digest->lim) {
+      memcpy (digest->buf + digest->lim, str, digest->tag - digest->lim);
+      digest->stats.copied += digest->tag - digest->lim;
+    }
+    digest->lim = digest->tag;
+    pos = (size_t)gt + 1;
+    memcpy (digest->buf + digest->lim, str + pos, len - pos);
+    if ((ptr = memchr (str + pos, '<', len - pos)))
+      digest->tag = digest->lim + (size_t)(ptr - (str + pos));
+    else
+      digest->tag = 0;
+    digest->lim += len - pos;
+    digest->stats.copied += len - pos;
+  } else {
+    memcpy (digest->buf + digest->lim, str, len);
+    digest->lim += len;
+    digest->stats.copied += len;
+  }
+
+  pyzor_digest_part_term (digest);
+
+  return (0);
+}
+
+/* whether line num is in one of the windows */
+static int
+pyzor_digest_selected (size_t offs[][2], unsigned int noffs, size_t num)
+{
+  unsigned int win;
+
+  for (win = 0; win < noffs; win++) {
+    if (num >= offs[win][0] && num <= offs[win][1])
+      return (1);
+  }
+
+  return (0);
+}
+
+static int
+pyzor_digest_part_final (pyzor_digest_t *digest)
+{
+  pyzor_select_t *sel;
+  int err;
+  size_t len, off;
+
+  assert (digest);
+
+  if ((digest->delim + PYZOR_DELIM_LEN) >= digest->lim) {
+    len = 0;
+  } else {
+    len = digest->lim - (digest->delim + PYZOR_DELIM_LEN);
+  }
+
+  if (len >= digest->line_min) {
+    PYZOR_PROBE2 (line, digest->tot + 1, len);
+    digest->stats.lines++;
+  } else {
+    PYZOR_PROBE1 (short__line, len);
+    digest->stats.short_lines++;
+  }
+
+  if (len >= digest->line_min && digest->mode != pyzor_mode_keep) {
+    /* line is passed on and forgotten */
+    digest->tot++;
+    for (sel = digest->sel; sel < digest->sel + digest->nsel; sel++) {
+      if (len < sel->spec->line_min)
+        continue;
+      sel->tot++;
+      if (digest->mode == pyzor_mode_select &&
+          pyzor_digest_selected (sel->offs, sel->noffs, sel->tot))
+      {
+        pyzor_sha1_update (&sel->sum, digest->buf + digest->delim + PYZOR_DELIM_LEN, len);
       }
     }
+    digest->lim = digest->delim;
+    digest->cnt = digest->delim;
+  } else if (len >= digest->line_min) {
+    if ((err = pyzor_digest_index (digest, 1)) != 0)
+      return (err);
+    off = digest->delim + sizeof (unsigned char);
+    memcpy (digest->buf + off, &len, sizeof (size_t));
+    digest->lines[digest->tot].off = digest->delim + PYZOR_DELIM_LEN;
+    digest->lines[digest->tot].len = len;
+    digest->tot++;
+    /* no rewind */
+    digest->delim = digest->lim;
+  } else {
+    /* rewind */
+    digest->lim = digest->delim;
+    digest->cnt = digest->delim;
+  }
+
+  if ((err = pyzor_digest_grow (digest, 0)) != 0)
+    return (err);
+  if ((err = pyzor_digest_part_term (digest)) != 0)
+    return (err);
+
+  digest->cnt += PYZOR_DELIM_LEN;
+  digest->lim = digest->delim + PYZOR_DELIM_LEN;
+  digest->tag = 0;
+  digest->state = PYZOR_STATE_NONE;
+
+  return (err);
+}
+
+static int
+pyzor_digest_part_term (pyzor_digest_t *digest)
+{
+  int err;
+
+  assert (digest);
+
+  if (digest->len - digest->cnt < PYZOR_DELIM_LEN)
+    return (ENOBUFS);
+
+  /* used space counter not updated here on purpose */
+  memset (digest->buf + digest->lim, '\0', PYZOR_DELIM_LEN);
+  return (0);
+}
+
+/* complete a token that was cut off by the end of the previous update. a
+   token that is kept is shorter than PYZOR_STRING_MIN, so it is completed in
+   the carry buffer and then scanned as a whole. the digest therefore does
+   not depend on how a part is split into updates. */
+static int
+pyzor_digest_pre_update (pyzor_digest_t *digest,
+                         const unsigned char *str,
+                         size_t len,
+                         int eom,
+                         size_t *num)
+{
+  int err;
+  size_t pos, toklen;
+
+  assert (digest);
+  assert (str);
+  assert (num);
+
+  pos = 0;
+
+  if (digest->toklen != 0) {
+    for (; pos < len && pyzor_class[str[pos]] < PYZOR_CLASS_SPACE &&
+           digest->toklen < PYZOR_STRING_MIN; pos++)
+      digest->tok[digest->toklen++] = str[pos];
+
+    /* token is still cut off */
+    if (pos == len && ! eom && digest->toklen < PYZOR_STRING_MIN) {
+      *num = pos;
+      return (0);
+    }
+
+    /* a token of PYZOR_STRING_MIN bytes is dropped by the table, the rest
+       of it is skipped by the scan that follows */
+    toklen = digest->toklen;
+    digest->toklen = 0;
+    digest->state = PYZOR_STATE_SPACE;
+    err = pyzor_digest_scan (digest, digest->tok, toklen, 0,
+      toklen == PYZOR_STRING_MIN ? pyzor_end_carry : pyzor_end_token);
+    if (err != 0)
+      return (err);
   }
 
   *num = pos;
@@ -476,145 +1331,837 @@ pyzor_digest_pre_update (pyzor_digest_t *digest,
   return (0);
 }
 
-int
-pyzor_digest_update (pyzor_digest_t *digest,
+/* perform the actions of a transition that ends a token or a line, or
+   that drops a token */
+static int
+pyzor_digest_action (pyzor_digest_t *digest,
+                     unsigned int act,
                      const unsigned char *str,
-                     size_t len, /* number of bytes in str */
-                     int eom) /* indicates end of mime part */
+                     size_t off, /* offset of token in str */
+                     size_t pos, /* offset of byte that triggered act */
+                     ssize_t lt,
+                     ssize_t gt)
 {
   int err;
-  pyzor_phase_t phase, phase_ii;
-  size_t off, pos;
+
+  if (act & PYZOR_ACT_EMIT) {
+    err = pyzor_digest_part_update (digest, str + off, pos - off,
+      lt >= 0 ? lt - (ssize_t)off : -1, gt >= 0 ? gt - (ssize_t)off : -1);
+    if (err != 0)
+      return (err);
+  }
+  if (act & PYZOR_ACT_LINE) {
+    if ((err = pyzor_digest_part_final (digest)) != 0)
+      return (err);
+  }
+  if (act & PYZOR_ACT_LONG) {
+    PYZOR_PROBE1 (drop, PYZOR_DROP_LONG);
+    digest->stats.long_tokens++;
+  }
+  if (act & PYZOR_ACT_DELIM) {
+    PYZOR_PROBE1 (drop, PYZOR_DROP_DELIM);
+    digest->stats.delim_tokens++;
+  }
+
+  return (0);
+}
+
+static int
+pyzor_digest_scan (pyzor_digest_t *digest,
+                   const unsigned char *str,
+                   size_t len, /* number of bytes in str */
+                   size_t pos, /* offset to start at */
+                   pyzor_end_t end) /* what to do at the end of str */
+{
+  int err;
+  unsigned int act, state;
+  size_t off;
   ssize_t lt, gt;
 
   assert (digest);
   assert (str);
+  /* tokens cut off are completed by pyzor_digest_pre_update */
+  assert (! PYZOR_STATE_IS_TOKEN (digest->state));
 
-  if ((err = pyzor_digest_pre_update (digest, str, len, eom, &pos)))
-    return (err);
-
-  phase = digest->phase;
+  state = digest->state;
   off = 0;
   lt = -1;
   gt = -1;
 
-  for (;; pos++) {
-    if (pos == len || pyzor_isspace (str[pos])) {
-      if ((pos == len && eom) || str[pos] == '\n')
-        phase_ii = pyzor_phase_none;
-      else
-        phase_ii = pyzor_phase_space;
-
-      /* update intermediate buffer */
-      if (phase == pyzor_phase_non_space ||
-          phase == pyzor_phase_alpha     ||
-          phase == pyzor_phase_delim)
-      {
-        if ((err = pyzor_digest_part_update (digest, phase_ii, str+off, pos-off, (lt >= 0 ? lt-off : lt), (gt >= 0 ? gt-off : gt))))
-          return (err);
-      }
+  /* rest of a token dropped in the previous update */
+  if (state == PYZOR_STATE_DISCARD)
+    pos = pyzor_scan_space (str, pos, len);
 
-      if (phase_ii == pyzor_phase_none)
-      {
-        if ((err = pyzor_digest_part_final (digest)))
-          return (err);
+  for (; pos < len; pos++) {
+    act = pyzor_dfa[state][pyzor_class[str[pos]]];
+    state = act & ((1u << PYZOR_DFA_SHIFT) - 1);
+    act >>= PYZOR_DFA_SHIFT;
+
+    /* most bytes extend a token */
+    if (act == 0)
+      continue;
+
+    if (act & (PYZOR_ACT_START | PYZOR_ACT_LT | PYZOR_ACT_GT)) {
+      if (act & PYZOR_ACT_START) {
+        off = pos;
+        lt = -1;
+        gt = -1;
       }
+      if ((act & PYZOR_ACT_LT) && lt == -1)
+        lt = (ssize_t)pos;
+      if ((act & PYZOR_ACT_GT) && gt == -1)
+        gt = (ssize_t)pos;
+      continue;
+    }
 
-      off = 0;
-      lt = -1;
-      gt = -1;
-      phase = phase_ii;
+    if ((err = pyzor_digest_action (digest, act, str, off, pos, lt, gt)))
+      return (err);
 
-      if (pos == len)
-        break;
+    /* consecutive white space other than newline has no effect and tokens
+       that are discarded are dropped as a whole */
+    if (act & PYZOR_ACT_BLANK)
+      pos = pyzor_scan_blank (str, pos + 1, len) - 1;
+    else if (act & (PYZOR_ACT_LONG | PYZOR_ACT_DELIM))
+      pos = pyzor_scan_space (str, pos + 1, len) - 1;
+  }
 
-    } else if (phase != pyzor_phase_discard) {
-      if (off && ((pos - off) + 1) >= PYZOR_STRING_MIN || (phase == pyzor_phase_delim)) {
-        phase = pyzor_phase_discard;
-      } else if (str[pos] == ':' && (phase == pyzor_phase_alpha)) {
-        phase = pyzor_phase_delim;
-      } else if (str[pos] == '@' && (phase == pyzor_phase_alpha || phase == pyzor_phase_non_space)) {
-        phase = pyzor_phase_delim;
-      } else {
-        if (phase == pyzor_phase_none || phase == pyzor_phase_space) {
-          off = pos;
-          if (pyzor_isalpha (str[pos]))
-            phase = pyzor_phase_alpha;
-          else
-            phase = pyzor_phase_non_space;
-        } else if (phase == pyzor_phase_alpha) {
-          if (! pyzor_isalpha (str[pos]))
-            phase = pyzor_phase_non_space;
-        }
-
-        if (str[pos] == '<' && lt == -1)
-          lt = pos;
-        else if (str[pos] == '>' && gt == -1)
-          gt = pos;
-      }
+  if (end == pyzor_end_carry) {
+    /* token is cut off, keep it until the next update */
+    if (PYZOR_STATE_IS_TOKEN (state)) {
+      memcpy (digest->tok, str + off, len - off);
+      digest->toklen = len - off;
     }
+  } else {
+    /* end of str acts as white space or as newline */
+    act = pyzor_dfa[state][end == pyzor_end_line ? PYZOR_CLASS_NL : PYZOR_CLASS_SPACE];
+    state = act & ((1u << PYZOR_DFA_SHIFT) - 1);
+    act >>= PYZOR_DFA_SHIFT;
+    if ((err = pyzor_digest_action (digest, act, str, off, len, lt, gt)))
+      return (err);
   }
 
+  digest->state = state;
+
   return (0);
 }
 
+static int
+pyzor_digest_normalize (pyzor_digest_t *digest,
+                        const unsigned char *str,
+                        size_t len,
+                        int eom)
+{
+  int err;
+  size_t pos;
+
+  if ((err = pyzor_digest_pre_update (digest, str, len, eom, &pos)))
+    return (err);
+
+  /* token is still cut off */
+  if (digest->toklen != 0)
+    return (0);
+
+  return (pyzor_digest_scan (digest, str, len, pos,
+                             eom ? pyzor_end_line : pyzor_end_carry));
+}
+
 int
-pyzor_digest_final (unsigned char *str, size_t len, pyzor_digest_t *digest)
+pyzor_digest_update (pyzor_digest_t *digest,
+                     const unsigned char *str,
+                     size_t len, /* number of bytes in str */
+                     int eom) /* indicates end of mime part */
+{
+  int err;
+  uint64_t start;
+
+  assert (digest);
+  assert (str);
+
+  PYZOR_PROBE2 (update, len, eom);
+  digest->stats.bytes += len;
+  digest->stats.updates++;
+
+  if (! __atomic_load_n (&pyzor_timing, __ATOMIC_RELAXED))
+    return (pyzor_digest_normalize (digest, str, len, eom));
+
+  start = pyzor_now ();
+  err = pyzor_digest_normalize (digest, str, len, eom);
+  digest->stats.update_ns += pyzor_now () - start;
+
+  return (err);
+}
+
+/* normalized lines are exchanged as the records they are kept as in the line
+   buffer. records can only be taken out or put in between mime parts, i.e.
+   after an update with eom set. */
+static int
+pyzor_digest_boundary (pyzor_digest_t *digest)
 {
-  /* Pyzor's DataDigestSpec is hard-coded. if the number of lines after
-     normalization is equal to or more than four, the algorithm evaluates
-     three lines at twenty percent and three lines at sixty percent. */
+  return (digest->mode == pyzor_mode_keep &&
+          digest->state == PYZOR_STATE_NONE &&
+          digest->toklen == 0 &&
+          digest->lim == digest->delim + PYZOR_DELIM_LEN);
+}
+
+/* position to pass to pyzor_digest_export to get the lines of the parts that
+   follow */
+size_t
+pyzor_digest_tell (pyzor_digest_t *digest)
+{
+  assert (digest);
+
+  return (digest->delim);
+}
+
+int
+pyzor_digest_export (pyzor_digest_t *digest,
+                     size_t pos,
+                     const unsigned char **str,
+                     size_t *len)
+{
+  assert (digest);
+  assert (str);
+  assert (len);
 
-  GChecksum *sum;
+  if (! pyzor_digest_boundary (digest) || pos > digest->delim)
+    return (EINVAL);
+
+  *str = digest->buf + pos;
+  *len = digest->delim - pos;
+
+  return (0);
+}
+
+int
+pyzor_digest_import (pyzor_digest_t *digest,
+                     const unsigned char *str,
+                     size_t len)
+{
+  int err;
   size_t cnt, num, pos;
-  size_t off, offs[2][2];
-  unsigned int inc;
 
   assert (digest);
+  assert (str || ! len);
 
-  inc = sizeof (size_t);
-  sum = g_checksum_new (G_CHECKSUM_SHA1);
-  /* FIXME: implement error handling */
+  if (! pyzor_digest_boundary (digest))
+    return (EINVAL);
 
-  if (digest->tot > PYZOR_LINES_ATOMIC) {
-    off = (20.0 * digest->tot) / 100.0;
-    off++;
-    offs[0][0] = off;
-    offs[0][1] = off + 2;
-    off = (60.0 * digest->tot) / 100.0;
+  /* records must be complete */
+  for (cnt = 0, pos = 0; pos < len; cnt++) {
+    if (len - pos < PYZOR_DELIM_LEN || str[pos] != '\0')
+      return (EINVAL);
+    memcpy (&num, str + pos + 1, sizeof (size_t));
+    pos += PYZOR_DELIM_LEN;
+    if (num < digest->line_min || num > len - pos)
+      return (EINVAL);
+    pos += num;
+  }
+
+  if (cnt == 0)
+    return (0);
+  if ((err = pyzor_digest_grow (digest, len)) != 0 ||
+      (err = pyzor_digest_index (digest, cnt)) != 0)
+    return (err);
+
+  memcpy (digest->buf + digest->delim, str, len);
+  digest->stats.copied += len;
+  for (pos = 0; pos < len; digest->tot++) {
+    memcpy (&num, str + pos + 1, sizeof (size_t));
+    pos += PYZOR_DELIM_LEN;
+    digest->lines[digest->tot].off = digest->delim + pos;
+    digest->lines[digest->tot].len = num;
+    pos += num;
+  }
+  digest->cnt += len;
+  digest->delim += len;
+  /* delimiter of the next line */
+  memset (digest->buf + digest->delim, '\0', PYZOR_DELIM_LEN);
+  digest->lim = digest->delim + PYZOR_DELIM_LEN;
+
+  return (0);
+}
+
+/* lines the context keeps, e.g. to derive a fingerprint from. line numbers
+   start at one */
+size_t
+pyzor_digest_lines (pyzor_digest_t *digest)
+{
+  assert (digest);
+
+  return (digest->mode == pyzor_mode_keep ? digest->tot : 0);
+}
+
+int
+pyzor_digest_line (pyzor_digest_t *digest,
+                   size_t num,
+                   const unsigned char **str,
+                   size_t *len)
+{
+  assert (digest);
+  assert (str);
+  assert (len);
+
+  if (digest->mode != pyzor_mode_keep || num == 0 || num > digest->tot)
+    return (EINVAL);
+
+  *str = digest->buf + digest->lines[num - 1].off;
+  *len = digest->lines[num - 1].len;
+
+  return (0);
+}
+
+/* the complete state of a context as a blob, so that a message can be fed
+   in pieces by different processes or after a pause. values are stored in
+   host byte order, a blob is only valid on a host with the same byte order
+   and word size, which the magic and the word size in the header assert.
+
+   header:  u32 magic, u8 version, u8 word size, u8 state, u8 token length,
+            u64 delimiter, u64 limit, u64 tag, u64 number of counters
+   body:    counters, cut off token, line buffer up to the limit
+
+   counters are a prefix of struct pyzor_digest_stats, counters a blob does
+   not have are zero after it is loaded. */
+
+#define PYZOR_SAVE_MAGIC (0x707a7373u)
+#define PYZOR_SAVE_VERSION (1)
+#define PYZOR_SAVE_HDR_LEN (8 + 4 * sizeof (uint64_t))
+#define PYZOR_SAVE_STATS (sizeof (struct pyzor_digest_stats) / sizeof (uint64_t))
+
+static unsigned char *
+pyzor_save_put (unsigned char *str, uint64_t num)
+{
+  memcpy (str, &num, sizeof (num));
+  return (str + sizeof (num));
+}
+
+static const unsigned char *
+pyzor_save_get (const unsigned char *str, uint64_t *num)
+{
+  memcpy (num, str, sizeof (*num));
+  return (str + sizeof (*num));
+}
+
+int
+pyzor_digest_save (pyzor_digest_t *digest,
+                   unsigned char *str,
+                   size_t len, /* number of bytes available in str */
+                   size_t *num) /* number of bytes needed */
+{
+  uint32_t magic;
+  size_t need;
+
+  assert (digest);
+  assert (str || ! len);
+  assert (num);
+
+  /* lines of pyzor_digest_buffer are never kept */
+  if (digest->mode != pyzor_mode_keep)
+    return (EINVAL);
+
+  need = PYZOR_SAVE_HDR_LEN + sizeof (digest->stats) + digest->toklen + digest->lim;
+  *num = need;
+  if (len < need)
+    return (ENOBUFS);
+
+  magic = PYZOR_SAVE_MAGIC;
+  memcpy (str, &magic, sizeof (magic));
+  str[4] = PYZOR_SAVE_VERSION;
+  str[5] = (unsigned char)sizeof (size_t);
+  str[6] = (unsigned char)digest->state;
+  str[7] = (unsigned char)digest->toklen;
+  str = pyzor_save_put (str + 8, digest->delim);
+  str = pyzor_save_put (str, digest->lim);
+  str = pyzor_save_put (str, digest->tag);
+  str = pyzor_save_put (str, PYZOR_SAVE_STATS);
+  memcpy (str, &digest->stats, sizeof (digest->stats));
+  str += sizeof (digest->stats);
+  memcpy (str, digest->tok, digest->toklen);
+  str += digest->toklen;
+  memcpy (str, digest->buf, digest->lim);
+
+  return (0);
+}
+
+/* replace the state of a context by a blob from pyzor_digest_save. the
+   context is reset if the blob is rejected */
+int
+pyzor_digest_load (pyzor_digest_t *digest, const unsigned char *str, size_t len)
+{
+  uint64_t delim, lim, tag, cnt;
+  uint32_t magic;
+  unsigned int state;
+  size_t lines, num, pos, toklen;
+  const unsigned char *buf, *stats;
+  int err;
+
+  assert (digest);
+  assert (str || ! len);
+
+  if ((err = pyzor_digest_init (digest)) != 0)
+    return (err);
+
+  if (len < PYZOR_SAVE_HDR_LEN)
+    return (EINVAL);
+  memcpy (&magic, str, sizeof (magic));
+  if (magic != PYZOR_SAVE_MAGIC)
+    return (EINVAL);
+  if (str[4] != PYZOR_SAVE_VERSION || str[5] != sizeof (size_t))
+    return (ENOTSUP);
+
+  state = str[6];
+  toklen = str[7];
+  buf = pyzor_save_get (str + 8, &delim);
+  buf = pyzor_save_get (buf, &lim);
+  buf = pyzor_save_get (buf, &tag);
+  buf = pyzor_save_get (buf, &cnt);
+  len -= PYZOR_SAVE_HDR_LEN;
+
+  /* a cut off token is kept if, and only if, the state is in a token */
+  if (state >= PYZOR_STATES ||
+      (PYZOR_STATE_IS_TOKEN (state) ? toklen == 0 || toklen >= PYZOR_STRING_MIN
+                                    : toklen != 0))
+    return (EINVAL);
+  if (cnt > len / sizeof (uint64_t) ||
+      len - cnt * sizeof (uint64_t) < toklen ||
+      len - cnt * sizeof (uint64_t) - toklen != lim)
+    return (EINVAL);
+  if (lim > PYZOR_SIZE_MAX || lim < PYZOR_DELIM_LEN || delim > lim - PYZOR_DELIM_LEN ||
+      (tag != 0 && (tag < delim + PYZOR_DELIM_LEN || tag >= lim)))
+    return (EINVAL);
+
+  stats = buf;
+  buf += cnt * sizeof (uint64_t);
+  memcpy (digest->tok, buf, toklen);
+  buf += toklen;
+
+  /* lines that are complete must be records that end at the delimiter of
+     the current line */
+  for (lines = 0, pos = 0; pos < delim; lines++) {
+    if (delim - pos < PYZOR_DELIM_LEN || buf[pos] != '\0')
+      return (EINVAL);
+    memcpy (&num, buf + pos + 1, sizeof (size_t));
+    pos += PYZOR_DELIM_LEN;
+    if (num < digest->line_min || num > delim - pos)
+      return (EINVAL);
+    pos += num;
+  }
+  if (buf[delim] != '\0')
+    return (EINVAL);
+
+  if ((err = pyzor_digest_grow (digest, lim)) != 0 ||
+      (err = pyzor_digest_index (digest, lines)) != 0)
+  {
+    pyzor_digest_init (digest);
+    return (err);
+  }
+
+  memcpy (digest->buf, buf, lim);
+  for (pos = 0; pos < delim; digest->tot++) {
+    memcpy (&num, buf + pos + 1, sizeof (size_t));
+    pos += PYZOR_DELIM_LEN;
+    digest->lines[digest->tot].off = pos;
+    digest->lines[digest->tot].len = num;
+    pos += num;
+  }
+
+  digest->state = state;
+  digest->toklen = toklen;
+  digest->cnt = lim;
+  digest->delim = delim;
+  digest->lim = lim;
+  digest->tag = tag;
+
+  if ((err = pyzor_digest_grow (digest, 0)) != 0 ||
+      (err = pyzor_digest_part_term (digest)) != 0)
+  {
+    pyzor_digest_init (digest);
+    return (err);
+  }
+
+  memcpy (&digest->stats, stats,
+    (cnt < PYZOR_SAVE_STATS ? cnt : PYZOR_SAVE_STATS) * sizeof (uint64_t));
+
+  return (0);
+}
+
+const pyzor_spec_t pyzor_spec_default = {
+  PYZOR_LINES_ATOMIC, PYZOR_LINE_MIN, 2, { { 20, 3 }, { 60, 3 } }
+};
+
+static int
+pyzor_spec_check (const pyzor_spec_t *spec)
+{
+  unsigned int win;
+
+  assert (spec);
+
+  if (spec->line_min == 0 || spec->nwindows > PYZOR_SPEC_WINDOWS)
+    return (EINVAL);
+  for (win = 0; win < spec->nwindows; win++) {
+    if (spec->windows[win].percent > 100 || spec->windows[win].count == 0)
+      return (EINVAL);
+    if (win > 0 && spec->windows[win].percent < spec->windows[win - 1].percent)
+      return (EINVAL);
+  }
+
+  return (0);
+}
+
+/* a spec is written as windows, an atomic line count and a minimum line
+   length separated by slashes, e.g. "20:3,60:3/4/8". windows are a comma
+   separated list of percent:count or "all" for the whole body. fields that
+   are left out or empty are taken from the default spec. */
+int
+pyzor_spec_parse (pyzor_spec_t *spec, const char *str)
+{
+  pyzor_spec_t tmp;
+  unsigned long num[2];
+  unsigned int cnt;
+  char *end;
+
+  assert (spec);
+  assert (str);
+
+  tmp = pyzor_spec_default;
+
+  if (strncmp (str, "all", 3) == 0) {
+    tmp.nwindows = 0;
+    str += 3;
+  } else if (*str != '/' && *str != '\0') {
+    for (tmp.nwindows = 0; ; str = end + 1) {
+      if (tmp.nwindows == PYZOR_SPEC_WINDOWS || ! pyzor_isdigit (*str))
+        return (EINVAL);
+      num[0] = strtoul (str, &end, 10);
+      if (*end != ':' || ! pyzor_isdigit (end[1]))
+        return (EINVAL);
+      num[1] = strtoul (end + 1, &end, 10);
+      if (num[0] > 100 || num[1] > UINT_MAX)
+        return (EINVAL);
+      tmp.windows[tmp.nwindows].percent = (unsigned int)num[0];
+      tmp.windows[tmp.nwindows].count = (unsigned int)num[1];
+      tmp.nwindows++;
+      if (*end != ',')
+        break;
+    }
+    str = end;
+  }
+
+  for (cnt = 0; *str == '/' && cnt < 2; cnt++) {
+    str++;
+    if (*str == '/' || *str == '\0')
+      continue;
+    if (! pyzor_isdigit (*str))
+      return (EINVAL);
+    num[0] = strtoul (str, &end, 10);
+    if (cnt == 0)
+      tmp.atomic = num[0];
+    else
+      tmp.line_min = num[0];
+    str = end;
+  }
+
+  if (*str != '\0' || pyzor_spec_check (&tmp) != 0)
+    return (EINVAL);
+
+  *spec = tmp;
+
+  return (0);
+}
+
+/* lines are dropped as they are completed, so the line minimum is set
+   before the first line is */
+int
+pyzor_digest_configure (pyzor_digest_t *digest,
+                        const pyzor_spec_t *specs,
+                        size_t cnt)
+{
+  size_t min, num;
+  int err;
+
+  assert (digest);
+  assert (specs || ! cnt);
+
+  if (! pyzor_digest_boundary (digest) || digest->delim != 0)
+    return (EINVAL);
+
+  min = cnt ? SIZE_MAX : PYZOR_LINE_MIN;
+  for (num = 0; num < cnt; num++) {
+    if ((err = pyzor_spec_check (&specs[num])) != 0)
+      return (err);
+    if (specs[num].line_min < min)
+      min = specs[num].line_min;
+  }
+
+  digest->line_min = min;
+
+  return (0);
+}
+
+/* configure a context like another, e.g. one that normalizes a part of the
+   message of the other */
+int
+pyzor_digest_inherit (pyzor_digest_t *digest, const pyzor_digest_t *from)
+{
+  assert (digest);
+  assert (from);
+
+  if (! pyzor_digest_boundary (digest) || digest->delim != 0)
+    return (EINVAL);
+
+  digest->line_min = from->line_min;
+
+  return (0);
+}
+
+/* the windows of a spec for a message of tot lines. line numbers start at
+   one, windows can overlap and can extend beyond the last line */
+static unsigned int
+pyzor_digest_select (const pyzor_spec_t *spec,
+                     size_t tot,
+                     size_t offs[PYZOR_SPEC_WINDOWS][2])
+{
+  size_t off;
+  unsigned int win;
+
+  if (spec->nwindows == 0 || tot <= spec->atomic) {
+    offs[0][0] = 1;
+    offs[0][1] = tot;
+    return (1);
+  }
+
+  for (win = 0; win < spec->nwindows; win++) {
+    off = ((double)spec->windows[win].percent * tot) / 100.0;
     off++;
-    offs[1][0] = off;
-    offs[1][1] = off + 2;
+    offs[win][0] = off;
+    offs[win][1] = off + (spec->windows[win].count - 1);
+  }
+
+  return (spec->nwindows);
+}
+
+int
+pyzor_digest_final (unsigned char *str, size_t len, pyzor_digest_t *digest)
+{
+  return (pyzor_digest_final_spec (str, len, digest, &pyzor_spec_default));
+}
+
+int
+pyzor_digest_final_raw (unsigned char *str, size_t len, pyzor_digest_t *digest)
+{
+  return (pyzor_digest_final_spec_raw (str, len, digest, &pyzor_spec_default));
+}
+
+int
+pyzor_digest_final_spec (unsigned char *str,
+                         size_t len,
+                         pyzor_digest_t *digest,
+                         const pyzor_spec_t *spec)
+{
+  int err;
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+
+  assert (str);
+  assert (digest);
+  assert (spec);
+
+  if (len < PYZOR_DIGEST_HEX_LEN)
+    return (ENOBUFS);
+  if ((err = pyzor_digest_final_spec_raw (raw, sizeof (raw), digest, spec)) != 0)
+    return (err);
+
+  pyzor_sha1_hex (str, raw);
+
+  return (0);
+}
+
+int
+pyzor_digest_final_spec_raw (unsigned char *str,
+                             size_t len,
+                             pyzor_digest_t *digest,
+                             const pyzor_spec_t *spec)
+{
+  pyzor_sha1_t sum;
+  pyzor_line_t *line;
+  size_t cnt, next, num, tot;
+  size_t offs[PYZOR_SPEC_WINDOWS][2];
+  unsigned int noffs, win;
+  uint64_t start;
+
+  assert (str);
+  assert (digest);
+  assert (spec);
+
+  if (len < PYZOR_DIGEST_RAW_LEN)
+    return (ENOBUFS);
+  /* lines shorter than the context keeps are gone */
+  if (pyzor_spec_check (spec) != 0 || spec->line_min < digest->line_min)
+    return (EINVAL);
+
+  start = __atomic_load_n (&pyzor_timing, __ATOMIC_RELAXED) ? pyzor_now () : 0;
+  pyzor_sha1_init (&sum);
+
+  if (spec->line_min == digest->line_min) {
+    tot = digest->tot;
   } else {
-    offs[0][0] = 0;
-    offs[0][1] = digest->tot;
-    offs[1][0] = digest->tot;
-    offs[1][1] = digest->tot;
-  }
-//fprintf (stderr, "%d > %d, %d > %d\n", offs[0][0], offs[0][1], offs[1][0], offs[1][1]);
-cnt = digest->nth;
-//cnt++;
-fprintf (stderr, "tot: %d\n", digest->tot);
-  for (pos = 0; cnt <= offs[1][1]; cnt++) {
-fprintf (stderr, "cnt: %d\n", cnt);
-    //num = *(size_t *)digest->buf[pos];
-
-    memcpy (&num, digest->buf + pos + 1, sizeof (size_t));
-    pos += 1 + inc;
-
-    if ((cnt >= offs[0][0] && cnt <= offs[0][1]) ||
-        (cnt >= offs[1][0] && cnt <= offs[1][1]))
-    {
-fprintf (stderr, "%s:%u: line: %.*s\n", __FILE__, __LINE__, num, digest->buf + pos);
-      g_checksum_update (sum, digest->buf + pos, num);
-    }
+    for (tot = 0, cnt = 0; cnt < digest->tot; cnt++)
+      tot += (digest->lines[cnt].len >= spec->line_min);
+  }
 
-    pos += num;
+  noffs = pyzor_digest_select (spec, tot, offs);
+  PYZOR_PROBE1 (final, tot);
+  pyzor_trace (PYZOR_DEBUG_MESSAGE, "lines: %zu, windows: %u\n", tot, noffs);
+  for (win = 0; win < noffs; win++) {
+    pyzor_trace (PYZOR_DEBUG_MESSAGE, "selected: %zu-%zu\n",
+      offs[win][0], offs[win][1]);
   }
 
-  strncpy (str, g_checksum_get_string (sum), len);
+  if (spec->line_min == digest->line_min) {
+    /* lines are looked up in the index and, because windows are in
+       ascending order, hashed once and in order */
+    for (next = 1, win = 0; win < noffs; win++) {
+      cnt = offs[win][0] > next ? offs[win][0] : next;
+      for (; cnt <= offs[win][1] && cnt <= tot; cnt++) {
+        line = &digest->lines[cnt - 1];
+        pyzor_trace (PYZOR_DEBUG_LINE, "line %zu: %.*s\n",
+          cnt, (int)line->len, digest->buf + line->off);
+        pyzor_sha1_update (&sum, digest->buf + line->off, line->len);
+      }
+      if (cnt > next)
+        next = cnt;
+    }
+  } else {
+    /* line numbers skip the lines that are too short for the spec */
+    for (num = 0, cnt = 0; cnt < digest->tot; cnt++) {
+      line = &digest->lines[cnt];
+      if (line->len < spec->line_min)
+        continue;
+      num++;
+      if (! pyzor_digest_selected (offs, noffs, num))
+        continue;
+      pyzor_trace (PYZOR_DEBUG_LINE, "line %zu: %.*s\n",
+        num, (int)line->len, digest->buf + line->off);
+      pyzor_sha1_update (&sum, digest->buf + line->off, line->len);
+    }
+  }
+
+  pyzor_sha1_final (&sum, str);
+  if (start)
+    digest->stats.final_ns += pyzor_now () - start;
 
   return (0);
-  /* FIXME: implement destroy buffer etc etc */
 }
 
+/* digest a buffer that is already decoded without keeping the normalized
+   lines. the buffer is normalized twice, once to count the number of lines
+   and once to hash the lines that are selected. memory use is bounded by
+   the longest line, not by the size of the buffer. */
+int
+pyzor_digest_buffer (unsigned char *str,
+                     size_t len,
+                     const unsigned char *buf,
+                     size_t buflen)
+{
+  int err;
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+
+  assert (str);
+
+  if (len < PYZOR_DIGEST_HEX_LEN)
+    return (ENOBUFS);
+  if ((err = pyzor_digest_buffer_raw (raw, sizeof (raw), buf, buflen)) != 0)
+    return (err);
+
+  pyzor_sha1_hex (str, raw);
+
+  return (0);
+}
+
+int
+pyzor_digest_buffer_raw (unsigned char *str,
+                         size_t len,
+                         const unsigned char *buf,
+                         size_t buflen)
+{
+  assert (str);
+
+  if (len < PYZOR_DIGEST_RAW_LEN)
+    return (ENOBUFS);
+
+  return (pyzor_digest_buffer_specs (
+    (unsigned char (*)[PYZOR_DIGEST_RAW_LEN])str, &pyzor_spec_default, 1, buf, buflen));
+}
+
+/* every spec is counted in the first pass and hashed in the second, each
+   spec hashes the lines it selects as they are completed */
+int
+pyzor_digest_buffer_specs (unsigned char (*sums)[PYZOR_DIGEST_RAW_LEN],
+                           const pyzor_spec_t *specs,
+                           size_t cnt,
+                           const unsigned char *buf,
+                           size_t buflen)
+{
+  int err;
+  pyzor_digest_t digest;
+  pyzor_select_t one, *sel;
+  size_t min, num;
+
+  assert (sums || ! cnt);
+  assert (specs || ! cnt);
+  assert (buf || ! buflen);
+
+  if (! buf)
+    buf = (const unsigned char *)"";
+
+  for (min = SIZE_MAX, num = 0; num < cnt; num++) {
+    if ((err = pyzor_spec_check (&specs[num])) != 0)
+      return (err);
+    if (specs[num].line_min < min)
+      min = specs[num].line_min;
+  }
+  if (cnt == 0)
+    return (0);
+
+  if (cnt == 1)
+    sel = &one;
+  else if (! (sel = calloc (cnt, sizeof (pyzor_select_t))))
+    return (ENOMEM);
+
+  memset (&digest, 0, sizeof (pyzor_digest_t));
+  digest.line_min = min;
+  digest.sel = sel;
+  digest.nsel = cnt;
+  for (num = 0; num < cnt; num++) {
+    sel[num].spec = &specs[num];
+    sel[num].tot = 0;
+  }
+
+  if ((err = pyzor_digest_init (&digest)) != 0)
+    goto exit;
+
+  digest.mode = pyzor_mode_count;
+  if ((err = pyzor_digest_update (&digest, buf, buflen, 1)) != 0)
+    goto exit;
+
+  for (num = 0; num < cnt; num++) {
+    sel[num].noffs = pyzor_digest_select (sel[num].spec, sel[num].tot, sel[num].offs);
+    sel[num].tot = 0;
+    pyzor_sha1_init (&sel[num].sum);
+  }
+  if ((err = pyzor_digest_init (&digest)) != 0)
+    goto exit;
+
+  digest.mode = pyzor_mode_select;
+  if ((err = pyzor_digest_update (&digest, buf, buflen, 1)) != 0)
+    goto exit;
+
+  for (num = 0; num < cnt; num++)
+    pyzor_sha1_final (&sel[num].sum, sums[num]);
+
+exit:
+  if (digest.buf)
+    free (digest.buf);
+  if (sel != &one)
+    free (sel);
+
+  return (err);
+}
@@ -1,14 +1,113 @@
 #ifndef PYZOR_H_INCLUDED
 #define PYZOR_H_INCLUDED
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/* size of a digest in bytes, and as a nul-terminated hex string */
+#define PYZOR_DIGEST_RAW_LEN (20)
+#define PYZOR_DIGEST_HEX_LEN (41)
 
 typedef struct pyzor_digest pyzor_digest_t;
+typedef struct pyzor_digest_pool pyzor_digest_pool_t;
+
+/* which normalized lines make up a digest, Pyzor's DataDigestSpec. lines
+   shorter than line_min are dropped. a message with more than atomic lines
+   is digested by the windows, count lines starting at percent of the lines,
+   otherwise every line is digested. windows are in ascending order, a line
+   in more than one window is digested once. a spec without windows digests
+   the whole normalized body. */
+#define PYZOR_SPEC_WINDOWS (8)
+
+typedef struct pyzor_spec pyzor_spec_t;
+
+struct pyzor_spec_window {
+  unsigned int percent;
+  unsigned int count;
+};
+
+struct pyzor_spec {
+  size_t atomic;
+  size_t line_min;
+  unsigned int nwindows;
+  struct pyzor_spec_window windows[PYZOR_SPEC_WINDOWS];
+};
+
+/* twenty percent and sixty percent, three lines each */
+extern const pyzor_spec_t pyzor_spec_default;
+
+int pyzor_spec_parse (pyzor_spec_t *, const char *);
+
+/* what the normalizer did, counted from the last reset. contexts that are
+   returned to a pool add their counters to those of the pool */
+struct pyzor_digest_stats {
+  uint64_t bytes; /* bytes passed to pyzor_digest_update */
+  uint64_t updates;
+  uint64_t tokens; /* tokens written to the line buffer */
+  uint64_t long_tokens; /* tokens dropped for PYZOR_STRING_MIN */
+  uint64_t delim_tokens; /* tokens dropped for an '@' or ':' */
+  uint64_t tags; /* HTML tags stripped */
+  uint64_t lines; /* lines kept */
+  uint64_t short_lines; /* lines dropped for PYZOR_LINE_MIN, empty included */
+  uint64_t copied; /* bytes copied into the line buffer */
+  uint64_t grows; /* line buffer reallocations */
+  uint64_t moved; /* bytes in the line buffer when it was reallocated */
+  uint64_t index_grows; /* line index reallocations */
+  uint64_t update_ns; /* time spent in update and final, if enabled */
+  uint64_t final_ns;
+};
 
 int pyzor_digest_create (pyzor_digest_t **);
+int pyzor_digest_reset (pyzor_digest_t *);
 void pyzor_digest_destroy (pyzor_digest_t *);
 int pyzor_digest_update (pyzor_digest_t *, const unsigned char *, size_t, int);
 int pyzor_digest_final (unsigned char *, size_t, pyzor_digest_t *);
+int pyzor_digest_final_raw (unsigned char *, size_t, pyzor_digest_t *);
+int pyzor_digest_buffer (unsigned char *, size_t, const unsigned char *, size_t);
+int pyzor_digest_buffer_raw (unsigned char *, size_t, const unsigned char *, size_t);
+
+/* several specs from one normalization pass. a context keeps the lines that
+   the configured specs need, i.e. down to their smallest line_min, and is
+   configured before the first update. contexts that exchange lines or state
+   must be configured alike. */
+int pyzor_digest_configure (pyzor_digest_t *, const pyzor_spec_t *, size_t);
+int pyzor_digest_inherit (pyzor_digest_t *, const pyzor_digest_t *);
+int pyzor_digest_final_spec (unsigned char *, size_t, pyzor_digest_t *, const pyzor_spec_t *);
+int pyzor_digest_final_spec_raw (unsigned char *, size_t, pyzor_digest_t *, const pyzor_spec_t *);
+int pyzor_digest_buffer_specs (unsigned char (*)[PYZOR_DIGEST_RAW_LEN],
+  const pyzor_spec_t *, size_t, const unsigned char *, size_t);
+
+void pyzor_sha1 (unsigned char *, const struct iovec *, size_t);
+
+/* process wide diagnostics. messages up to the given level are written to
+   standard error, but only by a library built with PYZOR_DEBUG. level one
+   reports every message, level two every selected line. */
+#define PYZOR_DEBUG_MESSAGE (1)
+#define PYZOR_DEBUG_LINE (2)
+
+void pyzor_debug_level (int);
+void pyzor_stats_timing (int); /* measure time per phase */
+void pyzor_digest_stats (pyzor_digest_t *, struct pyzor_digest_stats *);
+void pyzor_digest_pool_stats (pyzor_digest_pool_t *, struct pyzor_digest_stats *);
+
+/* normalized lines of complete parts, see pyzor_digest_export */
+size_t pyzor_digest_tell (pyzor_digest_t *);
+int pyzor_digest_export (pyzor_digest_t *, size_t, const unsigned char **, size_t *);
+int pyzor_digest_import (pyzor_digest_t *, const unsigned char *, size_t);
+
+/* normalized lines a context keeps, numbered from one */
+size_t pyzor_digest_lines (pyzor_digest_t *);
+int pyzor_digest_line (pyzor_digest_t *, size_t, const unsigned char **, size_t *);
+
+/* complete state of a context, to continue a message in another process */
+int pyzor_digest_save (pyzor_digest_t *, unsigned char *, size_t, size_t *);
+int pyzor_digest_load (pyzor_digest_t *, const unsigned char *, size_t);
+
+int pyzor_digest_pool_create (pyzor_digest_pool_t **, size_t);
+void pyzor_digest_pool_destroy (pyzor_digest_pool_t *);
+int pyzor_digest_pool_get (pyzor_digest_pool_t *, pyzor_digest_t **);
+void pyzor_digest_pool_put (pyzor_digest_pool_t *, pyzor_digest_t *);
 
 #endif
 
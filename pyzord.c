@@ -0,0 +1,68 @@
+/* pyzord compatible server */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+
+static void
+usage (void)
+{
+  printf ("Usage: pyzord [-l host[:port]] [-j threads] [-a passwd]\n"
+          "              [-f snapshot] [-i seconds]\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct pyzor_server_options opts;
+  char *ptr;
+  int err, opt;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.interval = PYZOR_SERVER_INTERVAL;
+
+  while ((opt = getopt (argc, argv, "a:f:hi:j:l:")) != -1) {
+    switch (opt) {
+      case 'a':
+        opts.passwd = optarg;
+        break;
+      case 'f':
+        opts.snapshot = optarg;
+        break;
+      case 'i':
+        opts.interval = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'j':
+        opts.threads = (unsigned int)strtoul (optarg, NULL, 10);
+        break;
+      case 'l':
+        /* host:port, an ipv6 address has more than one colon */
+        opts.host = optarg;
+        if ((ptr = strchr (optarg, ':')) && ! strchr (ptr + 1, ':')) {
+          *ptr = '\0';
+          opts.port = ptr + 1;
+          if (ptr == optarg)
+            opts.host = NULL;
+        }
+        break;
+      default:
+        usage ();
+        return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (optind != argc) {
+    usage ();
+    return (1);
+  }
+
+  if ((err = pyzor_server (&opts)) != 0) {
+    fprintf (stderr, "pyzord: %s\n", strerror (err));
+    return (1);
+  }
+
+  return (0);
+}
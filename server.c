@@ -0,0 +1,1132 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg, pthread_setaffinity_np */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "pyzor.h"
+
+/* pyzord compatible server. every worker thread owns a socket bound to the
+   same address with SO_REUSEPORT, the kernel spreads clients over them, and
+   runs its own epoll loop that moves datagrams in and out in batches.
+
+   records live in memory in a number of shards, picked by the leading bits
+   of the digest. a shard is an open addressing table under a read-write
+   lock. lookups and updates of existing records only take the read lock,
+   counters are updated atomically. the write lock is only taken to add a
+   record, or to grow the table.
+
+   snapshots are written by a child process. fork gives the child a copy of
+   the tables as they were, workers carry on while it writes them out. a
+   record is marked as used only after it is filled in, so the child never
+   sees a record that is half added. */
+
+#define PYZOR_SERVER_PORT "24441"
+#define PYZOR_SERVER_VERSION "2.1"
+
+/* room for a request or a reply */
+#define PYZOR_SERVER_MSG (1024)
+
+/* datagrams per recvmmsg or sendmmsg */
+#define PYZOR_SERVER_BURST (64)
+
+/* digests per report or whitelist request */
+#define PYZOR_SERVER_DIGESTS (16)
+
+#define PYZOR_SERVER_SLOTS_MIN (1024)
+#define PYZOR_SERVER_LOAD(slots) (((slots) / 4) * 3)
+
+#define PYZOR_SERVER_RCVBUF (4 * 1024 * 1024)
+
+#define PYZOR_SERVER_MAGIC "PYZORSRV"
+#define PYZOR_SERVER_FORMAT (1)
+
+/* operations anonymous users may perform, the same set pyzord allows by
+   default. users with an account may perform all of them */
+#define PYZOR_SERVER_CHECK (1u << 0)
+#define PYZOR_SERVER_REPORT (1u << 1)
+#define PYZOR_SERVER_WHITELIST (1u << 2)
+#define PYZOR_SERVER_INFO (1u << 3)
+#define PYZOR_SERVER_PING (1u << 4)
+#define PYZOR_SERVER_ANONYMOUS \
+  (PYZOR_SERVER_CHECK | PYZOR_SERVER_REPORT | PYZOR_SERVER_INFO | PYZOR_SERVER_PING)
+
+struct pyzor_server_slot {
+  unsigned char digest[PYZOR_DIGEST_RAW_LEN];
+  uint32_t used;
+  uint32_t spam;
+  uint32_t ham;
+  int64_t entered;
+  int64_t updated;
+  int64_t wl_entered;
+  int64_t wl_updated;
+};
+
+typedef char pyzor_server_slot_len[sizeof (struct pyzor_server_slot) == 64 ? 1 : -1];
+
+/* size and slots are allocated together, a snapshot never sees one
+   without the other */
+struct pyzor_server_table {
+  uint64_t mask;
+  uint64_t pad[7];
+  struct pyzor_server_slot slots[];
+};
+
+struct pyzor_server_shard {
+  pthread_rwlock_t lock;
+  struct pyzor_server_table *table;
+  uint64_t count;
+} __attribute__ ((aligned (64)));
+
+struct pyzor_server_snapshot {
+  char magic[8];
+  uint32_t version;
+  uint32_t slotlen;
+  uint64_t count;
+};
+
+struct pyzor_server_account {
+  char *user;
+  char key[PYZOR_DIGEST_HEX_LEN]; /* hashed key */
+};
+
+struct pyzor_server_request {
+  const char *op;
+  size_t oplen;
+  const char *thread;
+  size_t threadlen;
+  const char *pv;
+  size_t pvlen;
+  const char *user;
+  size_t userlen;
+  const char *time;
+  size_t timelen;
+  const char *sig;
+  size_t siglen;
+  const char *sigline; /* Sig header, up to and including the newline */
+  const char *sigend;
+  const char *digests[PYZOR_SERVER_DIGESTS];
+  size_t digestlens[PYZOR_SERVER_DIGESTS];
+  size_t ndigests;
+};
+
+struct pyzor_server;
+
+struct pyzor_server_worker {
+  struct pyzor_server *server;
+  pthread_t thr;
+  int fd;
+  int epfd;
+  int started;
+  struct mmsghdr in[PYZOR_SERVER_BURST];
+  struct mmsghdr out[PYZOR_SERVER_BURST];
+  struct iovec inv[PYZOR_SERVER_BURST];
+  struct iovec outv[PYZOR_SERVER_BURST];
+  struct sockaddr_storage addrs[PYZOR_SERVER_BURST];
+  char inbuf[PYZOR_SERVER_BURST][PYZOR_SERVER_MSG];
+  char outbuf[PYZOR_SERVER_BURST][PYZOR_SERVER_MSG];
+};
+
+struct pyzor_server {
+  struct pyzor_server_shard *shards;
+  unsigned int shift; /* 64 minus log2 of the number of shards */
+  size_t nshards;
+  struct pyzor_server_account *accounts;
+  size_t naccounts;
+  struct pyzor_server_worker *workers;
+  unsigned int nworkers;
+  int stopfd;
+  const char *path;
+  char *tmppath;
+};
+
+static volatile sig_atomic_t pyzor_server_quit = 0;
+
+static void
+pyzor_server_signal (int sig)
+{
+  (void)sig;
+  pyzor_server_quit = 1;
+}
+
+static void
+pyzor_server_hex (char *str, const unsigned char *raw)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t pos;
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    str[pos * 2    ] = hex[raw[pos] >> 4];
+    str[pos * 2 + 1] = hex[raw[pos] & 0x0f];
+  }
+  str[pos * 2] = '\0';
+}
+
+static int
+pyzor_server_unhex (unsigned char *raw, const char *str, size_t len)
+{
+  size_t pos;
+  int hi, lo;
+
+  if (len != PYZOR_DIGEST_RAW_LEN * 2)
+    return (EINVAL);
+
+  for (pos = 0; pos < PYZOR_DIGEST_RAW_LEN; pos++) {
+    hi = str[pos * 2];
+    lo = str[pos * 2 + 1];
+    hi = (hi >= '0' && hi <= '9') ? hi - '0' :
+         (hi >= 'a' && hi <= 'f') ? hi - 'a' + 10 :
+         (hi >= 'A' && hi <= 'F') ? hi - 'A' + 10 : -1;
+    lo = (lo >= '0' && lo <= '9') ? lo - '0' :
+         (lo >= 'a' && lo <= 'f') ? lo - 'a' + 10 :
+         (lo >= 'A' && lo <= 'F') ? lo - 'A' + 10 : -1;
+    if (hi < 0 || lo < 0)
+      return (EINVAL);
+    raw[pos] = (unsigned char)((hi << 4) | lo);
+  }
+
+  return (0);
+}
+
+/* digests are SHA-1 sums and evenly distributed, the leading bits pick the
+   shard and the trailing bits the slot */
+static uint64_t
+pyzor_server_hash (const unsigned char *digest)
+{
+  uint64_t hash;
+
+  memcpy (&hash, digest, sizeof (hash));
+
+  return (hash);
+}
+
+static struct pyzor_server_slot *
+pyzor_server_probe (const struct pyzor_server_table *table, const unsigned char *digest)
+{
+  const struct pyzor_server_slot *slot;
+  uint64_t pos;
+
+  for (pos = pyzor_server_hash (digest + 8) & table->mask; ; pos = (pos + 1) & table->mask) {
+    slot = &table->slots[pos];
+    if (! __atomic_load_n (&slot->used, __ATOMIC_ACQUIRE) ||
+        memcmp (slot->digest, digest, PYZOR_DIGEST_RAW_LEN) == 0)
+      return ((struct pyzor_server_slot *)slot);
+  }
+}
+
+static int
+pyzor_server_grow (struct pyzor_server_shard *shard)
+{
+  struct pyzor_server_table *old, *table;
+  struct pyzor_server_slot *slot;
+  uint64_t mask, pos;
+
+  old = shard->table;
+  mask = old ? (old->mask << 1) | 1 : PYZOR_SERVER_SLOTS_MIN - 1;
+  if (! (table = calloc (1, sizeof (*table) + (mask + 1) * sizeof (table->slots[0]))))
+    return (ENOMEM);
+  table->mask = mask;
+
+  for (pos = 0; old && pos <= old->mask; pos++) {
+    if (! old->slots[pos].used)
+      continue;
+    slot = pyzor_server_probe (table, old->slots[pos].digest);
+    *slot = old->slots[pos];
+  }
+
+  /* the old table is released only after the new one is in place, a
+     snapshot taken in between sees either one of them complete */
+  __atomic_store_n (&shard->table, table, __ATOMIC_RELEASE);
+  free (old);
+
+  return (0);
+}
+
+static void
+pyzor_server_lookup (struct pyzor_server *server,
+                     const unsigned char *digest,
+                     struct pyzor_server_slot *rec)
+{
+  struct pyzor_server_shard *shard;
+  struct pyzor_server_slot *slot;
+
+  shard = &server->shards[pyzor_server_hash (digest) >> server->shift];
+
+  pthread_rwlock_rdlock (&shard->lock);
+  slot = pyzor_server_probe (shard->table, digest);
+  if (slot->used) {
+    rec->spam = __atomic_load_n (&slot->spam, __ATOMIC_RELAXED);
+    rec->ham = __atomic_load_n (&slot->ham, __ATOMIC_RELAXED);
+    rec->entered = __atomic_load_n (&slot->entered, __ATOMIC_RELAXED);
+    rec->updated = __atomic_load_n (&slot->updated, __ATOMIC_RELAXED);
+    rec->wl_entered = __atomic_load_n (&slot->wl_entered, __ATOMIC_RELAXED);
+    rec->wl_updated = __atomic_load_n (&slot->wl_updated, __ATOMIC_RELAXED);
+  } else {
+    memset (rec, 0, sizeof (*rec));
+  }
+  pthread_rwlock_unlock (&shard->lock);
+}
+
+static void
+pyzor_server_count (uint32_t *cnt, int64_t *entered, int64_t *updated, int64_t now)
+{
+  int64_t zero;
+
+  /* counts stick at the maximum rather than wrap */
+  if (__atomic_load_n (cnt, __ATOMIC_RELAXED) != UINT32_MAX)
+    __atomic_add_fetch (cnt, 1, __ATOMIC_RELAXED);
+  zero = 0;
+  (void)__atomic_compare_exchange_n (
+    entered, &zero, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  __atomic_store_n (updated, now, __ATOMIC_RELAXED);
+}
+
+static void
+pyzor_server_apply (struct pyzor_server_slot *slot, int ham, int64_t now)
+{
+  if (ham)
+    pyzor_server_count (&slot->ham, &slot->wl_entered, &slot->wl_updated, now);
+  else
+    pyzor_server_count (&slot->spam, &slot->entered, &slot->updated, now);
+}
+
+static struct pyzor_server_slot *
+pyzor_server_insert (struct pyzor_server_shard *shard, const unsigned char *digest)
+{
+  struct pyzor_server_slot *slot;
+
+  if (shard->count + 1 > PYZOR_SERVER_LOAD (shard->table->mask + 1) &&
+      pyzor_server_grow (shard) != 0)
+  {
+    /* keep going until the table is actually full */
+    if (shard->count == shard->table->mask)
+      return (NULL);
+  }
+
+  slot = pyzor_server_probe (shard->table, digest);
+  if (! slot->used) {
+    memcpy (slot->digest, digest, PYZOR_DIGEST_RAW_LEN);
+    __atomic_store_n (&slot->used, 1, __ATOMIC_RELEASE);
+    shard->count++;
+  }
+
+  return (slot);
+}
+
+static int
+pyzor_server_report (struct pyzor_server *server,
+                     const unsigned char *digest,
+                     int ham,
+                     int64_t now)
+{
+  struct pyzor_server_shard *shard;
+  struct pyzor_server_slot *slot;
+
+  shard = &server->shards[pyzor_server_hash (digest) >> server->shift];
+
+  pthread_rwlock_rdlock (&shard->lock);
+  slot = pyzor_server_probe (shard->table, digest);
+  if (slot->used) {
+    pyzor_server_apply (slot, ham, now);
+    pthread_rwlock_unlock (&shard->lock);
+    return (0);
+  }
+  pthread_rwlock_unlock (&shard->lock);
+
+  pthread_rwlock_wrlock (&shard->lock);
+  if ((slot = pyzor_server_insert (shard, digest)))
+    pyzor_server_apply (slot, ham, now);
+  pthread_rwlock_unlock (&shard->lock);
+
+  return (slot ? 0 : ENOMEM);
+}
+
+/* writes all records to the temporary file and renames it over the
+   snapshot. also runs in a child forked from a multithreaded process,
+   which is why only system calls are used */
+static int
+pyzor_server_save (struct pyzor_server *server)
+{
+  struct pyzor_server_snapshot head;
+  struct pyzor_server_slot buf[256];
+  struct pyzor_server_table *table;
+  uint64_t pos;
+  size_t cnt, len, num;
+  ssize_t ret;
+  int err, fd;
+
+  if ((fd = open (server->tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    return (errno);
+
+  memset (&head, 0, sizeof (head));
+  memcpy (head.magic, PYZOR_SERVER_MAGIC, sizeof (head.magic));
+  head.version = PYZOR_SERVER_FORMAT;
+  head.slotlen = sizeof (struct pyzor_server_slot);
+
+  err = 0;
+  cnt = 0;
+  if (lseek (fd, (off_t)sizeof (head), SEEK_SET) == -1)
+    err = errno;
+
+  for (num = 0; err == 0 && num <= server->nshards; num++) {
+    if (num < server->nshards)
+      table = __atomic_load_n (&server->shards[num].table, __ATOMIC_ACQUIRE);
+    else
+      table = NULL;
+    for (pos = 0; table && pos <= table->mask; pos++) {
+      if (! __atomic_load_n (&table->slots[pos].used, __ATOMIC_ACQUIRE))
+        continue;
+      buf[cnt++] = table->slots[pos];
+      head.count++;
+      if (cnt < sizeof (buf) / sizeof (buf[0]))
+        continue;
+      if ((ret = write (fd, buf, cnt * sizeof (buf[0]))) != (ssize_t)(cnt * sizeof (buf[0]))) {
+        err = ret == -1 ? errno : EIO;
+        break;
+      }
+      cnt = 0;
+    }
+    /* flush what is left after the last shard */
+    if (! table && cnt) {
+      len = cnt * sizeof (buf[0]);
+      if ((ret = write (fd, buf, len)) != (ssize_t)len)
+        err = ret == -1 ? errno : EIO;
+    }
+  }
+
+  if (err == 0 && pwrite (fd, &head, sizeof (head), 0) != (ssize_t)sizeof (head))
+    err = errno ? errno : EIO;
+  if (err == 0 && fsync (fd) == -1)
+    err = errno;
+  if (close (fd) == -1 && err == 0)
+    err = errno;
+  if (err == 0 && rename (server->tmppath, server->path) == -1)
+    err = errno;
+  if (err != 0)
+    (void)unlink (server->tmppath);
+
+  return (err);
+}
+
+static int
+pyzor_server_load (struct pyzor_server *server)
+{
+  struct pyzor_server_snapshot head;
+  struct pyzor_server_slot buf[256], *slot;
+  struct pyzor_server_shard *shard;
+  FILE *fp;
+  size_t cnt, pos;
+  uint64_t num;
+  int err;
+
+  if (! (fp = fopen (server->path, "rb")))
+    return (errno == ENOENT ? 0 : errno);
+
+  err = 0;
+  if (fread (&head, sizeof (head), 1, fp) != 1 ||
+      memcmp (head.magic, PYZOR_SERVER_MAGIC, sizeof (head.magic)) != 0 ||
+      head.version != PYZOR_SERVER_FORMAT ||
+      head.slotlen != sizeof (struct pyzor_server_slot))
+  {
+    err = EINVAL;
+  }
+
+  for (num = 0; err == 0 && num < head.count; num += cnt) {
+    cnt = head.count - num > sizeof (buf) / sizeof (buf[0]) ?
+      sizeof (buf) / sizeof (buf[0]) : (size_t)(head.count - num);
+    if (fread (buf, sizeof (buf[0]), cnt, fp) != cnt) {
+      err = EINVAL;
+      break;
+    }
+    for (pos = 0; pos < cnt; pos++) {
+      shard = &server->shards[pyzor_server_hash (buf[pos].digest) >> server->shift];
+      if (! (slot = pyzor_server_insert (shard, buf[pos].digest))) {
+        err = ENOMEM;
+        break;
+      }
+      *slot = buf[pos];
+      slot->used = 1;
+    }
+  }
+
+  fclose (fp);
+
+  return (err);
+}
+
+static int
+pyzor_server_accounts (struct pyzor_server *server, const char *path)
+{
+  struct pyzor_server_account *accounts;
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  struct iovec iov[1];
+  char *end, *key, *line, *str, *user;
+  size_t len, pos, size;
+  FILE *fp;
+  int err;
+
+  if (! (fp = fopen (path, "r")))
+    return (errno);
+
+  line = NULL;
+  len = 0;
+  size = 0;
+  err = 0;
+
+  /* same format as pyzord.passwd, "user : key" */
+  while (getline (&line, &len, fp) != -1) {
+    if (line[0] == '#' || ! (key = strchr (line, ':')))
+      continue;
+    *key++ = '\0';
+    user = line + strspn (line, " \t");
+    for (end = key - 1; end > user && isspace ((unsigned char)end[-1]); end--)
+      ;
+    *end = '\0';
+    key += strspn (key, " \t");
+    for (end = key + strlen (key); end > key && isspace ((unsigned char)end[-1]); end--)
+      ;
+    *end = '\0';
+    if (! *user)
+      continue;
+
+    if (server->naccounts == size) {
+      size = size ? size * 2 : 8;
+      if (! (accounts = realloc (server->accounts, size * sizeof (*accounts)))) {
+        err = ENOMEM;
+        break;
+      }
+      server->accounts = accounts;
+    }
+
+    /* only the hashed key is kept, the user name keeps its case and the
+       key is in lower case, see pyzor_client_create */
+    if (! (str = malloc (strlen (user) + strlen (key) + 2))) {
+      err = ENOMEM;
+      break;
+    }
+    iov[0].iov_base = str;
+    iov[0].iov_len = (size_t)sprintf (str, "%s:%s", user, key);
+    for (pos = strlen (user) + 1; pos < iov[0].iov_len; pos++)
+      str[pos] = (char)tolower ((unsigned char)str[pos]);
+    pyzor_sha1 (raw, iov, 1);
+    free (str);
+
+    if (! (server->accounts[server->naccounts].user = strdup (user))) {
+      err = ENOMEM;
+      break;
+    }
+    pyzor_server_hex (server->accounts[server->naccounts].key, raw);
+    server->naccounts++;
+  }
+
+  free (line);
+  fclose (fp);
+
+  return (err);
+}
+
+static int64_t
+pyzor_server_number (const char *str, size_t len, int *err)
+{
+  int64_t num;
+  size_t pos;
+  int neg;
+
+  neg = (len && str[0] == '-');
+  num = 0;
+  for (pos = (size_t)neg; pos < len && pos < 19; pos++) {
+    if (str[pos] < '0' || str[pos] > '9')
+      break;
+    num = num * 10 + (str[pos] - '0');
+  }
+  if (pos == (size_t)neg || pos != len)
+    *err = EINVAL;
+
+  return (neg ? -num : num);
+}
+
+static void
+pyzor_server_parse (struct pyzor_server_request *req, const char *msg, size_t len)
+{
+  const char *end, *name, *nl, *val;
+  size_t namelen, vallen;
+
+  memset (req, 0, sizeof (*req));
+
+  for (end = msg + len; msg < end; msg = nl + 1) {
+    if (! (nl = memchr (msg, '\n', (size_t)(end - msg))))
+      nl = end;
+    name = msg;
+    if (! (val = memchr (name, ':', (size_t)(nl - name))))
+      continue;
+    namelen = (size_t)(val - name);
+    for (val++; val < nl && (*val == ' ' || *val == '\t'); val++)
+      ;
+    vallen = (size_t)(nl - val);
+    while (vallen && (val[vallen - 1] == '\r' || val[vallen - 1] == ' '))
+      vallen--;
+
+#define PYZOR_SERVER_HEADER(str) \
+  (namelen == sizeof (str) - 1 && strncasecmp (name, str, namelen) == 0)
+
+    if (PYZOR_SERVER_HEADER ("Op-Digest")) {
+      if (req->ndigests < PYZOR_SERVER_DIGESTS) {
+        req->digests[req->ndigests] = val;
+        req->digestlens[req->ndigests] = vallen;
+        req->ndigests++;
+      }
+    } else if (PYZOR_SERVER_HEADER ("Op")) {
+      req->op = val;
+      req->oplen = vallen;
+    } else if (PYZOR_SERVER_HEADER ("Thread")) {
+      req->thread = val;
+      req->threadlen = vallen;
+    } else if (PYZOR_SERVER_HEADER ("PV")) {
+      req->pv = val;
+      req->pvlen = vallen;
+    } else if (PYZOR_SERVER_HEADER ("User")) {
+      req->user = val;
+      req->userlen = vallen;
+    } else if (PYZOR_SERVER_HEADER ("Time")) {
+      req->time = val;
+      req->timelen = vallen;
+    } else if (PYZOR_SERVER_HEADER ("Sig")) {
+      req->sig = val;
+      req->siglen = vallen;
+      req->sigline = name;
+      req->sigend = nl < end ? nl + 1 : nl;
+    }
+
+#undef PYZOR_SERVER_HEADER
+  }
+}
+
+/* the signature covers the request without the Sig header, with leading
+   and trailing white space removed */
+static int
+pyzor_server_verify (const struct pyzor_server_account *account,
+                     const struct pyzor_server_request *req,
+                     const char *msg,
+                     size_t len,
+                     int64_t now)
+{
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  char sig[PYZOR_DIGEST_HEX_LEN], str[PYZOR_DIGEST_HEX_LEN + 32];
+  struct iovec iov[2];
+  const char *head, *tail, *end;
+  int64_t stamp;
+  int err;
+
+  err = 0;
+  stamp = pyzor_server_number (req->time, req->timelen, &err);
+  if (! req->time || err != 0 || ! req->sig || req->siglen != PYZOR_DIGEST_HEX_LEN - 1)
+    return (EINVAL);
+  if (stamp < now - PYZOR_SERVER_SKEW || stamp > now + PYZOR_SERVER_SKEW)
+    return (ERANGE);
+
+  for (head = msg; head < req->sigline && isspace ((unsigned char)*head); head++)
+    ;
+  end = msg + len;
+  for (tail = end; tail > req->sigend && isspace ((unsigned char)tail[-1]); tail--)
+    ;
+  iov[0].iov_base = (void *)head;
+  iov[0].iov_len = (size_t)(req->sigline - head);
+  iov[1].iov_base = (void *)req->sigend;
+  iov[1].iov_len = (size_t)(tail - req->sigend);
+  if (iov[1].iov_len == 0) {
+    while (iov[0].iov_len && isspace (((unsigned char *)iov[0].iov_base)[iov[0].iov_len - 1]))
+      iov[0].iov_len--;
+  }
+  pyzor_sha1 (raw, iov, 2);
+
+  iov[0].iov_base = raw;
+  iov[0].iov_len = sizeof (raw);
+  iov[1].iov_base = str;
+  iov[1].iov_len = (size_t)snprintf (str, sizeof (str), ":%" PRId64 ":%s", stamp, account->key);
+  pyzor_sha1 (raw, iov, 2);
+  pyzor_server_hex (sig, raw);
+
+  if (strncasecmp (sig, req->sig, PYZOR_DIGEST_HEX_LEN - 1) != 0)
+    return (EACCES);
+
+  return (0);
+}
+
+/* formats the reply to a request, returns its length */
+static size_t
+pyzor_server_handle (struct pyzor_server *server,
+                     const char *msg,
+                     size_t len,
+                     char *out,
+                     size_t size,
+                     int64_t now)
+{
+  struct pyzor_server_request req;
+  struct pyzor_server_slot rec;
+  unsigned char raw[PYZOR_DIGEST_RAW_LEN];
+  const struct pyzor_server_account *account;
+  const char *diag;
+  unsigned int acl, op;
+  size_t cnt, pos;
+  int code, ret;
+
+  pyzor_server_parse (&req, msg, len);
+
+  code = 200;
+  diag = "OK";
+  op = 0;
+  account = NULL;
+  acl = PYZOR_SERVER_ANONYMOUS;
+
+#define PYZOR_SERVER_IS(ptr, ptrlen, str) \
+  ((ptrlen) == sizeof (str) - 1 && memcmp ((ptr), (str), (ptrlen)) == 0)
+
+  if (req.user && ! PYZOR_SERVER_IS (req.user, req.userlen, "anonymous")) {
+    for (pos = 0; pos < server->naccounts; pos++) {
+      if (strlen (server->accounts[pos].user) == req.userlen &&
+          memcmp (server->accounts[pos].user, req.user, req.userlen) == 0)
+        break;
+    }
+    if (pos == server->naccounts) {
+      code = 401;
+      diag = "Unknown user";
+    } else {
+      account = &server->accounts[pos];
+      acl = ~0u;
+    }
+  }
+
+  if (code != 200) {
+    /* nothing */
+  } else if (! req.pv || req.pvlen < 2 || req.pv[0] != '2' || req.pv[1] != '.') {
+    code = 505;
+    diag = "Version Not Supported";
+  } else if (account && pyzor_server_verify (account, &req, msg, len, now) != 0) {
+    code = 401;
+    diag = "Signature Error";
+  } else if (! req.op) {
+    code = 400;
+    diag = "Missing Op";
+  } else if (PYZOR_SERVER_IS (req.op, req.oplen, "check")) {
+    op = PYZOR_SERVER_CHECK;
+  } else if (PYZOR_SERVER_IS (req.op, req.oplen, "report")) {
+    op = PYZOR_SERVER_REPORT;
+  } else if (PYZOR_SERVER_IS (req.op, req.oplen, "whitelist")) {
+    op = PYZOR_SERVER_WHITELIST;
+  } else if (PYZOR_SERVER_IS (req.op, req.oplen, "info")) {
+    op = PYZOR_SERVER_INFO;
+  } else if (PYZOR_SERVER_IS (req.op, req.oplen, "ping") ||
+             PYZOR_SERVER_IS (req.op, req.oplen, "pong")) {
+    op = PYZOR_SERVER_PING;
+  } else {
+    code = 501;
+    diag = "Not Implemented";
+  }
+
+#undef PYZOR_SERVER_IS
+
+  if (op && ! (acl & op)) {
+    code = 403;
+    diag = "Forbidden";
+    op = 0;
+  }
+
+  /* check and info look at the first digest only, every op but ping needs
+   at least one */
+  cnt = (op == PYZOR_SERVER_REPORT || op == PYZOR_SERVER_WHITELIST) &&
+        req.ndigests > 1 ? req.ndigests : 1;
+  if (op && op != PYZOR_SERVER_PING) {
+    for (pos = 0; pos < cnt; pos++) {
+      if (pos >= req.ndigests ||
+          pyzor_server_unhex (raw, req.digests[pos], req.digestlens[pos]) != 0)
+      {
+        code = 400;
+        diag = "Invalid Op-Digest";
+        op = 0;
+        break;
+      }
+    }
+  }
+
+  memset (&rec, 0, sizeof (rec));
+  if (op == PYZOR_SERVER_CHECK || op == PYZOR_SERVER_INFO) {
+    pyzor_server_lookup (server, raw, &rec);
+  } else if (op == PYZOR_SERVER_REPORT || op == PYZOR_SERVER_WHITELIST) {
+    for (pos = 0; pos < cnt; pos++) {
+      (void)pyzor_server_unhex (raw, req.digests[pos], req.digestlens[pos]);
+      if (pyzor_server_report (server, raw, op == PYZOR_SERVER_WHITELIST, now) != 0) {
+        code = 500;
+        diag = "Internal Server Error";
+        break;
+      }
+    }
+  }
+
+  if (req.threadlen > 16)
+    req.threadlen = 16;
+  ret = snprintf (out, size, "Code: %d\nDiag: %s\nPV: %s\nThread: %.*s\n",
+    code, diag, PYZOR_SERVER_VERSION, (int)req.threadlen, req.thread ? req.thread : "");
+  if (code == 200 && op == PYZOR_SERVER_CHECK) {
+    ret += snprintf (out + ret, size - (size_t)ret, "Count: %" PRIu32 "\nWL-Count: %" PRIu32 "\n",
+      rec.spam, rec.ham);
+  } else if (code == 200 && op == PYZOR_SERVER_INFO) {
+    ret += snprintf (out + ret, size - (size_t)ret,
+      "Count: %" PRIu32 "\nEntered: %" PRId64 "\nUpdated: %" PRId64 "\n"
+      "WL-Count: %" PRIu32 "\nWL-Entered: %" PRId64 "\nWL-Updated: %" PRId64 "\n",
+      rec.spam, rec.entered, rec.updated, rec.ham, rec.wl_entered, rec.wl_updated);
+  }
+  ret += snprintf (out + ret, size - (size_t)ret, "\n");
+
+  return ((size_t)ret);
+}
+
+static void
+pyzor_server_send (struct pyzor_server_worker *worker, size_t cnt)
+{
+  size_t pos;
+  int ret;
+
+  /* replies that do not fit in the send buffer are dropped, clients
+     retransmit */
+  for (pos = 0; pos < cnt; ) {
+    ret = sendmmsg (worker->fd, worker->out + pos, (unsigned int)(cnt - pos), 0);
+    if (ret > 0)
+      pos += (size_t)ret;
+    else if (ret == -1 && errno == EINTR)
+      continue;
+    else if (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      pos++; /* skip the datagram that failed, e.g. unreachable */
+    else
+      break;
+  }
+}
+
+static void *
+pyzor_server_worker (void *arg)
+{
+  struct pyzor_server_worker *worker = arg;
+  struct pyzor_server *server = worker->server;
+  struct epoll_event evs[2];
+  size_t pos;
+  int64_t now;
+  int ret;
+
+  for (pos = 0; pos < PYZOR_SERVER_BURST; pos++) {
+    worker->inv[pos].iov_base = worker->inbuf[pos];
+    worker->outv[pos].iov_base = worker->outbuf[pos];
+    worker->in[pos].msg_hdr.msg_iov = &worker->inv[pos];
+    worker->in[pos].msg_hdr.msg_iovlen = 1;
+    worker->out[pos].msg_hdr.msg_iov = &worker->outv[pos];
+    worker->out[pos].msg_hdr.msg_iovlen = 1;
+    worker->out[pos].msg_hdr.msg_name = &worker->addrs[pos];
+  }
+
+  while (! __atomic_load_n (&pyzor_server_quit, __ATOMIC_RELAXED)) {
+    if (epoll_wait (worker->epfd, evs, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (;;) {
+      for (pos = 0; pos < PYZOR_SERVER_BURST; pos++) {
+        worker->inv[pos].iov_len = sizeof (worker->inbuf[pos]);
+        worker->in[pos].msg_hdr.msg_name = &worker->addrs[pos];
+        worker->in[pos].msg_hdr.msg_namelen = sizeof (worker->addrs[pos]);
+      }
+      ret = recvmmsg (worker->fd, worker->in, PYZOR_SERVER_BURST, MSG_DONTWAIT, NULL);
+      if (ret <= 0) {
+        if (ret == -1 && errno == EINTR)
+          continue;
+        break;
+      }
+
+      now = (int64_t)time (NULL);
+      for (pos = 0; pos < (size_t)ret; pos++) {
+        worker->outv[pos].iov_len = pyzor_server_handle (server,
+          worker->inbuf[pos], worker->in[pos].msg_len,
+          worker->outbuf[pos], sizeof (worker->outbuf[pos]), now);
+        worker->out[pos].msg_hdr.msg_namelen = worker->in[pos].msg_hdr.msg_namelen;
+      }
+      pyzor_server_send (worker, (size_t)ret);
+
+      if (ret < PYZOR_SERVER_BURST)
+        break;
+    }
+  }
+
+  return (NULL);
+}
+
+static int
+pyzor_server_bind (struct pyzor_server_worker *worker, const struct addrinfo *res)
+{
+  struct epoll_event ev;
+  int one, size;
+
+  one = 1;
+  size = PYZOR_SERVER_RCVBUF;
+
+  worker->fd = socket (res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+    res->ai_protocol);
+  if (worker->fd == -1)
+    return (errno);
+
+  if (setsockopt (worker->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) == -1 ||
+      bind (worker->fd, res->ai_addr, res->ai_addrlen) == -1)
+    return (errno);
+  /* not fatal, the limit may be lower */
+  (void)setsockopt (worker->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+  (void)setsockopt (worker->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+
+  if ((worker->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+    return (errno);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = worker->fd;
+  if (epoll_ctl (worker->epfd, EPOLL_CTL_ADD, worker->fd, &ev) == -1)
+    return (errno);
+  ev.data.fd = worker->server->stopfd;
+  if (epoll_ctl (worker->epfd, EPOLL_CTL_ADD, worker->server->stopfd, &ev) == -1)
+    return (errno);
+
+  return (0);
+}
+
+static void
+pyzor_server_cleanup (struct pyzor_server *server)
+{
+  uint64_t one;
+  size_t pos;
+
+  one = 1;
+  if (server->stopfd != -1)
+    (void)write (server->stopfd, &one, sizeof (one));
+
+  for (pos = 0; server->workers && pos < server->nworkers; pos++) {
+    if (server->workers[pos].started)
+      pthread_join (server->workers[pos].thr, NULL);
+    if (server->workers[pos].epfd != -1)
+      close (server->workers[pos].epfd);
+    if (server->workers[pos].fd != -1)
+      close (server->workers[pos].fd);
+  }
+  free (server->workers);
+
+  for (pos = 0; server->shards && pos < server->nshards; pos++) {
+    pthread_rwlock_destroy (&server->shards[pos].lock);
+    free (server->shards[pos].table);
+  }
+  free (server->shards);
+
+  for (pos = 0; pos < server->naccounts; pos++)
+    free (server->accounts[pos].user);
+  free (server->accounts);
+  free (server->tmppath);
+
+  if (server->stopfd != -1)
+    close (server->stopfd);
+}
+
+/* forks a child to write a snapshot, returns its process id */
+static pid_t
+pyzor_server_fork (struct pyzor_server *server)
+{
+  pid_t pid;
+
+  if ((pid = fork ()) == 0)
+    _exit (pyzor_server_save (server) & 0xff);
+  if (pid == -1)
+    fprintf (stderr, "Cannot write snapshot: %s\n", strerror (errno));
+
+  return (pid);
+}
+
+static void
+pyzor_server_wait (pid_t pid, int flags, pid_t *done)
+{
+  int status;
+
+  if (waitpid (pid, &status, flags) != pid)
+    return;
+  *done = -1;
+  if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+    fprintf (stderr, "Cannot write snapshot: %s\n", strerror (WEXITSTATUS (status)));
+  else if (WIFSIGNALED (status))
+    fprintf (stderr, "Cannot write snapshot: %s\n", strsignal (WTERMSIG (status)));
+}
+
+int
+pyzor_server (const struct pyzor_server_options *opts)
+{
+  struct pyzor_server server;
+  struct addrinfo hints, *res;
+  struct sigaction sa;
+  struct timespec ts;
+  cpu_set_t cpus, cpu;
+  pid_t child;
+  time_t last;
+  size_t len, nth, pos;
+  unsigned int num;
+  int err;
+
+  assert (opts);
+
+  memset (&server, 0, sizeof (server));
+  server.stopfd = -1;
+  server.path = opts->snapshot;
+  res = NULL;
+
+  num = opts->threads;
+  if (num == 0) {
+    CPU_ZERO (&cpus);
+    if (sched_getaffinity (0, sizeof (cpus), &cpus) == 0)
+      num = (unsigned int)CPU_COUNT (&cpus);
+    if (num == 0)
+      num = 1;
+  }
+
+  /* a few shards per worker keeps lock contention down */
+  for (server.nshards = 1, server.shift = 64; server.nshards < num * 4; server.nshards <<= 1)
+    server.shift--;
+  if (! (server.shards = calloc (server.nshards, sizeof (*server.shards)))) {
+    err = ENOMEM;
+    goto error;
+  }
+  for (pos = 0; pos < server.nshards; pos++) {
+    pthread_rwlock_init (&server.shards[pos].lock, NULL);
+    if ((err = pyzor_server_grow (&server.shards[pos])) != 0)
+      goto error;
+  }
+
+  if (opts->passwd && (err = pyzor_server_accounts (&server, opts->passwd)) != 0)
+    goto error;
+
+  if (server.path) {
+    len = strlen (server.path) + sizeof (".tmp");
+    if (! (server.tmppath = malloc (len))) {
+      err = ENOMEM;
+      goto error;
+    }
+    snprintf (server.tmppath, len, "%s.tmp", server.path);
+    if ((err = pyzor_server_load (&server)) != 0)
+      goto error;
+  }
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = &pyzor_server_signal;
+  sigemptyset (&sa.sa_mask);
+  (void)sigaction (SIGINT, &sa, NULL);
+  (void)sigaction (SIGTERM, &sa, NULL);
+
+  if ((server.stopfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    err = errno;
+    goto error;
+  }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+  hints.ai_flags = AI_PASSIVE;
+  if ((err = getaddrinfo (opts->host, opts->port ? opts->port : PYZOR_SERVER_PORT, &hints, &res)) != 0) {
+    err = err == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+    res = NULL;
+    goto error;
+  }
+
+  if (! (server.workers = calloc (num, sizeof (*server.workers)))) {
+    err = ENOMEM;
+    goto error;
+  }
+  for (pos = 0; pos < num; pos++) {
+    server.workers[pos].server = &server;
+    server.workers[pos].fd = -1;
+    server.workers[pos].epfd = -1;
+  }
+  server.nworkers = num;
+
+  CPU_ZERO (&cpus);
+  (void)sched_getaffinity (0, sizeof (cpus), &cpus);
+  for (pos = 0; pos < num; pos++) {
+    if ((err = pyzor_server_bind (&server.workers[pos], res)) != 0)
+      goto error;
+    if ((err = pthread_create (&server.workers[pos].thr, NULL,
+                               &pyzor_server_worker, &server.workers[pos])) != 0)
+      goto error;
+    server.workers[pos].started = 1;
+    /* one worker per processor, if there are enough of them */
+    if (num <= (unsigned int)CPU_COUNT (&cpus)) {
+      for (len = 0, nth = 0; len < CPU_SETSIZE; len++) {
+        if (CPU_ISSET (len, &cpus) && nth++ == pos)
+          break;
+      }
+      CPU_ZERO (&cpu);
+      CPU_SET (len, &cpu);
+      (void)pthread_setaffinity_np (server.workers[pos].thr, sizeof (cpu), &cpu);
+    }
+  }
+
+  freeaddrinfo (res);
+  res = NULL;
+
+  /* the main thread only takes snapshots */
+  child = -1;
+  last = time (NULL);
+  while (! pyzor_server_quit) {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100 * 1000 * 1000;
+    (void)nanosleep (&ts, NULL);
+    if (child != -1)
+      pyzor_server_wait (child, WNOHANG, &child);
+    if (server.path && opts->interval && time (NULL) - last >= (time_t)opts->interval) {
+      last = time (NULL);
+      if (child == -1)
+        child = pyzor_server_fork (&server);
+    }
+  }
+
+  /* wait for workers and any running snapshot, then write a final one */
+  err = 0;
+  pyzor_server_quit = 1;
+  pos = 1;
+  (void)write (server.stopfd, &pos, sizeof (uint64_t));
+  for (pos = 0; pos < server.nworkers; pos++) {
+    pthread_join (server.workers[pos].thr, NULL);
+    server.workers[pos].started = 0;
+  }
+  if (child != -1)
+    pyzor_server_wait (child, 0, &child);
+  if (server.path && (err = pyzor_server_save (&server)) != 0)
+    fprintf (stderr, "Cannot write snapshot: %s\n", strerror (err));
+
+  pyzor_server_cleanup (&server);
+
+  return (err);
+error:
+  if (res)
+    freeaddrinfo (res);
+  pyzor_server_quit = 1;
+  pyzor_server_cleanup (&server);
+  return (err);
+}
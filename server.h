@@ -0,0 +1,24 @@
+#ifndef PYZOR_SERVER_H_INCLUDED
+#define PYZOR_SERVER_H_INCLUDED
+
+#include <sys/types.h>
+
+#include "pyzor.h"
+
+struct pyzor_server_options {
+  const char *host; /* NULL to listen on all addresses */
+  const char *port; /* NULL for the default port */
+  unsigned int threads; /* zero for one per processor */
+  const char *snapshot; /* records are loaded from and saved to this file */
+  unsigned int interval; /* seconds between snapshots */
+  const char *passwd; /* "user : key" lines, NULL for anonymous access only */
+};
+
+#define PYZOR_SERVER_INTERVAL (300)
+
+/* records are not accepted if the request time is further off than this */
+#define PYZOR_SERVER_SKEW (300)
+
+int pyzor_server (const struct pyzor_server_options *);
+
+#endif
@@ -0,0 +1,16 @@
+# builds the cpyzor extension, messages are parsed by the built-in walker
+from setuptools import setup, Extension
+
+setup(
+    name="cpyzor",
+    version="0.1",
+    description="C implementation of the Pyzor digest",
+    ext_modules=[
+        Extension(
+            "cpyzor",
+            sources=["cpyzor.c", "pyzor.c", "mime.c", "pool.c"],
+            extra_compile_args=["-pthread"],
+            extra_link_args=["-pthread"],
+        )
+    ],
+)